@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "mem.h"
+
+#define WORD_BITS          (64)
+#define NWORDS(nbits)      (((nbits) + WORD_BITS - 1) / WORD_BITS)
+
+struct bitmap_t {
+   size_t nbits;
+   size_t nwords;
+   uint64_t *words;
+};
+
+// Bits past the end of the bitmap in the last word are always kept at
+// zero so that count and next never have to special-case the tail.
+static void mask_tail (bitmap_t *bm)
+{
+   size_t rem = bm->nbits % WORD_BITS;
+   if (rem && bm->nwords) {
+      bm->words[bm->nwords - 1] &= (((uint64_t)1) << rem) - 1;
+   }
+}
+
+bitmap_t *bitmap_new (size_t nbits)
+{
+   bitmap_t *ret = mem_alloc (sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   memset (ret, 0, sizeof *ret);
+   if (!bitmap_resize (ret, nbits)) {
+      mem_free (ret);
+      return NULL;
+   }
+
+   return ret;
+}
+
+bitmap_t *bitmap_dup (const bitmap_t *bm)
+{
+   if (!bm)
+      return NULL;
+
+   bitmap_t *ret = bitmap_new (bm->nbits);
+   if (!ret)
+      return NULL;
+
+   memcpy (ret->words, bm->words, bm->nwords * sizeof *bm->words);
+   return ret;
+}
+
+void bitmap_del (bitmap_t *bm)
+{
+   if (!bm)
+      return;
+
+   mem_free (bm->words);
+   mem_free (bm);
+}
+
+size_t bitmap_length (const bitmap_t *bm)
+{
+   return bm ? bm->nbits : 0;
+}
+
+bool bitmap_resize (bitmap_t *bm, size_t nbits)
+{
+   if (!bm)
+      return false;
+
+   size_t nwords = NWORDS (nbits);
+   if (nwords != bm->nwords) {
+      uint64_t *tmp = mem_realloc (bm->words, (nwords ? nwords : 1) *
+                                              sizeof *tmp);
+      if (!tmp)
+         return false;
+
+      if (nwords > bm->nwords) {
+         memset (&tmp[bm->nwords], 0,
+                 (nwords - bm->nwords) * sizeof *tmp);
+      }
+      bm->words = tmp;
+      bm->nwords = nwords;
+   }
+
+   bm->nbits = nbits;
+   mask_tail (bm);
+   return true;
+}
+
+void bitmap_set (bitmap_t *bm, size_t bit)
+{
+   if (!bm || bit >= bm->nbits)
+      return;
+
+   bm->words[bit / WORD_BITS] |= ((uint64_t)1) << (bit % WORD_BITS);
+}
+
+void bitmap_clear (bitmap_t *bm, size_t bit)
+{
+   if (!bm || bit >= bm->nbits)
+      return;
+
+   bm->words[bit / WORD_BITS] &= ~(((uint64_t)1) << (bit % WORD_BITS));
+}
+
+bool bitmap_test (const bitmap_t *bm, size_t bit)
+{
+   if (!bm || bit >= bm->nbits)
+      return false;
+
+   return (bm->words[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1;
+}
+
+void bitmap_zero (bitmap_t *bm)
+{
+   if (!bm)
+      return;
+
+   memset (bm->words, 0, bm->nwords * sizeof *bm->words);
+}
+
+void bitmap_fill (bitmap_t *bm)
+{
+   if (!bm)
+      return;
+
+   memset (bm->words, 0xff, bm->nwords * sizeof *bm->words);
+   mask_tail (bm);
+}
+
+void bitmap_and (bitmap_t *dst, const bitmap_t *src)
+{
+   if (!dst || !src)
+      return;
+
+   size_t n = dst->nwords < src->nwords ? dst->nwords : src->nwords;
+   for (size_t i=0; i<n; i++) {
+      dst->words[i] &= src->words[i];
+   }
+   for (size_t i=n; i<dst->nwords; i++) {
+      dst->words[i] = 0;
+   }
+}
+
+void bitmap_or (bitmap_t *dst, const bitmap_t *src)
+{
+   if (!dst || !src)
+      return;
+
+   size_t n = dst->nwords < src->nwords ? dst->nwords : src->nwords;
+   for (size_t i=0; i<n; i++) {
+      dst->words[i] |= src->words[i];
+   }
+   mask_tail (dst);
+}
+
+size_t bitmap_count (const bitmap_t *bm)
+{
+   size_t ret = 0;
+
+   if (!bm)
+      return 0;
+
+   for (size_t i=0; i<bm->nwords; i++) {
+      ret += __builtin_popcountll (bm->words[i]);
+   }
+   return ret;
+}
+
+size_t bitmap_next (const bitmap_t *bm, size_t from)
+{
+   if (!bm || from >= bm->nbits)
+      return BITMAP_NONE;
+
+   size_t idx = from / WORD_BITS;
+   uint64_t word = bm->words[idx] & (~((uint64_t)0) << (from % WORD_BITS));
+
+   while (!word) {
+      if (++idx >= bm->nwords)
+         return BITMAP_NONE;
+      word = bm->words[idx];
+   }
+
+   return idx * WORD_BITS + __builtin_ctzll (word);
+}
+
+uint64_t bitmap_word (const bitmap_t *bm, size_t idx)
+{
+   if (!bm || idx >= bm->nwords)
+      return 0;
+
+   return bm->words[idx];
+}
+
+void bitmap_set_word (bitmap_t *bm, size_t idx, uint64_t word)
+{
+   if (!bm || idx >= bm->nwords)
+      return;
+
+   bm->words[idx] = word;
+   if (idx==bm->nwords - 1) {
+      mask_tail (bm);
+   }
+}
+
@@ -0,0 +1,55 @@
+
+#ifndef H_BITMAP
+#define H_BITMAP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// A dense bitmap with one bit per record number. Used by the indexes to
+// represent sets of records so that predicates can be combined a word at
+// a time instead of a record at a time.
+
+#define BITMAP_NONE        ((size_t)-1)
+
+typedef struct bitmap_t bitmap_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   bitmap_t *bitmap_new (size_t nbits);
+   bitmap_t *bitmap_dup (const bitmap_t *bm);
+   void bitmap_del (bitmap_t *bm);
+
+   size_t bitmap_length (const bitmap_t *bm);
+   bool bitmap_resize (bitmap_t *bm, size_t nbits);
+
+   void bitmap_set (bitmap_t *bm, size_t bit);
+   void bitmap_clear (bitmap_t *bm, size_t bit);
+   bool bitmap_test (const bitmap_t *bm, size_t bit);
+
+   void bitmap_zero (bitmap_t *bm);
+   void bitmap_fill (bitmap_t *bm);
+
+   // dst = dst OP src. Both bitmaps must be the same length.
+   void bitmap_and (bitmap_t *dst, const bitmap_t *src);
+   void bitmap_or (bitmap_t *dst, const bitmap_t *src);
+
+   size_t bitmap_count (const bitmap_t *bm);
+
+   // Returns the first set bit at or after 'from', or BITMAP_NONE.
+   size_t bitmap_next (const bitmap_t *bm, size_t from);
+
+   // Word level access for code that works on 64 records at a time. Word
+   // 'idx' holds bits idx*64 to idx*64+63; words past the end read as 0
+   // and writes to them are ignored.
+   uint64_t bitmap_word (const bitmap_t *bm, size_t idx);
+   void bitmap_set_word (bitmap_t *bm, size_t idx, uint64_t word);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
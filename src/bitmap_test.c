@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "bitmap.h"
+
+static bool test_setclear (void)
+{
+   bool error = true;
+   bitmap_t *bm = bitmap_new (130);
+   if (!bm) {
+      fprintf (stderr, "Out of memory\n");
+      goto errorexit;
+   }
+
+   bitmap_set (bm, 0);
+   bitmap_set (bm, 63);
+   bitmap_set (bm, 64);
+   bitmap_set (bm, 129);
+   bitmap_set (bm, 130);   // Out of range, must be ignored
+
+   if (bitmap_count (bm) != 4) {
+      fprintf (stderr, "Expected 4 bits, got %zu\n", bitmap_count (bm));
+      goto errorexit;
+   }
+
+   bitmap_clear (bm, 63);
+   if (bitmap_test (bm, 63) || !bitmap_test (bm, 64)) {
+      fprintf (stderr, "Clear affected the wrong bit\n");
+      goto errorexit;
+   }
+
+   size_t expected[] = { 0, 64, 129, BITMAP_NONE };
+   size_t bit = bitmap_next (bm, 0);
+   for (size_t i=0; i<sizeof expected/sizeof expected[0]; i++) {
+      if (bit != expected[i]) {
+         fprintf (stderr, "Iteration %zu: expected %zu, got %zu\n",
+                  i, expected[i], bit);
+         goto errorexit;
+      }
+      bit = bit==BITMAP_NONE ? bit : bitmap_next (bm, bit + 1);
+   }
+
+   error = false;
+errorexit:
+   bitmap_del (bm);
+   return !error;
+}
+
+static bool test_ops (void)
+{
+   bool error = true;
+   bitmap_t *lhs = bitmap_new (200);
+   bitmap_t *rhs = bitmap_new (200);
+   if (!lhs || !rhs) {
+      fprintf (stderr, "Out of memory\n");
+      goto errorexit;
+   }
+
+   bitmap_fill (lhs);
+   if (bitmap_count (lhs) != 200) {
+      fprintf (stderr, "Fill set %zu bits\n", bitmap_count (lhs));
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<200; i += 3) {
+      bitmap_set (rhs, i);
+   }
+   bitmap_and (lhs, rhs);
+   if (bitmap_count (lhs) != 67) {
+      fprintf (stderr, "AND gave %zu bits\n", bitmap_count (lhs));
+      goto errorexit;
+   }
+
+   bitmap_zero (rhs);
+   bitmap_set (rhs, 1);
+   bitmap_or (lhs, rhs);
+   if (bitmap_count (lhs) != 68 || !bitmap_test (lhs, 1)) {
+      fprintf (stderr, "OR gave %zu bits\n", bitmap_count (lhs));
+      goto errorexit;
+   }
+
+   if (!bitmap_resize (lhs, 1000) || bitmap_count (lhs) != 68) {
+      fprintf (stderr, "Resize changed the contents\n");
+      goto errorexit;
+   }
+
+   bitmap_del (rhs);
+   rhs = bitmap_dup (lhs);
+   if (!rhs || bitmap_count (rhs) != 68 || bitmap_length (rhs) != 1000) {
+      fprintf (stderr, "Duplicate differs from the original\n");
+      goto errorexit;
+   }
+
+   bitmap_set_word (rhs, 15, ~(uint64_t)0);
+   bitmap_set_word (rhs, 16, ~(uint64_t)0);
+   if (bitmap_count (rhs) != 68 + 40 || bitmap_word (rhs, 16) != 0) {
+      fprintf (stderr, "Word access went past the end\n");
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   bitmap_del (lhs);
+   bitmap_del (rhs);
+   return !error;
+}
+
+int main (void)
+{
+   size_t num_failures = 0;
+
+   struct {
+      char *name;
+      bool (*fptr) (void);
+   } tests [] = {
+
+#define TESTFUNC(x)      { #x, x }
+
+      TESTFUNC (test_setclear),
+      TESTFUNC (test_ops),
+
+#undef TESTFUNC
+
+   };
+
+   for (size_t i=0; i<sizeof tests/sizeof tests[0]; i++) {
+      bool r = tests[i].fptr ();
+      printf ("XXX %25s: %s\n", tests[i].name, r ? "passed" : "failed");
+
+      if (!r)
+         num_failures++;
+   }
+
+   printf ("XXX %25s: %zu\n", "Failures", num_failures);
+
+   return num_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
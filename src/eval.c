@@ -2,13 +2,13 @@
 #include <string.h>
 
 #include "eval.h"
+#include "mem.h"
 
-#include "xvector/xvector.h"
 #include "xerror/xerror.h"
 
 struct eval_t {
-   xvector_t *st1;
-   xvector_t *st2;
+   memvec_t st1;
+   memvec_t st2;
    eval_copy_t       *fcopy;
    eval_del_t        *fdel;
    eval_run_op_t     *frun;
@@ -18,7 +18,7 @@ struct eval_t {
 eval_t *eval_new (eval_copy_t *copy_func, eval_del_t *del_func,
                   eval_run_op_t *run_op, eval_typefunc_t *type)
 {
-   eval_t *ret = malloc (sizeof *ret);
+   eval_t *ret = mem_alloc (sizeof *ret);
    if (!ret)
       return NULL;
 
@@ -36,27 +36,25 @@ void  eval_del (eval_t *ev)
    if (!ev)
       return;
 
-   xvector_iterate (ev->st1, (void (*) (void *))ev->fdel);
-   xvector_iterate (ev->st2, (void (*) (void *))ev->fdel);
+   eval_clear (ev);
+   mem_free (ev);
+}
 
-   xvector_free (ev->st1);
-   xvector_free (ev->st2);
-   free (ev);
+static void clear_stack (memvec_t *st, eval_del_t *fdel)
+{
+   for (size_t i=0; i<st->len; i++) {
+      fdel (st->items[i]);
+   }
+   memvec_free (st);
 }
 
 void eval_clear (eval_t *ev)
 {
-   xvector_iterate (ev->st1, (void (*) (void *))ev->fdel);
-   xvector_iterate (ev->st2, (void (*) (void *))ev->fdel);
-
-   xvector_free (ev->st1);
-   xvector_free (ev->st2);
-
-   ev->st1 = NULL;
-   ev->st2 = NULL;
+   clear_stack (&ev->st1, ev->fdel);
+   clear_stack (&ev->st2, ev->fdel);
 }
 
-static bool push (xvector_t **st, eval_copy_t *cf, const void *elm)
+static bool push (memvec_t *st, eval_copy_t *cf, const void *elm)
 {
    if (!elm)
       return true;
@@ -67,29 +65,27 @@ static bool push (xvector_t **st, eval_copy_t *cf, const void *elm)
       return false;
    }
 
-   xvector_t *tmpv = xvector_ins_tail ((*st), tmp);
-   if (!tmpv) {
+   if (!memvec_push (st, tmp)) {
       XERROR ("Malloc failure\n");
       return false;
    }
 
-   (*st) = tmpv;
    return true;
 }
 
-static void *pop (xvector_t **st)
+static void *pop (memvec_t *st)
 {
-   if (!st || !(*st) || XVECT_LENGTH ((*st))==0) {
-      XERROR ("Pop failure [%p] [ %p] [%zu]\n", st, (*st), XVECT_LENGTH ((*st)));
+   if (!st || st->len==0) {
+      XERROR ("Pop failure [%p] [%zu]\n", st, st ? st->len : 0);
       return NULL;
    }
 
-   return xvector_del_tail ((*st));
+   return memvec_pop (st);
 }
 
-static size_t length (xvector_t *st)
+static size_t length (memvec_t *st)
 {
-   return XVECT_LENGTH (st);
+   return st->len;
 }
 
 static bool apply (eval_t *ev)
@@ -127,11 +123,11 @@ errorexit:
 }
 
 #if 0
-static void prstack (xvector_t *st, const char *name)
+static void prstack (memvec_t *st, const char *name)
 {
    printf ("[%s]: ");
-   for (size_t i=0; i<XVECT_LENGTH (st); i++) {
-      printf ("%s,", (char *)(XVECT_INDEX (st, i)));
+   for (size_t i=0; i<st->len; i++) {
+      printf ("%s,", (char *)(st->items[i]));
    }
    printf ("\n");
 }
@@ -173,13 +169,13 @@ void *eval_execute (eval_t *ev, const void **tokens)
       }
    }
 
-   while (length (ev->st1) >= 2 && length (ev->st2) >= 1) {
+   while (length (&ev->st1) >= 2 && length (&ev->st2) >= 1) {
       if (!apply (ev)) {
          return NULL;
       }
    }
 
-   if (length (ev->st1) != 1 || length (ev->st2) !=0) {
+   if (length (&ev->st1) != 1 || length (&ev->st2) !=0) {
       return NULL;
    }
 
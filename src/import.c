@@ -0,0 +1,582 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "xerror/xerror.h"
+
+#include "import.h"
+#include "mem.h"
+
+static const struct {
+   const char *name;
+   size_t field;
+} import_fields[] = {
+   { "message",      RF_OPENED_MSG  },
+   { "opened_by",    RF_OPENED_BY   },
+   { "opened_on",    RF_OPENED_ON   },
+   { "status",       RF_STATUS      },
+   { "assigned_by",  RF_ASSIGNED_BY },
+   { "assigned_to",  RF_ASSIGNED_TO },
+   { "assigned_on",  RF_ASSIGNED_ON },
+   { "closed_by",    RF_CLOSED_BY   },
+   { "closed_on",    RF_CLOSED_ON   },
+   { "closed_msg",   RF_CLOSED_MSG  },
+};
+
+#define FIELD_NONE         ((size_t)-1)
+#define FIELD_COMMENT      ((size_t)-2)
+
+static size_t import_field (const char *name)
+{
+   if (strcmp (name, "comment")==0)
+      return FIELD_COMMENT;
+
+   for (size_t i=0; i<sizeof import_fields/sizeof import_fields[0]; i++) {
+      if (strcmp (import_fields[i].name, name)==0)
+         return import_fields[i].field;
+   }
+   return FIELD_NONE;
+}
+
+// One issue as read from the input. All the strings point into the input
+// buffer, which is decoded in place.
+struct icomment_t {
+   const char *user;
+   const char *time;
+   const char *text;
+};
+
+struct irec_t {
+   const char *fields[RF_LAST_FIELD];
+   struct icomment_t *comments;
+   size_t ncomments;
+   size_t maxcomments;
+};
+
+static void irec_clear (struct irec_t *ir)
+{
+   memset (ir->fields, 0, sizeof ir->fields);
+   ir->ncomments = 0;
+}
+
+static bool irec_comment (struct irec_t *ir, const char *user,
+                          const char *time, const char *text)
+{
+   if (ir->ncomments >= ir->maxcomments) {
+      size_t newmax = ir->maxcomments ? ir->maxcomments * 2 : 8;
+      struct icomment_t *tmp = mem_realloc (ir->comments,
+                                            newmax * sizeof *tmp);
+      if (!tmp) {
+         XERROR ("Out of memory\n");
+         return false;
+      }
+      ir->comments = tmp;
+      ir->maxcomments = newmax;
+   }
+
+   ir->comments[ir->ncomments].user = user;
+   ir->comments[ir->ncomments].time = time;
+   ir->comments[ir->ncomments].text = text;
+   ir->ncomments++;
+   return true;
+}
+
+// The database format uses backspaces in its delimiters, so they cannot
+// appear in any value.
+static bool valid_value (const char *value)
+{
+   return !value || !strchr (value, '\b');
+}
+
+static bool irec_add (rotsit_t *rs, struct irec_t *ir, const char *source,
+                      size_t lineno)
+{
+   rotrec_t *rr = NULL;
+   const char *msg = ir->fields[RF_OPENED_MSG];
+
+   if (!msg || !*msg) {
+      XERROR ("%s:%zu: issue has no message\n", source, lineno);
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<RF_LAST_FIELD; i++) {
+      if (!valid_value (ir->fields[i])) {
+         XERROR ("%s:%zu: values cannot contain a backspace\n",
+                  source, lineno);
+         goto errorexit;
+      }
+   }
+
+   if (!(rr = rotrec_new (msg))) {
+      XERROR ("%s:%zu: unable to create issue\n", source, lineno);
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<RF_LAST_FIELD; i++) {
+      if (i==RF_OPENED_MSG || !ir->fields[i] || !*ir->fields[i])
+         continue;
+
+      if (!rotrec_set_field (rr, i, ir->fields[i])) {
+         XERROR ("%s:%zu: invalid value [%s]\n", source, lineno,
+                  ir->fields[i]);
+         goto errorexit;
+      }
+   }
+
+   for (size_t i=0; i<ir->ncomments; i++) {
+      struct icomment_t *ic = &ir->comments[i];
+      const char *user = ic->user ? ic->user : ir->fields[RF_OPENED_BY];
+      const char *time = ic->time ? ic->time : ir->fields[RF_OPENED_ON];
+
+      if (!ic->text || !*ic->text)
+         continue;
+
+      if (!valid_value (ic->user) || !valid_value (ic->time) ||
+          !valid_value (ic->text)) {
+         XERROR ("%s:%zu: values cannot contain a backspace\n",
+                  source, lineno);
+         goto errorexit;
+      }
+
+      if (!rotrec_import_comment (rr, user && *user ? user : NULL,
+                                      time && *time ? time : NULL,
+                                      ic->text)) {
+         XERROR ("%s:%zu: invalid comment\n", source, lineno);
+         goto errorexit;
+      }
+   }
+
+   if (!rotsit_add_record (rs, rr)) {
+      XERROR ("%s:%zu: unable to add issue\n", source, lineno);
+      goto errorexit;
+   }
+
+   return true;
+
+errorexit:
+   rotrec_del (rr);
+   return false;
+}
+
+/* ******************************************************************** */
+
+static void skip_ws (char **p)
+{
+   while (isspace (**p))
+      (*p)++;
+}
+
+static size_t utf8_encode (char *dst, uint32_t cp)
+{
+   if (cp < 0x80) {
+      dst[0] = cp;
+      return 1;
+   }
+   if (cp < 0x800) {
+      dst[0] = 0xc0 | (cp >> 6);
+      dst[1] = 0x80 | (cp & 0x3f);
+      return 2;
+   }
+   if (cp < 0x10000) {
+      dst[0] = 0xe0 | (cp >> 12);
+      dst[1] = 0x80 | ((cp >> 6) & 0x3f);
+      dst[2] = 0x80 | (cp & 0x3f);
+      return 3;
+   }
+   dst[0] = 0xf0 | (cp >> 18);
+   dst[1] = 0x80 | ((cp >> 12) & 0x3f);
+   dst[2] = 0x80 | ((cp >> 6) & 0x3f);
+   dst[3] = 0x80 | (cp & 0x3f);
+   return 4;
+}
+
+static bool json_hex4 (const char *src, uint32_t *cp)
+{
+   *cp = 0;
+   for (size_t i=0; i<4; i++) {
+      if (!isxdigit (src[i]))
+         return false;
+      *cp = (*cp << 4) | (isdigit (src[i]) ? src[i] - '0'
+                                           : tolower (src[i]) - 'a' + 10);
+   }
+   return true;
+}
+
+// Decodes the string at *p in place. The decoded string is never longer
+// than the encoded one, so it is terminated where the closing quote was
+// or earlier.
+static char *json_string (char **p)
+{
+   char *src = *p;
+   if (*src!='"')
+      return NULL;
+
+   char *ret = ++src;
+   char *dst = ret;
+
+   while (*src!='"') {
+      uint32_t cp, lo;
+
+      if (!*src || *src=='\n')
+         return NULL;
+
+      if (*src!='\\') {
+         *dst++ = *src++;
+         continue;
+      }
+
+      src++;
+      switch (*src++) {
+         case '"':   *dst++ = '"';  break;
+         case '\\':  *dst++ = '\\'; break;
+         case '/':   *dst++ = '/';  break;
+         case 'b':   *dst++ = '\b'; break;
+         case 'f':   *dst++ = '\f'; break;
+         case 'n':   *dst++ = '\n'; break;
+         case 'r':   *dst++ = '\r'; break;
+         case 't':   *dst++ = '\t'; break;
+         case 'u':   if (!json_hex4 (src, &cp) || !cp)
+                        return NULL;
+                     src += 4;
+                     if (cp >= 0xd800 && cp < 0xdc00) {
+                        if (src[0]!='\\' || src[1]!='u' ||
+                            !json_hex4 (&src[2], &lo) ||
+                            lo < 0xdc00 || lo > 0xdfff)
+                           return NULL;
+                        src += 6;
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                     }
+                     dst += utf8_encode (dst, cp);
+                     break;
+         default:    return NULL;
+      }
+   }
+
+   *dst = 0;
+   *p = src + 1;
+   return ret;
+}
+
+// Values are strings, or null for a value that is not set.
+static bool json_value (char **p, const char **value)
+{
+   if (strncmp (*p, "null", 4)==0) {
+      *p += 4;
+      *value = NULL;
+      return true;
+   }
+
+   return (*value = json_string (p))!=NULL;
+}
+
+static bool json_comment (char **p, struct irec_t *ir)
+{
+   const char *user = NULL,
+              *time = NULL,
+              *text = NULL;
+
+   if (**p=='"') {
+      return (text = json_string (p)) && irec_comment (ir, NULL, NULL, text);
+   }
+
+   if (**p!='{')
+      return false;
+   (*p)++;
+
+   for (skip_ws (p); **p!='}'; skip_ws (p)) {
+      const char *key = json_string (p);
+      const char *value = NULL;
+
+      skip_ws (p);
+      if (!key || **p!=':')
+         return false;
+      (*p)++;
+      skip_ws (p);
+
+      if (!json_value (p, &value))
+         return false;
+
+      if (strcmp (key, "user")==0) {
+         user = value;
+      } else if (strcmp (key, "time")==0) {
+         time = value;
+      } else if (strcmp (key, "comment")==0) {
+         text = value;
+      }
+
+      skip_ws (p);
+      if (**p==',') {
+         (*p)++;
+         skip_ws (p);
+      } else if (**p!='}') {
+         return false;
+      }
+   }
+   (*p)++;
+
+   return irec_comment (ir, user, time, text);
+}
+
+static bool json_comments (char **p, struct irec_t *ir)
+{
+   if (**p!='[')
+      return false;
+   (*p)++;
+
+   for (skip_ws (p); **p!=']'; skip_ws (p)) {
+      if (!json_comment (p, ir))
+         return false;
+
+      skip_ws (p);
+      if (**p==',') {
+         (*p)++;
+         skip_ws (p);
+      } else if (**p!=']') {
+         return false;
+      }
+   }
+   (*p)++;
+   return true;
+}
+
+static bool json_record (char *line, struct irec_t *ir)
+{
+   char *p = line;
+
+   skip_ws (&p);
+   if (*p!='{')
+      return false;
+   p++;
+
+   for (skip_ws (&p); *p!='}'; skip_ws (&p)) {
+      const char *key = json_string (&p);
+      const char *value = NULL;
+
+      skip_ws (&p);
+      if (!key || *p!=':')
+         return false;
+      p++;
+      skip_ws (&p);
+
+      if (strcmp (key, "comments")==0) {
+         if (!json_comments (&p, ir))
+            return false;
+      } else {
+         size_t field = import_field (key);
+         if (!json_value (&p, &value))
+            return false;
+         if (field<RF_LAST_FIELD) {
+            ir->fields[field] = value;
+         }
+      }
+
+      skip_ws (&p);
+      if (*p==',') {
+         p++;
+         skip_ws (&p);
+      } else if (*p!='}') {
+         return false;
+      }
+   }
+   p++;
+
+   skip_ws (&p);
+   return *p==0;
+}
+
+static size_t import_jsonl (rotsit_t *rs, char *input, const char *source,
+                            struct irec_t *ir)
+{
+   size_t nrecords = 0;
+   size_t lineno = 0;
+   char *line = input;
+
+   while (line && *line) {
+      char *next = strchr (line, '\n');
+      if (next) {
+         *next++ = 0;
+      }
+      lineno++;
+
+      char *tmp = line;
+      skip_ws (&tmp);
+      if (*tmp) {
+         irec_clear (ir);
+         if (!json_record (line, ir)) {
+            XERROR ("%s:%zu: malformed JSON object\n", source, lineno);
+            return (size_t)-1;
+         }
+         if (!irec_add (rs, ir, source, lineno))
+            return (size_t)-1;
+         nrecords++;
+      }
+      line = next;
+   }
+
+   return nrecords;
+}
+
+/* ******************************************************************** */
+
+// Reads one CSV field at *p, in place, and sets *end to the character that
+// ended it: a comma, a newline or the end of the input. Quoted fields may
+// span lines.
+static char *csv_field (char **p, char *end, size_t *lineno)
+{
+   char *ret = *p;
+   char *src = *p;
+   char *dst = *p;
+
+   if (*src=='"') {
+      src++;
+      for (;;) {
+         if (!*src)
+            return NULL;
+
+         if (*src=='"') {
+            if (src[1]!='"')
+               break;
+            src++;
+         }
+
+         if (*src=='\n') {
+            (*lineno)++;
+         }
+         *dst++ = *src++;
+      }
+      src++;
+   } else {
+      while (*src && *src!=',' && *src!='\n' && *src!='\r')
+         src++;
+      dst = src;
+   }
+
+   if (*src=='\r')
+      src++;
+
+   if (*src && *src!=',' && *src!='\n')
+      return NULL;
+
+   *end = *src;
+   if (*src)
+      src++;
+   *dst = 0;
+
+   *p = src;
+   return ret;
+}
+
+static size_t import_csv (rotsit_t *rs, char *input, const char *source,
+                          struct irec_t *ir)
+{
+   size_t ret = (size_t)-1;
+   size_t nrecords = 0;
+   size_t lineno = 1;
+   size_t *columns = NULL;
+   size_t ncolumns = 0;
+   char *p = input;
+   char end = ',';
+
+   // The header names the columns
+   while (end==',') {
+      char *name = csv_field (&p, &end, &lineno);
+      if (!name) {
+         XERROR ("%s:%zu: malformed CSV header\n", source, lineno);
+         goto errorexit;
+      }
+
+      size_t *tmp = mem_realloc (columns, (ncolumns + 1) * sizeof *tmp);
+      if (!tmp) {
+         XERROR ("Out of memory\n");
+         goto errorexit;
+      }
+      columns = tmp;
+      columns[ncolumns++] = import_field (name);
+   }
+
+   while (*p) {
+      size_t start = ++lineno;
+      size_t column = 0;
+      const char *first = NULL;
+
+      irec_clear (ir);
+      end = ',';
+      while (end==',') {
+         char *value = csv_field (&p, &end, &lineno);
+         if (!value) {
+            XERROR ("%s:%zu: malformed CSV field\n", source, lineno);
+            goto errorexit;
+         }
+
+         if (!first) {
+            first = value;
+         }
+
+         if (column >= ncolumns) {
+            XERROR ("%s:%zu: more fields than the header has columns\n",
+                     source, start);
+            goto errorexit;
+         }
+
+         size_t field = columns[column++];
+         if (field==FIELD_COMMENT) {
+            if (!irec_comment (ir, NULL, NULL, value))
+               goto errorexit;
+         } else if (field<RF_LAST_FIELD) {
+            ir->fields[field] = value;
+         }
+      }
+
+      // Blank lines are skipped
+      if (column==1 && !*first)
+         continue;
+
+      if (column!=ncolumns) {
+         XERROR ("%s:%zu: expected %zu fields, found %zu\n",
+                  source, start, ncolumns, column);
+         goto errorexit;
+      }
+
+      if (!irec_add (rs, ir, source, start))
+         goto errorexit;
+      nrecords++;
+   }
+
+   ret = nrecords;
+
+errorexit:
+   mem_free (columns);
+   return ret;
+}
+
+/* ******************************************************************** */
+
+size_t import_records (rotsit_t *rs, char *input, const char *source)
+{
+   struct irec_t ir;
+   size_t ret;
+
+   if (!rs || !input)
+      return (size_t)-1;
+
+   memset (&ir, 0, sizeof ir);
+
+   // Skip a UTF-8 byte order mark
+   if (strncmp (input, "\xef\xbb\xbf", 3)==0)
+      input += 3;
+
+   char *first = input;
+   skip_ws (&first);
+
+   if (*first=='{') {
+      ret = import_jsonl (rs, input, source, &ir);
+   } else {
+      ret = import_csv (rs, input, source, &ir);
+   }
+
+   mem_free (ir.comments);
+   return ret;
+}
+
@@ -0,0 +1,35 @@
+
+#ifndef H_IMPORT
+#define H_IMPORT
+
+#include <stddef.h>
+
+#include "rotsit.h"
+
+// Bulk import of issues from another tracker. The input is either JSON
+// Lines, one object per issue, or CSV with a header row naming the
+// columns; the format is decided by whether the input starts with '{'.
+//
+// The keys/columns recognised are message, opened_by, opened_on, status,
+// assigned_by, assigned_to, assigned_on, closed_by, closed_on and
+// closed_msg. Anything else is ignored. Comments are given in JSON as an
+// array "comments" of strings or of objects with the keys user, time and
+// comment, and in CSV as any number of columns named comment. Comments
+// without a user or time take those of the issue.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Adds the issues in input, which is modified, to rs. Errors are
+   // reported against 'source' and the line they occur on. Returns the
+   // number of issues added or (size_t)-1 on error, in which case the
+   // issues before the error have been added.
+   size_t import_records (rotsit_t *rs, char *input, const char *source);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
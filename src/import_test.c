@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "import.h"
+
+#include "xstring/xstring.h"
+
+static char *dump_to_string (rotrec_t *rr)
+{
+   char *ret = NULL;
+   FILE *tmpf = tmpfile ();
+   if (!tmpf || !rotrec_dump (rr, tmpf)) {
+      fprintf (stderr, "Unable to dump record\n");
+      goto errorexit;
+   }
+
+   long len = ftell (tmpf);
+   if (len < 0 || !(ret = calloc (len + 1, 1))) {
+      fprintf (stderr, "Out of memory\n");
+      goto errorexit;
+   }
+
+   rewind (tmpf);
+   if (fread (ret, 1, len, tmpf)!=(size_t)len) {
+      fprintf (stderr, "Short read of record\n");
+      free (ret);
+      ret = NULL;
+   }
+
+errorexit:
+   if (tmpf)
+      fclose (tmpf);
+   return ret;
+}
+
+// Checks that record 'recnum' has the given fields and that its dump
+// contains each of the strings in 'expected'.
+static bool check_record (rotsit_t *rs, uint32_t recnum,
+                          const char *opened_by, const char *status,
+                          const char **expected)
+{
+   bool error = true;
+   char *dump = NULL;
+   rotrec_t *rr = rotsit_get_record (rs, recnum);
+
+   if (!rr) {
+      fprintf (stderr, "Record %u is missing\n", recnum);
+      goto errorexit;
+   }
+
+   if (strcmp (rotrec_get_field (rr, RF_OPENED_BY), opened_by)!=0 ||
+       strcmp (rotrec_get_field (rr, RF_STATUS), status)!=0) {
+      fprintf (stderr, "Record %u: expected [%s/%s], got [%s/%s]\n", recnum,
+               opened_by, status, rotrec_get_field (rr, RF_OPENED_BY),
+               rotrec_get_field (rr, RF_STATUS));
+      goto errorexit;
+   }
+
+   if (!(dump = dump_to_string (rr)))
+      goto errorexit;
+
+   for (size_t i=0; expected[i]; i++) {
+      if (!strstr (dump, expected[i])) {
+         fprintf (stderr, "Record %u: [%s] not found in\n%s\n",
+                  recnum, expected[i], dump);
+         goto errorexit;
+      }
+   }
+
+   error = false;
+errorexit:
+   free (dump);
+   return !error;
+}
+
+static bool test_jsonl (void)
+{
+   bool error = true;
+   rotsit_t *rs = rotsit_parse ("");
+   char *input = xstr_dup (
+      "{\"message\": \"Crash on startup\", \"opened_by\": \"jsmith\", "
+         "\"opened_on\": \"2023-01-05\", \"status\": \"OPEN\", "
+         "\"labels\": \"ignored\", "
+         "\"comments\": [\"Seen on \\\"Windows\\\" too\", "
+         "{\"user\": \"alice\", \"time\": \"2023-02-01\", "
+         "\"comment\": \"Fixed in r12 \\u00e9\"}]}\n"
+      "\n"
+      "{\"message\": \"Line one\\nLine two\", \"opened_by\": \"bob\", "
+         "\"status\": \"CLOSED\", \"closed_by\": \"bob\", "
+         "\"closed_on\": \"2023-03-10\", \"closed_msg\": \"Done\", "
+         "\"assigned_to\": null}\n");
+
+   const char *first[] = {
+      "** Crash on startup **", "Jan  5", "2023", "Seen on \"Windows\" too",
+      "alice", "Feb  1", "Fixed in r12 \xc3\xa9", NULL,
+   };
+   const char *second[] = {
+      "** Line one\nLine two **", "Closed by [bob]", "Mar 10", "Done", NULL,
+   };
+
+   if (!rs || !input) {
+      fprintf (stderr, "Out of memory\n");
+      goto errorexit;
+   }
+
+   size_t n = import_records (rs, input, "test.jsonl");
+   if (n!=2 || rotsit_count_records (rs)!=2) {
+      fprintf (stderr, "Imported %zu issues, expected 2\n", n);
+      goto errorexit;
+   }
+
+   if (!check_record (rs, 0, "jsmith", "OPEN", first) ||
+       !check_record (rs, 1, "bob", "CLOSED", second))
+      goto errorexit;
+
+   if (rotsit_filter_count (rs, "opened_on < 1 Feb 2023")!=1) {
+      fprintf (stderr, "Imported dates are not searchable\n");
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   free (input);
+   rotsit_del (rs);
+   return !error;
+}
+
+static bool test_csv (void)
+{
+   bool error = true;
+   rotsit_t *rs = rotsit_parse ("");
+   char *input = xstr_dup (
+      "\xef\xbb\xbfopened_by,message,status,comment,comment,priority\r\n"
+      "jsmith,\"Crash, on startup\",OPEN,First,,high\r\n"
+      "\r\n"
+      "bob,\"Spans\ntwo lines with \"\"quotes\"\"\",OPEN,,Second,low\n");
+
+   const char *first[] = { "** Crash, on startup **", "First", NULL };
+   const char *second[] = {
+      "** Spans\ntwo lines with \"quotes\" **", "Second", NULL,
+   };
+
+   if (!rs || !input) {
+      fprintf (stderr, "Out of memory\n");
+      goto errorexit;
+   }
+
+   size_t n = import_records (rs, input, "test.csv");
+   if (n!=2 || rotsit_count_records (rs)!=2) {
+      fprintf (stderr, "Imported %zu issues, expected 2\n", n);
+      goto errorexit;
+   }
+
+   if (!check_record (rs, 0, "jsmith", "OPEN", first) ||
+       !check_record (rs, 1, "bob", "OPEN", second))
+      goto errorexit;
+
+   error = false;
+errorexit:
+   free (input);
+   rotsit_del (rs);
+   return !error;
+}
+
+static bool test_errors (void)
+{
+   size_t num_errors = 0;
+   const char *inputs[] = {
+      "Missing message",   "{\"status\": \"OPEN\"}\n",
+      "Unterminated",      "{\"message\": \"one\"\n",
+      "Bad escape",        "{\"message\": \"\\q\"}\n",
+      "NUL escape",        "{\"message\": \"\\u0000\"}\n",
+      "Bad surrogate",     "{\"message\": \"\\ud800x\"}\n",
+      "Number value",      "{\"message\": 42}\n",
+      "Trailing junk",     "{\"message\": \"one\"} x\n",
+      "Backspace",         "{\"message\": \"one\\btwo\"}\n",
+      "Bad date",          "{\"message\": \"one\", \"opened_on\": \"never\"}\n",
+      "Short CSV row",     "message,status\none\n",
+      "Long CSV row",      "message,status\none,OPEN,extra\n",
+      "Open CSV quote",    "message\n\"one\n",
+      "Junk after quote",  "message\n\"one\"x\n",
+   };
+
+   for (size_t i=0; i<sizeof inputs/sizeof inputs[0]; i+=2) {
+      rotsit_t *rs = rotsit_parse ("");
+      char *input = xstr_dup (inputs[i + 1]);
+      if (!rs || !input) {
+         fprintf (stderr, "Out of memory\n");
+         num_errors++;
+      } else if (import_records (rs, input, inputs[i])!=(size_t)-1) {
+         fprintf (stderr, "%s: import did not fail\n", inputs[i]);
+         num_errors++;
+      }
+      free (input);
+      rotsit_del (rs);
+   }
+
+   return num_errors==0;
+}
+
+// Whatever export writes as JSON Lines or CSV, import reads back
+static bool test_roundtrip (void)
+{
+   size_t num_errors = 0;
+   const char *messages[] = {
+      "Plain", "Say \"hi\", then\n\ttab \\ \x01 \xc3\xa9", "Comma, \"quote\"",
+   };
+
+   for (rotsit_fmt_t fmt=rotsit_fmt_jsonl; fmt<=rotsit_fmt_csv; fmt++) {
+      char *output = NULL;
+      rotsit_t *copy = rotsit_parse ("");
+      rotsit_t *rs = rotsit_parse ("");
+      FILE *tmpf = tmpfile ();
+      if (!rs || !copy || !tmpf) {
+         fprintf (stderr, "Object creation failed\n");
+         num_errors++;
+         goto next;
+      }
+
+      for (size_t i=0; i<sizeof messages/sizeof messages[0]; i++) {
+         rotrec_t *rr = rotrec_new (messages[i]);
+         if (!rr || !rotsit_add_record (rs, rr) ||
+             !rotrec_add_comment (rr, messages[i])) {
+            fprintf (stderr, "Failed to add record\n");
+            num_errors++;
+            goto next;
+         }
+      }
+
+      long len;
+      if (!rotsit_export (rs, tmpf, fmt, 1) || (len = ftell (tmpf)) < 0 ||
+          !(output = calloc (len + 1, 1))) {
+         fprintf (stderr, "Export failed\n");
+         num_errors++;
+         goto next;
+      }
+      rewind (tmpf);
+      if (fread (output, 1, len, tmpf)!=(size_t)len ||
+          import_records (copy, output, "export")!=3) {
+         fprintf (stderr, "Format %i: import of export failed\n", fmt);
+         num_errors++;
+         goto next;
+      }
+
+      for (uint32_t i=0; i<3; i++) {
+         rotrec_t *orig = rotsit_get_record (rs, i);
+         rotrec_t *imported = rotsit_get_record (copy, i);
+         const size_t fields[] = {
+            RF_OPENED_BY, RF_OPENED_ON, RF_OPENED_MSG, RF_STATUS,
+         };
+         for (size_t j=0; j<sizeof fields/sizeof fields[0]; j++) {
+            if (strcmp (rotrec_get_field (orig, fields[j]),
+                        rotrec_get_field (imported, fields[j]))!=0) {
+               fprintf (stderr, "Format %i: field %zu of %u differs\n",
+                        fmt, fields[j], i);
+               num_errors++;
+            }
+         }
+
+         // The message appears once as the issue and once as the comment
+         char *dump = dump_to_string (imported);
+         char *first = dump ? strstr (dump, messages[i]) : NULL;
+         if (!first || !strstr (first + 1, messages[i])) {
+            fprintf (stderr, "Format %i: comment of %u is missing\n", fmt, i);
+            num_errors++;
+         }
+         free (dump);
+      }
+
+next:
+      if (tmpf)
+         fclose (tmpf);
+      free (output);
+      rotsit_del (rs);
+      rotsit_del (copy);
+   }
+
+   return num_errors==0;
+}
+
+int main (void)
+{
+   size_t num_failures = 0;
+
+   struct {
+      char *name;
+      bool (*fptr) (void);
+   } tests [] = {
+
+#define TESTFUNC(x)      { #x, x }
+
+      TESTFUNC (test_jsonl),
+      TESTFUNC (test_csv),
+      TESTFUNC (test_errors),
+      TESTFUNC (test_roundtrip),
+
+#undef TESTFUNC
+
+   };
+
+   for (size_t i=0; i<sizeof tests/sizeof tests[0]; i++) {
+      bool r = tests[i].fptr ();
+      printf ("XXX %25s: %s\n", tests[i].name, r ? "passed" : "failed");
+
+      if (!r)
+         num_failures++;
+   }
+
+   printf ("XXX %25s: %zu\n", "Failures", num_failures);
+
+   return num_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
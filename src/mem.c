@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "rotsit.h"
+#include "mem.h"
+
+// Each thread has its own allocator, so that threads serving different
+// requests can each use their own arena.
+static _Thread_local rotsit_allocator_t allocator;
+static _Thread_local bool allocator_set;
+
+void rotsit_set_allocator (const rotsit_allocator_t *alloc)
+{
+   if (alloc && alloc->alloc && alloc->resize && alloc->release) {
+      allocator = *alloc;
+      allocator_set = true;
+   } else {
+      memset (&allocator, 0, sizeof allocator);
+      allocator_set = false;
+   }
+}
+
+bool rotsit_get_allocator (rotsit_allocator_t *dst)
+{
+   if (dst) {
+      *dst = allocator;
+   }
+   return allocator_set;
+}
+
+void rotsit_free (void *ptr)
+{
+   mem_free (ptr);
+}
+
+void *mem_alloc (size_t size)
+{
+   if (allocator_set)
+      return allocator.alloc (allocator.ctx, size);
+   return malloc (size);
+}
+
+void *mem_calloc (size_t n, size_t size)
+{
+   if (size && n > SIZE_MAX / size)
+      return NULL;
+
+   void *ret = mem_alloc (n * size);
+   if (ret) {
+      memset (ret, 0, n * size);
+   }
+   return ret;
+}
+
+void *mem_realloc (void *ptr, size_t size)
+{
+   if (!ptr)
+      return mem_alloc (size);
+   if (allocator_set)
+      return allocator.resize (allocator.ctx, ptr, size);
+   return realloc (ptr, size);
+}
+
+void mem_free (void *ptr)
+{
+   if (!ptr)
+      return;
+   if (allocator_set) {
+      allocator.release (allocator.ctx, ptr);
+   } else {
+      free (ptr);
+   }
+}
+
+void mem_capture (mem_owner_t *dst)
+{
+   dst->set = allocator_set;
+   dst->alloc = allocator;
+}
+
+void mem_use (const mem_owner_t *owner)
+{
+   rotsit_set_allocator (owner->set ? &owner->alloc : NULL);
+}
+
+void mem_switch (const mem_owner_t *owner, mem_owner_t *prev)
+{
+   mem_capture (prev);
+   mem_use (owner);
+}
+
+char *mem_strdup (const char *s)
+{
+   if (!s)
+      return NULL;
+
+   size_t len = strlen (s) + 1;
+   char *ret = mem_alloc (len);
+   if (ret) {
+      memcpy (ret, s, len);
+   }
+   return ret;
+}
+
+char *mem_strcat (const char *s, ...)
+{
+   va_list ap;
+   size_t len = 0;
+
+   va_start (ap, s);
+   for (const char *tmp=s; tmp; tmp=va_arg (ap, const char *)) {
+      len += strlen (tmp);
+   }
+   va_end (ap);
+
+   char *ret = mem_alloc (len + 1);
+   if (!ret)
+      return NULL;
+
+   char *dst = ret;
+   va_start (ap, s);
+   for (const char *tmp=s; tmp; tmp=va_arg (ap, const char *)) {
+      size_t tmplen = strlen (tmp);
+      memcpy (dst, tmp, tmplen);
+      dst += tmplen;
+   }
+   va_end (ap);
+   *dst = 0;
+   return ret;
+}
+
+char **mem_split (const char *s, const char *delims)
+{
+   if (!s || !delims)
+      return NULL;
+
+   size_t ntokens = 1;
+   for (const char *tmp=s; *tmp; tmp++) {
+      if (strchr (delims, *tmp))
+         ntokens++;
+   }
+
+   char **ret = mem_calloc (ntokens + 1, sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   for (size_t i=0; i<ntokens; i++) {
+      size_t len = strcspn (s, delims);
+      if (!(ret[i] = mem_alloc (len + 1))) {
+         mem_delarray (ret);
+         return NULL;
+      }
+      memcpy (ret[i], s, len);
+      ret[i][len] = 0;
+      s += len + 1;
+   }
+   return ret;
+}
+
+char **mem_cpyarray (const char **a)
+{
+   if (!a)
+      return NULL;
+
+   size_t n = 0;
+   while (a[n])
+      n++;
+
+   char **ret = mem_calloc (n + 1, sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   for (size_t i=0; i<n; i++) {
+      if (!(ret[i] = mem_strdup (a[i]))) {
+         mem_delarray (ret);
+         return NULL;
+      }
+   }
+   return ret;
+}
+
+void mem_delarray (char **a)
+{
+   if (!a)
+      return;
+
+   for (size_t i=0; a[i]; i++) {
+      mem_free (a[i]);
+   }
+   mem_free (a);
+}
+
+bool memvec_push (memvec_t *mv, void *item)
+{
+   if (mv->len >= mv->cap) {
+      size_t newcap = mv->cap ? mv->cap * 2 : 16;
+      void **tmp = mem_realloc (mv->items, newcap * sizeof *tmp);
+      if (!tmp)
+         return false;
+
+      mv->items = tmp;
+      mv->cap = newcap;
+   }
+   mv->items[mv->len++] = item;
+   return true;
+}
+
+void *memvec_pop (memvec_t *mv)
+{
+   if (!mv->len)
+      return NULL;
+   return mv->items[--mv->len];
+}
+
+void memvec_free (memvec_t *mv)
+{
+   mem_free (mv->items);
+   memset (mv, 0, sizeof *mv);
+}
+
@@ -0,0 +1,65 @@
+
+#ifndef H_MEM
+#define H_MEM
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "rotsit.h"
+
+// Every allocation made by the library goes through these, so that the
+// allocator set with rotsit_set_allocator() sees all of them. The string
+// and vector functions stand in for the libxc ones, which always use
+// malloc().
+
+// The allocator of a thread as it was when captured. Memory that outlives
+// the call it was allocated in, such as everything a database owns, is
+// allocated and released under the allocator captured when its owner was
+// made, whichever thread does it.
+typedef struct {
+   rotsit_allocator_t alloc;
+   bool set;
+} mem_owner_t;
+
+// A growable array of pointers; zero-initialised it is empty.
+typedef struct {
+   void **items;
+   size_t len;
+   size_t cap;
+} memvec_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   void *mem_alloc (size_t size);
+   void *mem_calloc (size_t n, size_t size);
+   void *mem_realloc (void *ptr, size_t size);
+   void mem_free (void *ptr);
+
+   void mem_capture (mem_owner_t *dst);
+   // Makes owner the calling thread's allocator.
+   void mem_use (const mem_owner_t *owner);
+   // As mem_use(), first capturing the allocator it replaces in prev so
+   // that it can be put back with mem_use (prev).
+   void mem_switch (const mem_owner_t *owner, mem_owner_t *prev);
+
+   char *mem_strdup (const char *s);
+   // Concatenates its arguments up to the first NULL.
+   char *mem_strcat (const char *s, ...);
+   // Splits s at each of the characters in delims, keeping empty tokens.
+   // The array and the strings are freed with mem_delarray().
+   char **mem_split (const char *s, const char *delims);
+   char **mem_cpyarray (const char **a);
+   void mem_delarray (char **a);
+
+   bool memvec_push (memvec_t *mv, void *item);
+   void *memvec_pop (memvec_t *mv);
+   void memvec_free (memvec_t *mv);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -1,12 +1,15 @@
+#ifdef PLATFORM_POSIX
+#define _POSIX_C_SOURCE    200809L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
 
-#include "xstring/xstring.h"
-
 #include "pdate.h"
+#include "mem.h"
 
 #define ISENGLISH(x)    (x & (1 << 0))
 #define ISYEAR(x)       (x & (1 << 1))
@@ -28,7 +31,7 @@ int32_t strmonth (const char *string)
       "sep", "oct", "nov", "dec",
    };
    for (size_t i=0; i<sizeof months/sizeof months[0]; i++) {
-      if ((memcmp (months[i], string, 3))==0) {
+      if ((strncmp (months[i], string, 3))==0) {
          return i+1;
       }
    }
@@ -51,8 +54,9 @@ static bool is_DoW (const char *token)
 {
    static const char *days[] = {
 "mo", "tu", "we", "th", "fr", "sa", "su",
-"mon", "tue", "wed", "thurs", "fri", "sat", "sun",
-"monday", "tueday", "wednesday", "thursday", "friday", "saturday", "sunday",
+"mon", "tue", "wed", "thu", "fri", "sat", "sun",
+"tues", "thurs",
+"monday", "tuesday", "wednesday", "thursday", "friday", "saturday", "sunday",
    };
 
    for (size_t i=0; i<sizeof days/sizeof days[0]; i++) {
@@ -63,11 +67,20 @@ static bool is_DoW (const char *token)
    return false;
 }
 
+bool pdate_localtime (time_t when, struct tm *dst)
+{
+#ifdef PLATFORM_POSIX
+   return localtime_r (&when, dst)!=NULL;
+#else
+   return localtime_s (dst, &when)==0;
+#endif
+}
+
 enum pdate_errcode_t pdate_parse (const char *string, time_t *ret,
                                   bool fromdate)
 {
    time_t tv;
-   struct tm *tm;
+   struct tm tm;
    enum pdate_errcode_t errcode = pdate_error;
    int32_t year = -1;
    int32_t month = -1;
@@ -75,7 +88,8 @@ enum pdate_errcode_t pdate_parse (const char *string, time_t *ret,
    int32_t hour = -1;
    int32_t min = -1;
    int32_t sec = -1;
-   char *copy = xstr_dup (string);
+   bool year_first = false;
+   char *copy = mem_strdup (string);
    char **tokens = NULL;
    uint32_t typed[7]; // More than 6 tokens and we return errorcode.
 
@@ -90,9 +104,10 @@ enum pdate_errcode_t pdate_parse (const char *string, time_t *ret,
    }
 
    time (&tv);
-   tm = localtime (&tv);
-   tokens = xstr_split (copy, ",\n\t \\/-");
-   free (copy); copy = NULL;
+   if (!pdate_localtime (tv, &tm))
+      goto errorexit;
+   tokens = mem_split (copy, ",\n\t \\/-");
+   mem_free (copy); copy = NULL;
    if (!tokens) goto errorexit;
 
    // Definitive checks
@@ -116,19 +131,20 @@ enum pdate_errcode_t pdate_parse (const char *string, time_t *ret,
       }
       // Year check
       if (toklen==4) {
-         if ((sscanf (tokens[i], "%4i", &t_year))==1) {
+         if ((sscanf (tokens[i], "%4d", &t_year))==1) {
             if (year!=-1) {
                errcode = pdate_ambig_year;
                goto errorexit;
             }
             year = t_year;
+            year_first = i==0;
             tokens[i][0] = 0;
             continue;
          }
       }
       // Day check
       if (toklen==2) {
-         if ((sscanf (tokens[i], "%2i", &t_day))==1) {
+         if ((sscanf (tokens[i], "%2d", &t_day))==1) {
             if (t_day>12) {
                if (day!=-1) {
                   errcode = pdate_ambig_day;
@@ -144,7 +160,7 @@ enum pdate_errcode_t pdate_parse (const char *string, time_t *ret,
       if (strchr (tokens[i], ':') ||strchr (tokens[i], 'h')) {
          char *s_min;
          char *s_sec;
-         if ((sscanf (tokens[i], "%2i", &t_hour))==1) {
+         if ((sscanf (tokens[i], "%2d", &t_hour))==1) {
             if (hour!=-1) {
                errcode = pdate_ambig_hour;
                goto errorexit;
@@ -155,7 +171,7 @@ enum pdate_errcode_t pdate_parse (const char *string, time_t *ret,
          s_min = strchr (tokens[i], 'h');
          if (!s_min) s_min = strchr (tokens[i], ':');
 
-         if ((sscanf (s_min+1, "%2i", &t_min))==1) {
+         if ((sscanf (s_min+1, "%2d", &t_min))==1) {
             if (min!=-1) {
                errcode = pdate_ambig_min;
                goto errorexit;
@@ -166,7 +182,7 @@ enum pdate_errcode_t pdate_parse (const char *string, time_t *ret,
          s_sec = strchr (s_min+1, ':');
          if (!s_sec)
             continue;
-         if ((sscanf (s_sec+1, "%2i", &t_sec))==1) {
+         if ((sscanf (s_sec+1, "%2d", &t_sec))==1) {
             if (sec!=-1) {
                errcode = pdate_ambig_sec;
                goto errorexit;
@@ -183,11 +199,23 @@ enum pdate_errcode_t pdate_parse (const char *string, time_t *ret,
       size_t toklen = strlen (tokens[i]);
       if (toklen==0)
          continue;
-      if ((sscanf (tokens[i], "%i", &tmpval))!=1 &&
-          (is_DoW (tokens[i])!=true)) {
+      // The day of the week carries no information that the rest of the
+      // date does not, so it is skipped rather than used as a number.
+      if (is_DoW (tokens[i])) {
+         tokens[i][0] = 0;
+         continue;
+      }
+      if ((sscanf (tokens[i], "%d", &tmpval))!=1) {
          errcode = pdate_unknown_field;
          goto errorexit;
       }
+      // A date that starts with the year (2016-06-12) is in ISO order,
+      // with the month before the day.
+      if (year_first && month==-1) {
+         month = tmpval;
+         tokens[i][0] = 0;
+         continue;
+      }
       if (day==-1) {
          day = tmpval;
          tokens[i][0] = 0;
@@ -218,7 +246,7 @@ enum pdate_errcode_t pdate_parse (const char *string, time_t *ret,
       day = fromdate ? 1 : clamp_day (month);
    }
    if (year==-1) {
-      year = tm->tm_year + 1900;
+      year = tm.tm_year + 1900;
    }
    if (hour==-1) {
       hour = fromdate ? 0 : 59;
@@ -231,16 +259,16 @@ enum pdate_errcode_t pdate_parse (const char *string, time_t *ret,
    }
 
    month--;
-   memset (tm, 0, sizeof *tm);
+   memset (&tm, 0, sizeof tm);
    year = year - 1900;
-   tm->tm_sec = sec;
-   tm->tm_min = min;
-   tm->tm_hour = hour;
-   tm->tm_mday = day;
-   tm->tm_mon = month;
-   tm->tm_year = year;
+   tm.tm_sec = sec;
+   tm.tm_min = min;
+   tm.tm_hour = hour;
+   tm.tm_mday = day;
+   tm.tm_mon = month;
+   tm.tm_year = year;
 
-   tv = mktime (tm);
+   tv = mktime (&tm);
    if (tv==(time_t)-1) {
       errcode = pdate_invalid;
       goto errorexit;
@@ -249,14 +277,14 @@ enum pdate_errcode_t pdate_parse (const char *string, time_t *ret,
    errcode = pdate_valid;
    memcpy (ret, &tv, sizeof tv);
 
-   xstr_delarray (tokens);
+   mem_delarray (tokens);
    return errcode;
 
 
 errorexit:
-   free (copy);
+   mem_free (copy);
    if (tokens)
-      xstr_delarray (tokens);
+      mem_delarray (tokens);
    return errcode;
 }
 
@@ -304,6 +332,8 @@ void pdate_test (void)
      "12-June 23:01:19 2016",
      "12/6/2016",
      "12/06/2016",
+     "2016-06-12",
+     "2016/6/12 23:01:19",
      /*
      "Yesterday",
      "Today",
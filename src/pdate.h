@@ -26,6 +26,9 @@ extern "C" {
    enum pdate_errcode_t pdate_parse (const char *string, time_t *ret,
                                      bool fromdate);
    const char *pdate_errmsg (enum pdate_errcode_t pd);
+
+   // Reentrant localtime(), which is spelt differently on each platform.
+   bool pdate_localtime (time_t when, struct tm *dst);
    void pdate_test (void);
 
 #ifdef __cplusplus
@@ -1,10 +1,41 @@
 
 // Command-line client for the rotsit library
 
+#ifdef PLATFORM_POSIX
+#define _XOPEN_SOURCE      700
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#ifdef PLATFORM_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <glob.h>
+#include <pthread.h>
+#endif
+
+// For the heap in use, in --stats
+#if defined (__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#define HAVE_MALLINFO2
+#include <malloc.h>
+#endif
 
 #include "rotsit.h"
+#include "import.h"
+#include "pdate.h"
 
 #include "xerror/xerror.h"
 #include "xstring/xstring.h"
@@ -39,19 +70,378 @@ static uint32_t my_rand (void)
    return (uint32_t) (my_seed & 0xffffffff);
 }
 
+// putenv() keeps the string it is given, so the previous one can only be
+// released once it has been replaced.
+static bool set_user (const char *username)
+{
+   static char *current = NULL;
+
+   char *tmp = xstr_cat (ENV_USERNAME, "=", username, NULL);
+   if (!tmp) {
+      XERROR ("Out of memory\n");
+      return false;
+   }
+   putenv (tmp);
+   free (current);
+   current = tmp;
+   return true;
+}
+
+// The output format of export and list
+static rotsit_fmt_t out_format = rotsit_fmt_text;
+
+static bool set_format (const char *name)
+{
+   static const struct {
+      const char *name;
+      rotsit_fmt_t fmt;
+   } formats[] = {
+      { "text",   rotsit_fmt_text  },
+      { "jsonl",  rotsit_fmt_jsonl },
+      { "csv",    rotsit_fmt_csv   },
+      { "tsv",    rotsit_fmt_tsv   },
+   };
+
+   for (size_t i=0; i<sizeof formats/sizeof formats[0]; i++) {
+      if (strcmp (formats[i].name, name)==0) {
+         out_format = formats[i].fmt;
+         return true;
+      }
+   }
+
+   XERROR ("Unknown output format [%s]\n", name);
+   return false;
+}
+
+// --stats reports what each phase of a command cost. Time is charged to
+// whichever phase is current, so a filter run by a command counts as
+// filter time and not command time.
+enum phase_t {
+   PHASE_OTHER = 0,
+   PHASE_READ,
+   PHASE_PARSE,
+   PHASE_FILTER,
+   PHASE_COMMAND,
+   PHASE_WRITE,
+   NUM_PHASES,
+};
+
+static const char *phase_names[NUM_PHASES] = {
+   "other", "read", "parse", "filter", "command", "write",
+};
+
+static struct {
+   bool on;
+   bool json;
+   enum phase_t current;
+   double wall_mark;
+   double cpu_mark;
+   int64_t heap_mark;
+   uint64_t allocs_mark;
+   double wall[NUM_PHASES];
+   double cpu[NUM_PHASES];
+   int64_t heap[NUM_PHASES];     // Growth of the heap in use
+   uint64_t allocs[NUM_PHASES];  // Allocations made by the library
+   uint64_t bytes_read;
+} stats;
+
+// Export formats on several threads, each of which counts here
+static atomic_uint_fast64_t stats_nallocs;
+
+static void *stats_alloc (void *ctx, size_t size)
+{
+   (void)ctx;
+   atomic_fetch_add_explicit (&stats_nallocs, 1, memory_order_relaxed);
+   return malloc (size);
+}
+
+static void *stats_resize (void *ctx, void *ptr, size_t size)
+{
+   (void)ctx;
+   atomic_fetch_add_explicit (&stats_nallocs, 1, memory_order_relaxed);
+   return realloc (ptr, size);
+}
+
+static void stats_release (void *ctx, void *ptr)
+{
+   (void)ctx;
+   free (ptr);
+}
+
+static double stats_wall (void)
+{
+#ifdef PLATFORM_POSIX
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+   return (double)time (NULL);
+#endif
+}
+
+static int64_t stats_heap (void)
+{
+#ifdef HAVE_MALLINFO2
+   struct mallinfo2 mi = mallinfo2 ();
+   return (int64_t)(mi.uordblks + mi.hblkhd);
+#else
+   return 0;
+#endif
+}
+
+// Makes phase the current one and returns the one it replaces, so that
+// nested phases can hand back to the phase they interrupted.
+static enum phase_t stats_phase (enum phase_t phase)
+{
+   enum phase_t ret = stats.current;
+   if (!stats.on)
+      return ret;
+
+   double wall = stats_wall ();
+   double cpu = (double)clock () / CLOCKS_PER_SEC;
+   int64_t heap = stats_heap ();
+   uint64_t allocs = atomic_load (&stats_nallocs);
+
+   stats.wall[ret] += wall - stats.wall_mark;
+   stats.cpu[ret] += cpu - stats.cpu_mark;
+   stats.heap[ret] += heap - stats.heap_mark;
+   stats.allocs[ret] += allocs - stats.allocs_mark;
+   stats.wall_mark = wall;
+   stats.cpu_mark = cpu;
+   stats.heap_mark = heap;
+   stats.allocs_mark = allocs;
+   stats.current = phase;
+   return ret;
+}
+
+static void stats_start (const char *how)
+{
+   static const rotsit_allocator_t counter = {
+      stats_alloc, stats_resize, stats_release, NULL,
+   };
+
+   rotsit_set_allocator (&counter);
+   memset (&stats, 0, sizeof stats);
+   stats.on = true;
+   stats.json = strcmp (how, "json")==0;
+   stats.wall_mark = stats_wall ();
+   stats.cpu_mark = (double)clock () / CLOCKS_PER_SEC;
+   stats.heap_mark = stats_heap ();
+}
+
+// Written to stderr so that it never mixes with the command's output
+static void stats_report (rotsit_t *rs)
+{
+   rotsit_stats_t rstats;
+
+   if (!stats.on)
+      return;
+
+   stats_phase (PHASE_OTHER);
+   if (!rotsit_get_stats (rs, &rstats)) {
+      memset (&rstats, 0, sizeof rstats);
+   }
+
+   const struct {
+      const char *name;
+      uint64_t value;
+   } counts[] = {
+      { "bytes_read",         stats.bytes_read           },
+      { "bytes_parsed",       rstats.bytes_parsed        },
+      { "bytes_written",      rstats.bytes_written       },
+      { "records_parsed",     rstats.records_parsed      },
+      { "records_restored",   rstats.records_restored    },
+      { "records_kept",       rstats.records_kept        },
+      { "filters",            rstats.filters             },
+      { "records_scanned",    rstats.records_scanned     },
+      { "records_matched",    rstats.records_matched     },
+   };
+
+   if (stats.json) {
+      fprintf (stderr, "{\"phases\":{");
+      for (size_t i=0; i<NUM_PHASES; i++) {
+         fprintf (stderr, "%s\"%s\":{\"wall_s\":%.6f,\"cpu_s\":%.6f,"
+                  "\"heap_bytes\":%" PRId64 ",\"allocs\":%" PRIu64 "}",
+                  i ? "," : "", phase_names[i], stats.wall[i], stats.cpu[i],
+                  stats.heap[i], stats.allocs[i]);
+      }
+      fprintf (stderr, "}");
+      for (size_t i=0; i<sizeof counts/sizeof counts[0]; i++) {
+         fprintf (stderr, ",\"%s\":%" PRIu64, counts[i].name,
+                  counts[i].value);
+      }
+      fprintf (stderr, "}\n");
+      return;
+   }
+
+   fprintf (stderr, "%-10s %12s %12s %14s %10s\n", "phase", "wall ms",
+            "cpu ms", "heap bytes", "allocs");
+   for (size_t i=0; i<NUM_PHASES; i++) {
+      fprintf (stderr, "%-10s %12.3f %12.3f %14" PRId64 " %10" PRIu64 "\n",
+               phase_names[i], stats.wall[i] * 1e3, stats.cpu[i] * 1e3,
+               stats.heap[i], stats.allocs[i]);
+   }
+   for (size_t i=0; i<sizeof counts/sizeof counts[0]; i++) {
+      fprintf (stderr, "%-18s %" PRIu64 "\n", counts[i].name,
+               counts[i].value);
+   }
+}
+
+// Archived issues are kept in a second file (see <archive>) that is only
+// read by the commands that need it.
+#define ARCHIVE_DAYS    (90)
+static const char *archive_file = NULL;
+
+static char *read_stream (FILE *inf);
+
+// Where the archive of dbfile is kept when --archive is not given:
+// issues.sitdb is archived to issues.archive.sitdb, anything else to the
+// same name with ".archive" appended.
+static char *archive_name (const char *dbfile)
+{
+   char *ret = NULL;
+   size_t len = strlen (dbfile);
+   size_t extlen = strlen (".sitdb");
+
+   if (len > extlen && strcmp (&dbfile[len - extlen], ".sitdb")==0) {
+      char *stem = xstr_dup (dbfile);
+      if (stem) {
+         stem[len - extlen] = 0;
+         ret = xstr_cat (stem, ".archive.sitdb", NULL);
+      }
+      free (stem);
+   } else {
+      ret = xstr_cat (dbfile, ".archive", NULL);
+   }
+
+   if (!ret) {
+      XERROR ("Out of memory\n");
+   }
+   return ret;
+}
+
+static bool load_archive_from (rotsit_t *rs, const char *fname)
+{
+   if (!fname || rotsit_archive_loaded (rs))
+      return true;
+
+   // No archive has been made yet
+   FILE *inf = fopen (fname, "rb");
+   if (!inf)
+      return rotsit_load_archive (rs, "");
+
+   enum phase_t prev = stats_phase (PHASE_READ);
+   char *text = read_stream (inf);
+   fclose (inf);
+   if (!text) {
+      XERROR ("Unable to read archive [%s]\n", fname);
+      stats_phase (prev);
+      return false;
+   }
+
+   if (stats.on) {
+      stats.bytes_read += strlen (text);
+   }
+
+   stats_phase (PHASE_PARSE);
+   bool ret = rotsit_load_archive (rs, text);
+   if (!ret) {
+      XERROR ("Unable to load archive [%s]\n", fname);
+   }
+   free (text);
+   stats_phase (prev);
+   return ret;
+}
+
+static bool load_archive (rotsit_t *rs)
+{
+   return load_archive_from (rs, archive_file);
+}
+
+// Only closed issues are archived, so a query needs the archive whenever
+// it could match a closed issue, which the filter works out from the
+// expression itself.
+static bool query_needs_archive (const char *expr)
+{
+   return rotsit_filter_may_match (expr, RF_STATUS, "CLOSED");
+}
+
+// The file is written to a temporary file that is then renamed over the
+// original, so that a failed write never leaves a truncated file.
+static bool save_file (rotsit_t *rs, const char *fname,
+                       bool (*writer) (rotsit_t *, FILE *))
+{
+   bool error = true;
+   FILE *outf = NULL;
+   char *tmpname = xstr_cat (fname, ".tmp", NULL);
+   if (!tmpname) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
+
+   if (!(outf = fopen (tmpname, "wb"))) {
+      XERROR ("Unable to write file [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
+
+   bool written = writer (rs, outf);
+   int rc = fclose (outf);
+   outf = NULL;
+   if (!written || rc!=0) {
+      XERROR ("Failed to write [%s]\n", tmpname);
+      goto errorexit;
+   }
+
+#ifndef PLATFORM_POSIX
+   remove (fname);
+#endif
+   if (rename (tmpname, fname)!=0) {
+      XERROR ("Unable to replace [%s]: %m\n", fname);
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   if (outf)
+      fclose (outf);
+   if (error && tmpname)
+      remove (tmpname);
+   free (tmpname);
+   return !error;
+}
+
+// The archive is written first: if the database cannot then be written,
+// issues that were just archived are in both files rather than neither.
+static bool save_db (rotsit_t *rs, const char *dbfile)
+{
+   if (rotsit_archive_loaded (rs) &&
+       !save_file (rs, archive_file, rotsit_write_archive))
+      return false;
+
+   return save_file (rs, dbfile, rotsit_write);
+}
+
 // All the user commands are handled by functions that follow this
 // specification.
-typedef uint32_t (*cmdfptr_t) (rotsit_t *, char *, const char **);
+typedef uint32_t (*cmdfptr_t) (rotsit_t *, char *, const char **, FILE *);
+
+static bool needs_message (const char *command);
+static cmdfptr_t find_cmd (const char *name);
+static uint32_t cmd_batch (rotsit_t *rs, char *msg, const char **args,
+                           FILE *outf);
+static uint32_t cmd_import (rotsit_t *rs, char *msg, const char **args,
+                            FILE *outf);
 
 // All the user commands
-static uint32_t cmd_add (rotsit_t *rs, char *msg, const char **args)
+static uint32_t cmd_add (rotsit_t *rs, char *msg, const char **args,
+                         FILE *outf)
 {
    uint32_t ret = 0x000001ff;
    args = args;
 
    my_setseed (msg);
 
-   XLOG ("Creating new record (This may take a few minutes)\n");
+   XLOG ("Creating new record\n");
 
    rotrec_t *rec = rotrec_new (msg);
    if (!rec) {
@@ -66,167 +456,1583 @@ static uint32_t cmd_add (rotsit_t *rs, char *msg, const char **args)
       goto errorexit;
    }
 
-   ret = 0x00000100;
+   fprintf (outf, "%s\n", rotrec_get_field (rec, RF_GUID));
+
+   ret = 0x00000100;
+
+errorexit:
+   if (ret & 0xff) {
+      rotrec_del (rec);
+   }
+   return ret;
+}
+
+static rotrec_t *safe_rotrec_by_id (rotsit_t *rs, const char **args)
+{
+   const char *id = args[1];
+   const char *f = args[0];
+   rotrec_t *rr = NULL;
+
+   if (!id) {
+      XERROR ("Expected an id for function [%s], no id specified\n", f);
+      return NULL;
+   }
+
+   rr = rotsit_find_by_id (rs, id);
+   if (!rr && !rotsit_archive_loaded (rs) && load_archive (rs)) {
+      rr = rotsit_find_by_id (rs, id);
+   }
+   if (!rr) {
+      XERROR ("No record found with id [%s] in function [%s]\n", id, f);
+   }
+
+   return rr;
+}
+
+static uint32_t cmd_show (rotsit_t *rs, char *msg, const char **args,
+                          FILE *outf)
+{
+   msg = msg;
+
+   if (!rotrec_dump (safe_rotrec_by_id (rs, args), outf)) {
+      return 0xff;
+   }
+
+   return 0;
+}
+
+static uint32_t cmd_comment (rotsit_t *rs, char *msg, const char **args,
+                             FILE *outf)
+{
+   outf = outf;
+   my_setseed (msg);
+
+   if (!rotrec_add_comment (safe_rotrec_by_id (rs, args), msg)) {
+      return 0x00ff;
+   }
+
+   return 0x0100;
+}
+
+static uint32_t cmd_dup (rotsit_t *rs, char *msg, const char **args,
+                         FILE *outf)
+{
+   msg = msg;
+   outf = outf;
+
+   if (!args[1] || !args[2]) {
+      XERROR ("Marking duplicate requires two IDs\n");
+      return 0x00ff;
+   }
+
+   if (!rotrec_dup (safe_rotrec_by_id (rs, args), args[2])) {
+      return 0x00ff;
+   }
+
+   return 0x0100;
+}
+
+static uint32_t cmd_reopen (rotsit_t *rs, char *msg, const char **args,
+                            FILE *outf)
+{
+   outf = outf;
+
+   if (!rotrec_reopen (safe_rotrec_by_id (rs, args), msg)) {
+      return 0x00ff;
+   }
+
+   return 0x0100;
+}
+
+static uint32_t cmd_close (rotsit_t *rs, char *msg, const char **args,
+                           FILE *outf)
+{
+   outf = outf;
+
+   if (!rotrec_close (safe_rotrec_by_id (rs, args), msg)) {
+      return 0x00ff;
+   }
+   return 0x0100;
+}
+
+static uint32_t cmd_export (rotsit_t *rs, char *msg, const char **args,
+                            FILE *outf)
+{
+   msg = msg;
+   args = args;
+
+   if (!load_archive (rs))
+      return 0x00ff;
+
+   return rotsit_export (rs, outf, out_format, 0) ? 0x0000 : 0x00ff;
+}
+
+static void list_banner (FILE *outf, const char *expr)
+{
+   if (out_format==rotsit_fmt_text) {
+      fprintf (outf, " *****************************************************\n");
+      fprintf (outf, " ARGS: [%s]\n", expr);
+      fprintf (outf, " *****************************************************\n");
+   }
+}
+
+static uint32_t cmd_list (rotsit_t *rs, char *msg, const char **args,
+                          FILE *outf)
+{
+   msg = msg;
+
+   list_banner (outf, args[1]);
+
+   if (!args[1]) {
+      XERROR ("No search expression specified\n");
+      return 0x00ff;
+   }
+
+   if (query_needs_archive (args[1]) && !load_archive (rs))
+      return 0x00ff;
+
+   enum phase_t prev = stats_phase (PHASE_FILTER);
+   rotrec_t **results = rotsit_filter (rs, args[1]);
+   stats_phase (prev);
+   if (!results) {
+      XERROR ("Internal error in filter function\n");
+      return 0x00ff;
+   }
+
+   bool ok = rotsit_export_list (results, outf, out_format, 0);
+   rotsit_free (results);
+   return ok ? 0x0000 : 0x00ff;
+}
+
+static uint32_t cmd_count (rotsit_t *rs, char *msg, const char **args,
+                           FILE *outf)
+{
+   msg = msg;
+
+   if (!args[1]) {
+      XERROR ("No search expression specified\n");
+      return 0x00ff;
+   }
+
+   if (query_needs_archive (args[1]) && !load_archive (rs))
+      return 0x00ff;
+
+   enum phase_t prev = stats_phase (PHASE_FILTER);
+   uint32_t n = rotsit_filter_count (rs, args[1]);
+   stats_phase (prev);
+
+   fprintf (outf, "%" PRIu32 "\n", n);
+   return 0x0000;
+}
+
+// Moves the issues closed before the cutoff date (by default ARCHIVE_DAYS
+// ago) to the archive.
+static uint32_t cmd_archive (rotsit_t *rs, char *msg, const char **args,
+                             FILE *outf)
+{
+   char cutoff[64];
+   char expr[128];
+   time_t epoch = time (NULL) - ARCHIVE_DAYS * 24 * 60 * 60;
+   const char *fmt = "%d %b %Y";
+   struct tm tm;
+   msg = msg;
+
+   if (args[1]) {
+      if (pdate_parse (args[1], &epoch, true)!=pdate_valid) {
+         XERROR ("Cutoff [%s] is not a date\n", args[1]);
+         return 0x00ff;
+      }
+      fmt = "%d %b %Y %H:%M:%S";
+   }
+
+   // The filter is given the cutoff in a form it can only read as a date,
+   // whatever form it was given in
+   if (!pdate_localtime (epoch, &tm) ||
+       !strftime (cutoff, sizeof cutoff, fmt, &tm)) {
+      XERROR ("Unable to work out the cutoff\n");
+      return 0x00ff;
+   }
+
+   if (!load_archive (rs))
+      return 0x00ff;
+
+   snprintf (expr, sizeof expr, "(status == CLOSED) & (closed_on < %s)",
+             cutoff);
+   uint32_t n = rotsit_archive (rs, expr);
+   if (n==(uint32_t)-1) {
+      XERROR ("Unable to archive issues closed before [%s]\n", cutoff);
+      return 0x00ff;
+   }
+
+   fprintf (outf, "Archived %" PRIu32 " issues\n", n);
+   return 0x0100;
+}
+
+static char *read_stream (FILE *inf)
+{
+   char *ret = NULL;
+   size_t len = 0,
+          size = 0;
+
+   for (;;) {
+      if (len + 1 >= size) {
+         size = size ? size * 2 : 4096;
+         char *tmp = realloc (ret, size);
+         if (!tmp) {
+            XERROR ("Out of memory\n");
+            free (ret);
+            return NULL;
+         }
+         ret = tmp;
+      }
+
+      size_t nread = fread (&ret[len], 1, size - len - 1, inf);
+      len += nread;
+      if (!nread)
+         break;
+   }
+
+   if (ferror (inf)) {
+      XERROR ("Error reading input: %m\n");
+      free (ret);
+      return NULL;
+   }
+
+   ret[len] = 0;
+   return ret;
+}
+
+#define BATCH_MAXWORDS     (16)
+
+// Splits one line of a batch into words, in place. Words are separated by
+// whitespace. A word in double quotes may contain whitespace and the
+// escapes \n, \t, \" and \\. Returns the number of words, or (size_t)-1
+// if the line is malformed.
+static size_t batch_split (char *line, char **words)
+{
+   size_t nwords = 0;
+   char *src = line;
+
+   for (;;) {
+      while (isspace (*src))
+         src++;
+
+      if (!*src)
+         break;
+
+      if (nwords >= BATCH_MAXWORDS - 1)
+         return (size_t)-1;
+
+      char *dst = src;
+      words[nwords++] = dst;
+
+      if (*src=='"') {
+         src++;
+         while (*src && *src!='"') {
+            if (*src=='\\' && src[1]) {
+               src++;
+               switch (*src) {
+                  case 'n':   *dst++ = '\n';   break;
+                  case 't':   *dst++ = '\t';   break;
+                  default:    *dst++ = *src;   break;
+               }
+               src++;
+               continue;
+            }
+            *dst++ = *src++;
+         }
+
+         if (*src!='"')
+            return (size_t)-1;
+         src++;
+
+         if (*src && !isspace (*src))
+            return (size_t)-1;
+      } else {
+         while (*src && !isspace (*src))
+            src++;
+         dst = src;
+      }
+
+      char c = *src;
+      *dst = 0;
+      if (c)
+         src++;
+   }
+
+   words[nwords] = NULL;
+   return nwords;
+}
+
+// Runs a single line of a batch or a server request. Each line holds one
+// command with its arguments; commands that need a message take it as
+// their last argument. Lines "user <name>" and "format <name>" change the
+// user and output format for the commands that follow them. Blank lines
+// and comments do nothing.
+static uint32_t run_line (rotsit_t *rs, char *line, FILE *outf,
+                          const char *source, size_t lineno)
+{
+   char *words[BATCH_MAXWORDS];
+
+   size_t nwords = batch_split (line, words);
+   if (nwords==(size_t)-1) {
+      XERROR ("%s:%zu: malformed command\n", source, lineno);
+      return 0x00ff;
+   }
+
+   if (!nwords || words[0][0]=='#')
+      return 0x0000;
+
+   if (strcmp (words[0], "user")==0) {
+      if (nwords!=2) {
+         XERROR ("%s:%zu: expected a single username\n", source, lineno);
+         return 0x00ff;
+      }
+      return set_user (words[1]) ? 0x0000 : 0x00ff;
+   }
+
+   if (strcmp (words[0], "format")==0) {
+      if (nwords!=2) {
+         XERROR ("%s:%zu: expected a single format\n", source, lineno);
+         return 0x00ff;
+      }
+      return set_format (words[1]) ? 0x0000 : 0x00ff;
+   }
+
+   cmdfptr_t cmdfptr = find_cmd (words[0]);
+   if (!cmdfptr || cmdfptr==cmd_batch) {
+      XERROR ("%s:%zu: [%s] is not a batch command\n",
+               source, lineno, words[0]);
+      return 0x00ff;
+   }
+
+   if (cmdfptr==cmd_import && nwords < 2) {
+      XERROR ("%s:%zu: [import] requires a filename here\n", source, lineno);
+      return 0x00ff;
+   }
+
+   char *cmdmsg = NULL;
+   if (needs_message (words[0])) {
+      if (nwords < 2) {
+         XERROR ("%s:%zu: [%s] requires a message\n",
+                  source, lineno, words[0]);
+         return 0x00ff;
+      }
+      cmdmsg = words[--nwords];
+      words[nwords] = NULL;
+   }
+
+   uint32_t result = cmdfptr (rs, cmdmsg, (const char **)words, outf);
+   if (result & 0xff) {
+      XERROR ("%s:%zu: command [%s] returned error 0x%02x\n",
+               source, lineno, words[0], result & 0xff);
+   }
+   return result;
+}
+
+// Runs a stream of commands against the database, which is only read and
+// written once for the whole batch. The first failing command aborts the
+// batch and nothing is written.
+static uint32_t cmd_batch (rotsit_t *rs, char *msg, const char **args,
+                           FILE *outf)
+{
+   uint32_t ret = 0x00ff;
+   bool dirty = false;
+   size_t lineno = 0;
+   const char *source = args[1] ? args[1] : "stdin";
+   msg = msg;
+
+   char *input = args[1] ? xstr_readfile (args[1]) : read_stream (stdin);
+   if (!input) {
+      XERROR ("Unable to read batch commands from [%s]\n", source);
+      goto errorexit;
+   }
+
+   char *line = input;
+   while (line && *line) {
+      char *next = strchr (line, '\n');
+      if (next) {
+         *next++ = 0;
+      }
+
+      uint32_t result = run_line (rs, line, outf, source, ++lineno);
+      if (result & 0xff)
+         goto errorexit;
+
+      if ((result >> 8) & 0xff) {
+         dirty = true;
+      }
+      line = next;
+   }
+
+   ret = dirty ? 0x0100 : 0x0000;
+
+errorexit:
+   free (input);
+   return ret;
+}
+
+// Adds the issues exported by another tracker, as JSON Lines or CSV (see
+// import.h), in one pass. Nothing is written if any issue is rejected.
+static uint32_t cmd_import (rotsit_t *rs, char *msg, const char **args,
+                            FILE *outf)
+{
+   uint32_t ret = 0x00ff;
+   const char *source = args[1] ? args[1] : "stdin";
+   msg = msg;
+
+   char *input = args[1] ? xstr_readfile (args[1]) : read_stream (stdin);
+   if (!input) {
+      XERROR ("Unable to read issues from [%s]\n", source);
+      goto errorexit;
+   }
+
+   size_t n = import_records (rs, input, source);
+   if (n==(size_t)-1)
+      goto errorexit;
+
+   fprintf (outf, "Imported %zu issues\n", n);
+   ret = n ? 0x0100 : 0x0000;
+
+errorexit:
+   free (input);
+   return ret;
+}
+
+static bool needs_message (const char *command)
+{
+   static const char *cmds[] = {
+      "add", "comment", "close", "reopen",
+   };
+
+   for (size_t i=0; i<sizeof cmds/sizeof cmds[0]; i++) {
+      if (strcmp (cmds[i], command) == 0) {
+         return true;
+      }
+   }
+   return false;
+}
+
+static cmdfptr_t find_cmd (const char *name)
+{
+   static const struct {
+      const char *name;
+      cmdfptr_t fptr;
+   } cmds[] = {
+      { "add",       cmd_add     },
+      { "show",      cmd_show    },
+      { "comment",   cmd_comment },
+      { "dup",       cmd_dup     },
+      { "reopen",    cmd_reopen  },
+      { "close",     cmd_close   },
+      { "export",    cmd_export  },
+      { "list",      cmd_list    },
+      { "count",     cmd_count   },
+      { "batch",     cmd_batch   },
+      { "import",    cmd_import  },
+      { "archive",   cmd_archive },
+   };
+
+   for (size_t i=0; i<sizeof cmds/sizeof cmds[0]; i++) {
+      if (strcmp (cmds[i].name, name) == 0) {
+         return cmds[i].fptr;
+      }
+   }
+   return NULL;
+}
+
+// Reads a version of a database from a file other than dbfile. The text
+// is returned in *text, to be freed after the database.
+static rotsit_t *read_db (const char *fname, char **text)
+{
+   rotsit_t *ret = NULL;
+   FILE *inf = fopen (fname, "rb");
+   if (!inf) {
+      XERROR ("Unable to open [%s]: %m\n", fname);
+      return NULL;
+   }
+   *text = read_stream (inf);
+   fclose (inf);
+
+   if (!*text || !(ret = rotsit_parse (*text))) {
+      XERROR ("Unable to read issues from [%s]\n", fname);
+   }
+   return ret;
+}
+
+// A git merge driver: the versions of a database in base, ours and theirs
+// are merged record by record into ours (see <merge-driver>). Conflicts
+// are resolved in favour of ours, and reported to git as a failure.
+static int merge_driver (const char **args)
+{
+   int ret = EXIT_FAILURE;
+   char *texts[3] = { NULL, NULL, NULL };
+   rotsit_t *versions[3] = { NULL, NULL, NULL };
+   FILE *outf = NULL;
+   size_t nconflicts = 0;
+
+   if (!args[1] || !args[2] || !args[3]) {
+      XERROR ("merge-driver requires the base, ours and theirs files\n");
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<3; i++) {
+      if (!(versions[i] = read_db (args[i + 1], &texts[i])))
+         goto errorexit;
+   }
+
+   // Ours is a temporary file that git reads back once we are done
+   if (!(outf = fopen (args[2], "wb"))) {
+      XERROR ("Unable to write file [%s]: %m\n", args[2]);
+      goto errorexit;
+   }
+
+   bool merged = rotsit_merge (versions[0], versions[1], versions[2], outf,
+                               &nconflicts);
+   int rc = fclose (outf);
+   outf = NULL;
+   if (!merged || rc!=0) {
+      XERROR ("Failed to write the merge to [%s]\n", args[2]);
+      goto errorexit;
+   }
+
+   if (nconflicts) {
+      XERROR ("%zu conflicting changes in [%s], kept ours\n", nconflicts,
+              args[2]);
+      goto errorexit;
+   }
+
+   ret = EXIT_SUCCESS;
+errorexit:
+   if (outf)
+      fclose (outf);
+   for (size_t i=0; i<3; i++) {
+      rotsit_del (versions[i]);
+      free (texts[i]);
+   }
+   return ret;
+}
+
+// Lists what changed between two versions of a database, such as two
+// releases checked out of version control, for writing release notes.
+static int changes (const char **args)
+{
+   int ret = EXIT_FAILURE;
+   char *texts[2] = { NULL, NULL };
+   rotsit_t *versions[2] = { NULL, NULL };
+
+   if (!args[1] || !args[2]) {
+      XERROR ("changes requires the old and new database files\n");
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<2; i++) {
+      if (!(versions[i] = read_db (args[i + 1], &texts[i])))
+         goto errorexit;
+   }
+
+   if (!rotsit_changes (versions[0], versions[1], stdout)) {
+      XERROR ("Failed to write the changes\n");
+      goto errorexit;
+   }
+
+   ret = EXIT_SUCCESS;
+errorexit:
+   for (size_t i=0; i<2; i++) {
+      rotsit_del (versions[i]);
+      free (texts[i]);
+   }
+   return ret;
+}
+
+// The read-only commands can be run over many databases at once with
+// --dbfiles, such as one per component of a large tree. Each database is
+// read and queried on a pool of threads, and the results are written in
+// the order the files were given, labelled with the file they came from.
+#define FED_MAX_THREADS    (64)
+
+struct fedfile_t {
+   char *fname;
+   char *text;
+   rotsit_t *rs;
+   rotrec_t **results;     // NULL-terminated
+   size_t nresults;
+   bool ok;
+};
+
+struct fedpool_t {
+   struct fedfile_t *files;
+   size_t nfiles;
+   size_t next;            // The next file to be taken by a thread
+   const char **args;
+   bool all;
+   bool cache;
+#ifdef PLATFORM_POSIX
+   pthread_mutex_t lock;
+#endif
+};
+
+static bool fed_add (struct fedpool_t *pool, const char *fname)
+{
+   struct fedfile_t *tmp = realloc (pool->files,
+                                    (pool->nfiles + 1) * sizeof *tmp);
+   if (!tmp) {
+      XERROR ("Out of memory\n");
+      return false;
+   }
+   pool->files = tmp;
+
+   memset (&tmp[pool->nfiles], 0, sizeof *tmp);
+   if (!(tmp[pool->nfiles].fname = xstr_dup (fname))) {
+      XERROR ("Out of memory\n");
+      return false;
+   }
+   pool->nfiles++;
+   return true;
+}
+
+// The list is separated by commas, and each entry may be a glob pattern
+// on platforms that have glob().
+static bool fed_expand (struct fedpool_t *pool, const char *list)
+{
+   bool error = true;
+   char *copy = xstr_dup (list);
+   if (!copy) {
+      XERROR ("Out of memory\n");
+      return false;
+   }
+
+   char *entry = copy;
+   while (entry) {
+      char *next = strchr (entry, ',');
+      if (next) {
+         *next++ = 0;
+      }
+
+      if (*entry) {
+#ifdef PLATFORM_POSIX
+         glob_t matches;
+         int rc = glob (entry, 0, NULL, &matches);
+         if (rc!=0) {
+            XERROR ("No database files match [%s]\n", entry);
+            if (rc!=GLOB_NOMATCH)
+               globfree (&matches);
+            goto errorexit;
+         }
+         for (size_t i=0; i<matches.gl_pathc; i++) {
+            if (!fed_add (pool, matches.gl_pathv[i])) {
+               globfree (&matches);
+               goto errorexit;
+            }
+         }
+         globfree (&matches);
+#else
+         if (!fed_add (pool, entry))
+            goto errorexit;
+#endif
+      }
+      entry = next;
+   }
+
+   if (!pool->nfiles) {
+      XERROR ("No database files given in [%s]\n", list);
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   free (copy);
+   return !error;
+}
+
+// Runs the command against a single file, keeping the matching records
+static bool fed_query (struct fedpool_t *pool, struct fedfile_t *ff)
+{
+   bool error = true;
+   const char *cmd = pool->args[0];
+   const char *arg = pool->args[1];
+   char *archive = NULL;
+   char *cachefile = NULL;
+
+   FILE *inf = fopen (ff->fname, "rb");
+   if (!inf) {
+      XERROR ("Unable to open [%s]: %m\n", ff->fname);
+      goto errorexit;
+   }
+   ff->text = read_stream (inf);
+   fclose (inf);
+
+   if (pool->cache && !(cachefile = xstr_cat (ff->fname, ".cache", NULL))) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
+
+   if (!ff->text || !(ff->rs = rotsit_parse_cached (ff->text, cachefile))) {
+      XERROR ("Unable to read issues from [%s]\n", ff->fname);
+      goto errorexit;
+   }
+
+   if (!(archive = archive_name (ff->fname)))
+      goto errorexit;
+
+   bool needs_archive = pool->all || strcmp (cmd, "export")==0 ||
+                        (strcmp (cmd, "show")!=0 && query_needs_archive (arg));
+   if (needs_archive && !load_archive_from (ff->rs, archive))
+      goto errorexit;
+
+   if (strcmp (cmd, "show")==0) {
+      rotrec_t *rr = rotsit_find_by_id (ff->rs, arg);
+      if (!rr && !rotsit_archive_loaded (ff->rs)) {
+         if (!load_archive_from (ff->rs, archive))
+            goto errorexit;
+         rr = rotsit_find_by_id (ff->rs, arg);
+      }
+
+      if (!(ff->results = calloc (2, sizeof *ff->results))) {
+         XERROR ("Out of memory\n");
+         goto errorexit;
+      }
+      ff->results[0] = rr;
+   } else if (strcmp (cmd, "export")==0) {
+      uint32_t n = rotsit_count_records (ff->rs);
+      if (!(ff->results = calloc (n + 1, sizeof *ff->results))) {
+         XERROR ("Out of memory\n");
+         goto errorexit;
+      }
+      for (uint32_t i=0; i<n; i++) {
+         ff->results[i] = rotsit_get_record (ff->rs, i);
+      }
+   } else if (!(ff->results = rotsit_filter (ff->rs, arg))) {
+      XERROR ("Unable to search [%s]\n", ff->fname);
+      goto errorexit;
+   }
+
+   while (ff->results[ff->nresults])
+      ff->nresults++;
+
+   // Only the databases with records still to be written are kept
+   if (!ff->nresults || strcmp (cmd, "count")==0) {
+      rotsit_free (ff->results);
+      rotsit_del (ff->rs);
+      free (ff->text);
+      ff->results = NULL;
+      ff->rs = NULL;
+      ff->text = NULL;
+   }
+
+   error = false;
+errorexit:
+   free (archive);
+   free (cachefile);
+   return !error;
+}
+
+static void *fed_worker (void *arg)
+{
+   struct fedpool_t *pool = arg;
+
+   for (;;) {
+#ifdef PLATFORM_POSIX
+      pthread_mutex_lock (&pool->lock);
+#endif
+      size_t i = pool->next++;
+#ifdef PLATFORM_POSIX
+      pthread_mutex_unlock (&pool->lock);
+#endif
+      if (i >= pool->nfiles)
+         break;
+
+      pool->files[i].ok = fed_query (pool, &pool->files[i]);
+   }
+   return NULL;
+}
+
+#ifdef PLATFORM_POSIX
+static size_t fed_threads (size_t nfiles)
+{
+   long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+   size_t ret = ncpus > 0 ? ncpus : 1;
+
+   if (ret > nfiles)
+      ret = nfiles;
+   if (ret > FED_MAX_THREADS)
+      ret = FED_MAX_THREADS;
+   return ret ? ret : 1;
+}
+#endif
+
+// Runs list, show, export or count over every database in the list
+static int federated (const char *list, const char **args)
+{
+   int ret = EXIT_FAILURE;
+   struct fedpool_t pool;
+   rotrec_t **records = NULL;
+   const char **sources = NULL;
+#ifdef PLATFORM_POSIX
+   pthread_t threads[FED_MAX_THREADS];
+   size_t nstarted = 1;
+#endif
+
+   memset (&pool, 0, sizeof pool);
+   pool.args = args;
+   pool.all = xcfg_get ("none", "all")!=NULL;
+   pool.cache = xcfg_get ("none", "cache")!=NULL;
+
+   const char *cmd = args[0];
+   if (strcmp (cmd, "list")!=0 && strcmp (cmd, "show")!=0 &&
+       strcmp (cmd, "export")!=0 && strcmp (cmd, "count")!=0) {
+      XERROR ("Only list, show, export and count can be used with "
+              "--dbfiles, not [%s]\n", cmd);
+      return EXIT_FAILURE;
+   }
+   if (strcmp (cmd, "export")!=0 && !args[1]) {
+      XERROR ("[%s] requires %s\n", cmd,
+              strcmp (cmd, "show")==0 ? "an id" : "a search expression");
+      return EXIT_FAILURE;
+   }
+
+   if (!fed_expand (&pool, list))
+      goto errorexit;
+
+   // Phases are not tracked on the workers; all of it is command time
+   bool stats_on = stats.on;
+   stats.on = false;
+
+#ifdef PLATFORM_POSIX
+   size_t nthreads = fed_threads (pool.nfiles);
+   if (pthread_mutex_init (&pool.lock, NULL)!=0) {
+      XERROR ("Unable to create a lock\n");
+      stats.on = stats_on;
+      goto errorexit;
+   }
+   for (; nstarted<nthreads; nstarted++) {
+      // Whatever is not started leaves more files for the others
+      if (pthread_create (&threads[nstarted], NULL, fed_worker, &pool)!=0)
+         break;
+   }
+#endif
+
+   fed_worker (&pool);
+
+#ifdef PLATFORM_POSIX
+   for (size_t i=1; i<nstarted; i++) {
+      pthread_join (threads[i], NULL);
+   }
+   pthread_mutex_destroy (&pool.lock);
+#endif
+   stats.on = stats_on;
+
+   size_t total = 0;
+   for (size_t i=0; i<pool.nfiles; i++) {
+      if (!pool.files[i].ok)
+         goto errorexit;
+      total += pool.files[i].nresults;
+   }
+
+   if (strcmp (cmd, "count")==0) {
+      for (size_t i=0; i<pool.nfiles; i++) {
+         printf ("%zu\t%s\n", pool.files[i].nresults, pool.files[i].fname);
+      }
+      printf ("%zu\ttotal\n", total);
+      ret = EXIT_SUCCESS;
+      goto errorexit;
+   }
+
+   if (strcmp (cmd, "show")==0 && !total) {
+      XERROR ("No record found with id [%s] in function [show]\n", args[1]);
+      goto errorexit;
+   }
+
+   records = malloc ((total + 1) * sizeof *records);
+   sources = malloc ((total + 1) * sizeof *sources);
+   if (!records || !sources) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
+
+   size_t n = 0;
+   for (size_t i=0; i<pool.nfiles; i++) {
+      for (size_t j=0; j<pool.files[i].nresults; j++) {
+         records[n] = pool.files[i].results[j];
+         sources[n++] = pool.files[i].fname;
+      }
+   }
+   records[n] = NULL;
+   sources[n] = NULL;
+
+   if (strcmp (cmd, "list")==0) {
+      list_banner (stdout, args[1]);
+   }
+   if (!rotsit_export_sources (records, sources, stdout, out_format, 0))
+      goto errorexit;
+
+   ret = EXIT_SUCCESS;
+errorexit:
+   for (size_t i=0; i<pool.nfiles; i++) {
+      rotsit_free (pool.files[i].results);
+      rotsit_del (pool.files[i].rs);
+      free (pool.files[i].text);
+      free (pool.files[i].fname);
+   }
+   free (pool.files);
+   free (records);
+   free (sources);
+   return ret;
+}
+
+#ifdef PLATFORM_POSIX
+
+// Server mode keeps the database parsed in memory and answers requests
+// from clients on a local socket. A request is one line in the same form
+// as a line of a batch. The response is a line with the length of the
+// output of the command and its status, both in hex, followed by exactly
+// that many bytes of output, which can hold anything at all. Client
+// sockets never block: each response is queued for its client and sent
+// as the client takes it, so that one slow client cannot stall the
+// others. A client that takes none of its queue for SERVE_WRITE_MS, or
+// sends another request while more than SERVE_MAXQUEUE of it is waiting,
+// is disconnected. Requests are answered one at a time, which also
+// serialises the writers, and changes are written out once no further
+// changes have come in for SERVE_FLUSH_MS (but at least every
+// SERVE_FLUSH_MAX_MS). When the file is changed by something else, such
+// as a git pull, while there are no changes waiting to be written, the
+// issues that changed are reloaded.
+#define SERVE_MAXCLIENTS   (32)
+#define SERVE_MAXREQUEST   (1024 * 1024)
+#define SERVE_FLUSH_MS     (1000)
+#define SERVE_FLUSH_MAX_MS (10000)
+#define SERVE_WRITE_MS     (10000)
+#define SERVE_MAXQUEUE     (64 * 1024 * 1024)
+#define SERVE_MAXHEADER    (64)
+
+struct client_t {
+   int fd;
+   char *buf;        // Partial request
+   size_t len;
+   char *out;        // Responses not yet sent
+   size_t outlen;
+   size_t outpos;    // How much of out was sent
+   int64_t sent_at;  // When the client last took some of out
+   char *user;
+   rotsit_fmt_t format;
+   size_t nrequests;
+};
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_signal (int signum)
+{
+   signum = signum;
+   serve_stop = 1;
+}
+
+static int64_t now_ms (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// What a file was when it was last read or written. Files are replaced by
+// a rename(), which gives them a new inode, but an edit in place may leave
+// the size and even the time the same, so all of them are compared.
+struct filever_t {
+   dev_t dev;
+   ino_t ino;
+   off_t size;
+   struct timespec mtime;
+};
+
+static bool file_version (const char *fname, struct filever_t *dst)
+{
+   struct stat sb;
+   if (stat (fname, &sb)!=0)
+      return false;
+
+   dst->dev = sb.st_dev;
+   dst->ino = sb.st_ino;
+   dst->size = sb.st_size;
+   dst->mtime = sb.st_mtim;
+   return true;
+}
+
+static void serve_reload (rotsit_t *rs, const char *dbfile,
+                          struct filever_t *ver)
+{
+   struct filever_t now;
+   if (!file_version (dbfile, &now) ||
+       (now.dev==ver->dev && now.ino==ver->ino && now.size==ver->size &&
+        now.mtime.tv_sec==ver->mtime.tv_sec &&
+        now.mtime.tv_nsec==ver->mtime.tv_nsec))
+      return;
+
+   // A file that cannot be read is not tried again until it next changes
+   *ver = now;
+   char *text = xstr_readfile (dbfile);
+   if (!text) {
+      XERROR ("Unable to read issues from [%s]\n", dbfile);
+      return;
+   }
+
+   if (rotsit_reload (rs, text)) {
+      XLOG ("Reloaded [%s]\n", dbfile);
+   } else {
+      XERROR ("Unable to reload issues from [%s]\n", dbfile);
+   }
+   free (text);
+}
+
+static bool socket_address (struct sockaddr_un *addr, const char *sockname)
+{
+   memset (addr, 0, sizeof *addr);
+   if (strlen (sockname) >= sizeof addr->sun_path) {
+      XERROR ("Socket name [%s] is too long\n", sockname);
+      return false;
+   }
+
+   addr->sun_family = AF_UNIX;
+   strcpy (addr->sun_path, sockname);
+   return true;
+}
+
+static int serve_listen (const char *sockname)
+{
+   struct sockaddr_un addr;
+   struct stat sb;
+
+   if (!socket_address (&addr, sockname))
+      return -1;
+
+   int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0) {
+      XERROR ("Unable to create socket: %m\n");
+      return -1;
+   }
+
+   // A socket left behind by a server that has gone away is removed, but
+   // a live server (or a file that is not a socket) is never replaced.
+   if (connect (fd, (struct sockaddr *)&addr, sizeof addr)==0) {
+      XERROR ("A server is already listening on [%s]\n", sockname);
+      close (fd);
+      return -1;
+   }
+
+   if (stat (sockname, &sb)==0) {
+      if (!S_ISSOCK (sb.st_mode)) {
+         XERROR ("[%s] exists and is not a socket\n", sockname);
+         close (fd);
+         return -1;
+      }
+      unlink (sockname);
+   }
 
-errorexit:
-   if (ret & 0xff) {
-      rotrec_del (rec);
+   if (bind (fd, (struct sockaddr *)&addr, sizeof addr)!=0 ||
+       listen (fd, SERVE_MAXCLIENTS)!=0) {
+      XERROR ("Unable to listen on [%s]: %m\n", sockname);
+      close (fd);
+      return -1;
    }
-   return ret;
+
+   return fd;
 }
 
-static rotrec_t *safe_rotrec_by_id (rotsit_t *rs, const char **args)
+static bool socket_write_timeout (int fd)
 {
-   const char *id = args[1];
-   const char *f = args[0];
-   rotrec_t *rr = NULL;
+   struct timeval tv = { SERVE_WRITE_MS / 1000,
+                         (SERVE_WRITE_MS % 1000) * 1000 };
+   if (setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv)!=0) {
+      XERROR ("Unable to set a timeout on the socket: %m\n");
+      return false;
+   }
+   return true;
+}
 
-   if (!id) {
-      XERROR ("Expected an id for function [%s], no id specified\n", f);
-      return NULL;
+// Fails once the server has taken none of buf for SERVE_WRITE_MS
+static bool socket_write (int fd, const void *buf, size_t len)
+{
+   const char *src = buf;
+   while (len) {
+      ssize_t nwritten = write (fd, src, len);
+      if (nwritten < 0 && errno==EINTR)
+         continue;
+      if (nwritten <= 0)
+         return false;
+      src += nwritten;
+      len -= nwritten;
    }
+   return true;
+}
 
-   rr = rotsit_find_by_id (rs, id);
-   if (!rr) {
-      XERROR ("No record found with id [%s] in function [%s]\n", id, f);
+static void client_close (struct client_t *client)
+{
+   if (client->fd >= 0) {
+      close (client->fd);
    }
+   free (client->buf);
+   free (client->out);
+   free (client->user);
 
-   return rr;
+   memset (client, 0, sizeof *client);
+   client->fd = -1;
 }
 
-static uint32_t cmd_show (rotsit_t *rs, char *msg, const char **args)
+static bool client_waiting (const struct client_t *client)
 {
-   msg = msg;
+   return client->outpos < client->outlen;
+}
 
-   if (!rotrec_dump (safe_rotrec_by_id (rs, args), stdout)) {
-      return 0xff;
+// Sends as much of the queue as the client takes without blocking.
+// Returns false once the client has gone away.
+static bool client_flush (struct client_t *client)
+{
+   while (client_waiting (client)) {
+      ssize_t nwritten = write (client->fd, &client->out[client->outpos],
+                                client->outlen - client->outpos);
+      if (nwritten < 0 && errno==EINTR)
+         continue;
+      if (nwritten < 0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+         return true;
+      if (nwritten <= 0)
+         return false;
+      client->outpos += nwritten;
+      client->sent_at = now_ms ();
    }
 
-   return 0;
+   free (client->out);
+   client->out = NULL;
+   client->outlen = 0;
+   client->outpos = 0;
+   return true;
 }
 
-static uint32_t cmd_comment (rotsit_t *rs, char *msg, const char **args)
+static bool client_queue (struct client_t *client, const char *header,
+                          size_t hlen, const char *out, size_t outlen)
 {
-   my_setseed (msg);
+   if (client->outlen - client->outpos > SERVE_MAXQUEUE) {
+      XERROR ("Client is not reading its responses, disconnecting\n");
+      return false;
+   }
 
-   if (!rotrec_add_comment (safe_rotrec_by_id (rs, args), msg)) {
-      return 0x00ff;
+   if (!client_waiting (client)) {
+      client->sent_at = now_ms ();
    }
 
-   return 0x0100;
+   char *tmp = realloc (client->out, client->outlen + hlen + outlen);
+   if (!tmp) {
+      XERROR ("Out of memory\n");
+      return false;
+   }
+   memcpy (&tmp[client->outlen], header, hlen);
+   memcpy (&tmp[client->outlen + hlen], out, outlen);
+   client->out = tmp;
+   client->outlen += hlen + outlen;
+   return true;
 }
 
-static uint32_t cmd_dup (rotsit_t *rs, char *msg, const char **args)
+// Reads whatever the client has sent and answers every complete request
+// in it. Sets *changed if any request modified the database. Returns false
+// once the client has gone away.
+static bool client_read (struct client_t *client, rotsit_t *rs,
+                         const char *defuser, bool *changed)
 {
-   msg = msg;
+   char tmp[4096];
 
-   if (!args[1] || !args[2]) {
-      XERROR ("Marking duplicate requires two IDs\n");
-      return 0x00ff;
+   ssize_t nread = read (client->fd, tmp, sizeof tmp);
+   if (nread < 0 && (errno==EINTR || errno==EAGAIN || errno==EWOULDBLOCK))
+      return true;
+   if (nread <= 0)
+      return false;
+
+   if (client->len + nread >= SERVE_MAXREQUEST) {
+      XERROR ("Request from client is too long, disconnecting\n");
+      return false;
    }
 
-   if (!rotrec_dup (safe_rotrec_by_id (rs, args), args[2])) {
-      return 0x00ff;
+   char *buf = realloc (client->buf, client->len + nread + 1);
+   if (!buf) {
+      XERROR ("Out of memory\n");
+      return false;
    }
+   memcpy (&buf[client->len], tmp, nread);
+   client->buf = buf;
+   client->len += nread;
+   client->buf[client->len] = 0;
+
+   char *line = client->buf;
+   char *end;
+   while ((end = strchr (line, '\n'))) {
+      *end = 0;
+
+      // The user and format are per-client settings, but the environment
+      // and out_format are shared
+      if (!set_user (client->user ? client->user : defuser))
+         return false;
+      out_format = client->format;
+
+      // The output is sent after its length, so it is gathered first
+      char *out = NULL;
+      size_t outlen = 0;
+      FILE *outf = open_memstream (&out, &outlen);
+      if (!outf) {
+         XERROR ("Out of memory\n");
+         return false;
+      }
 
-   return 0x0100;
-}
+      uint32_t result = run_line (rs, line, outf, "client",
+                                  ++client->nrequests);
 
-static uint32_t cmd_reopen (rotsit_t *rs, char *msg, const char **args)
-{
-   if (!rotrec_reopen (safe_rotrec_by_id (rs, args), msg)) {
-      return 0x00ff;
-   }
+      const char *user = getenv (ENV_USERNAME);
+      free (client->user);
+      client->user = user ? xstr_dup (user) : NULL;
+      client->format = out_format;
 
-   return 0x0100;
-}
+      if ((result >> 8) & 0xff) {
+         *changed = true;
+      }
 
-static uint32_t cmd_close (rotsit_t *rs, char *msg, const char **args)
-{
-   if (!rotrec_close (safe_rotrec_by_id (rs, args), msg)) {
-      return 0x00ff;
+      bool queued = false;
+      if (fclose (outf)==0) {
+         char header[SERVE_MAXHEADER];
+         int hlen = snprintf (header, sizeof header, "%zx %02x\n", outlen,
+                              result & 0xff);
+         queued = client_queue (client, header, hlen, out, outlen);
+      } else {
+         XERROR ("Out of memory\n");
+      }
+      free (out);
+      if (!queued)
+         return false;
+      line = end + 1;
    }
-   return 0x0100;
+
+   client->len -= line - client->buf;
+   memmove (client->buf, line, client->len + 1);
+   return client_flush (client);
 }
 
-static uint32_t cmd_export (rotsit_t *rs, char *msg, const char **args)
+static int serve (rotsit_t *rs, const char *dbfile, const char *sockname)
 {
-   msg = msg;
-   args = args;
+   int ret = EXIT_FAILURE;
+   struct client_t clients[SERVE_MAXCLIENTS];
+   struct pollfd fds[SERVE_MAXCLIENTS + 1];
+   bool dirty = false;
+   int64_t dirty_since = 0,
+           flush_at = 0;
+   struct filever_t ver;
+
+   const char *user = getenv (ENV_USERNAME);
+   char *defuser = xstr_dup (user ? user : "Unknown");
+
+   for (size_t i=0; i<SERVE_MAXCLIENTS; i++) {
+      memset (&clients[i], 0, sizeof clients[i]);
+      clients[i].fd = -1;
+   }
 
-   uint32_t numrecs = rotsit_count_records (rs);
+   int lfd = serve_listen (sockname);
+   if (lfd < 0 || !defuser)
+      goto errorexit;
 
-   for (uint32_t i=0; i<numrecs; i++) {
-      rotrec_dump (rotsit_get_record (rs, i), stdout);
+   if (!file_version (dbfile, &ver)) {
+      XERROR ("Unable to read [%s]: %m\n", dbfile);
+      goto errorexit;
    }
 
-   return 0x0000;
-}
+   signal (SIGINT, serve_signal);
+   signal (SIGTERM, serve_signal);
+   signal (SIGPIPE, SIG_IGN);
+
+   XLOG ("Serving [%s] on [%s]\n", dbfile, sockname);
+
+   while (!serve_stop) {
+      // The poll wakes up for the next flush and for the first client
+      // that could be given up on
+      int64_t wake_at = dirty ? flush_at : -1;
+      fds[0].fd = lfd;
+      fds[0].events = POLLIN;
+      for (size_t i=0; i<SERVE_MAXCLIENTS; i++) {
+         fds[i + 1].fd = clients[i].fd;
+         fds[i + 1].events = POLLIN;
+         if (clients[i].fd >= 0 && client_waiting (&clients[i])) {
+            int64_t stall_at = clients[i].sent_at + SERVE_WRITE_MS;
+            fds[i + 1].events |= POLLOUT;
+            if (wake_at < 0 || stall_at < wake_at) {
+               wake_at = stall_at;
+            }
+         }
+      }
 
-static uint32_t cmd_list (rotsit_t *rs, char *msg, const char **args)
-{
-   msg = msg;
+      int timeout = -1;
+      if (wake_at >= 0) {
+         int64_t left = wake_at - now_ms ();
+         timeout = left > 0 ? (int)left : 0;
+      }
 
-   printf (" *****************************************************\n");
-   printf (" ARGS: [%s]\n", args[1]);
-   printf (" *****************************************************\n");
+      int nready = poll (fds, SERVE_MAXCLIENTS + 1, timeout);
+      if (nready < 0) {
+         if (errno==EINTR)
+            continue;
+         XERROR ("Failed to wait for clients: %m\n");
+         goto errorexit;
+      }
 
-   if (!args[1]) {
-      XERROR ("No search expression specified\n");
-      return 0x00ff;
+      if (!dirty) {
+         serve_reload (rs, dbfile, &ver);
+      }
+
+      if (fds[0].revents & POLLIN) {
+         int cfd = accept (lfd, NULL, NULL);
+         size_t slot = 0;
+         while (slot<SERVE_MAXCLIENTS && clients[slot].fd >= 0)
+            slot++;
+
+         if (cfd >= 0 && slot==SERVE_MAXCLIENTS) {
+            XERROR ("Too many clients, refusing connection\n");
+            close (cfd);
+         } else if (cfd >= 0) {
+            clients[slot].fd = cfd;
+            int flags = fcntl (cfd, F_GETFL);
+            if (flags < 0 || fcntl (cfd, F_SETFL, flags | O_NONBLOCK)!=0) {
+               XERROR ("Unable to make the client socket non-blocking: %m\n");
+               client_close (&clients[slot]);
+            }
+         }
+      }
+
+      for (size_t i=0; i<SERVE_MAXCLIENTS; i++) {
+         short revents = fds[i + 1].revents;
+         if (clients[i].fd < 0 || fds[i + 1].fd < 0)
+            continue;
+
+         if ((revents & POLLOUT) && !client_flush (&clients[i])) {
+            client_close (&clients[i]);
+            continue;
+         }
+
+         if (client_waiting (&clients[i]) &&
+             now_ms () - clients[i].sent_at >= SERVE_WRITE_MS) {
+            XERROR ("Client stopped reading its responses, disconnecting\n");
+            client_close (&clients[i]);
+            continue;
+         }
+         if (!(revents & ~POLLOUT))
+            continue;
+
+         bool changed = false;
+         if (!client_read (&clients[i], rs, defuser, &changed)) {
+            client_close (&clients[i]);
+         }
+
+         if (changed) {
+            int64_t now = now_ms ();
+            if (!dirty) {
+               dirty_since = now;
+            }
+            dirty = true;
+            flush_at = now + SERVE_FLUSH_MS;
+            if (flush_at > dirty_since + SERVE_FLUSH_MAX_MS) {
+               flush_at = dirty_since + SERVE_FLUSH_MAX_MS;
+            }
+         }
+      }
+
+      if (dirty && now_ms () >= flush_at) {
+         if (save_db (rs, dbfile)) {
+            dirty = false;
+            file_version (dbfile, &ver);
+         } else {
+            flush_at = now_ms () + SERVE_FLUSH_MS;
+         }
+      }
    }
 
-   rotrec_t **results = rotsit_filter (rs, args[1]);
-   if (!results) {
-      XERROR ("Internal error in filter function\n");
-      return 0x00ff;
+   ret = EXIT_SUCCESS;
+
+errorexit:
+   if (dirty && !save_db (rs, dbfile)) {
+      ret = EXIT_FAILURE;
    }
 
-   for (size_t i=0; results[i]; i++) {
-      rotrec_dump (results[i], stdout);
+   for (size_t i=0; i<SERVE_MAXCLIENTS; i++) {
+      client_close (&clients[i]);
    }
-   free (results);
-   return 0x0000;
+
+   if (lfd >= 0) {
+      close (lfd);
+      unlink (sockname);
+   }
+
+   free (defuser);
+   return ret;
 }
 
-static bool needs_message (const char *command)
+// Appends a quoted word to a request so that batch_split() on the server
+// gives back exactly the same word.
+static bool request_add (char **request, const char *word)
 {
-   static const char *cmds[] = {
-      "add", "comment", "close", "reopen",
-   };
+   size_t len = *request ? strlen (*request) : 0;
+   char *tmp = realloc (*request, len + strlen (word) * 2 + 4);
+   if (!tmp) {
+      XERROR ("Out of memory\n");
+      return false;
+   }
+   *request = tmp;
 
-   for (size_t i=0; i<sizeof cmds/sizeof cmds[0]; i++) {
-      if (strcmp (cmds[i], command) == 0) {
-         return true;
+   char *dst = &tmp[len];
+   if (len && dst[-1]!='\n') {
+      *dst++ = ' ';
+   }
+
+   *dst++ = '"';
+   for (size_t i=0; word[i]; i++) {
+      switch (word[i]) {
+         case '\n':  *dst++ = '\\'; *dst++ = 'n';   break;
+         case '\t':  *dst++ = '\\'; *dst++ = 't';   break;
+         case '"':
+         case '\\':  *dst++ = '\\'; *dst++ = word[i]; break;
+         default:    *dst++ = word[i];              break;
       }
    }
-   return false;
+   *dst++ = '"';
+   *dst = 0;
+   return true;
 }
 
-static cmdfptr_t find_cmd (const char *name)
+static bool request_end (char **request)
 {
-   static const struct {
-      const char *name;
-      cmdfptr_t fptr;
-   } cmds[] = {
-      { "add",       cmd_add     },
-      { "show",      cmd_show    },
-      { "comment",   cmd_comment },
-      { "dup",       cmd_dup     },
-      { "reopen",    cmd_reopen  },
-      { "close",     cmd_close   },
-      { "export",    cmd_export  },
-      { "list",      cmd_list    },
-   };
+   size_t len = *request ? strlen (*request) : 0;
+   char *tmp = realloc (*request, len + 2);
+   if (!tmp) {
+      XERROR ("Out of memory\n");
+      return false;
+   }
+   strcpy (&tmp[len], "\n");
+   *request = tmp;
+   return true;
+}
 
-   for (size_t i=0; i<sizeof cmds/sizeof cmds[0]; i++) {
-      if (strcmp (cmds[i].name, name) == 0) {
-         return cmds[i].fptr;
+// Sends a single command to a server and copies the output to stdout.
+static int client_call (const char *sockname, const char **args,
+                        const char *msg, const char *username,
+                        const char *format)
+{
+   int ret = EXIT_FAILURE;
+   char *request = NULL;
+   size_t nrequests = 0;
+   int fd = -1;
+   struct sockaddr_un addr;
+
+   if (username) {
+      if (!request_add (&request, "user") ||
+          !request_add (&request, username) ||
+          !request_end (&request))
+         goto errorexit;
+      nrequests++;
+   }
+
+   if (format) {
+      if (!request_add (&request, "format") ||
+          !request_add (&request, format) ||
+          !request_end (&request))
+         goto errorexit;
+      nrequests++;
+   }
+
+   for (size_t i=0; args[i]; i++) {
+      if (args[i][0]=='-' && args[i][1]=='-')
+         continue;
+      if (!request_add (&request, args[i]))
+         goto errorexit;
+   }
+   if (needs_message (args[0]) && !request_add (&request, msg))
+      goto errorexit;
+   if (!request_end (&request))
+      goto errorexit;
+   nrequests++;
+
+   if (!socket_address (&addr, sockname))
+      goto errorexit;
+
+   fd = socket (AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0 || connect (fd, (struct sockaddr *)&addr, sizeof addr)!=0) {
+      XERROR ("Unable to connect to server on [%s]: %m\n", sockname);
+      goto errorexit;
+   }
+
+   if (!socket_write_timeout (fd) ||
+       !socket_write (fd, request, strlen (request))) {
+      XERROR ("Failed to send request: %m\n");
+      goto errorexit;
+   }
+
+   // Each response is a header line, then as many bytes of output as the
+   // header gives
+   char header[SERVE_MAXHEADER];
+   size_t hlen = 0,
+          left = 0;
+   uint32_t result = 0;
+   while (nrequests) {
+      char buf[4096];
+      ssize_t nread = read (fd, buf, sizeof buf);
+      if (nread < 0 && errno==EINTR)
+         continue;
+      if (nread <= 0) {
+         XERROR ("Server closed the connection\n");
+         goto errorexit;
+      }
+
+      for (size_t i=0; i<(size_t)nread; ) {
+         if (left) {
+            size_t n = nread - i < left ? nread - i : left;
+            fwrite (&buf[i], 1, n, stdout);
+            i += n;
+            if (!(left -= n)) {
+               nrequests--;
+            }
+            continue;
+         }
+
+         if (buf[i]!='\n') {
+            if (hlen + 1 >= sizeof header) {
+               XERROR ("Malformed response from server\n");
+               goto errorexit;
+            }
+            header[hlen++] = buf[i++];
+            continue;
+         }
+         header[hlen] = 0;
+         hlen = 0;
+         i++;
+
+         unsigned int status;
+         if (sscanf (header, "%zx %x", &left, &status)!=2) {
+            XERROR ("Malformed response from server\n");
+            goto errorexit;
+         }
+         if (status) {
+            result = status;
+         }
+         if (!left) {
+            nrequests--;
+         }
       }
    }
-   return NULL;
+
+   if (result) {
+      XERROR ("Command [%s] returned error 0x%02x\n", args[0], result);
+      goto errorexit;
+   }
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+   if (fd >= 0)
+      close (fd);
+   free (request);
+   return ret;
 }
 
+#endif
+
 void print_help_msg (void)
 {
    static const char *msg[] = {
@@ -238,7 +2044,19 @@ void print_help_msg (void)
 "  --message:  Provide a message for commands that take a message",
 "  --file:     Read a message from file for commands that take a message",
 "  --dbfile:   Use specified filename as the db (defaults to 'issues.sitdb')",
+"  --stats:    Print the time, memory and records used by each phase of",
+"              the command to stderr; --stats=json prints it as JSON",
+"  --dbfiles:  Run list, show, export or count over several databases (see",
+"              <dbfiles>)",
 "  --user:     Set the username (defaults to " UNAMEVAR ")",
+"  --socket:   Send the command to the server listening on this socket",
+"  --format:   Output format of export and list: text (the default),",
+"              jsonl, csv or tsv",
+"  --cache:    Keep a snapshot of the parsed db in the given file (defaults",
+"              to the db filename with '.cache' appended) to load it faster",
+"  --archive:  Use specified filename as the archive (defaults to the db",
+"              filename with '.sitdb' replaced by '.archive.sitdb')",
+"  --all:      Always read the archive, so every command sees every issue",
 "  --fastrand: (Used for testing - do not use)",
 "",
 "All commands which require a message will check --message and --file",
@@ -254,6 +2072,105 @@ void print_help_msg (void)
 "  close <id>        Closes issue with id, "EDITOR" used.",
 "  export            Plain-text export of every issue",
 "  list <listexpr>   Short-form list of all the entries matching listexpr",
+"  count <listexpr>  Number of entries matching listexpr",
+"  batch [file]      Runs the commands in file (or stdin), one per line",
+"  import [file]     Adds the issues in file (or stdin), see <import>",
+"  serve             Serves the database on a local socket (see <serve>)",
+"  archive [date]    Moves issues closed before date to the archive (see",
+"                    <archive>)",
+"  merge-driver %O %A %B  Merges two versions of a database for git (see",
+"                    <merge-driver>)",
+"  changes <old> <new>  Lists the changes between two database files (see",
+"                    <changes>)",
+"",
+"<batch>",
+"  A batch reads and writes the database once for any number of commands.",
+"  Each line holds a command (add, show, comment, dup, reopen, close,",
+"  export, list or count) followed by its arguments. Commands that need a",
+"  message take it as their last argument. Arguments containing spaces",
+"  must be double-quoted; \\n, \\t, \\\" and \\\\ may be used within quotes.",
+"  A line \"user <name>\" sets the user for the commands after it, and a",
+"  line \"format <name>\" the output format. Blank lines and lines",
+"  starting with # are ignored. If any command fails the batch is",
+"  aborted and the database is left unchanged. For example:",
+"",
+"     user jsmith",
+"     add \"Crash on startup\\nSeen on every run since 0.0.1\"",
+"     comment 0x1234 \"Also seen on Windows\"",
+"     list \"status == OPEN\"",
+"",
+"<import>",
+"  Issues exported from another tracker are read as JSON Lines (one object",
+"  per line) or as CSV with a header row; input starting with '{' is taken",
+"  to be JSON. The keys (or columns) used are message, opened_by,",
+"  opened_on, status, assigned_by, assigned_to, assigned_on, closed_by,",
+"  closed_on and closed_msg; all others are ignored. JSON comments are an",
+"  array \"comments\" of strings or of {\"user\", \"time\", \"comment\"}",
+"  objects, CSV comments are any number of columns named comment. Dates",
+"  may be in any form accepted in a <listexpr>. If any issue is rejected",
+"  the database is left unchanged.",
+"",
+"<format>",
+"  jsonl writes one JSON object per issue, with the comments in an array",
+"  \"comments\". csv (RFC 4180) and tsv write a header row, then one row",
+"  per issue with a comment column for each comment. In tsv, tabs,",
+"  newlines and backslashes in values are written as \\t, \\n and \\\\.",
+"  The jsonl and csv output can be read back with import.",
+"",
+"<archive>",
+"  Closed issues are moved by the archive command to a second file in the",
+"  same format, which is only read when a command needs it: by export,",
+"  archive, a command given the id of an archived issue, and list and",
+"  count expressions that could match a closed issue, such as status !=",
+"  OPEN but not status == OPEN. Use --all to have every command read it.",
+"  The cutoff date defaults to 90 days ago. Issues already archived stay",
+"  in the archive until they are reopened, and the most recently added",
+"  issue is always kept in the database.",
+"",
+"<merge-driver>",
+"  Merges the versions of a database changed on two branches record by",
+"  record, matching issues up by id, so that comments added to the same",
+"  issue on both branches are both kept. A field changed on both branches",
+"  to different values is a conflict; the result then has the value from",
+"  the current branch and git reports the conflict. To use it:",
+"",
+"     git config merge.rotsit.driver \"rotsit merge-driver %O %A %B\"",
+"     echo \"*.sitdb merge=rotsit\" >> .gitattributes",
+"",
+"<dbfiles>",
+"  --dbfiles takes a comma-separated list of database files, each of which",
+"  may be a glob pattern such as \"*/issues.sitdb\" (quoted, so that it is",
+"  not expanded by the shell). The files are read and searched in",
+"  parallel, and the results are written in the order of the list with",
+"  the file each issue came from: a [source: ...] line in text, a",
+"  \"source\" key in jsonl and a first column \"source\" in csv and tsv.",
+"  count prints the count for each file and the total. Each file's",
+"  archive is read as it would be for that file alone, and --cache keeps",
+"  a snapshot next to each file.",
+"",
+"<changes>",
+"  Compares two versions of a database, such as those of two releases,",
+"  and prints a line for each issue added or removed, each change of",
+"  status, each new comment and each issue with other fields changed:",
+"",
+"     added   <id> [<status>] <first line of message>",
+"     status  <id> <old status> -> <new status>",
+"     changed <id> <field>,<field>,...",
+"     comment <id> [<user>] <first line of comment>",
+"     removed <id>",
+"",
+"<serve>",
+"  The serve command keeps the database loaded and answers commands sent",
+"  to it by other invocations of this program that are given the same",
+"  --socket option. The socket defaults to the database filename with",
+"  \".sock\" appended. Changes are written back to the database a short",
+"  while after the last change and when the server is stopped with",
+"  SIGINT or SIGTERM. If the database is changed by something else while",
+"  no changes are waiting to be written, the server reloads it before",
+"  answering the next command. Each request on the socket is one line in",
+"  the batch format; each response is a line with the length of the",
+"  command output and the status of the command, both in hex, followed",
+"  by the output itself.",
 "",
 "<listexpr>",
 "  List expression is a single string that specifies which records must",
@@ -276,6 +2193,12 @@ void print_help_msg (void)
 "opened-by == jsmith@example.com & closed-by jsmith@example.com      [Wrong]",
 "(opened-by == jsmith@example.com) & closed-by jsmith@example.com    [Right]",
 "",
+"  The date fields (those ending in _on) can only be compared with dates",
+"  and the guid and order fields with hex numbers, although == and != will",
+"  also match part of a guid. All other fields are text and can only be",
+"  compared with == and !=. Expressions that break these rules are",
+"  rejected before any issue is looked at.",
+"",
 "",
 "  OPERATOR LIST",
 "     <        Less than",
@@ -298,7 +2221,9 @@ void print_help_msg (void)
 "  assigned_by       User who set the assignment of the issue",
 "  assigned_to       User who is responsible for closing the issue",
 "  assigned_on       Date when the assignment was performed",
-"  status            Match the status (OPEN/CLOSED)",
+"  dup_by            User who marked the issue as a duplicate",
+"  dup_guid          The GUID of the issue this one duplicates",
+"  status            Match the status (OPEN/CLOSED/REOPEN)",
 "  message           Case-insensitive match of keyword in OPEN message",
 "  closed_message    Case-insensitive match of keyword in the CLOSE message",
 "  comment           Case-insensitive match of keyword in comment",
@@ -328,6 +2253,9 @@ int main (int argc, char **argv)
    rotsit_t *issues = NULL;
    bool issues_dirty = false;
    char *fcontents = NULL;
+   char *def_sockname = NULL;
+   char *def_cachefile = NULL;
+   char *def_archive = NULL;
 
    // Set the options we want to read to default values
    static const struct {
@@ -339,6 +2267,13 @@ int main (int argc, char **argv)
       { "file",      NULL },
       { "user",      NULL },
       { "dbfile",    "issues.sitdb" },
+      { "dbfiles",   NULL },
+      { "socket",    NULL },
+      { "format",    NULL },
+      { "cache",     NULL },
+      { "archive",   NULL },
+      { "all",       NULL },
+      { "stats",     NULL },
    };
 
    my_seed = time (NULL);
@@ -352,10 +2287,15 @@ int main (int argc, char **argv)
       goto errorexit;
    }
 
+   const char *stats_how = xcfg_get ("none", "stats");
+   if (stats_how) {
+      stats_start (stats_how);
+   }
+
    // Check which options are set
    const char *fastrand = xcfg_get ("none", "fastrand");
    if (fastrand) {
-      rotsit_user_rand = my_rand;
+      rotsit_set_user_rand (my_rand);
    }
 
    const char *help_requested = xcfg_get ("none", "help");
@@ -372,14 +2312,13 @@ int main (int argc, char **argv)
    }
 
    const char *username = xcfg_get ("none", "user");
-   if (username) {
-      char *tmp = xstr_cat (ENV_USERNAME, "=", username, NULL);
-      if (!tmp) {
-         XERROR ("Out of memory\n");
-         goto errorexit;
-      }
-      putenv (tmp);
-      // free (tmp);
+   if (username && !set_user (username)) {
+      goto errorexit;
+   }
+
+   const char *format = xcfg_get ("none", "format");
+   if (format && !set_format (format)) {
+      goto errorexit;
    }
 
    const char *dbfile = xcfg_get ("none", "dbfile");
@@ -389,27 +2328,24 @@ int main (int argc, char **argv)
       goto errorexit;
    }
 
-   inf = fopen (dbfile, "rb");
-   if (!inf) {
-      inf = fopen (dbfile, "wb");
-      if (!inf) {
-         XERROR ("Unable to create database file [%s]\n", dbfile);
+   const char *sockname = xcfg_get ("none", "socket");
+
+   archive_file = xcfg_get ("none", "archive");
+   if (!archive_file || !*archive_file) {
+      if (!(def_archive = archive_name (dbfile)))
          goto errorexit;
-      }
+      archive_file = def_archive;
    }
-   fclose (inf);
-   inf = NULL;
 
-   fcontents = xstr_readfile (dbfile);
-   if (!fcontents) {
-      XERROR ("Unable to read issues from [%s]\n", dbfile);
-      goto errorexit;   // TODO: Double check this - might return NULL for
-                        // empty file and we must be able to work with an
-                        // empty file.
+   const char *cachefile = xcfg_get ("none", "cache");
+   if (cachefile && !*cachefile) {
+      if (!(def_cachefile = xstr_cat (dbfile, ".cache", NULL))) {
+         XERROR ("Out of memory\n");
+         goto errorexit;
+      }
+      cachefile = def_cachefile;
    }
 
-   issues = rotsit_parse (fcontents);
-
    // Check which command was requested - the first non-option argument
    // is a command
    size_t cmdidx = (size_t)-1;
@@ -427,6 +2363,82 @@ int main (int argc, char **argv)
       goto errorexit;
    }
 
+   // These run on files of their own; the database is not used
+   stats_phase (PHASE_COMMAND);
+   if (strcmp (argv[cmdidx], "merge-driver")==0) {
+      ret = merge_driver ((const char **)&argv[cmdidx]);
+      goto errorexit;
+   }
+   if (strcmp (argv[cmdidx], "changes")==0) {
+      ret = changes ((const char **)&argv[cmdidx]);
+      goto errorexit;
+   }
+
+   const char *dbfiles = xcfg_get ("none", "dbfiles");
+   if (dbfiles) {
+      ret = federated (dbfiles, (const char **)&argv[cmdidx]);
+      goto errorexit;
+   }
+   stats_phase (PHASE_READ);
+
+   // With --socket every command except serve is sent to the server, and
+   // the database is never read here.
+   bool serving = strcmp (argv[cmdidx], "serve")==0;
+   bool remote = sockname && !serving;
+
+   if (!remote) {
+      inf = fopen (dbfile, "rb");
+   }
+   if (!remote && !inf) {
+      inf = fopen (dbfile, "wb");
+      if (!inf) {
+         XERROR ("Unable to create database file [%s]\n", dbfile);
+         goto errorexit;
+      }
+   }
+   if (inf)
+      fclose (inf);
+   inf = NULL;
+
+   fcontents = remote ? NULL : xstr_readfile (dbfile);
+   if (!remote && !fcontents) {
+      XERROR ("Unable to read issues from [%s]\n", dbfile);
+      goto errorexit;   // TODO: Double check this - might return NULL for
+                        // empty file and we must be able to work with an
+                        // empty file.
+   }
+   if (fcontents && stats.on) {
+      stats.bytes_read += strlen (fcontents);
+   }
+
+   stats_phase (PHASE_PARSE);
+   issues = remote ? NULL : rotsit_parse_cached (fcontents, cachefile);
+   if (!remote && !issues) {
+      XERROR ("Unable to parse issues from [%s]\n", dbfile);
+      goto errorexit;
+   }
+
+   if (!remote && xcfg_get ("none", "all") && !load_archive (issues))
+      goto errorexit;
+
+   stats_phase (PHASE_COMMAND);
+
+   if (serving) {
+#ifdef PLATFORM_POSIX
+      if (!sockname) {
+         if (!(def_sockname = xstr_cat (dbfile, ".sock", NULL))) {
+            XERROR ("Out of memory\n");
+            goto errorexit;
+         }
+         sockname = def_sockname;
+      }
+      ret = serve (issues, dbfile, sockname);
+#else
+      XERROR ("Server mode is not supported on this platform\n");
+#endif
+      goto errorexit;
+   }
+
    cmdfptr_t cmdfptr = find_cmd (argv[cmdidx]);
 
    if (!cmdfptr) {
@@ -473,11 +2485,25 @@ int main (int argc, char **argv)
       }
    }
 
+   if (remote) {
+#ifdef PLATFORM_POSIX
+      if (!username) {
+         username = getenv (ENV_USERNAME);
+      }
+      ret = client_call (sockname, (const char **)&argv[cmdidx], msg,
+                         username, format);
+#else
+      XERROR ("Server mode is not supported on this platform\n");
+#endif
+      goto errorexit;
+   }
+
    // Execute the command - the return value is 4 bytes:
    // ret[0] = return status (0=success)
    // ret[1] = object now dirty, command mutated the object
    // ret[2], ret[3] = RFU
-   uint32_t result = cmdfptr (issues, msg, (const char **)&argv[cmdidx]);
+   uint32_t result = cmdfptr (issues, msg, (const char **)&argv[cmdidx],
+                              stdout);
    if (result & 0xff) {
       XERROR ("Command [%s] returned error 0x%02x\n", argv[cmdidx],
                                                       result & 0xff);
@@ -494,15 +2520,11 @@ errorexit:
    if (inf)
       fclose (inf);
 
-   if (issues_dirty) {
-      FILE *outf = fopen (dbfile, "wb");
-      if (!outf) {
-         XERROR ("Unable to write file [%s]: %m\n", dbfile);
-      } else {
-         rotsit_write (issues, outf);
-         fclose (outf);
-      }
+   stats_phase (PHASE_WRITE);
+   if (issues_dirty && !save_db (issues, dbfile)) {
+      ret = EXIT_FAILURE;
    }
+   stats_report (issues);
 
    free (msg);
    if (tmp_fname) {
@@ -511,6 +2533,9 @@ errorexit:
    }
    free (edit_cmd);
    free (fcontents);
+   free (def_sockname);
+   free (def_cachefile);
+   free (def_archive);
    xerror_set_logfile (NULL);
    rotsit_del (issues);
    xcfg_shutdown ();
@@ -1,12 +1,31 @@
 
+#ifdef PLATFORM_POSIX
+#define _POSIX_C_SOURCE    200809L
+#endif
+
 #include <string.h>
+#include <stdarg.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#ifdef PLATFORM_POSIX
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef PLATFORM_WINDOWS
+#include <windows.h>
+#endif
 
-#include "xvector/xvector.h"
 #include "xstring/xstring.h"
 #include "xerror/xerror.h"
 #include "xcrypto/xcrypto.h"
@@ -14,108 +33,156 @@
 #include "rotsit.h"
 #include "pdate.h"
 #include "eval.h"
-#include "pdate.h"
+#include "bitmap.h"
+#include "mem.h"
 
 #define RECORD_DELIM       ("f\b\n")
 #define FIELD_DELIM        ("f\b")
 
-static void *exec_op (const void *p_op, void const *p_lhs, void const *p_rhs)
+static bool is_integer (const char *s)
+{
+   if (*s=='-')
+      s++;
+
+   if (!*s)
+      return false;
+
+   for (size_t i=0; s[i]; i++) {
+      if (!isdigit (s[i]))
+         return false;
+   }
+   return true;
+}
+
+static bool is_hex (const char *s, int64_t *value)
 {
-   const char *s_op = p_op;
-   const char *s_lhs = p_lhs;
-   const char *s_rhs = p_rhs;
+   return sscanf (s, "0x%016" PRIx64, value)==1;
+}
+
+// A date operand must contain something other than hex digits, otherwise
+// it is treated as a number.
+static bool is_nonhex (const char *s)
+{
+   for (size_t i=1; s[i]; i++) {
+      if (!isxdigit (s[i]))
+         return true;
+   }
+   return false;
+}
+
+// Applies a comparison operator to two numbers, returning 0 or 1.
+static int num_compare (const char *op, int64_t lhs, int64_t rhs)
+{
+   switch (*op) {
+      case '<':   return op[1]=='=' ? lhs <= rhs : lhs < rhs;
+      case '>':   return op[1]=='=' ? lhs >= rhs : lhs > rhs;
+      case '=':   return lhs == rhs;
+      case '!':   return lhs != rhs;
+   }
+   return 0;
+}
+
+// Applies a comparison operator to two strings, returning 0 or 1. Only the
+// equality and non-equality are defined for strings. Equality matches if
+// either string contains the other, non-equality matches unless the two
+// strings are identical. An empty string is only equal to another empty
+// string; it is not contained in every other string.
+static int str_compare (const char *op, const char *lhs, const char *rhs)
+{
+   if (*op!='=' && *op!='!')
+      return 0;
+
+   if (!*lhs || !*rhs) {
+      bool equal = !*lhs && !*rhs;
+      return *op=='=' ? equal : !equal;
+   }
+
+   if (*op=='!')
+      return strstr (rhs, lhs)==NULL || strstr (lhs, rhs)==NULL;
+
+   return strstr (rhs, lhs)!=NULL || strstr (lhs, rhs)!=NULL;
+}
 
+// Applies an operator to two operands that were read as numbers, hex
+// numbers or dates, returning the integer result.
+static int num_apply (const char *op, int64_t lhs, int64_t rhs)
+{
    int result = -1;
+
+   switch (*op) {
+      case '+':   result = lhs + rhs;  break;
+      case '-':   result = lhs - rhs;  break;
+      case '*':   result = lhs * rhs;  break;
+      case '/':   result = lhs / rhs;  break;
+      case '<':
+      case '>':
+      case '=':
+      case '!':   result = num_compare (op, lhs, rhs); break;
+      case '&':   result = lhs && rhs; break;
+      case '|':   result = lhs || rhs; break;
+   }
+
+   return result;
+}
+
+// Applies "lhs OP rhs" and returns the integer result. The class of the
+// operands (number, hex number, date or string) is worked out from their
+// text on every call.
+static int exec_int (const char *s_op, const char *s_lhs, const char *s_rhs)
+{
    int64_t lhs = 0;
    int64_t rhs = 0;
-   char tmp[40];
 
    bool parsed = false;
 
    enum pdate_errcode_t d_err_lhs, d_err_rhs;
    time_t tv_lhs, tv_rhs;
 
-   // First try to parse this as a date. If it's a valid date we use it as
-   // a large integer.
-   d_err_lhs = pdate_parse (s_lhs, &tv_lhs, true);
-   d_err_rhs = pdate_parse (s_rhs, &tv_rhs, true);
-
-   // XERROR (" [%s] (%s) [%s]\n", s_lhs, s_op, s_rhs);
-
-   if (d_err_lhs==pdate_valid && d_err_rhs==pdate_valid) {
-      // At this point the operands could still be numbers and not dates.
-      bool is_date = false;
-      for (size_t i=1; s_lhs[i]; i++) {
-         if (!isxdigit (s_lhs[i])) {
-            is_date = true;
-            break;
-         }
-      }
-      for (size_t i=1; !is_date && s_rhs[i]; i++) {
-         if (!isxdigit (s_rhs[i])) {
-            is_date = true;
-            break;
-         }
-      }
+   // Plain decimal numbers are checked before dates. The results of
+   // nested comparisons are "0" or "1", and pdate_parse() will happily
+   // read a lone number as a day of the month.
+   if (is_integer (s_lhs) && is_integer (s_rhs)) {
+      lhs = strtoll (s_lhs, NULL, 10);
+      rhs = strtoll (s_rhs, NULL, 10);
+      parsed = true;
+   }
 
-      if (is_date) {
-         lhs = (int32_t)tv_lhs;
-         rhs = (int32_t)tv_rhs;
-         XERROR ("Read dates [0x%016" PRIx64 "], [0x%016" PRIx64 "] \n",
-               lhs, rhs);
-         parsed = true;
-      }
+   // Next, try to read lhs/rhs as a hex number. This must come before the
+   // date check as well: pdate_parse() reads "0x..." as day zero, so two
+   // guids would otherwise be compared as the same date.
+   if (!parsed && is_hex (s_lhs, &lhs) && is_hex (s_rhs, &rhs)) {
+      parsed = true;
    }
 
-   // Next, try to read lhs/rhs as a number. If both are numbers
-   // then we assume that the integer operators apply
-   if (!parsed) {
-      int i_lhs = sscanf (s_lhs, "0x%016" PRIx64, &lhs);
-      int i_rhs = sscanf (s_rhs, "0x%016" PRIx64, &rhs);
+   // Next try to parse this as a date. If it's a valid date we use it as
+   // a large integer.
+   d_err_lhs = parsed ? pdate_error : pdate_parse (s_lhs, &tv_lhs, true);
+   d_err_rhs = parsed ? pdate_error : pdate_parse (s_rhs, &tv_rhs, true);
 
-      if (i_lhs==1 && i_rhs==1) {
+   if (d_err_lhs==pdate_valid && d_err_rhs==pdate_valid) {
+      // At this point the operands could still be numbers and not dates.
+      if (is_nonhex (s_lhs) || is_nonhex (s_rhs)) {
+         lhs = tv_lhs;
+         rhs = tv_rhs;
          parsed = true;
       }
    }
 
    // If none of the above parsings worked, then we treat the operands as
-   // strings. Note that not all operators are defined for strings, only
-   // the equality and non-equality.
+   // strings.
    if (!parsed) {
-      tmp [0] = '0';
-      tmp [1] = 0;
-      if (*s_op == '!') {
-         sprintf (tmp, "%i", strstr (s_rhs, s_lhs)==NULL);
-      }
-      if (*s_op == '=') {
-         sprintf (tmp, "%i", strstr (s_rhs, s_lhs)!=NULL);
-      }
-      if (tmp[0] == '0') {
-         if (*s_op == '!') {
-            sprintf (tmp, "%i", strstr (s_lhs, s_rhs)==NULL);
-         }
-         if (*s_op == '=') {
-            sprintf (tmp, "%i", strstr (s_lhs, s_rhs)!=NULL);
-         }
-      }
-      return xstr_dup (tmp);
+      return str_compare (s_op, s_lhs, s_rhs);
    }
 
-   switch (*s_op) {
-      case '+':   result = lhs + rhs;  break;
-      case '-':   result = lhs - rhs;  break;
-      case '*':   result = lhs * rhs;  break;
-      case '/':   result = lhs / rhs;  break;
-      case '<':   result = lhs < rhs;  break;
-      case '>':   result = lhs > rhs;  break;
-      case '=':   result = lhs == rhs; break;
-      case '!':   result = lhs != rhs; break;
-      case '&':   result = lhs && rhs; break;
-      case '|':   result = lhs || rhs; break;
-   }
+   return num_apply (s_op, lhs, rhs);
+}
+
+static void *exec_op (const void *p_op, void const *p_lhs, void const *p_rhs)
+{
+   char tmp[40];
 
-   sprintf (tmp, "%i", result);
-   return xstr_dup (tmp);
+   sprintf (tmp, "%i", exec_int (p_op, p_lhs, p_rhs));
+   return mem_strdup (tmp);
 }
 
 static eval_type_t check_type (void const *token)
@@ -147,8 +214,8 @@ static char **make_tokens (const char *input)
 {
    bool error = true;
    char **ret = NULL;
-   xvector_t *xv = NULL;
-   char *local = xstr_dup (input);
+   memvec_t tokens = { NULL, 0, 0 };
+   char *local = mem_strdup (input);
    if (!local) {
       goto errorexit;
    }
@@ -165,19 +232,19 @@ static char **make_tokens (const char *input)
          dbl = true;
 
       switch (*start) {
-         case '(':   new_token = xstr_dup ("("); break;
-         case ')':   new_token = xstr_dup (")"); break;
-         case '+':   new_token = xstr_dup ("+"); break;
-         case '-':   new_token = xstr_dup ("-"); break;
-         case '/':   new_token = xstr_dup ("/"); break;
-         case '*':   new_token = xstr_dup ("*"); break;
-         case '&':   new_token = xstr_dup ("&"); break;
-         case '|':   new_token = xstr_dup ("|"); break;
-
-         case '<':   new_token = xstr_dup (dbl ? "<=" : "<");  break;
-         case '>':   new_token = xstr_dup (dbl ? ">=" : ">");  break;
-         case '=':   new_token = xstr_dup (dbl ? "==" : NULL); break;
-         case '!':   new_token = xstr_dup (dbl ? "!=" : NULL); break;
+         case '(':   new_token = mem_strdup ("("); break;
+         case ')':   new_token = mem_strdup (")"); break;
+         case '+':   new_token = mem_strdup ("+"); break;
+         case '-':   new_token = mem_strdup ("-"); break;
+         case '/':   new_token = mem_strdup ("/"); break;
+         case '*':   new_token = mem_strdup ("*"); break;
+         case '&':   new_token = mem_strdup ("&"); break;
+         case '|':   new_token = mem_strdup ("|"); break;
+
+         case '<':   new_token = mem_strdup (dbl ? "<=" : "<");  break;
+         case '>':   new_token = mem_strdup (dbl ? ">=" : ">");  break;
+         case '=':   new_token = mem_strdup (dbl ? "==" : NULL); break;
+         case '!':   new_token = mem_strdup (dbl ? "!=" : NULL); break;
 
          case ' ':
          case '\n':
@@ -190,7 +257,7 @@ static char **make_tokens (const char *input)
                      end++;
                   tmp_c = *end;
                   *end = 0;
-                  new_token = xstr_dup (start);
+                  new_token = mem_strdup (start);
                   *end = tmp_c;
                   end--;
                   start = end;
@@ -198,12 +265,10 @@ static char **make_tokens (const char *input)
       }
 
       if (new_token) {
-         xvector_t *tmp = xvector_ins_tail (xv, new_token);
-         if (!tmp) {
-            free (new_token);
+         if (!memvec_push (&tokens, new_token)) {
+            mem_free (new_token);
             goto errorexit;
          }
-         xv = tmp;
       }
 
       if (dbl)
@@ -213,809 +278,5562 @@ static char **make_tokens (const char *input)
          start++;
    }
 
-   ret = xvector_native (xv);
+   if (!memvec_push (&tokens, NULL))
+      goto errorexit;
+
+   ret = (char **)tokens.items;
    error = false;
 
 errorexit:
 
-   free (local);
-   xvector_free (xv);
+   mem_free (local);
 
    if (error) {
-      xstr_delarray (ret);
-      ret = NULL;
+      for (size_t i=0; i<tokens.len; i++) {
+         mem_free (tokens.items[i]);
+      }
+      memvec_free (&tokens);
    }
    return ret;
 }
 
-struct rotsit_t {
-   char *buffer;
-   xvector_t *records;  // rotrec_t
+// The date fields that get a sorted index. Each index holds the records
+// whose field parses as a date, ordered by (epoch, record number), so
+// that a range predicate is a binary search to a contiguous run of keys.
+#define NUM_DATE_FIELDS    (3)
+static const size_t date_fields[NUM_DATE_FIELDS] = {
+   RF_OPENED_ON, RF_CLOSED_ON, RF_ASSIGNED_ON,
 };
 
-struct rotrec_t {
-   xvector_t *fields;   // char *
+struct datekey_t {
+   int64_t epoch;
+   uint32_t recnum;
 };
 
-static bool fsubst (char **tokens, rotrec_t *rr)
-{
-   bool error = true;
+struct dateidx_t {
+   bool built;
+   struct datekey_t *keys;
+   size_t nkeys;
+   int64_t *epochs;     // Indexed by record number, 0 where not valid
+   bitmap_t *valid;     // Records whose field parsed as a date
+};
 
-   static const struct {
-      uint32_t       fnum;
-      const char    *name;
-   } fields[] = {
-      { RF_GUID,           "guid"        },
-      { RF_ORDER,          "order"       },
-      { RF_OPENED_BY,      "opened_by"   },
-      { RF_OPENED_ON,      "opened_on"   },
-      { RF_OPENED_MSG,     "message"     },
-      { RF_STATUS,         "status"      },
-      { RF_ASSIGNED_BY,    "assigned_by" },
-      { RF_ASSIGNED_TO,    "assigned_to" },
-      { RF_ASSIGNED_ON,    "assigned_on" },
-      { RF_CLOSED_BY,      "closed_by"   },
-      { RF_CLOSED_ON,      "closed_on"   },
-      { RF_CLOSED_MSG,     "closed_msg"  },
-      { RF_DUP_BY,         "dup_by"      },
-      // TODO: Must also match up comments
-      // RF_DUP_GUID
-      // RF_DUP_MSG
-   };
+// The low-cardinality fields that get one bitmap per distinct value. A
+// predicate on one of these fields is evaluated once per distinct value
+// instead of once per record, and the matching bitmaps are combined.
+#define NUM_ENUM_FIELDS    (6)
+static const size_t enum_fields[NUM_ENUM_FIELDS] = {
+   RF_STATUS, RF_OPENED_BY, RF_ASSIGNED_BY, RF_ASSIGNED_TO, RF_CLOSED_BY,
+   RF_DUP_BY,
+};
 
-   for (size_t i=0; tokens && tokens[i]; i++) {
+struct enumval_t {
+   char *value;
+   bitmap_t *bits;
+};
 
-      xstr_trim (tokens[i]);
+struct enumidx_t {
+   bool built;
+   struct enumval_t *vals;
+   size_t nvals;
+};
 
-      for (size_t j=0; j<sizeof fields/sizeof fields[0]; j++) {
+// Records whose GUID is a hex number, sorted by that number, so that a
+// lookup by id is a binary search.
+struct guidkey_t {
+   uint64_t guid;
+   uint32_t recnum;
+};
 
-         if (strcmp (fields[j].name, tokens[i])==0) {
-            char *field = XVECT_INDEX (rr->fields, j);
+struct guididx_t {
+   bool built;
+   struct guidkey_t *keys;
+   size_t nkeys;
+   size_t nunindexed;   // Records whose GUID is not a plain hex number
+};
 
-            free (tokens[i]);
-            tokens[i] = xstr_dup (field);
-            if (!tokens[i] && field) {
-               XERROR ("Out of memory\n");
-               goto errorexit;
-            }
-            break;
-         }
-      }
-   }
+// The text that records were parsed from, which the fields they have not
+// changed since point into. Frozen copies of a database hold on to its
+// text as well, so that it outlives a reload of the database.
+struct text_t {
+   char *buf;
+   size_t len;
+   uint32_t refs;
+};
 
-   error = false;
-errorexit:
-   return !error;
-}
+// Any number of threads may read a database at once, while anything that
+// changes it holds its lock alone. Readers that find an index missing
+// build it one at a time under the index lock, and readers that find no
+// current frozen copy make one under the freeze lock.
+#if defined (PLATFORM_POSIX)
+typedef pthread_rwlock_t dblock_t;
+typedef pthread_mutex_t dbmutex_t;
+#elif defined (PLATFORM_WINDOWS)
+typedef SRWLOCK dblock_t;
+typedef SRWLOCK dbmutex_t;
+#else
+typedef int dblock_t;
+typedef int dbmutex_t;
+#endif
 
-void rotrec_del (rotrec_t *rec)
-{
-   if (!rec)
-      return;
+struct rotsit_t {
+   mem_owner_t mem;     // Allocator of everything rs owns, see db_mem_enter()
+   dblock_t lock;
+   dbmutex_t index_lock;
+   dbmutex_t freeze_lock;
+   struct text_t *text;    // The parsed text
+   struct text_t *archive; // The same for the archive, once it is loaded
+   bool archive_loaded;
+   memvec_t records;    // rotrec_t
+   uint32_t order_next; // Order given to the next record added
+   struct dateidx_t dates[NUM_DATE_FIELDS];
+   struct enumidx_t enums[NUM_ENUM_FIELDS];
+   struct guididx_t guids;
+   rotsit_stats_t stats;
+   rotsit_t *current;   // Frozen copy of the database as it is now, if any
+   rotsit_t *last;      // The copy before it, whose indexes the next takes
+   bool frozen;         // Read-only, with records shared with other copies
+   uint32_t refs;       // Holders of a frozen copy, the database included
+};
 
-   xvector_iterate (rec->fields, free);
-   xvector_free (rec->fields);
-   free (rec);
-}
+struct rotrec_t {
+   char **fields;       // Grows geometrically, comments are appended
+   size_t nfields;
+   size_t maxfields;
+   rotsit_t *owner;     // Database this record was added to, if any
+   uint32_t recnum;     // Position of this record in the owner
+   bool archived;       // Written to the archive rather than the database
+   struct text_t *text; // Parsed from, if it was
+   // A record in a database that has been frozen shares its fields with
+   // a frozen copy, which is what the frozen databases hold, until it is
+   // next changed. The copy is freed along with its last holder.
+   rotrec_t *copy;
+   bool frozen;
+   uint32_t refs;       // Holders of a frozen copy
+};
 
-static bool safe_xvadd (xvector_t **xv, void *elm)
+static bool mutex_init (dbmutex_t *m)
 {
-   xvector_t *tmp = xvector_ins_tail ((*xv), elm);
-   if (!tmp) {
-      return false;
-   }
-
-   (*xv) = tmp;
+#if defined (PLATFORM_POSIX)
+   return pthread_mutex_init (m, NULL)==0;
+#elif defined (PLATFORM_WINDOWS)
+   InitializeSRWLock (m);
+#else
+   (void)m;
+#endif
    return true;
 }
 
-static xvector_t *split_alloc (char *input, const char *delim)
+static void mutex_destroy (dbmutex_t *m)
 {
-   bool error = true;
-   xvector_t *ret = NULL;
-   size_t len = input ? strlen (input) : 0;
-   size_t dlen = strlen (delim);
-   char *eofs = &input[len];
-
-   char *lhs = input;
-   char *rhs = input;
-   while (lhs && rhs < eofs) {
-
-      char *rhs = strstr (lhs, delim);
-      if (!rhs) {
-         break;
-      }
-
-      *rhs = 0;
+#ifdef PLATFORM_POSIX
+   pthread_mutex_destroy (m);
+#else
+   (void)m;
+#endif
+}
 
-      char *tmp = xstr_dup (lhs);
-      if (!tmp) {
-         XERROR ("Out of memory\n");
-         goto errorexit;
-      }
+static void mutex_lock (dbmutex_t *m)
+{
+#if defined (PLATFORM_POSIX)
+   pthread_mutex_lock (m);
+#elif defined (PLATFORM_WINDOWS)
+   AcquireSRWLockExclusive (m);
+#else
+   (void)m;
+#endif
+}
 
-      if (!safe_xvadd (&ret, tmp)) {
-         XERROR ("Out of memory\n");
-         free (tmp);
-         goto errorexit;
-      }
+static void mutex_unlock (dbmutex_t *m)
+{
+#if defined (PLATFORM_POSIX)
+   pthread_mutex_unlock (m);
+#elif defined (PLATFORM_WINDOWS)
+   ReleaseSRWLockExclusive (m);
+#else
+   (void)m;
+#endif
+}
 
-      lhs = &rhs[dlen];
+static bool db_lock_init (rotsit_t *rs)
+{
+#if defined (PLATFORM_POSIX)
+   if (pthread_rwlock_init (&rs->lock, NULL)!=0)
+      return false;
+#elif defined (PLATFORM_WINDOWS)
+   InitializeSRWLock (&rs->lock);
+#endif
+   if (!mutex_init (&rs->index_lock)) {
+      goto errorexit;
+   }
+   if (!mutex_init (&rs->freeze_lock)) {
+      mutex_destroy (&rs->index_lock);
+      goto errorexit;
    }
+   return true;
 
-   error = false;
 errorexit:
-   if (error) {
-      xvector_iterate (ret, free);
-      xvector_free (ret);
-      ret = NULL;
-   }
-   return ret;
+#ifdef PLATFORM_POSIX
+   pthread_rwlock_destroy (&rs->lock);
+#endif
+   return false;
+}
 
+static void db_lock_destroy (rotsit_t *rs)
+{
+#ifdef PLATFORM_POSIX
+   pthread_rwlock_destroy (&rs->lock);
+#endif
+   mutex_destroy (&rs->index_lock);
+   mutex_destroy (&rs->freeze_lock);
 }
 
-static rotrec_t *new_rotrec (xvector_t *fields)
+// Nothing changes a frozen database, so reading one takes no lock
+static void db_read_lock (rotsit_t *rs)
 {
-   rotrec_t *ret = malloc (sizeof *ret);
-   if (!ret) {
-      return NULL;
-   }
-   ret->fields = fields;
-   return ret;
+   if (rs->frozen)
+      return;
+
+#if defined (PLATFORM_POSIX)
+   pthread_rwlock_rdlock (&rs->lock);
+#elif defined (PLATFORM_WINDOWS)
+   AcquireSRWLockShared (&rs->lock);
+#else
+   (void)rs;
+#endif
 }
 
-rotsit_t *rotsit_parse (char *input_buf)
+static void db_read_unlock (rotsit_t *rs)
 {
-   bool error = true;
-   xvector_t *records = NULL;
+   if (rs->frozen)
+      return;
 
+#if defined (PLATFORM_POSIX)
+   pthread_rwlock_unlock (&rs->lock);
+#elif defined (PLATFORM_WINDOWS)
+   ReleaseSRWLockShared (&rs->lock);
+#else
+   (void)rs;
+#endif
+}
 
-   rotsit_t *ret = malloc (sizeof *ret);
-   if (!ret) {
-      XERROR ("Out of memory\n");
-      goto errorexit;
-   }
-   memset (ret, 0, sizeof *ret);
+static void db_write_lock (rotsit_t *rs)
+{
+#if defined (PLATFORM_POSIX)
+   pthread_rwlock_wrlock (&rs->lock);
+#elif defined (PLATFORM_WINDOWS)
+   AcquireSRWLockExclusive (&rs->lock);
+#else
+   (void)rs;
+#endif
+}
 
-   ret->buffer = xstr_dup (input_buf);
-   if (input_buf && !ret->buffer) {
-      XERROR ("Out of memory\n");
-      goto errorexit;
+// Whatever was done under the write lock, the current frozen copy no
+// longer shows the database as it is. Readers still holding it keep it,
+// and the last of them frees it. The database keeps it too, until the
+// next copy has taken over its indexes.
+static void db_write_unlock (rotsit_t *rs)
+{
+   mutex_lock (&rs->freeze_lock);
+   rotsit_t *old = NULL;
+   if (rs->current) {
+      old = rs->last;
+      rs->last = rs->current;
+      rs->current = NULL;
    }
+   mutex_unlock (&rs->freeze_lock);
 
-   records = split_alloc (ret->buffer, RECORD_DELIM);
+#if defined (PLATFORM_POSIX)
+   pthread_rwlock_unlock (&rs->lock);
+#elif defined (PLATFORM_WINDOWS)
+   ReleaseSRWLockExclusive (&rs->lock);
+#endif
 
-   for (size_t i=0; i<XVECT_LENGTH (records); i++) {
+   rotsit_del (old);
+}
 
-      char *rec_str = XVECT_INDEX (records, i);
+static int db_addr_cmp (const void *p_lhs, const void *p_rhs)
+{
+   uintptr_t lhs = (uintptr_t)*(rotsit_t * const *)p_lhs;
+   uintptr_t rhs = (uintptr_t)*(rotsit_t * const *)p_rhs;
 
-      xvector_t *fields = split_alloc (rec_str, FIELD_DELIM);
-      if (!fields) {
-         XERROR ("Failure parsing record [%zu]\n", i);
-         goto errorexit;
-      }
+   return lhs < rhs ? -1 : lhs > rhs;
+}
 
-      rotrec_t *rec = new_rotrec (fields);
-      if (!rec) {
-         XERROR ("Out of memory failure\n");
-         goto errorexit;
-      }
+// Read-locks each of several databases once, always in the same order so
+// that two threads locking overlapping sets cannot each hold a lock the
+// other is waiting behind. dbs is sorted and NULLs and repeats are
+// dropped; returns how many are left, to pass to db_read_unlock_all().
+static size_t db_read_lock_all (rotsit_t **dbs, size_t ndbs)
+{
+   size_t n = 0;
 
-      if (!safe_xvadd (&ret->records, rec)) {
-         XERROR ("Failed to store record\n");
-         goto errorexit;
+   if (ndbs > 1)
+      qsort (dbs, ndbs, sizeof *dbs, db_addr_cmp);
+   for (size_t i=0; i<ndbs; i++) {
+      if (dbs[i] && (!n || dbs[n - 1]!=dbs[i])) {
+         dbs[n++] = dbs[i];
       }
    }
 
-   error = false;
-errorexit:
-   xvector_iterate (records, free);
-   xvector_free (records);
-   if (error) {
-      rotsit_del (ret);
-      ret = NULL;
+   for (size_t i=0; i<n; i++) {
+      db_read_lock (dbs[i]);
    }
-   return ret;
+   return n;
 }
 
-void rotsit_del (rotsit_t *rs)
+static void db_read_unlock_all (rotsit_t **dbs, size_t ndbs)
 {
-   if (!rs)
-      return;
-
-   xvector_iterate (rs->records, (void (*) (void *))rotrec_del);
-   xvector_free (rs->records);
-   free (rs->buffer);
-   free (rs);
+   for (size_t i=ndbs; i>0; i--) {
+      db_read_unlock (dbs[i - 1]);
+   }
 }
 
-const char *rotrec_get_field (rotrec_t *rr, size_t field)
+// Whichever thread changes a database, builds its indexes or frees it,
+// what the database owns comes from and goes back to the allocator it was
+// made under. Memory handed to the caller, such as a filter list, comes
+// from the caller's own. Each is paired with mem_use (caller).
+static void db_mem_enter (rotsit_t *rs, mem_owner_t *caller)
 {
-   if (!rr || field > RF_LAST_FIELD) {
-      return "";
+   if (rs) {
+      mem_switch (&rs->mem, caller);
+   } else {
+      mem_capture (caller);
    }
-
-   return XVECT_INDEX (rr->fields, field);
 }
 
-void rotsit_dump (rotsit_t *rs, const char *id, FILE *outf)
+// A record that is not in a database is the caller's
+static void rec_mem_enter (rotrec_t *rr, mem_owner_t *caller)
 {
-   if (!outf)
-      outf = stdout;
+   db_mem_enter (rr ? rr->owner : NULL, caller);
+}
 
-   if (!rs) {
-      fprintf (outf, "Passed a NULL rotsit_t data object\n");
-      return;
-   }
+// Counters that readers update while holding only the read lock
+static void stats_add (uint64_t *counter, uint64_t n)
+{
+   __atomic_fetch_add (counter, n, __ATOMIC_RELAXED);
+}
 
-   fprintf (outf, "Data [%s] has [%zu] records\n", id,
-                                                  XVECT_LENGTH (rs->records));
+// The type of an operand in a filter expression. Fields take their type
+// from the schema below, literals from their shape and subexpressions are
+// always numbers.
+typedef enum {
+   ft_NUMBER = 0,
+   ft_HEX,
+   ft_DATE,
+   ft_STRING,
+} ftype_t;
+
+static const char *ftype_names[] = {
+   "number", "hex number", "date", "string",
+};
 
-   for (size_t i=0; i<XVECT_LENGTH (rs->records); i++) {
+static const struct {
+   uint32_t       fnum;
+   const char    *name;
+   ftype_t        type;
+} field_names[] = {
+   { RF_GUID,           "guid",           ft_HEX      },
+   { RF_ORDER,          "order",          ft_HEX      },
+   { RF_OPENED_BY,      "opened_by",      ft_STRING   },
+   { RF_OPENED_ON,      "opened_on",      ft_DATE     },
+   { RF_OPENED_MSG,     "message",        ft_STRING   },
+   { RF_STATUS,         "status",         ft_STRING   },
+   { RF_ASSIGNED_BY,    "assigned_by",    ft_STRING   },
+   { RF_ASSIGNED_TO,    "assigned_to",    ft_STRING   },
+   { RF_ASSIGNED_ON,    "assigned_on",    ft_DATE     },
+   { RF_CLOSED_BY,      "closed_by",      ft_STRING   },
+   { RF_CLOSED_ON,      "closed_on",      ft_DATE     },
+   { RF_CLOSED_MSG,     "closed_msg",     ft_STRING   },
+   { RF_DUP_BY,         "dup_by",         ft_STRING   },
+   { RF_DUP_GUID,       "dup_guid",       ft_HEX      },
+   // TODO: Must also match up comments
+   // RF_DUP_MSG
+};
 
-      rotrec_t *rr = XVECT_INDEX (rs->records, i);
-      fprintf (outf, "[(%s):%zu] ", id, i);
+// Returns the field number for a field name, or (size_t)-1 if the name
+// is not a field.
+static size_t field_lookup (const char *name)
+{
+   for (size_t i=0; i<sizeof field_names/sizeof field_names[0]; i++) {
+      if (strcmp (field_names[i].name, name)==0) {
+         return field_names[i].fnum;
+      }
+   }
+   return (size_t)-1;
+}
 
-      for (size_t j=0; j<XVECT_LENGTH (rr->fields); j++) {
-         fprintf (outf, "(%s)", (char *)XVECT_INDEX (rr->fields, j));
+static ftype_t field_type (size_t fnum)
+{
+   for (size_t i=0; i<sizeof field_names/sizeof field_names[0]; i++) {
+      if (field_names[i].fnum==fnum) {
+         return field_names[i].type;
       }
-      fprintf (outf, "\n");
    }
+   return ft_STRING;
 }
 
-bool rotsit_write (rotsit_t *rs, FILE *outf)
+static bool fsubst (char **tokens, rotrec_t *rr)
 {
-   if (!rs || !outf)
-      return false;
+   bool error = true;
 
-   uint32_t order_max = 0;
-   for (size_t i=0; i<XVECT_LENGTH (rs->records); i++) {
-      rotrec_t *rec = XVECT_INDEX (rs->records, i);
-      for (size_t j=0; j<XVECT_LENGTH (rec->fields); j++) {
-         char *field = XVECT_INDEX (rec->fields, j);
+   for (size_t i=0; tokens && tokens[i]; i++) {
 
-         if (field && j==RF_ORDER) {
-            uint32_t order;
-            if (sscanf (field, "%x", &order)!=1) {
-               XERROR ("Error: [%s] is not a number]\n", field);
-               return false;
-            }
-            if (order > order_max)
-               order_max = order;
-         }
+      xstr_trim (tokens[i]);
 
-         bool free_field = false;
-         if (!field && j==RF_ORDER) {
-            field = malloc (2 + 9 + 1);
-            if (!field) {
-               XERROR ("Out of memory\n");
-               return false;
-            }
-            free_field = true;
-            sprintf (field, "0x%x", order_max++);
+      size_t fnum = field_lookup (tokens[i]);
+      if (fnum != (size_t)-1) {
+         // Fields that were never set are NULL in records that have not
+         // yet been written out; they compare as empty strings.
+         char *field = rr->fields[fnum];
+         if (!field)
+            field = "";
+
+         mem_free (tokens[i]);
+         tokens[i] = mem_strdup (field);
+         if (!tokens[i]) {
+            XERROR ("Out of memory\n");
+            goto errorexit;
          }
+      }
+   }
+
+   error = false;
+errorexit:
+   return !error;
+}
+
+static size_t index_slot (const size_t *fields, size_t nfields, size_t field)
+{
+   for (size_t i=0; i<nfields; i++) {
+      if (fields[i]==field)
+         return i;
+   }
+   return (size_t)-1;
+}
+
+static void dateidx_clear (struct dateidx_t *di)
+{
+   mem_free (di->keys);
+   mem_free (di->epochs);
+   bitmap_del (di->valid);
+   di->keys = NULL;
+   di->epochs = NULL;
+   di->valid = NULL;
+   di->nkeys = 0;
+   di->built = false;
+}
+
+static void enumidx_clear (struct enumidx_t *ei)
+{
+   for (size_t i=0; i<ei->nvals; i++) {
+      mem_free (ei->vals[i].value);
+      bitmap_del (ei->vals[i].bits);
+   }
+   mem_free (ei->vals);
+   ei->vals = NULL;
+   ei->nvals = 0;
+   ei->built = false;
+}
+
+static void guididx_clear (struct guididx_t *gi)
+{
+   mem_free (gi->keys);
+   gi->keys = NULL;
+   gi->nkeys = 0;
+   gi->nunindexed = 0;
+   gi->built = false;
+}
+
+static void index_invalidate (rotsit_t *rs)
+{
+   if (!rs)
+      return;
+
+   guididx_clear (&rs->guids);
+
+   for (size_t i=0; i<NUM_DATE_FIELDS; i++) {
+      dateidx_clear (&rs->dates[i]);
+   }
+   for (size_t i=0; i<NUM_ENUM_FIELDS; i++) {
+      enumidx_clear (&rs->enums[i]);
+   }
+}
+
+static bool dateidx_copy (struct dateidx_t *dst, const struct dateidx_t *src,
+                         size_t nrecs)
+{
+   dst->keys = mem_alloc ((src->nkeys + 1) * sizeof *dst->keys);
+   dst->epochs = mem_alloc ((nrecs ? nrecs : 1) * sizeof *dst->epochs);
+   dst->valid = bitmap_dup (src->valid);
+   if (!dst->keys || !dst->epochs || !dst->valid) {
+      dateidx_clear (dst);
+      return false;
+   }
+
+   memcpy (dst->keys, src->keys, src->nkeys * sizeof *dst->keys);
+   memcpy (dst->epochs, src->epochs, nrecs * sizeof *dst->epochs);
+   dst->nkeys = src->nkeys;
+   dst->built = true;
+   return true;
+}
+
+static bool enumidx_copy (struct enumidx_t *dst, const struct enumidx_t *src)
+{
+   if (!(dst->vals = mem_calloc (src->nvals + 1, sizeof *dst->vals)))
+      return false;
+
+   for (size_t i=0; i<src->nvals; i++) {
+      struct enumval_t *val = &dst->vals[dst->nvals++];
+      val->value = mem_strdup (src->vals[i].value);
+      val->bits = bitmap_dup (src->vals[i].bits);
+      if (!val->value || !val->bits) {
+         enumidx_clear (dst);
+         return false;
+      }
+   }
+   dst->built = true;
+   return true;
+}
+
+static bool guididx_copy (struct guididx_t *dst, const struct guididx_t *src)
+{
+   if (!(dst->keys = mem_alloc ((src->nkeys + 1) * sizeof *dst->keys)))
+      return false;
+
+   memcpy (dst->keys, src->keys, src->nkeys * sizeof *dst->keys);
+   dst->nkeys = src->nkeys;
+   dst->nunindexed = src->nunindexed;
+   dst->built = true;
+   return true;
+}
+
+static bool index_built (const bool *built)
+{
+   return __atomic_load_n (built, __ATOMIC_ACQUIRE);
+}
+
+// Gives dst the indexes that src has built and dst has not, skipping any
+// that except has built as well. The indexes of src are left as they are
+// and the records of the two are taken to be in the same places. Returns
+// whether any were copied.
+static bool index_copy (rotsit_t *dst, rotsit_t *src, rotsit_t *except)
+{
+   size_t nrecs = src->records.len;
+   bool ret = false;
+
+   for (size_t i=0; i<NUM_DATE_FIELDS; i++) {
+      if (index_built (&src->dates[i].built) && !dst->dates[i].built &&
+          !(except && index_built (&except->dates[i].built))) {
+         ret |= dateidx_copy (&dst->dates[i], &src->dates[i], nrecs);
+      }
+   }
+   for (size_t i=0; i<NUM_ENUM_FIELDS; i++) {
+      if (index_built (&src->enums[i].built) && !dst->enums[i].built &&
+          !(except && index_built (&except->enums[i].built))) {
+         ret |= enumidx_copy (&dst->enums[i], &src->enums[i]);
+      }
+   }
+   if (index_built (&src->guids.built) && !dst->guids.built &&
+       !(except && index_built (&except->guids.built))) {
+      ret |= guididx_copy (&dst->guids, &src->guids);
+   }
+   return ret;
+}
+
+// Returns the bitmap for value, creating an empty one if this value has
+// not been seen before.
+static bitmap_t *enumidx_bits (struct enumidx_t *ei, const char *value,
+                               size_t nrecs)
+{
+   for (size_t i=0; i<ei->nvals; i++) {
+      if (strcmp (ei->vals[i].value, value)==0)
+         return ei->vals[i].bits;
+   }
+
+   struct enumval_t *tmp = mem_realloc (ei->vals,
+                                        (ei->nvals + 1) * sizeof *tmp);
+   if (!tmp)
+      return NULL;
+   ei->vals = tmp;
+
+   char *copy = mem_strdup (value);
+   bitmap_t *bits = bitmap_new (nrecs);
+   if (!copy || !bits) {
+      mem_free (copy);
+      bitmap_del (bits);
+      return NULL;
+   }
+
+   ei->vals[ei->nvals].value = copy;
+   ei->vals[ei->nvals].bits = bits;
+   ei->nvals++;
+   return bits;
+}
+
+static struct enumidx_t *enumidx_build (rotsit_t *rs, size_t field)
+{
+   size_t idx = index_slot (enum_fields, NUM_ENUM_FIELDS, field);
+   if (idx==(size_t)-1)
+      return NULL;
+
+   struct enumidx_t *ei = &rs->enums[idx];
+   if (ei->built)
+      return ei;
+
+   size_t nrecs = rs->records.len;
+   for (size_t i=0; i<nrecs; i++) {
+      rotrec_t *rr = rs->records.items[i];
+      const char *value = rr->fields[field];
+
+      bitmap_t *bits = enumidx_bits (ei, value ? value : "", nrecs);
+      if (!bits) {
+         XERROR ("Out of memory\n");
+         enumidx_clear (ei);
+         return NULL;
+      }
+      bitmap_set (bits, i);
+   }
+
+   __atomic_store_n (&ei->built, true, __ATOMIC_RELEASE);
+   return ei;
+}
+
+// Indexes are built on first use, which may be by any of several readers.
+// Once built they only change under the write lock, so checking for them
+// needs no lock.
+static struct enumidx_t *enumidx_get (rotsit_t *rs, size_t field)
+{
+   size_t idx = index_slot (enum_fields, NUM_ENUM_FIELDS, field);
+   if (idx!=(size_t)-1 &&
+       __atomic_load_n (&rs->enums[idx].built, __ATOMIC_ACQUIRE))
+      return &rs->enums[idx];
+
+   mem_owner_t caller;
+   db_mem_enter (rs, &caller);
+   mutex_lock (&rs->index_lock);
+   struct enumidx_t *ret = enumidx_build (rs, field);
+   mutex_unlock (&rs->index_lock);
+   mem_use (&caller);
+   return ret;
+}
+
+// A new record was appended to the database. The enum bitmaps are grown
+// and updated in place; the date indexes are simply rebuilt on demand.
+static void index_record_added (rotsit_t *rs, rotrec_t *rr)
+{
+   size_t nrecs = rs->records.len;
+
+   guididx_clear (&rs->guids);
+   for (size_t i=0; i<NUM_DATE_FIELDS; i++) {
+      dateidx_clear (&rs->dates[i]);
+   }
+
+   for (size_t i=0; i<NUM_ENUM_FIELDS; i++) {
+      struct enumidx_t *ei = &rs->enums[i];
+      if (!ei->built)
+         continue;
+
+      bool ok = true;
+      for (size_t j=0; ok && j<ei->nvals; j++) {
+         ok = bitmap_resize (ei->vals[j].bits, nrecs);
+      }
+
+      const char *value = rr->fields[enum_fields[i]];
+      bitmap_t *bits = ok ? enumidx_bits (ei, value ? value : "", nrecs)
+                          : NULL;
+      if (!bits) {
+         enumidx_clear (ei);
+         continue;
+      }
+      bitmap_set (bits, rr->recnum);
+   }
+}
+
+static struct text_t *text_new (const char *s)
+{
+   struct text_t *ret = mem_alloc (sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   if (!(ret->buf = mem_strdup (s))) {
+      mem_free (ret);
+      return NULL;
+   }
+   ret->len = strlen (s);
+   ret->refs = 1;
+   return ret;
+}
+
+static struct text_t *text_hold (struct text_t *text)
+{
+   if (text) {
+      __atomic_fetch_add (&text->refs, 1, __ATOMIC_RELAXED);
+   }
+   return text;
+}
+
+static void text_release (struct text_t *text)
+{
+   if (text && !__atomic_sub_fetch (&text->refs, 1, __ATOMIC_ACQ_REL)) {
+      mem_free (text->buf);
+      mem_free (text);
+   }
+}
+
+// Fields that have not changed since the record was parsed point into the
+// parsed text rather than being allocated one at a time.
+static bool field_parsed (rotrec_t *rr, const char *field)
+{
+   struct text_t *text = rr->text;
+
+   return text && field >= text->buf && field < text->buf + text->len;
+}
+
+static void field_free (rotrec_t *rr, char *field)
+{
+   if (!field_parsed (rr, field))
+      mem_free (field);
+}
+
+// Returns the frozen copy of a record for a frozen database to hold,
+// making it if the record has changed since it was last frozen. The copy
+// takes over the fields, which the record goes on sharing until it is
+// next changed.
+static rotrec_t *rotrec_freeze (rotrec_t *rr)
+{
+   if (!rr->copy) {
+      rotrec_t *copy = mem_alloc (sizeof *copy);
+      if (!copy)
+         return NULL;
+
+      *copy = *rr;
+      copy->frozen = true;
+      copy->refs = 1;
+      rr->copy = copy;
+   }
+
+   __atomic_fetch_add (&rr->copy->refs, 1, __ATOMIC_RELAXED);
+   return rr->copy;
+}
+
+static void rotrec_unfreeze (rotrec_t *copy)
+{
+   if (copy && !__atomic_sub_fetch (&copy->refs, 1, __ATOMIC_ACQ_REL))
+      rotrec_del (copy);
+}
+
+// Gives a record fields of its own before it is changed, so that its
+// frozen copy stays as it was.
+static bool rotrec_unshare (rotrec_t *rr)
+{
+   if (!rr->copy)
+      return true;
+
+   char **fields = mem_alloc (rr->maxfields * sizeof *fields);
+   if (!fields)
+      return false;
+
+   for (size_t i=0; i<rr->nfields; i++) {
+      fields[i] = rr->fields[i];
+      if (!fields[i] || field_parsed (rr, fields[i]))
+         continue;
+
+      if (!(fields[i] = mem_strdup (rr->fields[i]))) {
+         for (size_t j=0; j<i; j++) {
+            if (fields[j]!=rr->fields[j])
+               mem_free (fields[j]);
+         }
+         mem_free (fields);
+         return false;
+      }
+   }
+
+   rotrec_t *copy = rr->copy;
+   rr->fields = fields;
+   rr->copy = NULL;
+   rotrec_unfreeze (copy);
+   return true;
+}
+
+// Gives a record copies of the fields it shares with the text it was
+// parsed from, so that it can outlive that text. A record left with only
+// some of them copied is still whole.
+static bool rotrec_detach (rotrec_t *rr)
+{
+   if (!rotrec_unshare (rr))
+      return false;
+
+   for (size_t i=0; i<rr->nfields; i++) {
+      if (!rr->fields[i] || !field_parsed (rr, rr->fields[i]))
+         continue;
+      char *field = mem_strdup (rr->fields[i]);
+      if (!field)
+         return false;
+      rr->fields[i] = field;
+   }
+   rr->text = NULL;
+   return true;
+}
+
+// Changes to a record are changes to the database it was added to
+static bool rec_write_lock (rotrec_t *rr)
+{
+   if (rr->frozen) {
+      XERROR ("A frozen record cannot be changed\n");
+      return false;
+   }
+
+   if (rr->owner)
+      db_write_lock (rr->owner);
+
+   if (!rotrec_unshare (rr)) {
+      XERROR ("Out of memory\n");
+      if (rr->owner)
+         db_write_unlock (rr->owner);
+      return false;
+   }
+   return true;
+}
+
+static void rec_write_unlock (rotrec_t *rr)
+{
+   if (rr->owner)
+      db_write_unlock (rr->owner);
+}
+
+// Reading a record needs the lock of its database, unless it is a frozen
+// copy, which nothing changes.
+static rotsit_t *rec_read_db (rotrec_t *rr)
+{
+   return rr->frozen ? NULL : rr->owner;
+}
+
+// Replaces a fixed field of a record, keeping the indexes of the database
+// the record lives in up to date. Takes ownership of value.
+static void rotrec_set (rotrec_t *rr, size_t field, char *value)
+{
+   rotsit_t *rs = rr->owner;
+   char *old = rr->fields[field];
+   size_t idx;
+
+   if (rs && field==RF_GUID) {
+      guididx_clear (&rs->guids);
+   }
+
+   if (rs && (idx = index_slot (date_fields, NUM_DATE_FIELDS,
+                                field))!=(size_t)-1) {
+      dateidx_clear (&rs->dates[idx]);
+   }
+
+   if (rs && (idx = index_slot (enum_fields, NUM_ENUM_FIELDS,
+                                field))!=(size_t)-1 && rs->enums[idx].built) {
+      struct enumidx_t *ei = &rs->enums[idx];
+      size_t nrecs = rs->records.len;
+
+      bitmap_clear (enumidx_bits (ei, old ? old : "", nrecs), rr->recnum);
+      bitmap_t *bits = enumidx_bits (ei, value ? value : "", nrecs);
+      if (bits) {
+         bitmap_set (bits, rr->recnum);
+      } else {
+         enumidx_clear (ei);
+      }
+   }
+
+   field_free (rr, old);
+   rr->fields[field] = value;
+}
+
+static int datekey_cmp (const void *p_lhs, const void *p_rhs)
+{
+   const struct datekey_t *lhs = p_lhs;
+   const struct datekey_t *rhs = p_rhs;
+
+   if (lhs->epoch != rhs->epoch)
+      return lhs->epoch < rhs->epoch ? -1 : 1;
+
+   if (lhs->recnum != rhs->recnum)
+      return lhs->recnum < rhs->recnum ? -1 : 1;
+
+   return 0;
+}
+
+static struct dateidx_t *dateidx_build (rotsit_t *rs, size_t field)
+{
+   size_t idx = index_slot (date_fields, NUM_DATE_FIELDS, field);
+   if (idx==(size_t)-1)
+      return NULL;
+
+   struct dateidx_t *di = &rs->dates[idx];
+   if (di->built)
+      return di;
+
+   size_t nrecs = rs->records.len;
+   di->keys = mem_alloc ((nrecs ? nrecs : 1) * sizeof *di->keys);
+   di->epochs = mem_calloc (nrecs ? nrecs : 1, sizeof *di->epochs);
+   di->valid = bitmap_new (nrecs);
+   if (!di->keys || !di->epochs || !di->valid) {
+      XERROR ("Out of memory\n");
+      dateidx_clear (di);
+      return NULL;
+   }
+   di->nkeys = 0;
+
+   for (size_t i=0; i<nrecs; i++) {
+      rotrec_t *rr = rs->records.items[i];
+      const char *value = rr->fields[field];
+      time_t epoch;
+
+      if (!value || !*value)
+         continue;
+
+      if (pdate_parse (value, &epoch, true)!=pdate_valid)
+         continue;
+
+      di->keys[di->nkeys].epoch = epoch;
+      di->keys[di->nkeys].recnum = i;
+      di->nkeys++;
+
+      di->epochs[i] = epoch;
+      bitmap_set (di->valid, i);
+   }
+
+   qsort (di->keys, di->nkeys, sizeof *di->keys, datekey_cmp);
+   __atomic_store_n (&di->built, true, __ATOMIC_RELEASE);
+   return di;
+}
+
+static struct dateidx_t *dateidx_get (rotsit_t *rs, size_t field)
+{
+   size_t idx = index_slot (date_fields, NUM_DATE_FIELDS, field);
+   if (idx!=(size_t)-1 &&
+       __atomic_load_n (&rs->dates[idx].built, __ATOMIC_ACQUIRE))
+      return &rs->dates[idx];
+
+   mem_owner_t caller;
+   db_mem_enter (rs, &caller);
+   mutex_lock (&rs->index_lock);
+   struct dateidx_t *ret = dateidx_build (rs, field);
+   mutex_unlock (&rs->index_lock);
+   mem_use (&caller);
+   return ret;
+}
+
+// Returns the position of the first key that is after epoch (strict) or
+// at/after epoch (!strict).
+static size_t dateidx_bound (struct dateidx_t *di, int64_t epoch, bool strict)
+{
+   size_t lo = 0,
+          hi = di->nkeys;
+
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      bool before = strict ? di->keys[mid].epoch <= epoch
+                           : di->keys[mid].epoch < epoch;
+      if (before) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return lo;
+}
+
+// The filter expression is turned into a tree that mirrors the way
+// eval_execute() applies the tokens: a bracket holds exactly one operator
+// and its two operands, and unbracketed chains apply right to left. Any
+// expression that does not fit this shape is left entirely to the
+// evaluator.
+typedef struct fnode_t fnode_t;
+struct fnode_t {
+   const char *op;      // NULL for operands
+   const char *token;   // NULL for operators
+   fnode_t *lhs;
+   fnode_t *rhs;
+
+   // Filled in by fnode_fold() and fnode_check()
+   char *folded;        // Owned value of a folded constant subexpression
+   size_t fnum;         // Field number of an operand, or (size_t)-1
+   ftype_t type;
+   bool typed;          // A literal has the shape of its type ...
+   int64_t number;      // ... and this is its value as that type
+
+   // Filled in by plan_compile()
+   bitmap_t *bits;      // Matches of a comparison answered by an index
+   struct kernel_t *kernel;
+   struct dateidx_t *di;   // Epochs of a date field
+};
+
+static void fnode_del (fnode_t *fn)
+{
+   if (!fn)
+      return;
+
+   fnode_del (fn->lhs);
+   fnode_del (fn->rhs);
+   mem_free (fn->folded);
+   bitmap_del (fn->bits);
+   mem_free (fn->kernel);
+   mem_free (fn);
+}
+
+static fnode_t *fnode_new (const char *op, const char *token,
+                           fnode_t *lhs, fnode_t *rhs)
+{
+   fnode_t *ret = mem_alloc (sizeof *ret);
+   if (!ret) {
+      fnode_del (lhs);
+      fnode_del (rhs);
+      return NULL;
+   }
+
+   memset (ret, 0, sizeof *ret);
+   ret->op = op;
+   ret->token = token;
+   ret->lhs = lhs;
+   ret->rhs = rhs;
+   ret->fnum = (size_t)-1;
+   return ret;
+}
+
+static fnode_t *fnode_parse_unit (char **tokens, size_t *idx)
+{
+   const char *tok = tokens[*idx];
+   if (!tok)
+      return NULL;
+
+   switch (check_type (tok)) {
+      case eval_OPERAND:   (*idx)++;
+                           return fnode_new (NULL, tok, NULL, NULL);
+
+      case eval_OPEN:      break;
+
+      default:             return NULL;
+   }
+
+   (*idx)++;
+   fnode_t *lhs = fnode_parse_unit (tokens, idx);
+   if (!lhs)
+      return NULL;
+
+   const char *op = tokens[*idx];
+   if (!op || check_type (op)!=eval_LOW_OPS) {
+      fnode_del (lhs);
+      return NULL;
+   }
+   (*idx)++;
+
+   fnode_t *rhs = fnode_parse_unit (tokens, idx);
+   if (!rhs || !tokens[*idx] || check_type (tokens[*idx])!=eval_CLOSE) {
+      fnode_del (lhs);
+      fnode_del (rhs);
+      return NULL;
+   }
+   (*idx)++;
+
+   return fnode_new (op, NULL, lhs, rhs);
+}
+
+static fnode_t *fnode_parse_chain (char **tokens, size_t *idx)
+{
+   fnode_t *lhs = fnode_parse_unit (tokens, idx);
+   if (!lhs || !tokens[*idx])
+      return lhs;
+
+   const char *op = tokens[*idx];
+   if (check_type (op)!=eval_LOW_OPS) {
+      fnode_del (lhs);
+      return NULL;
+   }
+   (*idx)++;
+
+   fnode_t *rhs = fnode_parse_chain (tokens, idx);
+   if (!rhs) {
+      fnode_del (lhs);
+      return NULL;
+   }
+
+   return fnode_new (op, NULL, lhs, rhs);
+}
+
+static fnode_t *fnode_parse (char **tokens)
+{
+   size_t idx = 0;
+   fnode_t *ret = fnode_parse_chain (tokens, &idx);
+   if (ret && tokens[idx]) {
+      fnode_del (ret);
+      ret = NULL;
+   }
+   return ret;
+}
+
+static bool fnode_literal (fnode_t *fn)
+{
+   return fn->token && field_lookup (fn->token)==(size_t)-1;
+}
+
+// Replaces every subexpression that does not refer to a field with its
+// value, so that it is computed once and not once per record.
+static bool fnode_fold (fnode_t *fn)
+{
+   if (!fn->op)
+      return true;
+
+   if (!fnode_fold (fn->lhs) || !fnode_fold (fn->rhs))
+      return false;
+
+   if (!fnode_literal (fn->lhs) || !fnode_literal (fn->rhs))
+      return true;
+
+   char *value = exec_op (fn->op, fn->lhs->token, fn->rhs->token);
+   if (!value) {
+      XERROR ("Out of memory\n");
+      return false;
+   }
+
+   fnode_del (fn->lhs);
+   fnode_del (fn->rhs);
+   fn->lhs = NULL;
+   fn->rhs = NULL;
+   fn->op = NULL;
+   fn->folded = value;
+   fn->token = value;
+   return true;
+}
+
+// The class a literal would be given by exec_op() when compared against
+// another value of the same class.
+static ftype_t literal_type (const char *token)
+{
+   int64_t hex;
+   time_t tv;
+
+   if (is_integer (token))
+      return ft_NUMBER;
+
+   if (is_hex (token, &hex))
+      return ft_HEX;
+
+   if (is_nonhex (token) && pdate_parse (token, &tv, true)==pdate_valid)
+      return ft_DATE;
+
+   return ft_STRING;
+}
+
+// A date must not read as a plain or hex number, or exec_int() would
+// compare it as one.
+static bool date_shaped (const char *s)
+{
+   return *s && strncmp (s, "0x", 2)!=0 && is_nonhex (s);
+}
+
+// Reads a value as the given type. Succeeds only when exec_int() would
+// read it the same way against another value of that type, which is also
+// what any value of a different shape is left to.
+static bool typed_value (ftype_t type, const char *s, int64_t *number)
+{
+   time_t tv;
+
+   switch (type) {
+      case ft_NUMBER:   if (!is_integer (s))
+                           return false;
+                        *number = strtoll (s, NULL, 10);
+                        return true;
+
+      case ft_HEX:      return !is_integer (s) && is_hex (s, number);
+
+      case ft_DATE:     if (!date_shaped (s) ||
+                            pdate_parse (s, &tv, true)!=pdate_valid)
+                           return false;
+                        *number = tv;
+                        return true;
+
+      case ft_STRING:   break;
+   }
+   return false;
+}
+
+static void fnode_operand (fnode_t *fn)
+{
+   fn->fnum = field_lookup (fn->token);
+   if (fn->fnum!=(size_t)-1) {
+      fn->type = field_type (fn->fnum);
+      return;
+   }
+
+   fn->type = literal_type (fn->token);
+   fn->typed = typed_value (fn->type, fn->token, &fn->number);
+}
+
+// Comparisons are only defined between operands of the same type, with
+// two exceptions for equality: a string field is matched as text against
+// any literal, and a guid field may be matched against part of a guid.
+// Strings have no ordering.
+static bool fnode_comparable (fnode_t *fn)
+{
+   bool ordering = *fn->op=='<' || *fn->op=='>';
+   fnode_t *lhs = fn->lhs,
+           *rhs = fn->rhs;
+
+   if (lhs->type==rhs->type)
+      return !(ordering && lhs->type==ft_STRING);
+
+   if (ordering)
+      return false;
+
+   if (rhs->fnum!=(size_t)-1) {
+      lhs = fn->rhs;
+      rhs = fn->lhs;
+   }
+
+   return lhs->fnum!=(size_t)-1 && fnode_literal (rhs) &&
+          (lhs->type==ft_STRING || lhs->type==ft_HEX);
+}
+
+// Resolves the type of every node, rejecting expressions whose operands
+// cannot be meaningfully combined. This is done once, before any record
+// is looked at.
+static bool fnode_check (fnode_t *fn)
+{
+   if (!fn->op) {
+      fnode_operand (fn);
+      return true;
+   }
+
+   if (!fnode_check (fn->lhs) || !fnode_check (fn->rhs))
+      return false;
+
+   ftype_t ltype = fn->lhs->type,
+           rtype = fn->rhs->type;
+
+   fn->type = ft_NUMBER;
+
+   switch (*fn->op) {
+      case '&':
+      case '|':   if (ltype==ft_NUMBER && rtype==ft_NUMBER)
+                     return true;
+                  break;
+
+      case '+':
+      case '-':   if (ltype==rtype && (ltype==ft_NUMBER || ltype==ft_HEX))
+                     return true;
+                  break;
+
+      default:    if (fnode_comparable (fn))
+                     return true;
+                  break;
+   }
+
+   XERROR ("Type error: cannot apply [%s] to %s [%s] and %s [%s]\n",
+           fn->op,
+           ftype_names[ltype], fn->lhs->token ? fn->lhs->token : "(...)",
+           ftype_names[rtype], fn->rhs->token ? fn->rhs->token : "(...)");
+   return false;
+}
+
+// The value of a node for one record. Operators only have a number.
+struct fval_t {
+   const char *text;    // NULL for the result of an operator
+   bool typed;          // number holds the value as the node's type
+   int64_t number;
+};
+
+// Whether a value reads as a plain number, and which.
+static bool fval_integer (fnode_t *fn, const struct fval_t *val,
+                          int64_t *number)
+{
+   if (val->text && !(val->typed && fn->type==ft_NUMBER))
+      return false;
+
+   *number = val->number;
+   return true;
+}
+
+// Operands of the same type that both have its shape are compared as
+// numbers; anything else is left to exec_int() as text.
+static int fnode_apply (fnode_t *fn, const struct fval_t *lhs,
+                        const struct fval_t *rhs)
+{
+   if (lhs->typed && rhs->typed && fn->lhs->type==fn->rhs->type)
+      return num_apply (fn->op, lhs->number, rhs->number);
+
+   char lbuf[24], rbuf[24];
+   if (!lhs->text) {
+      snprintf (lbuf, sizeof lbuf, "%" PRId64, lhs->number);
+   }
+   if (!rhs->text) {
+      snprintf (rbuf, sizeof rbuf, "%" PRId64, rhs->number);
+   }
+   return exec_int (fn->op, lhs->text ? lhs->text : lbuf,
+                    rhs->text ? rhs->text : rbuf);
+}
+
+// Evaluates a checked tree against a single record. Literals were read as
+// their type when the tree was checked and date fields come from the date
+// index, so per record only hex fields are parsed, once each, and only
+// strings and values not of their field's shape go through exec_int().
+static void fnode_value (fnode_t *fn, rotrec_t *rr, struct fval_t *val)
+{
+   if (!fn->op) {
+      if (fn->fnum==(size_t)-1) {
+         val->text = fn->token;
+         val->typed = fn->typed;
+         val->number = fn->number;
+         return;
+      }
+
+      const char *value = rr->fields[fn->fnum];
+      val->text = value ? value : "";
+      if (fn->di) {
+         val->typed = bitmap_test (fn->di->valid, rr->recnum) &&
+                      date_shaped (val->text);
+         val->number = fn->di->epochs[rr->recnum];
+      } else {
+         val->typed = typed_value (fn->type, val->text, &val->number);
+      }
+      return;
+   }
+
+   struct fval_t lhs, rhs;
+   int64_t truth;
+   fnode_value (fn->lhs, rr, &lhs);
+
+   // Both operands of a logical operator are numbers, so the rhs need not
+   // be computed when the lhs already decides the result.
+   if (fval_integer (fn->lhs, &lhs, &truth)) {
+      if ((*fn->op=='&' && !truth) || (*fn->op=='|' && truth)) {
+         val->text = NULL;
+         val->typed = true;
+         val->number = truth!=0;
+         return;
+      }
+   }
+
+   fnode_value (fn->rhs, rr, &rhs);
+   val->text = NULL;
+   val->typed = true;
+   val->number = fnode_apply (fn, &lhs, &rhs);
+}
+
+// A literal can only be answered from the date index when exec_op()
+// would compare it as a date against every record that has a parseable
+// date: it must parse, must not be a plain or hex number and must contain
+// a non-hex character.
+static bool date_literal (const char *token, int64_t *epoch)
+{
+   time_t tv;
+   int64_t hex;
+
+   if (field_lookup (token)!=(size_t)-1 || is_integer (token) ||
+       is_hex (token, &hex) || !is_nonhex (token)) {
+      return false;
+   }
+
+   if (pdate_parse (token, &tv, true)!=pdate_valid)
+      return false;
+
+   *epoch = tv;
+   return true;
+}
+
+// Matches a comparison between a field and a literal. On success returns
+// the field number and sets *literal, and sets *flipped if the literal was
+// on the left-hand side.
+static size_t fnode_field_cmp (fnode_t *fn, const char **literal,
+                               bool *flipped)
+{
+   if (!fn->op || (*fn->op!='<' && *fn->op!='>' &&
+                   *fn->op!='=' && *fn->op!='!')) {
+      return (size_t)-1;
+   }
+
+   if (!fn->lhs->token || !fn->rhs->token)
+      return (size_t)-1;
+
+   size_t lfield = field_lookup (fn->lhs->token);
+   size_t rfield = field_lookup (fn->rhs->token);
+
+   if (lfield!=(size_t)-1 && rfield==(size_t)-1) {
+      *literal = fn->rhs->token;
+      *flipped = false;
+      return lfield;
+   }
+
+   if (lfield==(size_t)-1 && rfield!=(size_t)-1) {
+      *literal = fn->lhs->token;
+      *flipped = true;
+      return rfield;
+   }
+
+   return (size_t)-1;
+}
+
+static bitmap_t *plan_range (rotsit_t *rs, fnode_t *fn)
+{
+   const char *op = fn->op;
+   const char *literal = NULL;
+   bool flipped = false;
+   int64_t epoch;
+
+   size_t field = fnode_field_cmp (fn, &literal, &flipped);
+   if (field==(size_t)-1 || (*op!='<' && *op!='>'))
+      return NULL;
+
+   if (!date_literal (literal, &epoch))
+      return NULL;
+
+   struct dateidx_t *di = dateidx_get (rs, field);
+   if (!di)
+      return NULL;
+
+   // Normalise to "field OP literal"
+   bool less = (*op=='<') != flipped;
+   bool inclusive = op[1]=='=';
+
+   size_t start = 0,
+          end = di->nkeys;
+   if (less) {
+      end = dateidx_bound (di, epoch, inclusive);
+   } else {
+      start = dateidx_bound (di, epoch, !inclusive);
+   }
+
+   bitmap_t *ret = bitmap_new (rs->records.len);
+   if (!ret) {
+      XERROR ("Out of memory\n");
+      return NULL;
+   }
+
+   for (size_t i=start; i<end; i++) {
+      bitmap_set (ret, di->keys[i].recnum);
+   }
+   return ret;
+}
+
+// Runs the comparison once for every distinct value of the field and
+// unites the bitmaps of the values that match. Because exec_op() itself
+// decides each value the result is exactly what a full scan would give.
+static bitmap_t *plan_enum (rotsit_t *rs, fnode_t *fn)
+{
+   const char *literal = NULL;
+   bool flipped = false;
+
+   size_t field = fnode_field_cmp (fn, &literal, &flipped);
+   if (field==(size_t)-1)
+      return NULL;
+
+   struct enumidx_t *ei = enumidx_get (rs, field);
+   if (!ei)
+      return NULL;
+
+   bitmap_t *ret = bitmap_new (rs->records.len);
+   if (!ret) {
+      XERROR ("Out of memory\n");
+      return NULL;
+   }
+
+   for (size_t i=0; i<ei->nvals; i++) {
+      const char *value = ei->vals[i].value;
+      char *result = flipped ? exec_op (fn->op, literal, value)
+                             : exec_op (fn->op, value, literal);
+      if (!result) {
+         XERROR ("Out of memory\n");
+         bitmap_del (ret);
+         return NULL;
+      }
+
+      if (strcmp (result, "1")==0) {
+         bitmap_or (ret, ei->vals[i].bits);
+      }
+      mem_free (result);
+   }
+   return ret;
+}
+
+// Comparison kernels for "field OP literal". The class of the literal is
+// decided once, when the kernel is compiled, and each kernel then reads
+// the record field directly instead of copying tokens into the evaluator.
+// Record values that do not have the shape the kernel expects are handed
+// to exec_op() so that the result is always what the evaluator would give.
+typedef struct kernel_t kernel_t;
+typedef bool (kernel_fn_t) (const kernel_t *k, rotrec_t *rr);
+
+// Filters are evaluated a block of records at a time, one operator at a
+// time, with the records still in play held in a bitmask for the block.
+#define BLOCK_RECORDS      (1024)
+#define BLOCK_WORDS        (BLOCK_RECORDS / 64)
+
+struct kernel_t {
+   kernel_fn_t *fn;
+   size_t field;
+   const char *op;         // Normalised to "field OP literal"
+   const char *literal;
+   bool flipped;
+   int64_t number;
+   struct dateidx_t *di;
+};
+
+static const char *kernel_value (const kernel_t *k, rotrec_t *rr)
+{
+   const char *value = rr->fields[k->field];
+   return value ? value : "";
+}
+
+static bool kernel_generic (const kernel_t *k, rotrec_t *rr)
+{
+   const char *value = kernel_value (k, rr);
+   char *result = k->flipped ? exec_op (k->op, k->literal, value)
+                             : exec_op (k->op, value, k->literal);
+   bool ret = result && strcmp (result, "1")==0;
+   mem_free (result);
+   return ret;
+}
+
+// The literal is neither a number nor a date, so exec_op() compares every
+// record value as a string.
+static bool kernel_string (const kernel_t *k, rotrec_t *rr)
+{
+   const char *value = kernel_value (k, rr);
+   return k->flipped ? str_compare (k->op, k->literal, value)
+                     : str_compare (k->op, value, k->literal);
+}
+
+static bool kernel_hex (const kernel_t *k, rotrec_t *rr)
+{
+   int64_t value;
+   if (!is_hex (kernel_value (k, rr), &value))
+      return kernel_generic (k, rr);
+
+   return k->flipped ? num_compare (k->op, k->number, value)
+                     : num_compare (k->op, value, k->number);
+}
+
+static bool kernel_date (const kernel_t *k, rotrec_t *rr)
+{
+   if (!bitmap_test (k->di->valid, rr->recnum))
+      return kernel_generic (k, rr);
+
+   int64_t value = k->di->epochs[rr->recnum];
+   return k->flipped ? num_compare (k->op, k->number, value)
+                     : num_compare (k->op, value, k->number);
+}
+
+static bool kernel_compile (rotsit_t *rs, fnode_t *fn, kernel_t *k)
+{
+   time_t tv;
+
+   memset (k, 0, sizeof *k);
+   k->field = fnode_field_cmp (fn, &k->literal, &k->flipped);
+   if (k->field==(size_t)-1)
+      return false;
+
+   k->op = fn->op;
+   k->fn = kernel_generic;
+
+   if (is_integer (k->literal))
+      return true;
+
+   if (is_hex (k->literal, &k->number)) {
+      k->fn = kernel_hex;
+      return true;
+   }
+
+   if (pdate_parse (k->literal, &tv, true)!=pdate_valid) {
+      k->fn = kernel_string;
+      return true;
+   }
+
+   if (is_nonhex (k->literal) && (k->di = dateidx_get (rs, k->field))) {
+      k->number = tv;
+      k->fn = kernel_date;
+   }
+   return true;
+}
+
+// The date kernel over a block is a straight loop over the epoch column
+// with the operator hoisted out of it, which the compiler can vectorise.
+#define DATE_LOOP(cond)                                                 \
+   for (size_t i=0; i<n; i++) {                                         \
+      int64_t v = epochs[i];                                            \
+      mask[i / 64] |= ((uint64_t)(cond)) << (i % 64);                   \
+   }
+
+static void kernel_date_block (const kernel_t *k, size_t base, size_t n,
+                               uint64_t *mask)
+{
+   const int64_t *epochs = &k->di->epochs[base];
+   int64_t x = k->number;
+   char op = *k->op;
+   bool eq = k->op[1]=='=';
+
+   // Normalise to "value OP literal"
+   if (k->flipped && op=='<') {
+      op = '>';
+   } else if (k->flipped && op=='>') {
+      op = '<';
+   }
+
+   switch (op) {
+      case '<':   if (eq) {
+                     DATE_LOOP (v <= x);
+                  } else {
+                     DATE_LOOP (v < x);
+                  }
+                  break;
+      case '>':   if (eq) {
+                     DATE_LOOP (v >= x);
+                  } else {
+                     DATE_LOOP (v > x);
+                  }
+                  break;
+      case '=':   DATE_LOOP (v == x); break;
+      case '!':   DATE_LOOP (v != x); break;
+   }
+}
+
+#undef DATE_LOOP
+
+// Runs a kernel over the selected records of a block. Date kernels
+// compare the whole block at once and only fall back to a record at a
+// time for the selected records that have no valid date.
+static void kernel_block (const kernel_t *k, rotsit_t *rs, size_t base,
+                          size_t n, const uint64_t *sel, uint64_t *out)
+{
+   size_t nwords = (n + 63) / 64;
+   uint64_t rest[BLOCK_WORDS];
+
+   memcpy (rest, sel, nwords * sizeof *rest);
+   memset (out, 0, nwords * sizeof *out);
+
+   if (k->fn==kernel_date) {
+      kernel_date_block (k, base, n, out);
+      for (size_t w=0; w<nwords; w++) {
+         uint64_t valid = bitmap_word (k->di->valid, base / 64 + w);
+         out[w] &= sel[w] & valid;
+         rest[w] = sel[w] & ~valid;
+      }
+   }
+
+   for (size_t w=0; w<nwords; w++) {
+      for (uint64_t bits=rest[w]; bits; bits &= bits - 1) {
+         size_t i = w * 64 + __builtin_ctzll (bits);
+         rotrec_t *rr = rs->records.items[base + i];
+         if (k->fn (k, rr))
+            out[w] |= ((uint64_t)1) << (i % 64);
+      }
+   }
+}
+
+// A comparison left to fnode_value() reads its date fields from the date
+// index instead of parsing them for every record.
+static void plan_dates (rotsit_t *rs, fnode_t *fn)
+{
+   if (fn->op) {
+      plan_dates (rs, fn->lhs);
+      plan_dates (rs, fn->rhs);
+   } else if (fn->fnum!=(size_t)-1 && fn->type==ft_DATE) {
+      fn->di = dateidx_get (rs, fn->fnum);
+   }
+}
+
+// Decides, once per filter, how each comparison in the tree will be
+// answered: from an index, with a kernel or, for everything else, by
+// walking the tree for each record.
+static bool plan_compile (rotsit_t *rs, fnode_t *fn)
+{
+   if (!fn->op)
+      return true;
+
+   if (*fn->op=='&' || *fn->op=='|')
+      return plan_compile (rs, fn->lhs) && plan_compile (rs, fn->rhs);
+
+   if ((fn->bits = plan_range (rs, fn)) || (fn->bits = plan_enum (rs, fn)))
+      return true;
+
+   kernel_t k;
+   if (kernel_compile (rs, fn, &k)) {
+      if (!(fn->kernel = mem_alloc (sizeof *fn->kernel))) {
+         XERROR ("Out of memory\n");
+         return false;
+      }
+      *fn->kernel = k;
+   } else {
+      plan_dates (rs, fn);
+   }
+   return true;
+}
+
+// Evaluates the node for the records in 'sel' of the block of n records
+// starting at 'base', setting the bits of the matching records in 'out'.
+// Under & and | a record matches when the node is non-zero, at the top of
+// the tree only when it is 1, just as with the evaluator.
+static void block_eval (rotsit_t *rs, fnode_t *fn, size_t base, size_t n,
+                        const uint64_t *sel, uint64_t *out, bool top)
+{
+   size_t nwords = (n + 63) / 64;
+   uint64_t rsel[BLOCK_WORDS];
+   uint64_t tmp[BLOCK_WORDS];
+
+   if (fn->op && (*fn->op=='&' || *fn->op=='|')) {
+      block_eval (rs, fn->lhs, base, n, sel, out, false);
+
+      // The rhs of an AND is only looked at for the records the lhs kept,
+      // the rhs of an OR only for those the lhs did not.
+      for (size_t w=0; w<nwords; w++) {
+         rsel[w] = *fn->op=='&' ? out[w] : sel[w] & ~out[w];
+      }
+      block_eval (rs, fn->rhs, base, n, rsel, tmp, false);
+
+      for (size_t w=0; w<nwords; w++) {
+         out[w] = *fn->op=='&' ? tmp[w] : out[w] | tmp[w];
+      }
+      return;
+   }
+
+   if (fn->bits) {
+      for (size_t w=0; w<nwords; w++) {
+         out[w] = sel[w] & bitmap_word (fn->bits, base / 64 + w);
+      }
+      return;
+   }
+
+   // Records decided by an index are not counted as scanned
+   for (size_t w=0; w<nwords; w++) {
+      stats_add (&rs->stats.records_scanned, __builtin_popcountll (sel[w]));
+   }
+
+   if (fn->kernel) {
+      kernel_block (fn->kernel, rs, base, n, sel, out);
+      return;
+   }
+
+   memset (out, 0, nwords * sizeof *out);
+   for (size_t w=0; w<nwords; w++) {
+      for (uint64_t bits=sel[w]; bits; bits &= bits - 1) {
+         size_t i = w * 64 + __builtin_ctzll (bits);
+         struct fval_t val;
+         int iresult = -1;
+         bool match;
+
+         fnode_value (fn, rs->records.items[base + i], &val);
+         if (!val.text) {
+            match = top ? val.number==1 : val.number!=0;
+         } else if (top) {
+            match = sscanf (val.text, "%i", &iresult)==1 && iresult==1;
+         } else {
+            match = strtoll (val.text, NULL, 10)!=0;
+         }
+
+         if (match)
+            out[w] |= ((uint64_t)1) << (i % 64);
+      }
+   }
+}
+
+void rotrec_del (rotrec_t *rec)
+{
+   if (!rec)
+      return;
+
+   // The fields belong to the frozen copy once there is one
+   if (rec->copy) {
+      rotrec_unfreeze (rec->copy);
+      mem_free (rec);
+      return;
+   }
+
+   for (size_t i=0; i<rec->nfields; i++) {
+      field_free (rec, rec->fields[i]);
+   }
+   mem_free (rec->fields);
+   mem_free (rec);
+}
+
+// Makes room for at least 'count' more fields. Capacity is doubled so that
+// appending a comment at a time costs amortised O(1).
+static bool rotrec_reserve (rotrec_t *rr, size_t count)
+{
+   if (rr->nfields + count <= rr->maxfields)
+      return true;
+
+   size_t newmax = rr->maxfields ? rr->maxfields : 16;
+   while (newmax < rr->nfields + count) {
+      newmax *= 2;
+   }
+
+   char **tmp = mem_realloc (rr->fields, newmax * sizeof *tmp);
+   if (!tmp)
+      return false;
+
+   rr->fields = tmp;
+   rr->maxfields = newmax;
+   return true;
+}
+
+// Takes ownership of the strings in fields, but not of the array itself.
+static rotrec_t *new_rotrec (char **fields, size_t nfields)
+{
+   rotrec_t *ret = mem_alloc (sizeof *ret);
+   if (!ret) {
+      return NULL;
+   }
+   memset (ret, 0, sizeof *ret);
+
+   if (!rotrec_reserve (ret, nfields)) {
+      mem_free (ret);
+      return NULL;
+   }
+
+   memcpy (ret->fields, fields, nfields * sizeof *fields);
+   ret->nfields = nfields;
+   return ret;
+}
+
+// Keeps track of the highest order in the database as records are read
+// or added, so that the next order does not have to be searched for.
+static void order_seen (rotsit_t *rs, rotrec_t *rr)
+{
+   uint32_t order;
+
+   if (rr->nfields <= RF_ORDER)
+      return;
+
+   const char *field = rr->fields[RF_ORDER];
+   if (field && sscanf (field, "%x", &order)==1 && order >= rs->order_next) {
+      rs->order_next = order + 1;
+   }
+}
+
+// Grows a scratch array of field pointers to hold at least n.
+static bool fields_reserve (char ***fields, size_t *maxfields, size_t n)
+{
+   if (n <= *maxfields)
+      return true;
+
+   size_t newmax = *maxfields ? *maxfields : 32;
+   while (newmax < n) {
+      newmax *= 2;
+   }
+
+   char **tmp = mem_realloc (*fields, newmax * sizeof *tmp);
+   if (!tmp)
+      return false;
+
+   *fields = tmp;
+   *maxfields = newmax;
+   return true;
+}
+
+// Splits a record, which ends where its record delimiter started, in
+// place: every field is terminated where its delimiter starts and fields
+// is left pointing at them. Text after the last field delimiter is
+// ignored. Returns the number of fields, or (size_t)-1 when out of memory.
+static size_t split_record (char *rec_str, char ***fields, size_t *maxfields)
+{
+   size_t flen = strlen (FIELD_DELIM);
+   size_t nfields = 0;
+
+   char *field = rec_str;
+   char *field_end;
+   while ((field_end = strstr (field, FIELD_DELIM))) {
+      if (!fields_reserve (fields, maxfields, nfields + 1))
+         return (size_t)-1;
+
+      *field_end = 0;
+      (*fields)[nfields++] = field;
+      field = &field_end[flen];
+   }
+   return nfields;
+}
+
+// Splits the text in place, leaving the fields of each record pointing
+// into it. Text after the last delimiter is ignored, as is a record
+// without any complete field.
+static bool parse_records (rotsit_t *rs)
+{
+   bool error = true;
+   char **fields = NULL;
+   size_t maxfields = 0;
+   size_t rlen = strlen (RECORD_DELIM);
+
+   char *rec_str = rs->text ? rs->text->buf : NULL;
+   char *rec_end;
+   while (rec_str && (rec_end = strstr (rec_str, RECORD_DELIM))) {
+      *rec_end = 0;
+
+      size_t nfields = split_record (rec_str, &fields, &maxfields);
+      if (nfields==(size_t)-1) {
+         XERROR ("Out of memory\n");
+         goto errorexit;
+      }
+
+      size_t recnum = rs->records.len;
+      if (!nfields) {
+         XERROR ("Failure parsing record [%zu]\n", recnum);
+         goto errorexit;
+      }
+
+      rotrec_t *rec = new_rotrec (fields, nfields);
+      if (!rec) {
+         XERROR ("Out of memory failure\n");
+         goto errorexit;
+      }
+      rec->owner = rs;
+      rec->text = rs->text;
+      rec->recnum = recnum;
+      order_seen (rs, rec);
+
+      if (!memvec_push (&rs->records, rec)) {
+         XERROR ("Failed to store record\n");
+         rotrec_del (rec);
+         goto errorexit;
+      }
+
+      rs->stats.records_parsed++;
+      rec_str = &rec_end[rlen];
+   }
+
+   error = false;
+errorexit:
+   mem_free (fields);
+   return !error;
+}
+
+// An empty database holding its own copy of the text in input_buf.
+static rotsit_t *rotsit_alloc (const char *input_buf)
+{
+   rotsit_t *ret = mem_alloc (sizeof *ret);
+   if (!ret) {
+      XERROR ("Out of memory\n");
+      return NULL;
+   }
+   memset (ret, 0, sizeof *ret);
+   mem_capture (&ret->mem);
+
+   if (!db_lock_init (ret)) {
+      XERROR ("Unable to create the database lock\n");
+      mem_free (ret);
+      return NULL;
+   }
+
+   if (input_buf && !(ret->text = text_new (input_buf))) {
+      XERROR ("Out of memory\n");
+      db_lock_destroy (ret);
+      mem_free (ret);
+      return NULL;
+   }
+   return ret;
+}
+
+rotsit_t *rotsit_parse (char *input_buf)
+{
+   rotsit_t *ret = rotsit_alloc (input_buf);
+
+   if (ret && !parse_records (ret)) {
+      rotsit_del (ret);
+      ret = NULL;
+   }
+   if (ret && ret->text) {
+      ret->stats.bytes_parsed += ret->text->len;
+   }
+   return ret;
+}
+
+bool rotsit_load_archive (rotsit_t *rs, char *input_buf)
+{
+   if (!rs)
+      return false;
+
+   if (rs->frozen) {
+      XERROR ("A frozen database cannot be changed\n");
+      return false;
+   }
+
+   // Parsed straight into the allocator of rs, which takes its records
+   mem_owner_t caller;
+   db_mem_enter (rs, &caller);
+   rotsit_t *archive = rotsit_parse (input_buf);
+   if (!archive) {
+      mem_use (&caller);
+      return false;
+   }
+
+   db_write_lock (rs);
+   if (rs->archive_loaded) {
+      db_write_unlock (rs);
+      rotsit_del (archive);
+      mem_use (&caller);
+      return false;
+   }
+
+   // The archived records keep pointing into the text of the archive,
+   // which now belongs to rs.
+   rs->archive = archive->text;
+   archive->text = NULL;
+   rs->archive_loaded = true;
+   rs->stats.records_parsed += archive->stats.records_parsed;
+   rs->stats.bytes_parsed += archive->stats.bytes_parsed;
+
+   bool error = false;
+   for (size_t i=0; i<archive->records.len; i++) {
+      rotrec_t *rr = archive->records.items[i];
+      rr->owner = rs;
+      rr->archived = true;
+      if (error || !memvec_push (&rs->records, rr)) {
+         rotrec_del (rr);
+         error = true;
+         continue;
+      }
+      rr->recnum = rs->records.len - 1;
+      order_seen (rs, rr);
+   }
+   if (error) {
+      XERROR ("Failed to store archived records\n");
+   }
+
+   // Every record has been moved or deleted
+   memvec_free (&archive->records);
+   rotsit_del (archive);
+
+   index_invalidate (rs);
+   db_write_unlock (rs);
+   mem_use (&caller);
+   return !error;
+}
+
+bool rotsit_get_stats (rotsit_t *rs, rotsit_stats_t *dst)
+{
+   if (!rs || !dst)
+      return false;
+
+   // The stats are nothing but counters, some of which readers update
+   const uint64_t *src = (const uint64_t *)&rs->stats;
+   uint64_t *copy = (uint64_t *)dst;
+   for (size_t i=0; i<sizeof *dst/sizeof *copy; i++) {
+      copy[i] = __atomic_load_n (&src[i], __ATOMIC_RELAXED);
+   }
+   return true;
+}
+
+bool rotsit_archive_loaded (rotsit_t *rs)
+{
+   if (!rs)
+      return false;
+
+   db_read_lock (rs);
+   bool ret = rs->archive_loaded;
+   db_read_unlock (rs);
+   return ret;
+}
+
+void rotsit_del (rotsit_t *rs)
+{
+   if (!rs)
+      return;
+
+   // A frozen database is deleted once by each of its holders
+   if (rs->frozen && __atomic_sub_fetch (&rs->refs, 1, __ATOMIC_ACQ_REL))
+      return;
+
+   mem_owner_t caller;
+   db_mem_enter (rs, &caller);
+   rotsit_del (rs->current);
+   rotsit_del (rs->last);
+   index_invalidate (rs);
+   for (size_t i=0; i<rs->records.len; i++) {
+      if (rs->frozen) {
+         rotrec_unfreeze (rs->records.items[i]);
+      } else {
+         rotrec_del (rs->records.items[i]);
+      }
+   }
+   memvec_free (&rs->records);
+   text_release (rs->text);
+   text_release (rs->archive);
+   db_lock_destroy (rs);
+   mem_free (rs);
+   mem_use (&caller);
+}
+
+const char *rotrec_get_field (rotrec_t *rr, size_t field)
+{
+   if (!rr || field > RF_LAST_FIELD) {
+      return "";
+   }
+
+   rotsit_t *rs = rec_read_db (rr);
+   if (rs)
+      db_read_lock (rs);
+   const char *ret = rr->fields[field];
+   if (rs)
+      db_read_unlock (rs);
+   return ret;
+}
+
+void rotsit_dump (rotsit_t *rs, const char *id, FILE *outf)
+{
+   if (!outf)
+      outf = stdout;
+
+   if (!rs) {
+      fprintf (outf, "Passed a NULL rotsit_t data object\n");
+      return;
+   }
+
+   db_read_lock (rs);
+   fprintf (outf, "Data [%s] has [%zu] records\n", id,
+                                                  rs->records.len);
+
+   for (size_t i=0; i<rs->records.len; i++) {
+
+      rotrec_t *rr = rs->records.items[i];
+      fprintf (outf, "[(%s):%zu] ", id, i);
+
+      for (size_t j=0; j<rr->nfields; j++) {
+         fprintf (outf, "(%s)", rr->fields[j]);
+      }
+      fprintf (outf, "\n");
+   }
+   db_read_unlock (rs);
+}
+
+// The number of bytes written is added to *written, if given
+static bool write_list (rotrec_t **records, size_t nrecords, FILE *outf,
+                        uint64_t *written)
+{
+   bool error = true;
+   char *buf = NULL;
+   size_t len = 0;
+   size_t fdlen = strlen (FIELD_DELIM),
+          rdlen = strlen (RECORD_DELIM);
+
+   // The exact size of the output is worked out first so that the whole
+   // database is built in one buffer and written with a single call.
+   for (size_t i=0; i<nrecords; i++) {
+      rotrec_t *rec = records[i];
+      for (size_t j=0; j<rec->nfields; j++) {
+         char *field = rec->fields[j];
+         len += (field ? strlen (field) : 0) + fdlen;
+      }
+      len += rdlen;
+   }
+
+   if (!len)
+      return true;
+
+   if (!(buf = mem_alloc (len))) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
+
+   char *dst = buf;
+   for (size_t i=0; i<nrecords; i++) {
+      rotrec_t *rec = records[i];
+      for (size_t j=0; j<rec->nfields; j++) {
+         char *field = rec->fields[j];
+         if (field) {
+            size_t flen = strlen (field);
+            memcpy (dst, field, flen);
+            dst += flen;
+         }
+         memcpy (dst, FIELD_DELIM, fdlen);
+         dst += fdlen;
+      }
+      memcpy (dst, RECORD_DELIM, rdlen);
+      dst += rdlen;
+   }
+
+   if (fwrite (buf, 1, len, outf)!=len) {
+      XERROR ("Failed to write database: %m\n");
+      goto errorexit;
+   }
+   if (written) {
+      stats_add (written, len);
+   }
+
+   error = false;
+errorexit:
+   mem_free (buf);
+   return !error;
+}
+
+// Writes either the records that are archived or the ones that are not.
+static bool write_records (rotsit_t *rs, FILE *outf, bool archived)
+{
+   if (!rs || !outf)
+      return false;
+
+   bool ret = false;
+   size_t nrecords = 0;
+
+   db_read_lock (rs);
+   if (archived && !rs->archive_loaded) {
+      XERROR ("The archive must be loaded before it is written\n");
+      goto errorexit;
+   }
+
+   rotrec_t **records = mem_alloc ((rs->records.len + 1) *
+                                   sizeof *records);
+   if (!records) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<rs->records.len; i++) {
+      rotrec_t *rec = rs->records.items[i];
+      if (rec->archived==archived)
+         records[nrecords++] = rec;
+   }
+
+   ret = write_list (records, nrecords, outf, &rs->stats.bytes_written);
+   mem_free (records);
+
+errorexit:
+   db_read_unlock (rs);
+   return ret;
+}
+
+bool rotsit_write (rotsit_t *rs, FILE *outf)
+{
+   return write_records (rs, outf, false);
+}
+
+bool rotsit_write_archive (rotsit_t *rs, FILE *outf)
+{
+   return write_records (rs, outf, true);
+}
+
+uint32_t rotsit_count_records (rotsit_t *rs)
+{
+   if (!rs)
+      return 0;
+
+   db_read_lock (rs);
+   uint32_t ret = rs->records.len;
+   db_read_unlock (rs);
+   return ret;
+}
+
+rotrec_t *rotsit_get_record (rotsit_t *rs, uint32_t recnum)
+{
+   if (!rs)
+      return NULL;
+
+   db_read_lock (rs);
+   rotrec_t *ret = recnum < rs->records.len ? rs->records.items[recnum]
+                                            : NULL;
+   db_read_unlock (rs);
+   return ret;
+}
+
+void lower_string (char *src)
+{
+   for (size_t i=0; src[i]; i++) {
+      src[i] = tolower (src[i]);
+   }
+}
+
+#if 0    // Will come in handy when I add in case-insensitive matching
+static bool istrcmp (const char *lhs, const char *rhs)
+{
+   if (!lhs && rhs)
+      return false;
+
+   if (lhs && !rhs)
+      return false;
+
+   while (*lhs && *rhs && (tolower (*lhs++) == tolower (*rhs++)))
+      ;
+
+   return *lhs == *rhs;
+}
+#endif
+
+// Returns the bitmap of all the records that match expr. Expressions that
+// fit the tree are evaluated a block of records at a time, with the
+// indexes and kernels answering the comparisons. Anything else is run
+// through the evaluator one record at a time.
+static bitmap_t *filter_matches (rotsit_t *rs, const char *expr)
+{
+   bool error = true;
+   char **ltokens = NULL;
+   fnode_t *tree = NULL;
+   bitmap_t *matches = NULL;
+
+   eval_t *ev = eval_new ( (void *(*) (const void *))mem_strdup,
+                           (void (*) (void *))mem_free,
+                           exec_op, check_type);
+
+   char **tokens = make_tokens (expr);
+   uint32_t num_records = 0;
+
+   if (!rs) {
+      XERROR ("Passed a NULL rotsit database.\n");
+      goto errorexit;
+   }
+
+   if (!expr || !*expr) {
+      XERROR ("Expression is empty.\n");
+      goto errorexit;
+   }
+
+   num_records = rs->records.len;
+   if (!num_records) {
+      XERROR ("Database is empty, cowardly refusing to search it.\n");
+      goto errorexit;
+   }
+
+   if (!ev) {
+      XERROR ("Failed to create expression execution context.\n");
+      goto errorexit;
+   }
+
+   if (!tokens) {
+      XERROR ("Failed to tokenise input expression.\n");
+      goto errorexit;
+   }
+
+   for (size_t i=0; tokens[i]; i++) {
+      xstr_trim (tokens[i]);
+   }
+
+   matches = bitmap_new (num_records);
+   if (!matches) {
+      XERROR ("Out of memory error.\n");
+      goto errorexit;
+   }
+   stats_add (&rs->stats.filters, 1);
+
+   // Expressions that fit the tree are folded and type checked up front;
+   // anything else is left to the evaluator exactly as it is written.
+   tree = fnode_parse (tokens);
+   if (tree) {
+      if (!fnode_fold (tree) || !fnode_check (tree)) {
+         XERROR ("Invalid expression [%s]\n", expr);
+         goto errorexit;
+      }
+
+      if (tree->type!=ft_NUMBER) {
+         XERROR ("Expression [%s] is not a comparison\n", expr);
+         goto errorexit;
+      }
+
+      if (!plan_compile (rs, tree)) {
+         XERROR ("Failed to plan expression [%s]\n", expr);
+         goto errorexit;
+      }
+
+      for (size_t base=0; base<num_records; base += BLOCK_RECORDS) {
+         uint64_t sel[BLOCK_WORDS];
+         uint64_t out[BLOCK_WORDS];
+         size_t n = num_records - base;
+         if (n > BLOCK_RECORDS)
+            n = BLOCK_RECORDS;
+
+         size_t nwords = (n + 63) / 64;
+         for (size_t w=0; w<nwords; w++) {
+            size_t nbits = n - w * 64;
+            sel[w] = nbits >= 64 ? ~(uint64_t)0
+                                 : (((uint64_t)1) << nbits) - 1;
+         }
+
+         block_eval (rs, tree, base, n, sel, out, true);
+
+         for (size_t w=0; w<nwords; w++) {
+            bitmap_set_word (matches, base / 64 + w, out[w]);
+         }
+      }
+
+      error = false;
+      goto errorexit;
+   }
+
+   bitmap_fill (matches);
+   stats_add (&rs->stats.records_scanned, num_records);
+   for (uint32_t i=0; i<num_records; i++) {
+      int iresult = -1;
+      rotrec_t *rr = rs->records.items[i];
+
+      ltokens = mem_cpyarray ((const char **)tokens);
+      if (!fsubst (ltokens, rr)) {
+         XERROR ("Error during variable substitution.\n");
+         goto errorexit;
+      }
+
+      char *sresult = eval_execute (ev, (const void **)ltokens);
+      if (!sresult) {
+         XERROR ("Internal error during expression evaluation.\n");
+         for (size_t i=0; ltokens[i]; i++) {
+            XERROR ("Token %zu: [%s]\n", i, ltokens[i]);
+         }
+
+         goto errorexit;
+      }
+
+      sscanf (sresult, "%i", &iresult);
+      mem_free (sresult);
+
+      if (iresult!=1) {
+         bitmap_clear (matches, i);
+      }
+
+      mem_delarray (ltokens); ltokens = NULL;
+   }
+
+   error = false;
+
+errorexit:
+   if (error) {
+      bitmap_del (matches);
+      matches = NULL;
+   }
+
+   eval_del (ev);
+   fnode_del (tree);
+   mem_delarray (tokens);
+   mem_delarray (ltokens);
+
+   return matches;
+}
+
+rotrec_t **rotsit_filter (rotsit_t *rs, const char *expr)
+{
+   rotrec_t **ret = NULL;
+
+   if (!rs) {
+      XERROR ("Passed a NULL rotsit database.\n");
+      return NULL;
+   }
+
+   db_read_lock (rs);
+   bitmap_t *matches = filter_matches (rs, expr);
+   if (!matches)
+      goto errorexit;
+
+   size_t nmatches = bitmap_count (matches);
+   stats_add (&rs->stats.records_matched, nmatches);
+
+   ret = mem_alloc ((nmatches + 1) * sizeof *ret);
+   if (!ret) {
+      XERROR ("Out of memory error.\n");
+      goto errorexit;
+   }
+
+   size_t n = 0;
+   for (size_t i=bitmap_next (matches, 0);
+        i!=BITMAP_NONE;
+        i=bitmap_next (matches, i + 1)) {
+      ret[n++] = rs->records.items[i];
+   }
+   ret[n] = NULL;
+
+   if (!ret[0]) {
+      XERROR ("Warning: filter [%s] matched no records\n", expr);
+   }
+
+errorexit:
+   db_read_unlock (rs);
+   bitmap_del (matches);
+   return ret;
+}
+
+uint32_t rotsit_filter_count (rotsit_t *rs, const char *expr)
+{
+   if (!rs) {
+      XERROR ("Passed a NULL rotsit database.\n");
+      return 0;
+   }
+
+   db_read_lock (rs);
+   bitmap_t *matches = filter_matches (rs, expr);
+   uint32_t ret = bitmap_count (matches);
+   if (matches) {
+      stats_add (&rs->stats.records_matched, ret);
+   }
+   db_read_unlock (rs);
+   bitmap_del (matches);
+   return ret;
+}
+
+// Evaluates a tree as far as it can for a record of which only one field
+// is known, returning false where the result depends on the other fields.
+// Either operand alone can decide a logical operator.
+static bool fnode_partial (fnode_t *fn, size_t field, const char *value,
+                           struct fval_t *val)
+{
+   if (!fn->op) {
+      fnode_operand (fn);
+      if (fn->fnum==(size_t)-1) {
+         val->text = fn->token;
+         val->typed = fn->typed;
+         val->number = fn->number;
+         return true;
+      }
+      if (fn->fnum!=field)
+         return false;
+
+      val->text = value;
+      val->typed = typed_value (fn->type, value, &val->number);
+      return true;
+   }
+
+   struct fval_t lhs, rhs;
+   bool lknown = fnode_partial (fn->lhs, field, value, &lhs);
+   bool rknown = fnode_partial (fn->rhs, field, value, &rhs);
+   int64_t truth;
+
+   if (*fn->op=='&' || *fn->op=='|') {
+      bool decides = *fn->op=='|';
+      if ((lknown && fval_integer (fn->lhs, &lhs, &truth) &&
+           (truth!=0)==decides) ||
+          (rknown && fval_integer (fn->rhs, &rhs, &truth) &&
+           (truth!=0)==decides)) {
+         val->text = NULL;
+         val->typed = true;
+         val->number = decides;
+         return true;
+      }
+   }
+
+   if (!lknown || !rknown)
+      return false;
+
+   val->text = NULL;
+   val->typed = true;
+   val->number = fnode_apply (fn, &lhs, &rhs);
+   return true;
+}
+
+bool rotsit_filter_may_match (const char *expr, size_t field,
+                              const char *value)
+{
+   bool ret = true;
+   fnode_t *tree = NULL;
+   char **tokens = expr && value ? make_tokens (expr) : NULL;
+
+   if (!tokens)
+      return true;
+
+   for (size_t i=0; tokens[i]; i++) {
+      xstr_trim (tokens[i]);
+   }
+
+   if ((tree = fnode_parse (tokens))) {
+      struct fval_t val;
+      int64_t result;
+      ret = !fnode_partial (tree, field, value, &val) ||
+            !fval_integer (tree, &val, &result) || result!=0;
+   }
+
+   fnode_del (tree);
+   mem_delarray (tokens);
+   return ret;
+}
+
+// Only GUIDs that are plain hex numbers of at most 64 bits are indexed;
+// anything else is counted so that a lookup knows to fall back to a scan.
+static bool guid_value (const char *guid, uint64_t *value)
+{
+   if (!guid || !isxdigit ((unsigned char)*guid))
+      return false;
+
+   char *end;
+   unsigned long long tmp = strtoull (guid, &end, 16);
+   if (*end || (tmp==ULLONG_MAX && errno==ERANGE))
+      return false;
+
+   *value = tmp;
+   return true;
+}
+
+static int guidkey_cmp (const void *p_lhs, const void *p_rhs)
+{
+   const struct guidkey_t *lhs = p_lhs;
+   const struct guidkey_t *rhs = p_rhs;
+
+   if (lhs->guid != rhs->guid)
+      return lhs->guid < rhs->guid ? -1 : 1;
+
+   if (lhs->recnum != rhs->recnum)
+      return lhs->recnum < rhs->recnum ? -1 : 1;
+
+   return 0;
+}
+
+static struct guididx_t *guididx_build (rotsit_t *rs)
+{
+   struct guididx_t *gi = &rs->guids;
+   if (gi->built)
+      return gi;
+
+   size_t nrecs = rs->records.len;
+   gi->keys = mem_alloc ((nrecs ? nrecs : 1) * sizeof *gi->keys);
+   if (!gi->keys) {
+      XERROR ("Out of memory\n");
+      return NULL;
+   }
+   gi->nkeys = 0;
+   gi->nunindexed = 0;
+
+   for (size_t i=0; i<nrecs; i++) {
+      rotrec_t *rr = rs->records.items[i];
+      uint64_t guid;
+
+      if (!guid_value (rr->fields[RF_GUID], &guid)) {
+         gi->nunindexed++;
+         continue;
+      }
+      gi->keys[gi->nkeys].guid = guid;
+      gi->keys[gi->nkeys].recnum = i;
+      gi->nkeys++;
+   }
+
+   qsort (gi->keys, gi->nkeys, sizeof *gi->keys, guidkey_cmp);
+   __atomic_store_n (&gi->built, true, __ATOMIC_RELEASE);
+   return gi;
+}
+
+static struct guididx_t *guididx_get (rotsit_t *rs)
+{
+   if (__atomic_load_n (&rs->guids.built, __ATOMIC_ACQUIRE))
+      return &rs->guids;
+
+   mem_owner_t caller;
+   db_mem_enter (rs, &caller);
+   mutex_lock (&rs->index_lock);
+   struct guididx_t *ret = guididx_build (rs);
+   mutex_unlock (&rs->index_lock);
+   mem_use (&caller);
+   return ret;
+}
+
+// The record with the highest order is never archived, so that the next
+// order can always be worked out from the database alone.
+uint32_t rotsit_archive (rotsit_t *rs, const char *expr)
+{
+   if (!rs || !expr)
+      return (uint32_t)-1;
+
+   if (rs->frozen) {
+      XERROR ("A frozen database cannot be changed\n");
+      return (uint32_t)-1;
+   }
+
+   mem_owner_t caller;
+   db_mem_enter (rs, &caller);
+   db_write_lock (rs);
+   if (!rs->archive_loaded) {
+      XERROR ("The archive must be loaded before records are archived\n");
+      db_write_unlock (rs);
+      mem_use (&caller);
+      return (uint32_t)-1;
+   }
+
+   bitmap_t *matches = filter_matches (rs, expr);
+   if (!matches) {
+      db_write_unlock (rs);
+      mem_use (&caller);
+      return (uint32_t)-1;
+   }
+
+   size_t nrecs = rs->records.len;
+   size_t newest = nrecs;
+   uint32_t max_order = 0;
+   for (size_t i=0; i<nrecs; i++) {
+      rotrec_t *rr = rs->records.items[i];
+      const char *field = rr->nfields > RF_ORDER ? rr->fields[RF_ORDER]
+                                                 : NULL;
+      uint32_t order;
+      if (field && sscanf (field, "%x", &order)==1 &&
+          (newest==nrecs || order >= max_order)) {
+         max_order = order;
+         newest = i;
+      }
+   }
+
+   uint32_t ret = 0;
+   for (size_t i=0; i<nrecs; i++) {
+      rotrec_t *rr = rs->records.items[i];
+      if (rr->archived || i==newest || !bitmap_test (matches, i))
+         continue;
+
+      if (!rotrec_unshare (rr)) {
+         XERROR ("Out of memory\n");
+         ret = (uint32_t)-1;
+         break;
+      }
+      rr->archived = true;
+      ret++;
+   }
+
+   db_write_unlock (rs);
+   bitmap_del (matches);
+   mem_use (&caller);
+   return ret;
+}
+
+// An open-addressed hash table from GUID to record, for matching up the
+// records of several databases in linear time. The first of any records
+// with the same GUID is the one found.
+struct guidslot_t {
+   uint32_t recnum;     // Record number + 1, 0 for an empty slot
+   uint32_t tag;        // High half of the hash, checked before the GUID
+};
+
+struct guidmap_t {
+   rotsit_t *rs;
+   struct guidslot_t *slots;
+   size_t mask;
+   size_t ndups;        // Records with the same GUID as an earlier one
+};
+
+static const char *merge_field (rotrec_t *rr, size_t field)
+{
+   return rr && field < rr->nfields && rr->fields[field] ? rr->fields[field]
+                                                          : "";
+}
+
+static uint64_t guid_hash (const char *guid)
+{
+   uint64_t ret = 0xcbf29ce484222325ull;
+   for (size_t i=0; guid[i]; i++) {
+      ret = (ret ^ (uint8_t)guid[i]) * 0x100000001b3ull;
+   }
+   return ret;
+}
+
+// The versions of a database being merged mostly hold the same records in
+// the same order, so the record at the same position is tried first.
+static rotrec_t *guidmap_find (struct guidmap_t *gm, const char *guid,
+                               size_t hint)
+{
+   if (hint < gm->rs->records.len) {
+      rotrec_t *rr = gm->rs->records.items[hint];
+      if (strcmp (merge_field (rr, RF_GUID), guid)==0 && !gm->ndups)
+         return rr;
+   }
+
+   uint64_t hash = guid_hash (guid);
+   uint32_t tag = hash >> 32;
+   size_t slot = hash & gm->mask;
+   while (gm->slots[slot].recnum) {
+      if (gm->slots[slot].tag==tag) {
+         rotrec_t *rr = gm->rs->records.items[gm->slots[slot].recnum - 1];
+         if (strcmp (merge_field (rr, RF_GUID), guid)==0)
+            return rr;
+      }
+      slot = (slot + 1) & gm->mask;
+   }
+   return NULL;
+}
+
+static bool guidmap_init (struct guidmap_t *gm, rotsit_t *rs)
+{
+   size_t nrecs = rs->records.len;
+   size_t nslots = 16;
+   while (nslots < nrecs * 2) {
+      nslots *= 2;
+   }
+
+   gm->rs = rs;
+   gm->mask = nslots - 1;
+   gm->ndups = 0;
+   if (!(gm->slots = mem_calloc (nslots, sizeof *gm->slots))) {
+      XERROR ("Out of memory\n");
+      return false;
+   }
+
+   for (size_t i=0; i<nrecs; i++) {
+      rotrec_t *rr = rs->records.items[i];
+      uint64_t hash = guid_hash (merge_field (rr, RF_GUID));
+      uint32_t tag = hash >> 32;
+      size_t slot = hash & gm->mask;
+      bool dup = false;
+
+      while (!dup && gm->slots[slot].recnum) {
+         if (gm->slots[slot].tag==tag) {
+            rotrec_t *other = rs->records.items[gm->slots[slot].recnum - 1];
+            dup = strcmp (merge_field (other, RF_GUID),
+                          merge_field (rr, RF_GUID))==0;
+         }
+         slot = (slot + 1) & gm->mask;
+      }
+
+      if (dup) {
+         gm->ndups++;
+      } else {
+         gm->slots[slot].recnum = i + 1;
+         gm->slots[slot].tag = tag;
+      }
+   }
+   return true;
+}
+
+// Whether two lists of fields hold the same values, a missing field being
+// empty. Frozen copies of one database share the fields that did not
+// change between them, which are then the same without being compared.
+static bool fields_equal (char **lhs, size_t nlhs, char **rhs, size_t nrhs)
+{
+   if (nlhs!=nrhs)
+      return false;
+
+   for (size_t i=0; i<nlhs; i++) {
+      const char *l = lhs[i],
+                 *r = rhs[i];
+      if (l!=r && strcmp (l ? l : "", r ? r : "")!=0)
+         return false;
+   }
+   return true;
+}
+
+static bool rotrec_equal (rotrec_t *lhs, rotrec_t *rhs)
+{
+   return lhs==rhs ||
+          fields_equal (lhs->fields, lhs->nfields, rhs->fields, rhs->nfields);
+}
+
+// The same kind of table for the comments of one record, from GUID to
+// comment number.
+struct commentset_t {
+   rotrec_t *rr;
+   struct guidslot_t *slots;
+   size_t mask;
+};
+
+static const char *comment_guid (rotrec_t *rr, size_t comment)
+{
+   return merge_field (rr, RF_LAST_FIELD + comment * 4 + CF_GUID);
+}
+
+static size_t comment_count (rotrec_t *rr)
+{
+   return rr->nfields > RF_LAST_FIELD ? (rr->nfields - RF_LAST_FIELD) / 4 : 0;
+}
+
+static bool commentset_init (struct commentset_t *cs, rotrec_t *rr)
+{
+   size_t ncomments = comment_count (rr);
+   size_t nslots = 16;
+   while (nslots < ncomments * 2) {
+      nslots *= 2;
+   }
+
+   cs->rr = rr;
+   cs->mask = nslots - 1;
+   if (!(cs->slots = mem_calloc (nslots, sizeof *cs->slots))) {
+      XERROR ("Out of memory\n");
+      return false;
+   }
+
+   for (size_t i=0; i<ncomments; i++) {
+      uint64_t hash = guid_hash (comment_guid (rr, i));
+      size_t slot = hash & cs->mask;
+      while (cs->slots[slot].recnum) {
+         slot = (slot + 1) & cs->mask;
+      }
+      cs->slots[slot].recnum = i + 1;
+      cs->slots[slot].tag = hash >> 32;
+   }
+   return true;
+}
+
+static bool commentset_has (struct commentset_t *cs, const char *guid)
+{
+   uint64_t hash = guid_hash (guid);
+   uint32_t tag = hash >> 32;
+   size_t slot = hash & cs->mask;
+   while (cs->slots[slot].recnum) {
+      if (cs->slots[slot].tag==tag &&
+          strcmp (comment_guid (cs->rr, cs->slots[slot].recnum - 1),
+                  guid)==0)
+         return true;
+      slot = (slot + 1) & cs->mask;
+   }
+   return false;
+}
+
+static bool merge_add (char ***fields, size_t *nfields, size_t *maxfields,
+                       const char *value)
+{
+   char *copy = mem_strdup (value);
+   if (!copy || !fields_reserve (fields, maxfields, *nfields + 1)) {
+      mem_free (copy);
+      return false;
+   }
+   (*fields)[(*nfields)++] = copy;
+   return true;
+}
+
+// Merges one record. Fixed fields changed on only one side take that
+// side's value and fields changed differently on both sides take ours. The
+// comments are those of ours followed by those of theirs that ours does
+// not have. A missing side takes the other's record as it is.
+static rotrec_t *merge_record (rotrec_t *base, rotrec_t *ours,
+                               rotrec_t *theirs, size_t *nconflicts)
+{
+   char **fields = NULL;
+   size_t nfields = 0,
+          maxfields = 0;
+   rotrec_t *ret = NULL;
+   struct commentset_t seen = { NULL, NULL, 0 };
+
+   if (!ours)
+      ours = theirs;
+   if (!theirs)
+      theirs = ours;
+
+   for (size_t i=0; i<RF_LAST_FIELD; i++) {
+      const char *o = merge_field (ours, i);
+      const char *t = merge_field (theirs, i);
+      const char *value = o;
+
+      if (strcmp (o, t)!=0) {
+         if (base && strcmp (o, merge_field (base, i))==0) {
+            value = t;
+         } else if (!base || strcmp (t, merge_field (base, i))!=0) {
+            (*nconflicts)++;
+         }
+      }
+
+      if (!merge_add (&fields, &nfields, &maxfields, value))
+         goto errorexit;
+   }
+
+   size_t nours = comment_count (ours);
+   size_t ntheirs = theirs!=ours ? comment_count (theirs) : 0;
+   for (size_t i=0; i<nours; i++) {
+      for (size_t j=0; j<4; j++) {
+         const char *value = ours->fields[RF_LAST_FIELD + i * 4 + j];
+         if (!merge_add (&fields, &nfields, &maxfields, value ? value : ""))
+            goto errorexit;
+      }
+   }
+
+   if (ntheirs && !commentset_init (&seen, ours))
+      goto errorexit;
+
+   for (size_t i=0; i<ntheirs; i++) {
+      char **comment = &theirs->fields[RF_LAST_FIELD + i * 4];
+      if (commentset_has (&seen, comment_guid (theirs, i)))
+         continue;
+
+      for (size_t j=0; j<4; j++) {
+         if (!merge_add (&fields, &nfields, &maxfields,
+                         comment[j] ? comment[j] : ""))
+            goto errorexit;
+      }
+   }
+
+   ret = new_rotrec (fields, nfields);
+
+errorexit:
+   if (!ret) {
+      XERROR ("Out of memory\n");
+      for (size_t i=0; i<nfields; i++) {
+         mem_free (fields[i]);
+      }
+   }
+   mem_free (seen.slots);
+   mem_free (fields);
+   return ret;
+}
+
+static bool record_order (rotrec_t *rr, uint32_t *order)
+{
+   const char *field = rr->nfields > RF_ORDER ? rr->fields[RF_ORDER] : NULL;
+   return field && sscanf (field, "%x", order)==1;
+}
+
+static int order_cmp (const void *p_lhs, const void *p_rhs)
+{
+   uint32_t lhs = *(const uint32_t *)p_lhs;
+   uint32_t rhs = *(const uint32_t *)p_rhs;
+
+   return lhs < rhs ? -1 : lhs > rhs;
+}
+
+// A copy of a record with another order, for an issue that theirs added
+// with the order of one that ours added.
+static rotrec_t *merge_renumber (rotrec_t *rr, uint32_t order)
+{
+   size_t nconflicts = 0;
+   char *value = mem_alloc (2 + 8 + 1);
+   if (!value) {
+      XERROR ("Out of memory\n");
+      return NULL;
+   }
+
+   rotrec_t *ret = merge_record (NULL, rr, NULL, &nconflicts);
+   if (!ret) {
+      mem_free (value);
+      return NULL;
+   }
+   sprintf (value, "0x%" PRIx32, order);
+   rotrec_set (ret, RF_ORDER, value);
+   return ret;
+}
+
+// Picks the version of a record to write. Unless both sides changed it,
+// that is one of the records as it is; otherwise a merged record is made
+// and added to 'merged' to be freed later.
+static rotrec_t *merge_pick (rotrec_t *base, rotrec_t *ours, rotrec_t *theirs,
+                             rotrec_t **merged, size_t *nmerged,
+                             size_t *nconflicts)
+{
+   if (!theirs || rotrec_equal (ours, theirs) ||
+       (base && rotrec_equal (theirs, base)))
+      return ours;
+
+   if (base && rotrec_equal (ours, base))
+      return theirs;
+
+   rotrec_t *ret = merge_record (base, ours, theirs, nconflicts);
+   if (ret) {
+      merged[(*nmerged)++] = ret;
+   }
+   return ret;
+}
+
+bool rotsit_merge (rotsit_t *base, rotsit_t *ours, rotsit_t *theirs,
+                   FILE *outf, size_t *nconflicts)
+{
+   bool error = true;
+   struct guidmap_t base_map = { NULL, NULL, 0, 0 },
+                    ours_map = { NULL, NULL, 0, 0 },
+                    theirs_map = { NULL, NULL, 0, 0 };
+   rotrec_t **records = NULL,
+            **merged = NULL;
+   uint32_t *orders = NULL;
+   size_t nrecords = 0,
+          nmerged = 0,
+          norders = 0;
+   uint32_t next_order = 0;
+
+   if (!base || !ours || !theirs || !outf || !nconflicts)
+      return false;
+   *nconflicts = 0;
+
+   rotsit_t *dbs[] = { base, ours, theirs };
+   size_t ndbs = db_read_lock_all (dbs, sizeof dbs/sizeof dbs[0]);
+
+   size_t nours = ours->records.len;
+   size_t ntheirs = theirs->records.len;
+   records = mem_alloc ((nours + ntheirs + 1) * sizeof *records);
+   merged = mem_alloc ((nours + ntheirs + 1) * sizeof *merged);
+   orders = mem_alloc ((nours + 1) * sizeof *orders);
+   if (!records || !merged || !orders) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
+
+   if (!guidmap_init (&base_map, base) ||
+       !guidmap_init (&ours_map, ours) ||
+       !guidmap_init (&theirs_map, theirs))
+      goto errorexit;
+
+   // A record that one side removed (such as by archiving it) stays
+   // removed unless the other side changed it, which is a conflict.
+   for (size_t i=0; i<nours; i++) {
+      rotrec_t *rr = ours->records.items[i];
+      const char *guid = merge_field (rr, RF_GUID);
+      if (ours_map.ndups && guidmap_find (&ours_map, guid, i) != rr)
+         continue;
+
+      rotrec_t *b = guidmap_find (&base_map, guid, i);
+      rotrec_t *t = guidmap_find (&theirs_map, guid, i);
+      if (b && !t) {
+         if (rotrec_equal (rr, b))
+            continue;
+         (*nconflicts)++;
+      }
+
+      rotrec_t *pick = merge_pick (b, rr, t, merged, &nmerged, nconflicts);
+      if (!pick)
+         goto errorexit;
+      records[nrecords++] = pick;
+   }
+
+   // Issues added on both sides since the base may have been given the
+   // same order. Theirs are given the orders after the highest of either.
+   for (size_t i=0; i<nrecords; i++) {
+      uint32_t order;
+      if (record_order (records[i], &order)) {
+         orders[norders++] = order;
+      }
+   }
+   qsort (orders, norders, sizeof *orders, order_cmp);
+   for (size_t i=0; i<ntheirs; i++) {
+      uint32_t order;
+      if (record_order (theirs->records.items[i], &order) &&
+          order > next_order) {
+         next_order = order;
+      }
+   }
+   if (norders && orders[norders - 1] > next_order) {
+      next_order = orders[norders - 1];
+   }
+   next_order++;
+
+   for (size_t i=0; i<ntheirs; i++) {
+      rotrec_t *rr = theirs->records.items[i];
+      const char *guid = merge_field (rr, RF_GUID);
+      if ((theirs_map.ndups && guidmap_find (&theirs_map, guid, i) != rr) ||
+          guidmap_find (&ours_map, guid, i))
+         continue;
+
+      rotrec_t *b = guidmap_find (&base_map, guid, i);
+      if (b) {
+         if (rotrec_equal (rr, b))
+            continue;
+         (*nconflicts)++;
+      }
+
+      uint32_t order;
+      if (record_order (rr, &order) &&
+          bsearch (&order, orders, norders, sizeof *orders, order_cmp)) {
+         if (!(rr = merge_renumber (rr, next_order++)))
+            goto errorexit;
+         merged[nmerged++] = rr;
+      }
+      records[nrecords++] = rr;
+   }
+
+   if (!write_list (records, nrecords, outf, NULL))
+      goto errorexit;
+
+   error = false;
+errorexit:
+   for (size_t i=0; i<nmerged; i++) {
+      rotrec_del (merged[i]);
+   }
+   mem_free (merged);
+   mem_free (records);
+   mem_free (orders);
+   mem_free (base_map.slots);
+   mem_free (ours_map.slots);
+   mem_free (theirs_map.slots);
+   db_read_unlock_all (dbs, ndbs);
+   return !error;
+}
+
+// The index narrows the search down to the records whose GUID has the
+// same value; the string comparison still decides, so that "0x1" and "01"
+// are not confused. The first match in record order is returned.
+static rotrec_t *find_by_id (rotsit_t *rs, const char *id)
+{
+   struct guididx_t *gi = guididx_get (rs);
+   uint64_t guid;
+
+   if (gi && guid_value (id, &guid)) {
+      size_t lo = 0,
+             hi = gi->nkeys;
+      while (lo < hi) {
+         size_t mid = lo + (hi - lo) / 2;
+         if (gi->keys[mid].guid < guid) {
+            lo = mid + 1;
+         } else {
+            hi = mid;
+         }
+      }
+
+      for (size_t i=lo; i<gi->nkeys && gi->keys[i].guid==guid; i++) {
+         rotrec_t *rec = rs->records.items[gi->keys[i].recnum];
+         if (strcmp (rec->fields[RF_GUID], id)==0)
+            return rec;
+      }
+   }
+
+   if (gi && !gi->nunindexed)
+      return NULL;
+
+   for (size_t i=0; i<rs->records.len; i++) {
+
+      rotrec_t *rec = rs->records.items[i];
+
+      if (rec->fields[RF_GUID] && strcmp (rec->fields[RF_GUID], id)==0)
+         return rec;
+   }
+
+   return NULL;
+}
+
+rotrec_t *rotsit_find_by_id (rotsit_t *rs, const char *id)
+{
+   if (!rs || !id)
+      return NULL;
+
+   db_read_lock (rs);
+   rotrec_t *ret = find_by_id (rs, id);
+   db_read_unlock (rs);
+   return ret;
+}
+
+// Whether the record at rec_str has the same bytes as rr had in the text
+// it was parsed from, which is then split in the same places. This is
+// most of the records in a reload, and needs neither a lookup nor a split.
+static bool record_unchanged (rotrec_t *rr, const char *rec_str,
+                              size_t reclen)
+{
+   size_t flen = strlen (FIELD_DELIM);
+   size_t pos = 0;
+
+   if (!rr->nfields)
+      return false;
+
+   for (size_t i=0; i<rr->nfields; i++) {
+      const char *field = rr->fields[i];
+      if (!field || !field_parsed (rr, field) ||
+          (size_t)(field - rr->fields[0])!=pos)
+         return false;
+
+      size_t len = strlen (field);
+      if (reclen - pos < len + flen ||
+          memcmp (&rec_str[pos], field, len)!=0 ||
+          memcmp (&rec_str[pos + len], FIELD_DELIM, flen)!=0)
+         return false;
+      pos += len + flen;
+   }
+   return pos==reclen;
+}
+
+// Splits the record at rec_str, which record_unchanged() found to be the
+// same as rr, while it is still in the cache.
+static void record_split_as (rotrec_t *rr, char *rec_str, size_t reclen)
+{
+   size_t flen = strlen (FIELD_DELIM);
+
+   for (size_t i=1; i<rr->nfields; i++) {
+      rec_str[rr->fields[i] - rr->fields[0] - flen] = 0;
+   }
+   rec_str[reclen - flen] = 0;
+}
+
+// Points the fields of a kept record at the same values in the new text,
+// where the record starts at rec_str. Unchanged records are laid out as
+// before, so their fields are only moved.
+static void rotrec_rebase (rotrec_t *rr, struct text_t *text, char *rec_str,
+                           bool unchanged)
+{
+   size_t flen = strlen (FIELD_DELIM);
+   char *base = rr->fields[0];
+
+   for (size_t i=0; i<rr->nfields; i++) {
+      if (unchanged) {
+         rr->fields[i] = &rec_str[rr->fields[i] - base];
+         continue;
+      }
+      field_free (rr, rr->fields[i]);
+      rr->fields[i] = rec_str;
+      rec_str += strlen (rec_str) + flen;
+   }
+   rr->text = text;
+}
+
+// Sorts keys of which the first nsorted usually still are after a reload,
+// by sorting only the rest and merging it in.
+static void keys_sort (void *keys, size_t nsorted, size_t nkeys, size_t size,
+                       int (*cmp) (const void *, const void *))
+{
+   char *base = keys;
+   size_t nrest = nkeys - nsorted;
+   char *rest = NULL;
+
+   for (size_t i=1; i<nsorted; i++) {
+      if (cmp (&base[(i - 1) * size], &base[i * size]) > 0) {
+         qsort (keys, nkeys, size, cmp);
+         return;
+      }
+   }
+
+   if (!nrest)
+      return;
+
+   if (!(rest = mem_alloc (nrest * size))) {
+      qsort (keys, nkeys, size, cmp);
+      return;
+   }
+
+   qsort (&base[nsorted * size], nrest, size, cmp);
+   memcpy (rest, &base[nsorted * size], nrest * size);
+
+   // From the back, into the space the rest was in
+   size_t i = nsorted, j = nrest, k = nkeys;
+   while (j) {
+      if (i && cmp (&base[(i - 1) * size], &rest[(j - 1) * size]) > 0) {
+         memcpy (&base[--k * size], &base[--i * size], size);
+      } else {
+         memcpy (&base[--k * size], &rest[--j * size], size);
+      }
+   }
+   mem_free (rest);
+}
+
+#define RELOAD_GONE        (UINT32_MAX)
+
+// Carries the indexes over a reload. moved gives the new number of each
+// of the nold records that came before it, or RELOAD_GONE, and fresh has
+// the records parsed from the new text. Only the fresh records are looked
+// at; an index that cannot be carried over is left to be built again.
+static void index_reload (rotsit_t *rs, const uint32_t *moved, size_t nold,
+                          const bitmap_t *fresh)
+{
+   size_t nrecs = rs->records.len;
+   size_t nfresh = bitmap_count (fresh);
+
+   for (size_t i=0; i<NUM_ENUM_FIELDS; i++) {
+      struct enumidx_t *ei = &rs->enums[i];
+      bool ok = true;
+      if (!ei->built)
+         continue;
+
+      for (size_t j=0; j<ei->nvals; j++) {
+         bitmap_t *old = ei->vals[j].bits;
+         if (!(ei->vals[j].bits = bitmap_new (nrecs))) {
+            ei->vals[j].bits = old;
+            ok = false;
+            break;
+         }
+         for (size_t k=bitmap_next (old, 0); k!=BITMAP_NONE;
+              k=bitmap_next (old, k + 1)) {
+            if (k < nold && moved[k]!=RELOAD_GONE)
+               bitmap_set (ei->vals[j].bits, moved[k]);
+         }
+         bitmap_del (old);
+      }
+
+      for (size_t j=bitmap_next (fresh, 0); ok && j!=BITMAP_NONE;
+           j=bitmap_next (fresh, j + 1)) {
+         rotrec_t *rr = rs->records.items[j];
+         const char *value = rr->fields[enum_fields[i]];
+         bitmap_t *bits = enumidx_bits (ei, value ? value : "", nrecs);
+         if (!(ok = bits!=NULL))
+            break;
+         bitmap_set (bits, j);
+      }
+
+      if (!ok) {
+         enumidx_clear (ei);
+      }
+   }
+
+   for (size_t i=0; i<NUM_DATE_FIELDS; i++) {
+      struct dateidx_t *di = &rs->dates[i];
+      if (!di->built)
+         continue;
+
+      struct datekey_t *keys = mem_alloc ((di->nkeys + nfresh + 1) *
+                                          sizeof *keys);
+      int64_t *epochs = mem_calloc (nrecs ? nrecs : 1, sizeof *epochs);
+      bitmap_t *valid = bitmap_new (nrecs);
+      if (!keys || !epochs || !valid) {
+         mem_free (keys);
+         mem_free (epochs);
+         bitmap_del (valid);
+         dateidx_clear (di);
+         continue;
+      }
+
+      size_t nkeys = 0;
+      for (size_t j=0; j<di->nkeys; j++) {
+         uint32_t recnum = moved[di->keys[j].recnum];
+         if (recnum!=RELOAD_GONE) {
+            keys[nkeys].epoch = di->keys[j].epoch;
+            keys[nkeys].recnum = recnum;
+            epochs[recnum] = di->keys[j].epoch;
+            bitmap_set (valid, recnum);
+            nkeys++;
+         }
+      }
+      size_t nkept = nkeys;
+
+      for (size_t j=bitmap_next (fresh, 0); j!=BITMAP_NONE;
+           j=bitmap_next (fresh, j + 1)) {
+         rotrec_t *rr = rs->records.items[j];
+         const char *value = rr->fields[date_fields[i]];
+         time_t epoch;
+
+         if (!value || !*value ||
+             pdate_parse (value, &epoch, true)!=pdate_valid)
+            continue;
+
+         keys[nkeys].epoch = epoch;
+         keys[nkeys].recnum = j;
+         epochs[j] = epoch;
+         bitmap_set (valid, j);
+         nkeys++;
+      }
+
+      keys_sort (keys, nkept, nkeys, sizeof *keys, datekey_cmp);
+      dateidx_clear (di);
+      di->keys = keys;
+      di->nkeys = nkeys;
+      di->epochs = epochs;
+      di->valid = valid;
+      di->built = true;
+   }
+
+   struct guididx_t *gi = &rs->guids;
+   if (gi->built) {
+      struct guidkey_t *keys = mem_alloc ((gi->nkeys + nfresh + 1) *
+                                          sizeof *keys);
+      if (!keys) {
+         guididx_clear (gi);
+         return;
+      }
+
+      size_t nkeys = 0;
+      for (size_t j=0; j<gi->nkeys; j++) {
+         uint32_t recnum = moved[gi->keys[j].recnum];
+         if (recnum!=RELOAD_GONE) {
+            keys[nkeys].guid = gi->keys[j].guid;
+            keys[nkeys].recnum = recnum;
+            nkeys++;
+         }
+      }
+      size_t nkept = nkeys;
+
+      for (size_t j=bitmap_next (fresh, 0); j!=BITMAP_NONE;
+           j=bitmap_next (fresh, j + 1)) {
+         rotrec_t *rr = rs->records.items[j];
+         uint64_t guid;
+         if (guid_value (rr->fields[RF_GUID], &guid)) {
+            keys[nkeys].guid = guid;
+            keys[nkeys].recnum = j;
+            nkeys++;
+         }
+      }
+
+      keys_sort (keys, nkept, nkeys, sizeof *keys, guidkey_cmp);
+      guididx_clear (gi);
+      gi->keys = keys;
+      gi->nkeys = nkeys;
+      gi->nunindexed = nrecs - nkeys;
+      gi->built = true;
+   }
+}
+
+// The records are the frozen copies of those in rs, which are only made
+// for records that have changed since rs was last frozen. Each index that
+// rs has built is copied as it is. Any other index that the last copy had
+// is carried over as by a reload, with the records whose copy is not the
+// same as in the last copy indexed again. The copy is owned by rs, so the
+// caller has switched to its allocator.
+static rotsit_t *freeze_records (rotsit_t *rs)
+{
+   rotsit_t *ret = rotsit_alloc (NULL);
+   if (!ret)
+      return NULL;
+
+   ret->frozen = true;
+   ret->refs = 1;
+   ret->text = text_hold (rs->text);
+   ret->archive = text_hold (rs->archive);
+   ret->archive_loaded = rs->archive_loaded;
+   ret->order_next = rs->order_next;
+
+   size_t nrecs = rs->records.len;
+   ret->records.items = mem_alloc ((nrecs ? nrecs : 1)
+                                   * sizeof *ret->records.items);
+   if (!ret->records.items) {
+      XERROR ("Out of memory\n");
+      rotsit_del (ret);
+      return NULL;
+   }
+   ret->records.cap = nrecs ? nrecs : 1;
+
+   for (size_t i=0; i<nrecs; i++) {
+      rotrec_t *copy = rotrec_freeze (rs->records.items[i]);
+      if (!copy) {
+         XERROR ("Out of memory\n");
+         rotsit_del (ret);
+         return NULL;
+      }
+      ret->records.items[ret->records.len++] = copy;
+   }
+
+   rotsit_t *last = rs->last;
+   if (last && index_copy (ret, last, rs)) {
+      size_t nold = last->records.len;
+      uint32_t *moved = mem_alloc ((nold ? nold : 1) * sizeof *moved);
+      bitmap_t *fresh = bitmap_new (nrecs);
+      if (moved && fresh) {
+         for (size_t i=0; i<nrecs; i++) {
+            if (i >= nold ||
+                ret->records.items[i]!=last->records.items[i]) {
+               bitmap_set (fresh, i);
+            }
+         }
+         for (size_t i=0; i<nold; i++) {
+            moved[i] = i < nrecs && !bitmap_test (fresh, i) ? i
+                                                            : RELOAD_GONE;
+         }
+         index_reload (ret, moved, nold, fresh);
+      } else {
+         index_invalidate (ret);
+      }
+      mem_free (moved);
+      bitmap_del (fresh);
+   }
+   index_copy (ret, rs, NULL);
+   return ret;
+}
+
+// Takes hold of the current frozen copy of rs, first making it if there
+// is none and make is set.
+static rotsit_t *current_hold (rotsit_t *rs, bool make)
+{
+   mutex_lock (&rs->freeze_lock);
+   if (!rs->current && make) {
+      mem_owner_t caller;
+      db_mem_enter (rs, &caller);
+      if ((rs->current = freeze_records (rs))) {
+         rotsit_del (rs->last);
+         rs->last = NULL;
+      }
+      mem_use (&caller);
+   }
+   rotsit_t *ret = rs->current;
+   if (ret) {
+      __atomic_fetch_add (&ret->refs, 1, __ATOMIC_RELAXED);
+   }
+   mutex_unlock (&rs->freeze_lock);
+   return ret;
+}
+
+rotsit_t *rotsit_freeze (rotsit_t *rs)
+{
+   if (!rs)
+      return NULL;
+
+   if (rs->frozen) {
+      __atomic_fetch_add (&rs->refs, 1, __ATOMIC_RELAXED);
+      return rs;
+   }
+
+   // Until the database next changes, every reader shares one copy and
+   // only the first has to wait for the lock.
+   rotsit_t *ret = current_hold (rs, false);
+   if (!ret) {
+      db_read_lock (rs);
+      ret = current_hold (rs, true);
+      db_read_unlock (rs);
+   }
+   return ret;
+}
+
+bool rotsit_reload (rotsit_t *rs, char *input_buf)
+{
+   bool error = true;
+   struct text_t *text = NULL;
+   struct guidmap_t gm = { NULL, NULL, 0, 0 };
+   memvec_t records = { NULL, 0, 0 };
+   char **fields = NULL;
+   size_t maxfields = 0;
+   char **starts = NULL;   // Where each record is in the new text
+   size_t maxstarts = 0;
+   bitmap_t *kept = NULL;  // By the number before the reload
+   bitmap_t *unchanged = NULL;
+   bitmap_t *fresh = NULL; // By the number after
+   uint32_t *moved = NULL;
+   size_t rlen = strlen (RECORD_DELIM);
+
+   if (!rs || !input_buf)
+      return false;
+
+   if (rs->frozen) {
+      XERROR ("A frozen database cannot be changed\n");
+      return false;
+   }
+
+   mem_owner_t caller;
+   db_mem_enter (rs, &caller);
+   if (!(text = text_new (input_buf))) {
+      XERROR ("Out of memory\n");
+      mem_use (&caller);
+      return false;
+   }
+
+   db_write_lock (rs);
+   size_t nold = rs->records.len;
+   if (!(kept = bitmap_new (nold)) || !(unchanged = bitmap_new (nold)) ||
+       !(moved = mem_alloc ((nold ? nold : 1) * sizeof *moved))) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
+
+   // Records mostly come in the same order as before, so the one after
+   // the last record found is tried first. Those that are kept get their
+   // own fields now, as nothing can be allowed to fail once the first
+   // record has been moved over.
+   size_t next = 0;
+   char *rec_str = text->buf;
+   char *rec_end;
+   while ((rec_end = strstr (rec_str, RECORD_DELIM))) {
+      *rec_end = 0;
+
+      if (!fields_reserve (&starts, &maxstarts, records.len + 1)) {
+         XERROR ("Out of memory\n");
+         goto errorexit;
+      }
+      starts[records.len] = rec_str;
+
+      size_t reclen = rec_end - rec_str;
+      rotrec_t *rr = next < nold ? rs->records.items[next] : NULL;
+      if (rr && !rr->archived && !bitmap_test (kept, rr->recnum) &&
+          record_unchanged (rr, rec_str, reclen) && rotrec_unshare (rr)) {
+         record_split_as (rr, rec_str, reclen);
+         bitmap_set (kept, rr->recnum);
+         bitmap_set (unchanged, rr->recnum);
+         next = rr->recnum + 1;
+      } else {
+         size_t nfields = split_record (rec_str, &fields, &maxfields);
+         if (nfields==(size_t)-1) {
+            XERROR ("Out of memory\n");
+            goto errorexit;
+         }
+         if (!nfields) {
+            XERROR ("Failure parsing record [%zu]\n", records.len);
+            goto errorexit;
+         }
+
+         if (rr && strcmp (merge_field (rr, RF_GUID), fields[0])!=0) {
+            rr = NULL;
+         }
+         if (!rr) {
+            if (!gm.slots && !guidmap_init (&gm, rs))
+               goto errorexit;
+            rr = guidmap_find (&gm, fields[0], nold);
+         }
+         if (rr) {
+            next = rr->recnum + 1;
+         }
+
+         if (rr && !rr->archived && !bitmap_test (kept, rr->recnum) &&
+             fields_equal (rr->fields, rr->nfields, fields, nfields) &&
+             rotrec_unshare (rr)) {
+            bitmap_set (kept, rr->recnum);
+         } else if ((rr = new_rotrec (fields, nfields))) {
+            rr->owner = rs;
+            rr->text = text;
+         } else {
+            XERROR ("Out of memory failure\n");
+            goto errorexit;
+         }
+      }
+
+      if (!memvec_push (&records, rr)) {
+         XERROR ("Failed to store record\n");
+         if (rr->text==text) {
+            rotrec_del (rr);
+         }
+         goto errorexit;
+      }
+      rec_str = &rec_end[rlen];
+   }
+
+   // The archived records stay as they are, after the others. One that
+   // is numbered differently gets fields of its own, as its frozen copy
+   // is still read by the old number, and one that was archived from the
+   // old text keeps its fields when that text goes.
+   for (size_t i=0; i<nold; i++) {
+      rotrec_t *rr = rs->records.items[i];
+      if (!rr->archived)
+         continue;
+      if ((rr->text==rs->text && !rotrec_detach (rr)) ||
+          (rr->recnum!=records.len && !rotrec_unshare (rr))) {
+         XERROR ("Out of memory\n");
+         goto errorexit;
+      }
+      if (!memvec_push (&records, rr)) {
+         XERROR ("Failed to store record\n");
+         goto errorexit;
+      }
+   }
+
+   if (!(fresh = bitmap_new (records.len))) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<nold; i++) {
+      moved[i] = RELOAD_GONE;
+   }
+   for (size_t i=0; i<records.len; i++) {
+      rotrec_t *rr = records.items[i];
+      if (rr->text==text) {
+         bitmap_set (fresh, i);
+      } else {
+         moved[rr->recnum] = i;
+      }
+   }
+
+   // From here on nothing fails. The records that went are deleted while
+   // the text they point into is still there.
+   for (size_t i=0; i<nold; i++) {
+      if (moved[i]==RELOAD_GONE) {
+         rotrec_del (rs->records.items[i]);
+      }
+   }
+
+   uint64_t nkept = 0;
+   for (size_t i=0; i<records.len; i++) {
+      rotrec_t *rr = records.items[i];
+      if (bitmap_test (fresh, i)) {
+         order_seen (rs, rr);
+      } else if (!rr->archived) {
+         rotrec_rebase (rr, text, starts[i],
+                        bitmap_test (unchanged, rr->recnum));
+         nkept++;
+      }
+      rr->recnum = i;
+   }
+
+   memvec_free (&rs->records);
+   rs->records = records;
+   records.items = NULL;
+   records.len = 0;
+   index_reload (rs, moved, nold, fresh);
+
+   text_release (rs->text);
+   rs->text = text;
+   text = NULL;
+
+   rs->stats.records_parsed += bitmap_count (fresh);
+   rs->stats.records_kept += nkept;
+   rs->stats.bytes_parsed += rs->text->len;
+   error = false;
+
+errorexit:
+   // Only the records parsed from the new text belong to the reload
+   for (size_t i=0; i<records.len; i++) {
+      rotrec_t *rr = records.items[i];
+      if (rr->text==text) {
+         rotrec_del (rr);
+      }
+   }
+   memvec_free (&records);
+   db_write_unlock (rs);
+
+   text_release (text);
+   mem_free (gm.slots);
+   mem_free (fields);
+   mem_free (starts);
+   mem_free (moved);
+   bitmap_del (kept);
+   bitmap_del (fresh);
+   bitmap_del (unchanged);
+   mem_use (&caller);
+   return !error;
+}
+
+bool rotsit_add_record (rotsit_t *rs, rotrec_t *rr)
+{
+   bool error = true;
+
+   if (!rs || !rr)
+      return false;
+
+   if (rs->frozen || rr->frozen) {
+      XERROR ("A frozen database cannot be changed\n");
+      return false;
+   }
+
+   mem_owner_t caller;
+   db_mem_enter (rs, &caller);
+   db_write_lock (rs);
+
+   // New records are given the next order when they are added, rather
+   // than when the database is written.
+   if (!rr->fields[RF_ORDER]) {
+      char *order = mem_alloc (2 + 8 + 1);
+      if (!order) {
+         XERROR ("Out of memory\n");
+         goto errorexit;
+      }
+      sprintf (order, "0x%" PRIx32, rs->order_next);
+      rr->fields[RF_ORDER] = order;
+   }
+
+   if (!memvec_push (&rs->records, rr)) {
+      XERROR ("Failed to store record\n");
+      goto errorexit;
+   }
+
+   rr->owner = rs;
+   rr->recnum = rs->records.len - 1;
+   order_seen (rs, rr);
+   index_record_added (rs, rr);
+   error = false;
+
+errorexit:
+   db_write_unlock (rs);
+   mem_use (&caller);
+   return !error;
+}
+
+// Atomic so that it can be set while other threads are making records
+static uint32_t (* _Atomic user_rand) (void);
+
+void rotsit_set_user_rand (uint32_t (*fn) (void))
+{
+   atomic_store (&user_rand, fn);
+}
+
+// Random bytes are taken from a per-thread pool that is refilled from the
+// system RNG RAND_POOL_BYTES at a time, so that each GUID costs a copy out
+// of the pool rather than a call into the RNG.
+#define RAND_POOL_BYTES    (4096)
+
+static _Thread_local struct {
+   uint8_t bytes[RAND_POOL_BYTES];
+   size_t used;
+} rand_pool = { .used = RAND_POOL_BYTES };
+
+static bool local_rand (uint8_t *dst, size_t num_bytes)
+{
+#ifdef PLATFORM_WINDOWS
+#define SHIFTWIDTH         (8)
+#else
+#define SHIFTWIDTH         (8)
+#endif
+
+   // The user RNG is only used to get repeatable GUIDs for testing, so it
+   // is left unbuffered.
+   uint32_t (*fn) (void) = atomic_load (&user_rand);
+   if (fn) {
+      uint64_t r = 0;
+      for (size_t i=0; i<num_bytes+1; i++) {
+         r = (r << 8) | ((fn () >> SHIFTWIDTH) & 0xff);
+      }
+      for (size_t i=0; i<num_bytes; i++) {
+         dst[i] = r >> (8 * (num_bytes - i - 1));
+      }
+      return true;
+   }
+#undef SHIFTWIDTH
+
+   if (num_bytes > RAND_POOL_BYTES)
+      return xcrypto_random (dst, num_bytes);
+
+   if (RAND_POOL_BYTES - rand_pool.used < num_bytes) {
+      if (!xcrypto_random (rand_pool.bytes, RAND_POOL_BYTES)) {
+         XERROR ("Unable to read from the system random number generator\n");
+         return false;
+      }
+      rand_pool.used = 0;
+   }
+
+   memcpy (dst, &rand_pool.bytes[rand_pool.used], num_bytes);
+   // Bytes that have been handed out are not left lying around in the pool
+   memset (&rand_pool.bytes[rand_pool.used], 0, num_bytes);
+   rand_pool.used += num_bytes;
+   return true;
+}
+
+static char *make_guid (void)
+{
+   static const char hexdigits[] = "0123456789abcdef";
+   uint8_t guid[8];
+
+   char *str_guid = mem_alloc (2 + 16 + 1); // 0x + 16 digits + 0
+
+   if (!str_guid) {
+      XERROR ("Out of memory\n");
+      return NULL;
+   }
+
+   if (!local_rand (guid, sizeof guid)) {
+      mem_free (str_guid);
+      return NULL;
+   }
+
+   str_guid[0] = '0';
+   str_guid[1] = 'x';
+   for (size_t i=0; i<sizeof guid; i++) {
+      str_guid[2 + i * 2] = hexdigits[guid[i] >> 4];
+      str_guid[3 + i * 2] = hexdigits[guid[i] & 0x0f];
+   }
+   str_guid[2 + 16] = 0;
+   return str_guid;
+}
+
+static char *make_username (void)
+{
+   char *str_user = NULL;
+   char *tmp_user = getenv (ENV_USERNAME);
+
+   str_user = mem_strdup (tmp_user ? tmp_user : "Unknown");
+
+   if (!str_user) {
+      XERROR ("Out of memory\n");
+      return NULL;
+   }
+
+   return str_user;
+}
+
+// Formats a time the way asctime() does, without the newline. Records and
+// comments made in the same second get the same timestamp, so each thread
+// keeps the last one it formatted rather than converting it again.
+static char *make_time (time_t time_s)
+{
+   static const char days[] = "SunMonTueWedThuFriSat";
+   static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+   static _Thread_local struct {
+      time_t when;
+      char str[32];
+   } cache = { (time_t)-1, "" };
+
+   if (!time_s) {
+      time_s = time (NULL);
+   }
+
+   if (time_s!=cache.when) {
+      struct tm tm;
+      if (!pdate_localtime (time_s, &tm)) {
+         XERROR ("Unable to convert time [%" PRId64 "]\n", (int64_t)time_s);
+         return NULL;
+      }
+
+      snprintf (cache.str, sizeof cache.str, "%.3s %.3s%3d %.2d:%.2d:%.2d %d",
+                &days[3 * tm.tm_wday], &months[3 * tm.tm_mon], tm.tm_mday,
+                tm.tm_hour, tm.tm_min, tm.tm_sec, 1900 + tm.tm_year);
+      cache.when = time_s;
+   }
+
+   char *str_time = mem_strdup (cache.str);
+   if (!str_time) {
+      XERROR ("Out of memory\n");
+      return NULL;
+   }
+
+   return str_time;
+}
+
+rotrec_t *rotrec_new (const char *msg)
+{
+   bool error = true;
+   static char *fields[] = {
+      NULL, NULL, NULL, NULL,
+      NULL, NULL, NULL, NULL,
+      NULL, NULL, NULL, NULL,
+      NULL, NULL,
+   };
+
+   rotrec_t *ret = mem_alloc (sizeof *ret);
+
+   if (!ret) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
+   memset (ret, 0, sizeof *ret);
+
+   if (!rotrec_reserve (ret, sizeof fields/sizeof fields[0])) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
+   for (size_t i=0; i<sizeof fields/sizeof fields[0]; i++) {
+      ret->fields[ret->nfields++] = fields[i];
+   }
+
+   // First field/0 must get a GUID. For now simply using a random number -
+   // the extra search space by not limiting certain bits to dates
+   // decreases the probability of a collision.
+   char *str_guid = make_guid ();
+   if (!str_guid) {
+      goto errorexit;
+   }
+   ret->fields[RF_GUID] = str_guid;
+
+   // Third field/2 must be set to the current user
+   char *str_user = make_username ();
+   if (!str_user) {
+      goto errorexit;
+   }
+   ret->fields[RF_OPENED_BY] = str_user;
+
+   // Fourth field/3 must be set to the current time
+   char *str_time = make_time (0);
+   if (!str_time) {
+      goto errorexit;
+   }
+   ret->fields[RF_OPENED_ON] = str_time;
+
+   // Fifth field/4 must be set to the message
+   char *str_msg = mem_strdup (msg);
+   if (!str_msg) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
+   ret->fields[RF_OPENED_MSG] = str_msg;
+
+   // Set the status to OPEN
+   char *str_status = mem_strdup ("OPEN");
+   if (!str_status) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
+   ret->fields[RF_STATUS] = str_status;
+
+   error = false;
+errorexit:
+   if (error) {
+      rotrec_del (ret);
+      ret = NULL;
+   }
+   return ret;
+}
+
+// Reads a date in any form pdate_parse() accepts and returns it in the
+// form that the database stores dates in.
+static char *normalise_time (const char *when)
+{
+   time_t tv;
+
+   if (pdate_parse (when, &tv, true)!=pdate_valid) {
+      XERROR ("[%s] is not a valid date\n", when);
+      return NULL;
+   }
+   return make_time (tv);
+}
+
+// Appends a comment. Takes ownership of user and when, either of which may
+// be NULL to use the current user and time.
+static bool add_comment (rotrec_t *rr, char *user, char *when,
+                         const char *comment)
+{
+   bool error = true;
+   char *new_fields[4] = { NULL, user, when, NULL };
+
+   if (!rr || !comment)
+      goto errorexit;
+
+   new_fields[0] = make_guid ();
+   new_fields[1] = user ? user : make_username ();
+   new_fields[2] = when ? when : make_time (0);
+   new_fields[3] = mem_strdup (comment);
+
+   for (size_t i=0; i<sizeof new_fields/sizeof new_fields[0]; i++) {
+      if (!new_fields[i]) {
+         XERROR ("Out of memory\n");
+         goto errorexit;
+      }
+   }
+
+   if (!rec_write_lock (rr))
+      goto errorexit;
+   bool reserved = rotrec_reserve (rr, sizeof new_fields/sizeof new_fields[0]);
+   for (size_t i=0; reserved && i<sizeof new_fields/sizeof new_fields[0]; i++) {
+      rr->fields[rr->nfields++] = new_fields[i];
+   }
+   rec_write_unlock (rr);
+
+   if (!reserved) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   if (error) {
+      for (size_t i=0; i<sizeof new_fields/sizeof new_fields[0]; i++) {
+         mem_free (new_fields [i]);
+      }
+   }
+
+   return !error;
+}
+
+bool rotrec_add_comment (rotrec_t *rr, const char *comment)
+{
+   mem_owner_t caller;
+   rec_mem_enter (rr, &caller);
+   bool ret = add_comment (rr, NULL, NULL, comment);
+   mem_use (&caller);
+   return ret;
+}
+
+static bool import_comment (rotrec_t *rr, const char *user, const char *when,
+                            const char *comment)
+{
+   char *str_user = NULL;
+   char *str_time = NULL;
+
+   if (user && !(str_user = mem_strdup (user))) {
+      XERROR ("Out of memory\n");
+      return false;
+   }
+
+   if (when && !(str_time = normalise_time (when))) {
+      mem_free (str_user);
+      return false;
+   }
+
+   return add_comment (rr, str_user, str_time, comment);
+}
+
+bool rotrec_import_comment (rotrec_t *rr, const char *user, const char *when,
+                            const char *comment)
+{
+   mem_owner_t caller;
+   rec_mem_enter (rr, &caller);
+   bool ret = import_comment (rr, user, when, comment);
+   mem_use (&caller);
+   return ret;
+}
+
+static bool set_field (rotrec_t *rr, size_t field, const char *value)
+{
+   char *str_value = NULL;
+
+   if (!rr || !value || field >= RF_LAST_FIELD) {
+      return false;
+   }
+
+   if (index_slot (date_fields, NUM_DATE_FIELDS, field)!=(size_t)-1) {
+      str_value = normalise_time (value);
+   } else {
+      str_value = mem_strdup (value);
+   }
+
+   if (!str_value)
+      return false;
+
+   if (!rec_write_lock (rr)) {
+      mem_free (str_value);
+      return false;
+   }
+   rotrec_set (rr, field, str_value);
+   if (field==RF_ORDER && rr->owner) {
+      order_seen (rr->owner, rr);
+   }
+   rec_write_unlock (rr);
+   return true;
+}
+
+bool rotrec_set_field (rotrec_t *rr, size_t field, const char *value)
+{
+   mem_owner_t caller;
+   rec_mem_enter (rr, &caller);
+   bool ret = set_field (rr, field, value);
+   mem_use (&caller);
+   return ret;
+}
+
+// Closes a record whose database the caller holds the lock of. Takes
+// ownership of message.
+static bool close_record (rotrec_t *rr, char *message)
+{
+   char *str_status = mem_strdup ("CLOSED");
+   char *str_user = make_username ();
+   char *str_time = make_time (0);
+
+   if (!str_status || !str_user || !str_time || !message) {
+      mem_free (str_status);
+      mem_free (str_user);
+      mem_free (str_time);
+      mem_free (message);
+      return false;
+   }
+
+   rotrec_set (rr, RF_STATUS, str_status);
+   rotrec_set (rr, RF_CLOSED_BY, str_user);
+   rotrec_set (rr, RF_CLOSED_ON, str_time);
+   rotrec_set (rr, RF_CLOSED_MSG, message);
+
+   return true;
+}
+
+static bool close_issue (rotrec_t *rr, const char *message)
+{
+   if (!rr || !message)
+      return false;
+
+   if (!rec_write_lock (rr))
+      return false;
+   bool ret = close_record (rr, mem_strdup (message));
+   rec_write_unlock (rr);
+   return ret;
+}
+
+bool rotrec_close (rotrec_t *rr, const char *message)
+{
+   mem_owner_t caller;
+   rec_mem_enter (rr, &caller);
+   bool ret = close_issue (rr, message);
+   mem_use (&caller);
+   return ret;
+}
+
+static bool dup_issue (rotrec_t *rr, const char *id)
+{
+   if (!rr || !id)
+      return false;
 
-         char *tmpf = field ? field : "";
-         fprintf (outf, "%s%s", tmpf, FIELD_DELIM);
-         if (free_field) {
-            free (field);
-         }
+   char *str_user = make_username ();
+   char *str_guid = mem_strdup (id);
+   if (!str_user || !str_guid) {
+      XERROR ("Out of memory\n");
+      mem_free (str_user);
+      mem_free (str_guid);
+      return false;
+   }
+
+   // Readers see the record either as it was or closed as a duplicate
+   if (!rec_write_lock (rr)) {
+      mem_free (str_user);
+      mem_free (str_guid);
+      return false;
+   }
+   bool ret = close_record (rr, mem_strcat ("Closed as DUPLICATE of #", id,
+                                            NULL));
+   if (ret) {
+      rotrec_set (rr, RF_DUP_BY, str_user);
+      rotrec_set (rr, RF_DUP_GUID, str_guid);
+   }
+   rec_write_unlock (rr);
+
+   if (!ret) {
+      XERROR ("Out of memory\n");
+      mem_free (str_user);
+      mem_free (str_guid);
+   }
+   return ret;
+}
+
+bool rotrec_dup (rotrec_t *rr, const char *id)
+{
+   mem_owner_t caller;
+   rec_mem_enter (rr, &caller);
+   bool ret = dup_issue (rr, id);
+   mem_use (&caller);
+   return ret;
+}
+
+static bool reopen_issue (rotrec_t *rr, const char *message)
+{
+   if (!rr || !message)
+      return false;
+
+   char *str_status = mem_strdup ("REOPEN");
+   char *str_user = make_username ();
+   char *str_time = make_time (0);
+   char *str_message = mem_strcat ("REOPEN due to: ", message, NULL);
+
+   if (!str_status || !str_user || !str_time || !str_message) {
+      XERROR ("Out of memory\n");
+      mem_free (str_status);
+      mem_free (str_user);
+      mem_free (str_time);
+      mem_free (str_message);
+      return false;
+   }
+
+   if (!rec_write_lock (rr)) {
+      mem_free (str_status);
+      mem_free (str_user);
+      mem_free (str_time);
+      mem_free (str_message);
+      return false;
+   }
+   rotrec_set (rr, RF_STATUS, str_status);
+   rotrec_set (rr, RF_OPENED_BY, str_user);
+   rotrec_set (rr, RF_OPENED_ON, str_time);
+   rotrec_set (rr, RF_OPENED_MSG, str_message);
+
+   // Open issues are never archived
+   rr->archived = false;
+   rec_write_unlock (rr);
+
+   return true;
+}
+
+bool rotrec_reopen (rotrec_t *rr, const char *message)
+{
+   mem_owner_t caller;
+   rec_mem_enter (rr, &caller);
+   bool ret = reopen_issue (rr, message);
+   mem_use (&caller);
+   return ret;
+}
+
+// A growable output buffer for formatting records into memory.
+struct strbuf_t {
+   char *buf;
+   size_t len;
+   size_t cap;
+};
+
+static bool strbuf_printf (struct strbuf_t *sb, const char *fmt, ...)
+{
+   va_list ap;
+
+   va_start (ap, fmt);
+   int n = vsnprintf (sb->buf + sb->len, sb->cap - sb->len, fmt, ap);
+   va_end (ap);
+
+   if (n < 0)
+      return false;
+
+   if (sb->len + n >= sb->cap) {
+      size_t newcap = sb->cap ? sb->cap : 4096;
+      while (newcap <= sb->len + n) {
+         newcap *= 2;
       }
-      fprintf (outf, "%s", RECORD_DELIM);
+      char *tmp = mem_realloc (sb->buf, newcap);
+      if (!tmp)
+         return false;
+      sb->buf = tmp;
+      sb->cap = newcap;
+
+      va_start (ap, fmt);
+      vsnprintf (sb->buf + sb->len, sb->cap - sb->len, fmt, ap);
+      va_end (ap);
    }
+
+   sb->len += n;
    return true;
 }
 
-uint32_t rotsit_count_records (rotsit_t *rs)
+static bool strbuf_append (struct strbuf_t *sb, const char *s, size_t n)
 {
-   if (!rs)
-      return 0;
-   return XVECT_LENGTH (rs->records);
+   if (sb->len + n >= sb->cap) {
+      size_t newcap = sb->cap ? sb->cap : 4096;
+      while (newcap <= sb->len + n) {
+         newcap *= 2;
+      }
+      char *tmp = mem_realloc (sb->buf, newcap);
+      if (!tmp)
+         return false;
+      sb->buf = tmp;
+      sb->cap = newcap;
+   }
+
+   memcpy (&sb->buf[sb->len], s, n);
+   sb->len += n;
+   return true;
 }
 
-rotrec_t *rotsit_get_record (rotsit_t *rs, uint32_t recnum)
+static bool strbuf_puts (struct strbuf_t *sb, const char *s)
 {
-   if (!rs || recnum >= rotsit_count_records (rs)) {
-      return NULL;
+   return strbuf_append (sb, s, strlen (s));
+}
+
+static bool rotrec_format (rotrec_t *rr, const char *source,
+                           struct strbuf_t *sb)
+{
+   bool ok = true;
+
+   ok = ok && strbuf_printf (sb,
+                  "------------------------------------------------\n");
+   if (source) {
+      ok = ok && strbuf_printf (sb, "[source: %s]\n", source);
+   }
+   ok = ok && strbuf_printf (sb,
+                  "[id: %s] [order: %s] [status: %s]\nOpened by [%s] on [%s]\n",
+                  rr->fields[RF_GUID],
+                  rr->fields[RF_ORDER],
+                  rr->fields[RF_STATUS],
+                  rr->fields[RF_OPENED_BY],
+                  rr->fields[RF_OPENED_ON]);
+   // TODO: Use the assigned/assigned_by/assigned_to fields.
+   char *closed = rr->fields[RF_CLOSED_BY];
+   if (closed && *closed) {
+      ok = ok && strbuf_printf (sb,
+                     "Closed by [%s] on [%s] with message: [%s]\n",
+                     rr->fields[RF_CLOSED_BY],
+                     rr->fields[RF_CLOSED_ON],
+                     rr->fields[RF_CLOSED_MSG]);
+   }
+   // RF_DUP_MSG is not printed: it occupies the same slot as the first
+   // comment field, and the duplicate message is the closing message.
+   char *duped = rr->fields[RF_DUP_BY];
+   if (duped && *duped) {
+      ok = ok && strbuf_printf (sb, "Marked DUPLICATE of [%s] by [%s]\n",
+                     rr->fields[RF_DUP_GUID],
+                     rr->fields[RF_DUP_BY]);
+   }
+   ok = ok && strbuf_printf (sb, "** %s **\n",
+                  rr->fields[RF_OPENED_MSG]);
+
+   ok = ok && strbuf_printf (sb, "----- COMMENTS -----\n");
+
+   size_t comment_num = RF_LAST_FIELD;
+   while (ok && (comment_num + 4) <= rr->nfields) {
+      char *c_guid    = rr->fields[comment_num++];
+      char *c_user    = rr->fields[comment_num++];
+      char *c_time    = rr->fields[comment_num++];
+      char *c_comment = rr->fields[comment_num++];
+      ok = strbuf_printf (sb, "++ [comment: %s] by [%s] on [%s]\n%s\n",
+                          c_guid, c_user, c_time, c_comment);
    }
 
-   return XVECT_INDEX (rs->records, recnum);
+   return ok;
 }
 
-void lower_string (char *src)
+bool rotrec_dump (rotrec_t *rr, FILE *outf)
 {
-   for (size_t i=0; src[i]; i++) {
-      src[i] = tolower (src[i]);
+   struct strbuf_t sb = { NULL, 0, 0 };
+
+   if (!outf)
+      outf = stdout;
+
+   if (!rr) {
+      fprintf (outf, "Cannot print a NULL rotrec_t data bject\n");
+      return false;
    }
+
+   rotsit_t *rs = rec_read_db (rr);
+   if (rs)
+      db_read_lock (rs);
+   bool ret = rotrec_format (rr, NULL, &sb);
+   if (rs)
+      db_read_unlock (rs);
+
+   ret = ret && fwrite (sb.buf, 1, sb.len, outf)==sb.len;
+   mem_free (sb.buf);
+   return ret;
 }
 
-#if 0    // Will come in handy when I add in case-insensitive matching
-static bool istrcmp (const char *lhs, const char *rhs)
+// The columns of the machine-readable formats, named as import expects
+// them. CSV and TSV follow these with one comment column for each comment
+// of the issue with the most comments.
+static const struct {
+   const char *name;
+   size_t field;
+} export_columns[] = {
+   { "guid",         RF_GUID        },
+   { "order",        RF_ORDER       },
+   { "opened_by",    RF_OPENED_BY   },
+   { "opened_on",    RF_OPENED_ON   },
+   { "message",      RF_OPENED_MSG  },
+   { "status",       RF_STATUS      },
+   { "assigned_by",  RF_ASSIGNED_BY },
+   { "assigned_to",  RF_ASSIGNED_TO },
+   { "assigned_on",  RF_ASSIGNED_ON },
+   { "closed_by",    RF_CLOSED_BY   },
+   { "closed_on",    RF_CLOSED_ON   },
+   { "closed_msg",   RF_CLOSED_MSG  },
+   { "dup_by",       RF_DUP_BY      },
+   { "dup_guid",     RF_DUP_GUID    },
+};
+
+#define NUM_EXPORT_COLUMNS    (sizeof export_columns/sizeof export_columns[0])
+
+static const char *export_value (rotrec_t *rr, size_t field)
 {
-   if (!lhs && rhs)
+   return field < rr->nfields ? rr->fields[field] : NULL;
+}
+
+// Most values need no escaping at all, so they are tested eight bytes at a
+// time for the characters that are special in each format, and copied in
+// one piece up to the first one found.
+#define SWAR_ONES          (0x0101010101010101ull)
+#define SWAR_HIGHS         (0x8080808080808080ull)
+#define SWAR_LESS(w,n)     (((w) - SWAR_ONES * (n)) & ~(w) & SWAR_HIGHS)
+#define SWAR_BYTE(w,b)     SWAR_LESS ((w) ^ (SWAR_ONES * (uint8_t)(b)), 1)
+
+static bool is_special (char c, rotsit_fmt_t fmt)
+{
+   switch (fmt) {
+      case rotsit_fmt_jsonl:  return (uint8_t)c < 0x20 || c=='"' || c=='\\';
+      case rotsit_fmt_csv:    return c==',' || c=='"' || c=='\n' || c=='\r';
+      case rotsit_fmt_tsv:    return c=='\t' || c=='\n' || c=='\r' || c=='\\';
+      default:                return false;
+   }
+}
+
+static size_t plain_span (const char *s, size_t len, rotsit_fmt_t fmt)
+{
+   size_t i = 0;
+
+   for (; i + 8 <= len; i += 8) {
+      uint64_t w, hit = 0;
+      memcpy (&w, &s[i], sizeof w);
+
+      switch (fmt) {
+         case rotsit_fmt_jsonl:
+            hit = SWAR_LESS (w, 0x20) | SWAR_BYTE (w, '"') |
+                  SWAR_BYTE (w, '\\');
+            break;
+         case rotsit_fmt_csv:
+            hit = SWAR_BYTE (w, ',') | SWAR_BYTE (w, '"') |
+                  SWAR_BYTE (w, '\n') | SWAR_BYTE (w, '\r');
+            break;
+         case rotsit_fmt_tsv:
+            hit = SWAR_BYTE (w, '\t') | SWAR_BYTE (w, '\n') |
+                  SWAR_BYTE (w, '\r') | SWAR_BYTE (w, '\\');
+            break;
+         default:
+            break;
+      }
+      if (hit)
+         break;
+   }
+
+   while (i < len && !is_special (s[i], fmt)) {
+      i++;
+   }
+   return i;
+}
+
+static bool append_json (struct strbuf_t *sb, const char *s)
+{
+   static const char hexdigits[] = "0123456789abcdef";
+
+   if (!s)
+      return strbuf_puts (sb, "null");
+
+   size_t len = strlen (s);
+   if (!strbuf_puts (sb, "\""))
       return false;
 
-   if (lhs && !rhs)
+   while (len) {
+      size_t n = plain_span (s, len, rotsit_fmt_jsonl);
+      if (!strbuf_append (sb, s, n))
+         return false;
+      s += n;
+      len -= n;
+      if (!len)
+         break;
+
+      char esc[6] = { '\\', *s, 0, 0, 0, 0 };
+      size_t esclen = 2;
+      switch (*s) {
+         case '"':   case '\\':                break;
+         case '\b':  esc[1] = 'b';             break;
+         case '\f':  esc[1] = 'f';             break;
+         case '\n':  esc[1] = 'n';             break;
+         case '\r':  esc[1] = 'r';             break;
+         case '\t':  esc[1] = 't';             break;
+         default:    esc[1] = 'u';
+                     esc[2] = '0';
+                     esc[3] = '0';
+                     esc[4] = hexdigits[(*s >> 4) & 0x0f];
+                     esc[5] = hexdigits[*s & 0x0f];
+                     esclen = 6;
+                     break;
+      }
+      if (!strbuf_append (sb, esc, esclen))
+         return false;
+      s++;
+      len--;
+   }
+
+   return strbuf_puts (sb, "\"");
+}
+
+static bool append_csv (struct strbuf_t *sb, const char *s)
+{
+   if (!s)
+      return true;
+
+   size_t len = strlen (s);
+   if (plain_span (s, len, rotsit_fmt_csv)==len)
+      return strbuf_append (sb, s, len);
+
+   if (!strbuf_puts (sb, "\""))
       return false;
 
-   while (*lhs && *rhs && (tolower (*lhs++) == tolower (*rhs++)))
-      ;
+   const char *quote;
+   while ((quote = memchr (s, '"', len))) {
+      size_t n = quote - s + 1;
+      if (!strbuf_append (sb, s, n) || !strbuf_puts (sb, "\""))
+         return false;
+      s += n;
+      len -= n;
+   }
 
-   return *lhs == *rhs;
+   return strbuf_append (sb, s, len) && strbuf_puts (sb, "\"");
 }
-#endif
 
-rotrec_t **rotsit_filter (rotsit_t *rs, const char *expr)
+static bool append_tsv (struct strbuf_t *sb, const char *s)
 {
-   bool error = true;
-   xvector_t *results = NULL;
-   rotrec_t **ret = NULL;
-   char **ltokens = NULL;
+   if (!s)
+      return true;
+
+   size_t len = strlen (s);
+   while (len) {
+      size_t n = plain_span (s, len, rotsit_fmt_tsv);
+      if (!strbuf_append (sb, s, n))
+         return false;
+      s += n;
+      len -= n;
+      if (!len)
+         break;
 
-   eval_t *ev = eval_new ( (void *(*) (const void *))xstr_dup,
-                           (void (*) (void *))free,
-                           exec_op, check_type);
+      char esc[2] = { '\\', *s };
+      switch (*s) {
+         case '\t':  esc[1] = 't';    break;
+         case '\n':  esc[1] = 'n';    break;
+         case '\r':  esc[1] = 'r';    break;
+         default:                     break;
+      }
+      if (!strbuf_append (sb, esc, 2))
+         return false;
+      s++;
+      len--;
+   }
+   return true;
+}
 
-   char **tokens = make_tokens (expr);
-   uint32_t num_records = 0;
+static bool rotrec_format_jsonl (rotrec_t *rr, const char *source,
+                                 struct strbuf_t *sb)
+{
+   static const char *comment_keys[] = {
+      "{\"guid\":", ",\"user\":", ",\"time\":", ",\"comment\":",
+   };
+   bool ok = strbuf_puts (sb, "{");
 
-   if (!rs) {
-      XERROR ("Passed a NULL rotsit database.\n");
-      goto errorexit;
+   if (source) {
+      ok = ok && strbuf_puts (sb, "\"source\":") &&
+           append_json (sb, source) && strbuf_puts (sb, ",");
    }
 
-   if (!expr || !*expr) {
-      XERROR ("Expression is empty.\n");
-      goto errorexit;
+   for (size_t i=0; ok && i<NUM_EXPORT_COLUMNS; i++) {
+      ok = (i==0 || strbuf_puts (sb, ",")) &&
+           strbuf_puts (sb, "\"") &&
+           strbuf_puts (sb, export_columns[i].name) &&
+           strbuf_puts (sb, "\":") &&
+           append_json (sb, export_value (rr, export_columns[i].field));
    }
 
-   num_records = rotsit_count_records (rs);
-   if (!num_records) {
-      XERROR ("Database is empty, cowardly refusing to search it.\n");
-      goto errorexit;
+   ok = ok && strbuf_puts (sb, ",\"comments\":[");
+   for (size_t i=0; ok && i<comment_count (rr); i++) {
+      for (size_t j=0; ok && j<4; j++) {
+         ok = (i==0 || j>0 || strbuf_puts (sb, ",")) &&
+              strbuf_puts (sb, comment_keys[j]) &&
+              append_json (sb, rr->fields[RF_LAST_FIELD + i * 4 + j]);
+      }
+      ok = ok && strbuf_puts (sb, "}");
    }
 
-   if (!ev) {
-      XERROR ("Failed to create expression execution context.\n");
-      goto errorexit;
+   return ok && strbuf_puts (sb, "]}\n");
+}
+
+static bool rotrec_format_table (rotrec_t *rr, const char *source,
+                                 struct strbuf_t *sb, rotsit_fmt_t fmt,
+                                 size_t ncomments)
+{
+   bool (*append) (struct strbuf_t *, const char *) =
+         fmt==rotsit_fmt_csv ? append_csv : append_tsv;
+   const char *sep = fmt==rotsit_fmt_csv ? "," : "\t";
+   bool ok = true;
+
+   if (source) {
+      ok = append (sb, source) && strbuf_puts (sb, sep);
    }
 
-   if (!tokens) {
-      XERROR ("Failed to tokenise input expression.\n");
-      goto errorexit;
+   for (size_t i=0; ok && i<NUM_EXPORT_COLUMNS; i++) {
+      ok = (i==0 || strbuf_puts (sb, sep)) &&
+           append (sb, export_value (rr, export_columns[i].field));
    }
 
-   for (size_t i=0; i<num_records; i++) {
-      int iresult = -1;
-      rotrec_t *rr = rotsit_get_record (rs, i);
+   size_t nactual = comment_count (rr);
+   for (size_t i=0; ok && i<ncomments; i++) {
+      ok = strbuf_puts (sb, sep) &&
+           (i >= nactual ||
+            append (sb, rr->fields[RF_LAST_FIELD + i * 4 + CF_COMMENT]));
+   }
 
-      ltokens = xstr_cpyarray ((const char **)tokens);
-      if (!fsubst (ltokens, rr)) {
-         XERROR ("Error during variable substitution.\n");
-         goto errorexit;
+   return ok && (fmt==rotsit_fmt_csv ? strbuf_puts (sb, "\r\n")
+                                     : strbuf_puts (sb, "\n"));
+}
+
+static bool format_header (struct strbuf_t *sb, rotsit_fmt_t fmt,
+                           bool sources, size_t ncomments)
+{
+   const char *sep = fmt==rotsit_fmt_csv ? "," : "\t";
+   bool ok = true;
+
+   if (fmt!=rotsit_fmt_csv && fmt!=rotsit_fmt_tsv)
+      return true;
+
+   if (sources) {
+      ok = strbuf_puts (sb, "source") && strbuf_puts (sb, sep);
+   }
+
+   for (size_t i=0; ok && i<NUM_EXPORT_COLUMNS; i++) {
+      ok = (i==0 || strbuf_puts (sb, sep)) &&
+           strbuf_puts (sb, export_columns[i].name);
+   }
+   for (size_t i=0; ok && i<ncomments; i++) {
+      ok = strbuf_puts (sb, sep) && strbuf_puts (sb, "comment");
+   }
+
+   return ok && (fmt==rotsit_fmt_csv ? strbuf_puts (sb, "\r\n")
+                                     : strbuf_puts (sb, "\n"));
+}
+
+// Export formats a contiguous slice of the records per thread, each into
+// its own buffer. The slices are written out in order as they complete,
+// so writing the first slice overlaps with formatting the others.
+#define EXPORT_MIN_RECORDS    (2048)
+#define EXPORT_MAX_THREADS    (64)
+
+struct export_slice_t {
+   rotrec_t **records;
+   const char **sources;
+   size_t start;
+   size_t end;
+   rotsit_fmt_t fmt;
+   size_t ncomments;
+   struct strbuf_t sb;
+   bool ok;
+   // The buffers are freed by the caller, so they come from its allocator
+   rotsit_allocator_t allocator;
+   bool allocator_set;
+};
+
+static void *export_slice (void *arg)
+{
+   struct export_slice_t *slice = arg;
+
+   rotsit_set_allocator (slice->allocator_set ? &slice->allocator : NULL);
+   slice->ok = true;
+   for (size_t i=slice->start; slice->ok && i<slice->end; i++) {
+      rotrec_t *rr = slice->records[i];
+      const char *source = slice->sources ? slice->sources[i] : NULL;
+      switch (slice->fmt) {
+         case rotsit_fmt_jsonl:
+            slice->ok = rotrec_format_jsonl (rr, source, &slice->sb);
+            break;
+         case rotsit_fmt_csv:
+         case rotsit_fmt_tsv:
+            slice->ok = rotrec_format_table (rr, source, &slice->sb,
+                                             slice->fmt, slice->ncomments);
+            break;
+         default:
+            slice->ok = rotrec_format (rr, source, &slice->sb);
+            break;
       }
+   }
+   return NULL;
+}
 
-      char *sresult = eval_execute (ev, (const void **)ltokens);
-      if (!sresult) {
-         XERROR ("Internal error during expression evaluation.\n");
-         for (size_t i=0; ltokens[i]; i++) {
-            XERROR ("Token %i: [%s]\n", i, ltokens[i]);
-         }
+static size_t export_threads (size_t nthreads, size_t nrecords)
+{
+   if (!nthreads) {
+#ifdef PLATFORM_POSIX
+      long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+      nthreads = ncpus > 0 ? ncpus : 1;
+#else
+      nthreads = 1;
+#endif
+   }
 
-         goto errorexit;
+#ifndef PLATFORM_POSIX
+   nthreads = 1;
+#endif
+
+   size_t max = nrecords / EXPORT_MIN_RECORDS;
+   if (nthreads > max)
+      nthreads = max;
+   if (nthreads > EXPORT_MAX_THREADS)
+      nthreads = EXPORT_MAX_THREADS;
+
+   return nthreads ? nthreads : 1;
+}
+
+static bool export_records (rotrec_t **records, const char **sources,
+                            size_t nrecords, FILE *outf, rotsit_fmt_t fmt,
+                            size_t nthreads)
+{
+   bool error = true;
+   struct export_slice_t slices[EXPORT_MAX_THREADS];
+#ifdef PLATFORM_POSIX
+   pthread_t threads[EXPORT_MAX_THREADS];
+#endif
+   size_t nstarted = 1;
+   size_t ncomments = 0;
+   struct strbuf_t header = { NULL, 0, 0 };
+
+   if (fmt==rotsit_fmt_csv || fmt==rotsit_fmt_tsv) {
+      for (size_t i=0; i<nrecords; i++) {
+         size_t n = comment_count (records[i]);
+         ncomments = n > ncomments ? n : ncomments;
       }
+   }
 
-      // TODO: Remove this diagnostic
-      sscanf (sresult, "%i", &iresult);
-      // XERROR ("RESULT: [%s]\n", sresult);
-      free (sresult);
+   if (!format_header (&header, fmt, sources!=NULL, ncomments) ||
+       (header.len && fwrite (header.buf, 1, header.len, outf)!=header.len)) {
+      XERROR ("Failed to write export\n");
+      mem_free (header.buf);
+      return false;
+   }
+   mem_free (header.buf);
+
+   nthreads = export_threads (nthreads, nrecords);
+
+   memset (slices, 0, sizeof slices);
+   for (size_t i=0; i<nthreads; i++) {
+      slices[i].records = records;
+      slices[i].sources = sources;
+      slices[i].start = nrecords * i / nthreads;
+      slices[i].end = nrecords * (i + 1) / nthreads;
+      slices[i].fmt = fmt;
+      slices[i].ncomments = ncomments;
+      slices[i].allocator_set = rotsit_get_allocator (&slices[i].allocator);
+   }
 
-      if (iresult==1) {
-         xvector_t *tmp = xvector_ins_tail (results, rr);
-         if (!tmp) {
-            XERROR ("Out of memory error.\n");
-            goto errorexit;
-         }
-         results = tmp;
-         // XERROR ("Matched\n");
+#ifdef PLATFORM_POSIX
+   for (; nstarted<nthreads; nstarted++) {
+      if (pthread_create (&threads[nstarted], NULL, export_slice,
+                          &slices[nstarted])!=0) {
+         // Whatever was not started is formatted by this thread instead
+         break;
       }
+   }
+#endif
 
-      xstr_delarray (ltokens); ltokens = NULL;
+   export_slice (&slices[0]);
+   for (size_t i=nstarted; i<nthreads; i++) {
+      export_slice (&slices[i]);
    }
 
    error = false;
+   for (size_t i=0; i<nthreads; i++) {
+#ifdef PLATFORM_POSIX
+      if (i > 0 && i < nstarted) {
+         pthread_join (threads[i], NULL);
+      }
+#endif
+      if (!slices[i].ok) {
+         XERROR ("Out of memory\n");
+         error = true;
+      }
+
+      if (!error && slices[i].sb.len &&
+          fwrite (slices[i].sb.buf, 1, slices[i].sb.len, outf)!=
+                  slices[i].sb.len) {
+         XERROR ("Failed to write export\n");
+         error = true;
+      }
+      mem_free (slices[i].sb.buf);
+   }
+
+   return !error;
+}
+
+// The databases that the records of a list belong to, which are kept
+// read-locked while the list is exported.
+struct owners_t {
+   rotsit_t **dbs;
+   size_t ndbs;
+};
+
+static bool owners_lock (struct owners_t *ow, rotrec_t **records,
+                         size_t nrecords)
+{
+   size_t maxdbs = 0;
+
+   memset (ow, 0, sizeof *ow);
+   for (size_t i=0; i<nrecords; i++) {
+      rotsit_t *rs = rec_read_db (records[i]);
+      if (!rs || (ow->ndbs && ow->dbs[ow->ndbs - 1]==rs))
+         continue;
+
+      if (ow->ndbs==maxdbs) {
+         maxdbs = maxdbs ? maxdbs * 2 : 8;
+         rotsit_t **tmp = mem_realloc (ow->dbs, maxdbs * sizeof *tmp);
+         if (!tmp) {
+            XERROR ("Out of memory\n");
+            mem_free (ow->dbs);
+            return false;
+         }
+         ow->dbs = tmp;
+      }
+      ow->dbs[ow->ndbs++] = rs;
+   }
+
+   ow->ndbs = db_read_lock_all (ow->dbs, ow->ndbs);
+   return true;
+}
+
+static void owners_unlock (struct owners_t *ow)
+{
+   db_read_unlock_all (ow->dbs, ow->ndbs);
+   mem_free (ow->dbs);
+}
+
+bool rotsit_export (rotsit_t *rs, FILE *outf, rotsit_fmt_t fmt,
+                    size_t nthreads)
+{
+   bool ret = false;
+
+   if (!rs || !outf)
+      return false;
 
-errorexit:
-   if (error) {
-      for (size_t i=0; ret && *ret; i++) {
-         rotrec_del (ret[i]);
-      }
-      free (ret);
-      ret = NULL;
+   db_read_lock (rs);
+   size_t nrecords = rs->records.len;
+   rotrec_t **records = mem_alloc ((nrecords + 1) * sizeof *records);
+   if (!records) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
    }
 
-   eval_del (ev);
-   xstr_delarray (tokens);
-   xstr_delarray (ltokens);
+   for (size_t i=0; i<nrecords; i++) {
+      records[i] = rs->records.items[i];
+   }
 
-   ret = xvector_native (results);
+   ret = export_records (records, NULL, nrecords, outf, fmt, nthreads);
+   mem_free (records);
 
-   if (!ret[0]) {
-      XERROR ("Warning: filter [%s] matched no records\n", expr);
-   }
-   xvector_free (results);
+errorexit:
+   db_read_unlock (rs);
    return ret;
 }
 
-rotrec_t *rotsit_find_by_id (rotsit_t *rs, const char *id)
+bool rotsit_export_list (rotrec_t **records, FILE *outf, rotsit_fmt_t fmt,
+                         size_t nthreads)
 {
-   if (!rs || !id)
-      return NULL;
+   size_t nrecords = 0;
 
-   for (size_t i=0; i<XVECT_LENGTH (rs->records); i++) {
+   if (!records || !outf)
+      return false;
 
-      rotrec_t *rec = XVECT_INDEX (rs->records, i);
+   while (records[nrecords])
+      nrecords++;
 
-      if (strcmp (XVECT_INDEX (rec->fields, RF_GUID), id)==0)
-         return rec;
-   }
+   struct owners_t owners;
+   if (!owners_lock (&owners, records, nrecords))
+      return false;
 
-   return NULL;
+   bool ret = export_records (records, NULL, nrecords, outf, fmt, nthreads);
+   owners_unlock (&owners);
+   return ret;
 }
 
-bool rotsit_add_record (rotsit_t *rs, rotrec_t *rr)
+bool rotsit_export_sources (rotrec_t **records, const char **sources,
+                            FILE *outf, rotsit_fmt_t fmt, size_t nthreads)
 {
-   if (!rs || !rr)
+   size_t nrecords = 0;
+
+   if (!records || !sources || !outf)
       return false;
 
-   if (!safe_xvadd (&rs->records, rr)) {
-      XERROR ("Failed to store record\n");
+   while (records[nrecords])
+      nrecords++;
+
+   struct owners_t owners;
+   if (!owners_lock (&owners, records, nrecords))
       return false;
-   }
 
-   return true;
+   bool ret = export_records (records, sources, nrecords, outf, fmt,
+                              nthreads);
+   owners_unlock (&owners);
+   return ret;
 }
 
-uint32_t (*rotsit_user_rand) (void);
+// A snapshot is a database as parsed, with its date and GUID indexes,
+// written out so that a later load can map it and skip parsing the text
+// and every date in it. It is tied to the text it was made from by the
+// length and hash of that text, and to the local time zone the dates were
+// read in, and is otherwise stale. After the header,
+// with every section a multiple of 8 bytes long, come:
+//
+//    struct snaprec_t     [nrecords]
+//    uint32_t             [nfields]         Length of each field in turn
+//    for each date field:
+//       int64_t           [nrecords]        SNAP_NODATE if not a date
+//       struct datekey_t  [ndatekeys[i]]
+//    struct guidkey_t     [nguidkeys]
+//
+// Everything is in the byte order of the machine that wrote it, so a
+// snapshot from a machine with another byte order is treated as stale.
+#define SNAP_MAGIC         ("ROTSNAP")
+#define SNAP_VERSION       (2)
+#define SNAP_BYTEORDER     (0x01020304)
+#define SNAP_NODATE        (INT64_MIN)
+#define SNAP_HASH_INIT     (0xcbf29ce484222325ull)
+#define SNAP_HASH_PRIME    (0x100000001b3ull)
+#define SNAP_LENS          (512)
+
+struct snaphdr_t {
+   char magic[8];
+   uint32_t version;
+   uint32_t byteorder;
+   uint64_t size;          // Of the whole snapshot
+   uint64_t bodyhash;      // Of everything after the header
+   uint64_t textlen;
+   uint64_t texthash;
+   uint64_t tzhash;        // Of the local time zone, see snap_tzhash()
+   uint64_t nrecords;
+   uint64_t nfields;
+   uint64_t order_next;
+   uint64_t ndatekeys[NUM_DATE_FIELDS];
+   uint64_t nguidkeys;
+   uint64_t nunindexed;
+};
 
-static uint64_t local_rand (size_t num_bytes)
-{
-#ifdef PLATFORM_WINDOWS
-#define SHIFTWIDTH         (8)
-#else
-#define SHIFTWIDTH         (8)
-#endif
+struct snaprec_t {
+   uint64_t offset;        // Of the first field in the text
+   uint64_t nfields;
+};
 
-   uint64_t ret = 0;
+// FNV-1a taken a word at a time, with the high half folded back in so
+// that every bit of the input reaches the low bits. A staleness check
+// only, not a defence against anyone.
+static uint64_t snap_hash (uint64_t hash, const void *data, size_t len)
+{
+   const uint8_t *bytes = data;
+   size_t i = 0;
+
+   for (; i + 8 <= len; i += 8) {
+      uint64_t word;
+      memcpy (&word, &bytes[i], sizeof word);
+      hash = (hash ^ word) * SNAP_HASH_PRIME;
+      hash ^= hash >> 32;
+   }
+   for (; i<len; i++) {
+      hash = (hash ^ bytes[i]) * SNAP_HASH_PRIME;
+   }
+   return hash;
+}
 
-   num_bytes = num_bytes > 8 ? 8 : num_bytes;
+// Every date is read as local time, so the epochs in a snapshot are only
+// good in the time zone they were made in. The zone is identified by its
+// name, if it has one, and by the epoch of noon in winter and summer of a
+// few years, read the same way pdate_parse() reads them.
+static uint64_t snap_tzhash (void)
+{
+   static const int years[] = { 1980, 2000, 2020, 2040 };
+   static const int months[] = { 0, 6 };
+   uint64_t ret = SNAP_HASH_INIT;
 
-   if (!rotsit_user_rand) {
-      xcrypto_random ((uint8_t *)&ret, num_bytes);
-      return ret;
+   const char *tz = getenv ("TZ");
+   if (tz) {
+      ret = snap_hash (ret, tz, strlen (tz) + 1);
    }
-
-   for (size_t i=0; i<num_bytes+1; i++) {
-      uint32_t r = rotsit_user_rand ();
-      uint8_t t = (r >> SHIFTWIDTH) & 0xff;
-      ret = ret << 8;
-      ret |= t;
+   for (size_t i=0; i<sizeof years / sizeof years[0]; i++) {
+      for (size_t j=0; j<sizeof months / sizeof months[0]; j++) {
+         struct tm tm;
+         memset (&tm, 0, sizeof tm);
+         tm.tm_hour = 12;
+         tm.tm_mday = 1;
+         tm.tm_mon = months[j];
+         tm.tm_year = years[i] - 1900;
+         int64_t epoch = mktime (&tm);
+         ret = snap_hash (ret, &epoch, sizeof epoch);
+      }
    }
-#undef SHIFTWIDTH
    return ret;
 }
 
-static char *make_guid (void)
+static size_t snap_size (const struct snaphdr_t *hdr)
 {
-   uint64_t guid;
-
-   char *str_guid = malloc (2 + 16 + 1); // 0x + 16 digits + 0
-
-   if (!str_guid) {
-      XERROR ("Out of memory\n");
-      return NULL;
+   size_t ret = sizeof *hdr +
+                hdr->nrecords * sizeof (struct snaprec_t) +
+                (hdr->nfields + (hdr->nfields & 1)) * sizeof (uint32_t) +
+                hdr->nguidkeys * sizeof (struct guidkey_t);
+
+   for (size_t i=0; i<NUM_DATE_FIELDS; i++) {
+      ret += hdr->nrecords * sizeof (int64_t) +
+             hdr->ndatekeys[i] * sizeof (struct datekey_t);
    }
-
-   // xcrypto_random ((uint8_t *)&guid, sizeof guid);
-   guid = local_rand (8);
-
-   sprintf (str_guid, "0x%016" PRIx64, guid);
-   return str_guid;
+   return ret;
 }
 
-static char *make_username (void)
+#ifdef PLATFORM_POSIX
+static uint8_t *snap_map (const char *fname, size_t *len)
 {
-   char *str_user = NULL;
-   char *tmp_user = getenv (ENV_USERNAME);
-
-   str_user = xstr_dup (tmp_user ? tmp_user : "Unknown");
+   uint8_t *ret = NULL;
+   struct stat sb;
 
-   if (!str_user) {
-      XERROR ("Out of memory\n");
+   int fd = open (fname, O_RDONLY);
+   if (fd < 0)
       return NULL;
+
+   if (fstat (fd, &sb)==0 && sb.st_size > 0) {
+      ret = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ret==MAP_FAILED) {
+         ret = NULL;
+      } else {
+         *len = sb.st_size;
+      }
    }
 
-   return str_user;
+   close (fd);
+   return ret;
 }
 
-// TODO: Make this function thread-safe. Might need a mutex because
-// localtime_r is not available on MingW32.
-static char *make_time (time_t time_s)
+static void snap_unmap (uint8_t *snap, size_t len)
 {
-   char *str_time = NULL;
-   if (!time_s) {
-      time_s = time (NULL);
-   }
+   munmap (snap, len);
+}
 
-   str_time = xstr_dup (asctime (localtime (&time_s)));
-   if (!str_time) {
-      XERROR ("Out of memory\n");
+#else
+static uint8_t *snap_map (const char *fname, size_t *len)
+{
+   uint8_t *ret = NULL;
+   long flen;
+
+   FILE *inf = fopen (fname, "rb");
+   if (!inf)
       return NULL;
+
+   if (fseek (inf, 0, SEEK_END)==0 && (flen = ftell (inf)) > 0 &&
+       fseek (inf, 0, SEEK_SET)==0 && (ret = mem_alloc (flen))) {
+      if (fread (ret, 1, flen, inf)==(size_t)flen) {
+         *len = flen;
+      } else {
+         mem_free (ret);
+         ret = NULL;
+      }
    }
 
-   char *tmp = strchr (str_time, '\n');
-   if (tmp)
-      *tmp = 0;
+   fclose (inf);
+   return ret;
+}
 
-   return str_time;
+static void snap_unmap (uint8_t *snap, size_t len)
+{
+   (void)len;
+   mem_free (snap);
 }
+#endif
 
-rotrec_t *rotrec_new (const char *msg)
+// Restores the records and indexes of rs, which holds nothing but the
+// text, from snap. Anything in the snapshot that does not match the text
+// makes it stale; rs is then only fit to be deleted.
+static bool snap_restore (rotsit_t *rs, const uint8_t *snap, size_t len,
+                          uint64_t texthash)
 {
    bool error = true;
-   static char *fields[] = {
-      NULL, NULL, NULL, NULL,
-      NULL, NULL, NULL, NULL,
-      NULL, NULL, NULL, NULL,
-      NULL, NULL,
-   };
-
-   rotrec_t *ret = malloc (sizeof *ret);
+   char **fields = NULL;
+   size_t maxfields = 0;
+   struct snaphdr_t hdr;
 
-   if (!ret) {
-      XERROR ("Out of memory\n");
+   if (len < sizeof hdr)
       goto errorexit;
+   memcpy (&hdr, snap, sizeof hdr);
+
+   if (memcmp (hdr.magic, SNAP_MAGIC, sizeof hdr.magic)!=0 ||
+       hdr.version != SNAP_VERSION ||
+       hdr.byteorder != SNAP_BYTEORDER ||
+       hdr.size != len ||
+       hdr.textlen != rs->text->len ||
+       hdr.texthash != texthash ||
+       hdr.tzhash != snap_tzhash ())
+      goto errorexit;
+
+   // No count can be larger than the file, which also keeps snap_size()
+   // from overflowing.
+   bool sane = hdr.nrecords <= len && hdr.nfields <= len &&
+               hdr.nguidkeys + hdr.nunindexed==hdr.nrecords &&
+               hdr.nguidkeys <= hdr.nrecords &&
+               hdr.nrecords <= UINT32_MAX;
+   for (size_t i=0; i<NUM_DATE_FIELDS; i++) {
+      sane = sane && hdr.ndatekeys[i] <= hdr.nrecords;
    }
-   ret->fields = NULL;
+   if (!sane || snap_size (&hdr)!=len ||
+       snap_hash (SNAP_HASH_INIT, &snap[sizeof hdr],
+                  len - sizeof hdr)!=hdr.bodyhash)
+      goto errorexit;
 
-   for (size_t i=0; i<sizeof fields/sizeof fields[0]; i++) {
-      xvector_t *tmp = xvector_ins_tail (ret->fields, fields[i]);
-      if (!tmp) {
-         XERROR ("Out of memory\n");
+   const uint8_t *sect = &snap[sizeof hdr];
+   const struct snaprec_t *recs = (const struct snaprec_t *)sect;
+   sect += hdr.nrecords * sizeof *recs;
+   const uint32_t *lens = (const uint32_t *)sect;
+   sect += (hdr.nfields + (hdr.nfields & 1)) * sizeof *lens;
+
+   size_t flen = strlen (FIELD_DELIM);
+   size_t fieldnum = 0;
+   for (size_t i=0; i<hdr.nrecords; i++) {
+      uint64_t pos = recs[i].offset;
+      uint64_t nfields = recs[i].nfields;
+
+      if (!nfields || nfields > hdr.nfields - fieldnum ||
+          !fields_reserve (&fields, &maxfields, nfields))
          goto errorexit;
+
+      for (size_t j=0; j<nfields; j++) {
+         uint64_t l = lens[fieldnum++];
+         if (pos > rs->text->len || rs->text->len - pos < l + flen ||
+             memcmp (&rs->text->buf[pos + l], FIELD_DELIM, flen)!=0)
+            goto errorexit;
+
+         rs->text->buf[pos + l] = 0;
+         fields[j] = &rs->text->buf[pos];
+         pos += l + flen;
       }
-      ret->fields = tmp;
-   }
 
-   // First field/0 must get a GUID. For now simply using a random number -
-   // the extra search space by not limiting certain bits to dates
-   // decreases the probability of a collision.
-   char *str_guid = make_guid ();
-   if (!str_guid) {
-      goto errorexit;
-   }
-   XVECT_INDEX (ret->fields, RF_GUID) = str_guid;
+      rotrec_t *rec = new_rotrec (fields, nfields);
+      if (!rec) {
+         XERROR ("Out of memory failure\n");
+         goto errorexit;
+      }
+      rec->owner = rs;
+      rec->text = rs->text;
+      rec->recnum = i;
 
-   // Third field/2 must be set to the current user
-   char *str_user = make_username ();
-   if (!str_user) {
-      goto errorexit;
+      if (!memvec_push (&rs->records, rec)) {
+         XERROR ("Failed to store record\n");
+         rotrec_del (rec);
+         goto errorexit;
+      }
    }
-   XVECT_INDEX (ret->fields, RF_OPENED_BY) = str_user;
-
-   // Fourth field/3 must be set to the current time
-   char *str_time = make_time (0);
-   if (!str_time) {
+   if (fieldnum != hdr.nfields)
       goto errorexit;
-   }
-   XVECT_INDEX (ret->fields, RF_OPENED_ON) = str_time;
+   rs->order_next = hdr.order_next;
+
+   for (size_t i=0; i<NUM_DATE_FIELDS; i++) {
+      struct dateidx_t *di = &rs->dates[i];
+      const int64_t *epochs = (const int64_t *)sect;
+      sect += hdr.nrecords * sizeof *epochs;
+      const struct datekey_t *keys = (const struct datekey_t *)sect;
+      sect += hdr.ndatekeys[i] * sizeof *keys;
+
+      di->keys = mem_alloc ((hdr.ndatekeys[i] ? hdr.ndatekeys[i] : 1) *
+                            sizeof *di->keys);
+      di->epochs = mem_alloc ((hdr.nrecords ? hdr.nrecords : 1) *
+                              sizeof *di->epochs);
+      di->valid = bitmap_new (hdr.nrecords);
+      if (!di->keys || !di->epochs || !di->valid) {
+         XERROR ("Out of memory\n");
+         goto errorexit;
+      }
 
-   // Fifth field/4 must be set to the message
-   char *str_msg = xstr_dup (msg);
-   if (!str_msg) {
-      XERROR ("Out of memory\n");
-      goto errorexit;
+      memcpy (di->epochs, epochs, hdr.nrecords * sizeof *epochs);
+      for (size_t j=0; j<hdr.nrecords; j++) {
+         if (epochs[j] != SNAP_NODATE)
+            bitmap_set (di->valid, j);
+      }
+
+      memcpy (di->keys, keys, hdr.ndatekeys[i] * sizeof *keys);
+      for (size_t j=0; j<hdr.ndatekeys[i]; j++) {
+         if (keys[j].recnum >= hdr.nrecords)
+            goto errorexit;
+      }
+      di->nkeys = hdr.ndatekeys[i];
+      di->built = true;
    }
-   XVECT_INDEX (ret->fields, RF_OPENED_MSG) = str_msg;
 
-   // Set the status to OPEN
-   char *str_status = xstr_dup ("OPEN");
-   if (!str_status) {
+   struct guididx_t *gi = &rs->guids;
+   const struct guidkey_t *keys = (const struct guidkey_t *)sect;
+   gi->keys = mem_alloc ((hdr.nguidkeys ? hdr.nguidkeys : 1) * sizeof *keys);
+   if (!gi->keys) {
       XERROR ("Out of memory\n");
       goto errorexit;
    }
-   XVECT_INDEX (ret->fields, RF_STATUS) = str_status;
+   memcpy (gi->keys, keys, hdr.nguidkeys * sizeof *keys);
+   for (size_t j=0; j<hdr.nguidkeys; j++) {
+      if (keys[j].recnum >= hdr.nrecords)
+         goto errorexit;
+   }
+   gi->nkeys = hdr.nguidkeys;
+   gi->nunindexed = hdr.nunindexed;
+   gi->built = true;
 
    error = false;
 errorexit:
-   if (error) {
-      rotrec_del (ret);
-      ret = NULL;
-   }
-   return ret;
+   mem_free (fields);
+   return !error;
 }
 
-bool rotrec_add_comment (rotrec_t *rr, const char *comment)
+struct snapout_t {
+   FILE *outf;
+   uint64_t hash;
+   bool ok;
+};
+
+// Every section is a multiple of 8 bytes, so hashing the pieces as they
+// are written gives the same hash as hashing the body in one go.
+static void snap_put (struct snapout_t *so, const void *data, size_t len)
+{
+   so->hash = snap_hash (so->hash, data, len);
+   so->ok = so->ok && fwrite (data, 1, len, so->outf)==len;
+}
+
+// Writes a snapshot of rs, which must not have changed since it was
+// parsed and must have all its date indexes and the GUID index built.
+static bool snap_write (rotsit_t *rs, const char *cachefile,
+                        uint64_t texthash)
 {
    bool error = true;
-   char *new_fields[4] = { NULL, NULL, NULL, NULL };
-   xvector_t *newxv = NULL;
+   struct snapout_t so = { NULL, SNAP_HASH_INIT, true };
+   struct snaphdr_t hdr;
+   size_t nrecords = rs->records.len;
+   size_t flen = strlen (FIELD_DELIM);
+   uint32_t lens[SNAP_LENS];
+   size_t nlens = 0;
+
+   char *tmpname = mem_strcat (cachefile, ".tmp", NULL);
+   if (!tmpname) {
+      XERROR ("Out of memory\n");
+      goto errorexit;
+   }
 
-   if (!rr || !comment)
-      return false;
+   if (!(so.outf = fopen (tmpname, "wb"))) {
+      XERROR ("Unable to create [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
 
-   new_fields[0] = make_guid ();
-   new_fields[1] = make_username ();
-   new_fields[2] = make_time (0);
-   new_fields[3] = xstr_dup (comment);
+   memset (&hdr, 0, sizeof hdr);
+   memcpy (hdr.magic, SNAP_MAGIC, sizeof hdr.magic);
+   hdr.version = SNAP_VERSION;
+   hdr.byteorder = SNAP_BYTEORDER;
+   hdr.textlen = rs->text->len;
+   hdr.texthash = texthash;
+   hdr.tzhash = snap_tzhash ();
+   hdr.nrecords = nrecords;
+   hdr.order_next = rs->order_next;
+   for (size_t i=0; i<NUM_DATE_FIELDS; i++) {
+      hdr.ndatekeys[i] = rs->dates[i].nkeys;
+   }
+   hdr.nguidkeys = rs->guids.nkeys;
+   hdr.nunindexed = rs->guids.nunindexed;
+
+   // Filled in once the body has been written
+   so.ok = fwrite (&hdr, sizeof hdr, 1, so.outf)==1;
+
+   for (size_t i=0; i<nrecords; i++) {
+      rotrec_t *rr = rs->records.items[i];
+      struct snaprec_t rec = {
+         (uint64_t)(rr->fields[0] - rs->text->buf), rr->nfields,
+      };
+      snap_put (&so, &rec, sizeof rec);
+      hdr.nfields += rr->nfields;
+   }
 
-   for (size_t i=0; i<sizeof new_fields/sizeof new_fields[0]; i++) {
-      if (!new_fields[i]) {
-         XERROR ("Out of memory\n");
+   // Only fields that are still where the parse left them can be restored
+   for (size_t i=0; i<nrecords; i++) {
+      rotrec_t *rr = rs->records.items[i];
+      if (rr->fields[0] < rs->text->buf ||
+          rr->fields[0] >= rs->text->buf + rs->text->len)
          goto errorexit;
+
+      for (size_t j=0; j<rr->nfields; j++) {
+         size_t l = strlen (rr->fields[j]);
+         if (j + 1 < rr->nfields &&
+             rr->fields[j + 1] != &rr->fields[j][l + flen])
+            goto errorexit;
+
+         lens[nlens++] = l;
+         if (nlens==SNAP_LENS) {
+            snap_put (&so, lens, sizeof lens);
+            nlens = 0;
+         }
       }
    }
-
-   for (size_t i=0; i<sizeof new_fields/sizeof new_fields[0]; i++) {
-      xvector_t *tmp = xvector_ins_tail (newxv, new_fields[i]);
-      if (!tmp) {
-         XERROR ("Out of memory\n");
-         goto errorexit;
+   if (nlens & 1) {
+      lens[nlens++] = 0;
+   }
+   snap_put (&so, lens, nlens * sizeof *lens);
+
+   for (size_t i=0; i<NUM_DATE_FIELDS; i++) {
+      struct dateidx_t *di = &rs->dates[i];
+      for (size_t j=0; j<nrecords; j++) {
+         int64_t epoch = bitmap_test (di->valid, j) ? di->epochs[j]
+                                                    : SNAP_NODATE;
+         snap_put (&so, &epoch, sizeof epoch);
+      }
+      for (size_t j=0; j<di->nkeys; j++) {
+         // Copied so that the padding is written as zeros
+         struct datekey_t key;
+         memset (&key, 0, sizeof key);
+         key.epoch = di->keys[j].epoch;
+         key.recnum = di->keys[j].recnum;
+         snap_put (&so, &key, sizeof key);
       }
-      newxv = tmp;
    }
 
-   xvector_t *tmp = xvector_join (rr->fields, newxv);
-   if (!tmp) {
-      XERROR ("Out of memory\n");
-      goto errorexit;
+   for (size_t i=0; i<rs->guids.nkeys; i++) {
+      struct guidkey_t key;
+      memset (&key, 0, sizeof key);
+      key.guid = rs->guids.keys[i].guid;
+      key.recnum = rs->guids.keys[i].recnum;
+      snap_put (&so, &key, sizeof key);
    }
 
-   xvector_t *swap_tmp = rr->fields;
-   rr->fields = tmp;
-   xvector_free (swap_tmp);
-   xvector_free (newxv);
+   hdr.size = snap_size (&hdr);
+   hdr.bodyhash = so.hash;
+   if (!so.ok || fseek (so.outf, 0, SEEK_SET)!=0 ||
+       fwrite (&hdr, sizeof hdr, 1, so.outf)!=1) {
+      XERROR ("Unable to write [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
 
-   error = false;
+   int rc = fclose (so.outf);
+   so.outf = NULL;
+   if (rc!=0) {
+      XERROR ("Unable to write [%s]: %m\n", tmpname);
+      goto errorexit;
+   }
 
-errorexit:
-   if (error) {
-      for (size_t i=0; i<sizeof new_fields/sizeof new_fields[0]; i++) {
-         free (new_fields [i]);
-      }
+#ifndef PLATFORM_POSIX
+   remove (cachefile);
+#endif
+   if (rename (tmpname, cachefile)!=0) {
+      XERROR ("Unable to replace [%s]: %m\n", cachefile);
+      goto errorexit;
    }
 
+   error = false;
+errorexit:
+   if (so.outf)
+      fclose (so.outf);
+   if (error && tmpname)
+      remove (tmpname);
+   mem_free (tmpname);
    return !error;
 }
 
-bool rotrec_close (rotrec_t *rr, const char *message)
+rotsit_t *rotsit_parse_cached (char *input_buf, const char *cachefile)
 {
-   if (!rr || !message)
-      return false;
+   if (!cachefile || !input_buf)
+      return rotsit_parse (input_buf);
+
+   size_t textlen = strlen (input_buf);
+   uint64_t texthash = snap_hash (SNAP_HASH_INIT, input_buf, textlen);
+
+   size_t snaplen = 0;
+   uint8_t *snap = snap_map (cachefile, &snaplen);
+   if (snap) {
+      rotsit_t *ret = rotsit_alloc (input_buf);
+      bool restored = ret && snap_restore (ret, snap, snaplen, texthash);
+      snap_unmap (snap, snaplen);
+      if (restored) {
+         ret->stats.records_restored = ret->records.len;
+         return ret;
+      }
+      rotsit_del (ret);
+   }
 
-   char *str_status = xstr_dup ("CLOSED");
-   char *str_user = make_username ();
-   char *str_time = make_time (0);
-   char *str_message = xstr_dup (message);
+   // Stale or missing: parse the text, and build every index now so that
+   // the next load does not have to.
+   rotsit_t *ret = rotsit_parse (input_buf);
+   if (!ret)
+      return NULL;
 
-   if (!str_status || !str_user || !str_time || !str_message) {
-      free (str_status);
-      free (str_user);
-      free (str_time);
-      free (str_message);
-      return false;
+   bool indexed = guididx_get (ret)!=NULL;
+   for (size_t i=0; indexed && i<NUM_DATE_FIELDS; i++) {
+      indexed = dateidx_get (ret, date_fields[i])!=NULL;
    }
 
-   free (XVECT_INDEX (rr->fields, RF_STATUS));
-   free (XVECT_INDEX (rr->fields, RF_CLOSED_BY));
-   free (XVECT_INDEX (rr->fields, RF_CLOSED_ON));
-   free (XVECT_INDEX (rr->fields, RF_CLOSED_MSG));
-
-   XVECT_INDEX (rr->fields, RF_STATUS) = str_status;
-   XVECT_INDEX (rr->fields, RF_CLOSED_BY) = str_user;
-   XVECT_INDEX (rr->fields, RF_CLOSED_ON) = str_time;
-   XVECT_INDEX (rr->fields, RF_CLOSED_MSG) = str_message;
+   // The database is still usable without a snapshot
+   if (indexed && !snap_write (ret, cachefile, texthash)) {
+      XERROR ("Warning: unable to update the snapshot [%s]\n", cachefile);
+   }
 
-   return true;
+   return ret;
 }
 
-bool rotrec_dup (rotrec_t *rr, const char *id)
+// Only the first line of a message is shown in a change
+static void print_line (FILE *outf, const char *text)
 {
-   if (!rr || !id)
-      return false;
+   size_t len = strcspn (text, "\n");
+   fprintf (outf, "%.*s", (int)len, text);
+}
 
-   char *str_message = xstr_cat ("Closed as DUPLICATE of #", id, NULL);
-   if (!str_message) {
-      XERROR ("Out of memory\n");
-      return false;
-   }
+// Comments are only ever added after the existing ones, so those after
+// the comments of before are new. Only if the comments before that differ
+// (as when a merge put them in between) are they looked up by GUID.
+static bool print_changes (FILE *outf, rotrec_t *before, rotrec_t *after)
+{
+   struct commentset_t seen = { NULL, NULL, 0 };
 
-   bool retval = rotrec_close (rr, str_message);
+   const char *guid = merge_field (after, RF_GUID);
+   const char *old_status = merge_field (before, RF_STATUS);
+   const char *new_status = merge_field (after, RF_STATUS);
 
-   free (str_message);
+   if (strcmp (old_status, new_status)!=0) {
+      fprintf (outf, "status  %s %s -> %s\n", guid, old_status, new_status);
+   }
 
-   return retval;
-}
+   // Any other edits are listed by field name on a single line
+   const char *sep = NULL;
+   for (size_t i=0; i<sizeof field_names/sizeof field_names[0]; i++) {
+      size_t fnum = field_names[i].fnum;
+      if (fnum==RF_STATUS ||
+          strcmp (merge_field (before, fnum), merge_field (after, fnum))==0)
+         continue;
+
+      if (!sep) {
+         fprintf (outf, "changed %s", guid);
+         sep = " ";
+      }
+      fprintf (outf, "%s%s", sep, field_names[i].name);
+      sep = ",";
+   }
+   if (sep) {
+      fprintf (outf, "\n");
+   }
 
-bool rotrec_reopen (rotrec_t *rr, const char *message)
-{
-   if (!rr || !message)
+   size_t nbefore = comment_count (before);
+   size_t nafter = comment_count (after);
+   size_t nsame = 0;
+   while (nsame < nbefore && nsame < nafter &&
+          strcmp (comment_guid (before, nsame),
+                  comment_guid (after, nsame))==0) {
+      nsame++;
+   }
+   if (nsame < nbefore && !commentset_init (&seen, before))
       return false;
 
-   char *str_status = xstr_dup ("REOPEN");
-   char *str_user = make_username ();
-   char *str_time = make_time (0);
-   char *str_message = xstr_cat ("REOPEN due to: ", message, NULL);
+   for (size_t i=nsame; i<nafter; i++) {
+      size_t first = RF_LAST_FIELD + i * 4;
+      if (seen.slots && commentset_has (&seen, comment_guid (after, i)))
+         continue;
 
-   if (!str_status || !str_user || !str_time || !str_message) {
-      XERROR ("Out of memory\n");
-      free (str_status);
-      free (str_user);
-      free (str_time);
-      free (str_message);
-      return false;
+      fprintf (outf, "comment %s [%s] ", guid,
+               merge_field (after, first + CF_USER));
+      print_line (outf, merge_field (after, first + CF_COMMENT));
+      fprintf (outf, "\n");
    }
 
-   free (XVECT_INDEX (rr->fields, RF_STATUS));
-   free (XVECT_INDEX (rr->fields, RF_OPENED_BY));
-   free (XVECT_INDEX (rr->fields, RF_OPENED_ON));
-   free (XVECT_INDEX (rr->fields, RF_OPENED_MSG));
-
-   XVECT_INDEX (rr->fields, RF_STATUS) = str_status;
-   XVECT_INDEX (rr->fields, RF_OPENED_BY) = str_user;
-   XVECT_INDEX (rr->fields, RF_OPENED_ON) = str_time;
-   XVECT_INDEX (rr->fields, RF_OPENED_MSG) = str_message;
-
+   mem_free (seen.slots);
    return true;
 }
 
-bool rotrec_dump (rotrec_t *rr, FILE *outf)
+bool rotsit_changes (rotsit_t *before, rotsit_t *after, FILE *outf)
 {
-   if (!outf)
-      outf = stdout;
+   bool error = true;
+   struct guidmap_t before_map = { NULL, NULL, 0, 0 },
+                    after_map = { NULL, NULL, 0, 0 };
 
-   if (!rr) {
-      fprintf (outf, "Cannot print a NULL rotrec_t data bject\n");
+   if (!before || !after || !outf)
       return false;
-   }
 
-   fprintf (outf, "------------------------------------------------\n");
-   fprintf (outf, "[id: %s] [order: %s] [status: %s]\nOpened by [%s] on [%s]\n",
-                  (char *)XVECT_INDEX (rr->fields, RF_GUID),
-                  (char *)XVECT_INDEX (rr->fields, RF_ORDER),
-                  (char *)XVECT_INDEX (rr->fields, RF_STATUS),
-                  (char *)XVECT_INDEX (rr->fields, RF_OPENED_BY),
-                  (char *)XVECT_INDEX (rr->fields, RF_OPENED_ON));
-   // TODO: Use the assigned/assigned_by/assigned_to fields.
-   char *closed = XVECT_INDEX (rr->fields, RF_CLOSED_BY);
-   if (closed && *closed) {
-      fprintf (outf, "Closed by [%s] on [%s] with message: [%s]\n",
-                     (char *)XVECT_INDEX (rr->fields, RF_CLOSED_BY),
-                     (char *)XVECT_INDEX (rr->fields, RF_CLOSED_ON),
-                     (char *)XVECT_INDEX (rr->fields, RF_CLOSED_MSG));
-   }
-   char *duped = XVECT_INDEX (rr->fields, RF_DUP_BY);
-   if (duped && *duped) {
-      fprintf (outf, "Marked DUPLICATE of [%s] by [%s] with message: [%s]\n",
-                     (char *)XVECT_INDEX (rr->fields, RF_DUP_GUID),
-                     (char *)XVECT_INDEX (rr->fields, RF_DUP_BY),
-                     (char *)XVECT_INDEX (rr->fields, RF_DUP_MSG));
+   rotsit_t *dbs[] = { before, after };
+   size_t ndbs = db_read_lock_all (dbs, sizeof dbs/sizeof dbs[0]);
+
+   if (!guidmap_init (&before_map, before) ||
+       !guidmap_init (&after_map, after))
+      goto errorexit;
+
+   for (size_t i=0; i<after->records.len; i++) {
+      rotrec_t *rr = after->records.items[i];
+      const char *guid = merge_field (rr, RF_GUID);
+      if (after_map.ndups && guidmap_find (&after_map, guid, i) != rr)
+         continue;
+
+      rotrec_t *old = guidmap_find (&before_map, guid, i);
+      if (!old) {
+         fprintf (outf, "added   %s [%s] ", guid, merge_field (rr, RF_STATUS));
+         print_line (outf, merge_field (rr, RF_OPENED_MSG));
+         fprintf (outf, "\n");
+      } else if (!rotrec_equal (old, rr) &&
+                 !print_changes (outf, old, rr)) {
+         goto errorexit;
+      }
    }
-   fprintf (outf, "** %s **\n",
-                  (char *)XVECT_INDEX (rr->fields, RF_OPENED_MSG));
 
-   fprintf (outf, "----- COMMENTS -----\n");
+   for (size_t i=0; i<before->records.len; i++) {
+      rotrec_t *rr = before->records.items[i];
+      const char *guid = merge_field (rr, RF_GUID);
+      if ((before_map.ndups && guidmap_find (&before_map, guid, i) != rr) ||
+          guidmap_find (&after_map, guid, i))
+         continue;
 
-   size_t comment_num = RF_LAST_FIELD;
-   while ((comment_num + 4) <= XVECT_LENGTH (rr->fields)) {
-      char *c_guid    = XVECT_INDEX (rr->fields, comment_num++);
-      char *c_user    = XVECT_INDEX (rr->fields, comment_num++);
-      char *c_time    = XVECT_INDEX (rr->fields, comment_num++);
-      char *c_comment = XVECT_INDEX (rr->fields, comment_num++);
-      fprintf (outf, "++ [comment: %s] by [%s] on [%s]\n%s\n",
-               c_guid, c_user, c_time, c_comment);
+      fprintf (outf, "removed %s\n", guid);
    }
 
-   return true;
+   error = ferror (outf);
+errorexit:
+   mem_free (before_map.slots);
+   mem_free (after_map.slots);
+   db_read_unlock_all (dbs, ndbs);
+   return !error;
 }
-
@@ -3,6 +3,7 @@
 #define H_ROTSIT
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -40,27 +41,175 @@
 typedef struct rotsit_t rotsit_t;
 typedef struct rotrec_t rotrec_t;
 
+// Output formats for export. JSON Lines has one object per issue with the
+// comments in an array; CSV and TSV have a header row and one comment
+// column per comment. JSON Lines and CSV can be read back by import.
+typedef enum {
+   rotsit_fmt_text = 0,
+   rotsit_fmt_jsonl,
+   rotsit_fmt_csv,
+   rotsit_fmt_tsv,
+} rotsit_fmt_t;
+
+// What has been done with a database since it was loaded, for finding out
+// where the time goes. Records that a filter decides with an index are
+// not scanned; records read back from a snapshot are not parsed, and
+// neither are records that a reload finds unchanged.
+typedef struct {
+   uint64_t records_parsed;
+   uint64_t records_restored;
+   uint64_t records_kept;
+   uint64_t bytes_parsed;
+   uint64_t filters;
+   uint64_t records_scanned;
+   uint64_t records_matched;
+   uint64_t bytes_written;
+} rotsit_stats_t;
+
+// Where the library gets its memory from: alloc, resize and release are
+// called as malloc(), realloc() and free() are, with ctx as the first
+// argument. resize and release are only given memory from this allocator.
+typedef struct {
+   void *(*alloc) (void *ctx, size_t size);
+   void *(*resize) (void *ctx, void *ptr, size_t size);
+   void (*release) (void *ctx, void *ptr);
+   void *ctx;
+} rotsit_allocator_t;
+
+// Any number of threads may use a database at once. Everything that only
+// reads it, including the rotrec_* getters and exports of its records,
+// shares its lock, and everything that changes it or any of its records
+// holds the lock alone. Fields and lists returned by a read stay valid
+// until the database is next changed. rotsit_del() must only be called
+// once no other thread is using the database. Readers that must not wait
+// for changes read a copy made by rotsit_freeze() instead, which never
+// changes and is read without any lock.
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+   // Every allocation the library makes on the calling thread, and on the
+   // threads it starts for that call, goes through alloc from now on; NULL
+   // goes back to malloc(). A database keeps the allocator it was parsed
+   // under for everything it owns, whichever thread changes, indexes,
+   // freezes or deletes it; only what is handed back, such as the lists
+   // from rotsit_filter(), comes from the calling thread's allocator. A
+   // record from rotrec_new() belongs to the caller until it is added to a
+   // database, so it is made under the allocator of that database.
+   void rotsit_set_allocator (const rotsit_allocator_t *alloc);
+   // Copies the calling thread's allocator to dst and returns true, or
+   // returns false when it is malloc().
+   bool rotsit_get_allocator (rotsit_allocator_t *dst);
+   // Frees memory returned by the library, such as rotsit_filter() lists.
+   void rotsit_free (void *ptr);
+
    rotsit_t *rotsit_parse (char *input_buf);
+   // As rotsit_parse(), but restores the records and their indexes from
+   // the snapshot in cachefile when it was made from the same text in the
+   // same local time zone. When it was not, or cannot be read, the text
+   // is parsed and the snapshot rewritten. A NULL cachefile is the same
+   // as rotsit_parse().
+   rotsit_t *rotsit_parse_cached (char *input_buf, const char *cachefile);
    void rotsit_del (rotsit_t *rs);
+   // Returns a read-only copy of rs as it is now, which can be read like
+   // any other database without waiting for threads that are changing rs.
+   // Until rs changes every call returns the same copy; after that only
+   // the records that changed are copied and indexed again. Each copy
+   // returned is deleted with rotsit_del(), before rs is; rotrec_* calls
+   // that change its records fail. A copy belongs to rs and is freed under
+   // its allocator by whichever thread lets go of it last.
+   rotsit_t *rotsit_freeze (rotsit_t *rs);
+   // Brings rs up to date with a later version of the text it was parsed
+   // from, such as after the file was changed by another process. Records
+   // whose fields are all the same, matched up by GUID, are kept together
+   // with their index entries, and pointers to them stay valid; only the
+   // rest are parsed. Records no longer in the text are deleted, and
+   // archived records stay as they are. On failure rs is left as it was.
+   bool rotsit_reload (rotsit_t *rs, char *input_buf);
    void rotsit_dump (rotsit_t *rs, const char *id, FILE *outf);
+   // Writes the records that are not archived.
    bool rotsit_write (rotsit_t *rs, FILE *outf);
+   bool rotsit_get_stats (rotsit_t *rs, rotsit_stats_t *dst);
+
+   // Closed issues can be moved to an archive kept in a second file of
+   // the same format, which is only loaded when it is needed. Once it is
+   // loaded its records are part of rs like any other, apart from being
+   // written by rotsit_write_archive() rather than rotsit_write().
+   // Reopening an archived record takes it out of the archive.
+   bool rotsit_load_archive (rotsit_t *rs, char *input_buf);
+   bool rotsit_archive_loaded (rotsit_t *rs);
+   bool rotsit_write_archive (rotsit_t *rs, FILE *outf);
+   // Archives the records matching expr, apart from the record with the
+   // highest order which always stays in the database. Records already
+   // archived stay archived. The archive must have been loaded. Returns
+   // the number of records archived or (uint32_t)-1 on error.
+   uint32_t rotsit_archive (rotsit_t *rs, const char *expr);
+   // Writes every record in the given format, formatting them on up to
+   // nthreads threads (0 for one per processor). rotsit_fmt_text is the
+   // form used by rotrec_dump().
+   bool rotsit_export (rotsit_t *rs, FILE *outf, rotsit_fmt_t fmt,
+                       size_t nthreads);
+   // As rotsit_export(), for a NULL-terminated list such as the one
+   // returned by rotsit_filter().
+   bool rotsit_export_list (rotrec_t **records, FILE *outf,
+                            rotsit_fmt_t fmt, size_t nthreads);
+   // As rotsit_export_list(), with each record labelled with the entry
+   // at the same position in sources, such as the file it was read from:
+   // a "source" key in JSON, a first column "source" in CSV and TSV, and
+   // a "[source: ...]" line in text.
+   bool rotsit_export_sources (rotrec_t **records, const char **sources,
+                               FILE *outf, rotsit_fmt_t fmt,
+                               size_t nthreads);
 
    uint32_t rotsit_count_records (rotsit_t *rs);
    rotrec_t *rotsit_get_record (rotsit_t *rs, uint32_t recnum);
    rotrec_t **rotsit_filter (rotsit_t *rs, const char *expr);
+   uint32_t rotsit_filter_count (rotsit_t *rs, const char *expr);
+   // Whether expr could be true for a record whose field holds value,
+   // whatever its other fields hold. Returns true when it cannot tell,
+   // including when expr is not valid.
+   bool rotsit_filter_may_match (const char *expr, size_t field,
+                                 const char *value);
 
    rotrec_t *rotsit_find_by_id (rotsit_t *rs, const char *id);
 
+   // Three-way merge of two databases changed from a common base, with
+   // the records matched up by GUID; the result is written to outf. A
+   // field changed on one side takes that side's value, and comments are
+   // the union of both sides' comments. Fields changed differently on both
+   // sides take the value in ours, and records removed on one side but
+   // changed on the other are kept; each of these is counted in
+   // nconflicts. The records of ours come first, then those only in
+   // theirs; any of these with the order of a record of ours is given a
+   // new order after the highest on either side.
+   bool rotsit_merge (rotsit_t *base, rotsit_t *ours, rotsit_t *theirs,
+                      FILE *outf, size_t *nconflicts);
+
+   // Writes to outf what changed from one version of a database to a
+   // later one, with the records matched up by GUID, one line each:
+   //    added   <guid> [<status>] <first line of message>
+   //    status  <guid> <old status> -> <new status>
+   //    changed <guid> <field>,<field>,...
+   //    comment <guid> [<user>] <first line of comment>
+   //    removed <guid>
+   // Records with the same fields in both versions are skipped.
+   bool rotsit_changes (rotsit_t *before, rotsit_t *after, FILE *outf);
+
    bool rotsit_add_record (rotsit_t *rs, rotrec_t *rr);
 
    rotrec_t *rotrec_new (const char *msg);
    void rotrec_del (rotrec_t *rec);
 
    bool rotrec_add_comment (rotrec_t *rr, const char *comment);
+
+   // For importing issues from elsewhere: set a fixed field, or add a
+   // comment by a given user at a given time (NULL for the current user or
+   // time). Dates may be in any form that filters accept, and are stored
+   // in the same form as dates set by rotsit itself.
+   bool rotrec_set_field (rotrec_t *rr, size_t field, const char *value);
+   bool rotrec_import_comment (rotrec_t *rr, const char *user,
+                               const char *when, const char *comment);
    bool rotrec_close (rotrec_t *rr, const char *message);
    bool rotrec_dup (rotrec_t *rr, const char *id);
    bool rotrec_reopen (rotrec_t *rr, const char *message);
@@ -69,7 +218,10 @@ extern "C" {
 
    bool rotrec_dump (rotrec_t *rr, FILE *outf);
 
-   uint32_t (*rotsit_user_rand) (void);
+   // When set, GUIDs are made from fn instead of the system RNG; NULL goes
+   // back to the system RNG. fn is called from whichever thread is making
+   // a record.
+   void rotsit_set_user_rand (uint32_t (*fn) (void));
 
 #ifdef __cplusplus
 };
@@ -0,0 +1,546 @@
+// Benchmarks for the library on generated databases. Each database is
+// made by a deterministic generator, so that runs on different builds or
+// machines time exactly the same work. The results are written to stdout
+// as JSON Lines, one object per operation and database size:
+//
+//    {"issues":10000,"op":"filter","arg":"status == OPEN","runs":10,
+//     "total_s":0.0123,"ops_per_s":813.0,"mb_per_s":0.0,
+//     "p50_us":1201.5,"p99_us":1530.2}
+//
+// Usage:
+//    rotsit_bench [size ...]      Times every operation at each size
+//                                 (defaults to 1000, 10000 and 100000)
+//    rotsit_bench gen <size>      Writes a generated database to stdout
+
+#ifdef PLATFORM_POSIX
+#define _POSIX_C_SOURCE    200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "rotsit.h"
+#include "pdate.h"
+
+#define BENCH_LOOKUPS      (10000)
+#define BENCH_COMMENTS     (10000)
+#define BENCH_MAX_RUNS     (100)
+#define BENCH_MIN_RUNS     (3)
+
+// The generated issues are opened over five years from mid-2017
+#define GEN_START          ((time_t)1500000000)
+#define GEN_SPAN           ((time_t)5 * 365 * 24 * 60 * 60)
+
+static const char *users[] = {
+   "Alice", "Bob", "Carol", "Dan", "Eve", "Fred",
+   "Gwen", "Horace", "Iris", "Jack", "Kim", "Lee",
+};
+#define NUM_USERS          (sizeof users/sizeof users[0])
+
+static const char *words[] = {
+   "crash", "startup", "config", "file", "missing", "when", "the",
+   "user", "opens", "a", "database", "with", "more", "than", "one",
+   "record", "error", "message", "is", "wrong", "after", "upgrade",
+   "on", "windows", "linux", "slow", "export", "of", "large", "list",
+   "fails", "to", "parse", "date", "comment", "lost", "every", "second",
+   "time", "server", "socket", "timeout", "memory", "leak", "in", "filter",
+};
+#define NUM_WORDS          (sizeof words/sizeof words[0])
+
+// splitmix64: small, fast and the same on every platform
+static uint64_t bench_state = 1;
+
+static uint64_t bench_rand (void)
+{
+   uint64_t z = (bench_state += 0x9e3779b97f4a7c15ull);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+   return z ^ (z >> 31);
+}
+
+static size_t bench_below (size_t n)
+{
+   return (size_t)(bench_rand () % n);
+}
+
+// Number of successes before the first failure, with the given chance of
+// success in percent, capped at max.
+static size_t bench_geometric (size_t percent, size_t max)
+{
+   size_t ret = 0;
+   while (ret < max && bench_below (100) < percent)
+      ret++;
+   return ret;
+}
+
+// A few users open and comment on most of the issues
+static const char *bench_user (void)
+{
+   size_t a = bench_below (NUM_USERS),
+          b = bench_below (NUM_USERS);
+   return users[a < b ? a : b];
+}
+
+static double bench_now (void)
+{
+#ifdef PLATFORM_POSIX
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+   return (double)clock () / CLOCKS_PER_SEC;
+#endif
+}
+
+struct textbuf_t {
+   char *buf;
+   size_t len;
+   size_t size;
+};
+
+static bool text_append (struct textbuf_t *tb, const char *s, size_t len)
+{
+   if (tb->len + len + 1 > tb->size) {
+      size_t size = tb->size ? tb->size : 4096;
+      while (tb->len + len + 1 > size)
+         size *= 2;
+
+      char *tmp = realloc (tb->buf, size);
+      if (!tmp)
+         return false;
+      tb->buf = tmp;
+      tb->size = size;
+   }
+
+   memcpy (&tb->buf[tb->len], s, len);
+   tb->len += len;
+   tb->buf[tb->len] = 0;
+   return true;
+}
+
+// Appends a field and its delimiter
+static bool text_field (struct textbuf_t *tb, const char *s)
+{
+   return text_append (tb, s, strlen (s)) && text_append (tb, "f\b", 2);
+}
+
+// Dates are written in the same form as the library writes them
+static bool text_date (struct textbuf_t *tb, time_t when)
+{
+   static const char days[] = "SunMonTueWedThuFriSat";
+   static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+   char str[32];
+   struct tm tm;
+
+   if (!pdate_localtime (when, &tm))
+      return false;
+
+   snprintf (str, sizeof str, "%.3s %.3s%3d %.2d:%.2d:%.2d %d",
+             &days[3 * tm.tm_wday], &months[3 * tm.tm_mon], tm.tm_mday,
+             tm.tm_hour, tm.tm_min, tm.tm_sec, 1900 + tm.tm_year);
+   return text_field (tb, str);
+}
+
+// A one-line summary, often followed by a few lines of detail
+static bool text_message (struct textbuf_t *tb, size_t nlines)
+{
+   bool ok = true;
+   for (size_t i=0; ok && i<nlines; i++) {
+      size_t nwords = 3 + bench_below (i ? 12 : 8);
+      for (size_t j=0; ok && j<nwords; j++) {
+         const char *word = words[bench_below (NUM_WORDS)];
+         ok = (j==0 || text_append (tb, " ", 1)) &&
+              text_append (tb, word, strlen (word));
+      }
+      ok = ok && (i + 1==nlines || text_append (tb, "\n", 1));
+   }
+   return ok && text_append (tb, "f\b", 2);
+}
+
+static void guid_str (char *dst, size_t len)
+{
+   snprintf (dst, len, "0x%016" PRIx64, bench_rand ());
+}
+
+// Generates the text of a database of nissues issues. Roughly a third are
+// open, most of the rest closed and a few closed as duplicates or
+// reopened. The GUIDs of the issues are stored in guids, if given.
+static char *bench_generate (size_t nissues, char (*guids)[24])
+{
+   struct textbuf_t tb = { NULL, 0, 0 };
+   char guid[24], order[24], dup_guid[24] = "";
+   bool ok = true;
+
+   bench_state = nissues;
+
+   for (size_t i=0; ok && i<nissues; i++) {
+      time_t opened = GEN_START + (time_t)(GEN_SPAN * i / nissues) +
+                      (time_t)bench_below (3600);
+      time_t closed = opened + (time_t)bench_below (180 * 24 * 60 * 60);
+      size_t kind = bench_below (100);
+      bool is_closed = kind < 55;
+      bool is_dup = kind >= 55 && kind < 60 && i > 0;
+      bool is_reopened = kind >= 60 && kind < 65;
+      bool is_assigned = bench_below (100) < 30;
+      const char *opener = bench_user ();
+
+      guid_str (guid, sizeof guid);
+      snprintf (order, sizeof order, "0x%zx", i);
+      if (guids) {
+         strcpy (guids[i], guid);
+      }
+
+      ok = text_field (&tb, guid) &&
+           text_field (&tb, order) &&
+           text_field (&tb, opener) &&
+           text_date (&tb, opened) &&
+           text_message (&tb, 1 + bench_geometric (45, 40)) &&
+           text_field (&tb, is_closed || is_dup ? "CLOSED" :
+                            is_reopened ? "REOPEN" : "OPEN");
+
+      if (is_assigned) {
+         ok = ok && text_field (&tb, bench_user ()) &&
+              text_field (&tb, bench_user ()) &&
+              text_date (&tb, opened + 60 * 60);
+      } else {
+         ok = ok && text_append (&tb, "f\bf\bf\b", 6);
+      }
+
+      if (is_closed || is_dup) {
+         ok = ok && text_field (&tb, bench_user ()) &&
+              text_date (&tb, closed);
+         if (is_dup) {
+            ok = ok && text_append (&tb, "Closed as DUPLICATE of #", 24) &&
+                 text_field (&tb, dup_guid) &&
+                 text_field (&tb, bench_user ()) &&
+                 text_field (&tb, dup_guid);
+         } else {
+            ok = ok && text_message (&tb, 1) &&
+                 text_append (&tb, "f\bf\b", 4);
+         }
+      } else {
+         ok = ok && text_append (&tb, "f\bf\bf\bf\bf\b", 10);
+      }
+
+      size_t ncomments = bench_geometric (55, 50);
+      for (size_t j=0; ok && j<ncomments; j++) {
+         char cguid[24];
+         guid_str (cguid, sizeof cguid);
+         ok = text_field (&tb, cguid) &&
+              text_field (&tb, bench_user ()) &&
+              text_date (&tb, opened + (time_t)(j + 1) * 24 * 60 * 60) &&
+              text_message (&tb, 1 + bench_geometric (30, 20));
+      }
+
+      ok = ok && text_append (&tb, "f\b\n", 3);
+      strcpy (dup_guid, guid);
+   }
+
+   if (!ok || !tb.buf) {
+      fprintf (stderr, "Out of memory generating %zu issues\n", nissues);
+      free (tb.buf);
+      return NULL;
+   }
+   return tb.buf;
+}
+
+struct samples_t {
+   double *times;
+   size_t n;
+   size_t max;
+   double bytes;        // Processed by all the samples together
+};
+
+static bool sample_add (struct samples_t *s, double elapsed)
+{
+   if (s->n >= s->max) {
+      size_t max = s->max ? s->max * 2 : 64;
+      double *tmp = realloc (s->times, max * sizeof *tmp);
+      if (!tmp) {
+         fprintf (stderr, "Out of memory\n");
+         return false;
+      }
+      s->times = tmp;
+      s->max = max;
+   }
+   s->times[s->n++] = elapsed;
+   return true;
+}
+
+static int cmp_double (const void *lhs, const void *rhs)
+{
+   double l = *(const double *)lhs,
+          r = *(const double *)rhs;
+   return l < r ? -1 : l > r ? 1 : 0;
+}
+
+// Prints the samples and empties them for the next operation
+static void report (size_t nissues, const char *op, const char *arg,
+                    struct samples_t *s)
+{
+   double total = 0;
+
+   if (!s->n)
+      return;
+
+   qsort (s->times, s->n, sizeof *s->times, cmp_double);
+   for (size_t i=0; i<s->n; i++) {
+      total += s->times[i];
+   }
+
+   printf ("{\"issues\":%zu,\"op\":\"%s\",\"arg\":\"%s\",\"runs\":%zu,"
+           "\"total_s\":%.6f,\"ops_per_s\":%.1f,\"mb_per_s\":%.1f,"
+           "\"p50_us\":%.2f,\"p99_us\":%.2f}\n",
+           nissues, op, arg ? arg : "", s->n, total,
+           total > 0 ? s->n / total : 0.0,
+           total > 0 ? s->bytes / total / 1e6 : 0.0,
+           s->times[(s->n - 1) * 50 / 100] * 1e6,
+           s->times[(s->n - 1) * 99 / 100] * 1e6);
+   fflush (stdout);
+
+   s->n = 0;
+   s->bytes = 0;
+}
+
+// Filters representative of everyday use: the open issues, one user's
+// issues, recently opened issues, the archive cutoff and a single issue.
+static bool bench_filters (rotsit_t *rs, size_t nissues, size_t nruns,
+                           struct samples_t *s)
+{
+   char recent[64], cutoff[64], exprs[5][128];
+   struct tm tm;
+
+   if (!pdate_localtime (GEN_START + GEN_SPAN * 9 / 10, &tm) ||
+       !strftime (recent, sizeof recent, "%d %b %Y", &tm) ||
+       !pdate_localtime (GEN_START + GEN_SPAN / 2, &tm) ||
+       !strftime (cutoff, sizeof cutoff, "%d %b %Y", &tm)) {
+      fprintf (stderr, "Unable to make the filter dates\n");
+      return false;
+   }
+
+   snprintf (exprs[0], sizeof exprs[0], "status == OPEN");
+   snprintf (exprs[1], sizeof exprs[1], "opened_by == Carol");
+   snprintf (exprs[2], sizeof exprs[2], "opened_on > %s", recent);
+   snprintf (exprs[3], sizeof exprs[3],
+             "(status == CLOSED) & (closed_on < %s)", cutoff);
+   snprintf (exprs[4], sizeof exprs[4], "order == 0x%zx", nissues / 2);
+
+   for (size_t i=0; i<sizeof exprs/sizeof exprs[0]; i++) {
+      for (size_t j=0; j<nruns; j++) {
+         double start = bench_now ();
+         rotrec_t **results = rotsit_filter (rs, exprs[i]);
+         double elapsed = bench_now () - start;
+         if (!results) {
+            fprintf (stderr, "Filter [%s] failed\n", exprs[i]);
+            return false;
+         }
+         rotsit_free (results);
+         if (!sample_add (s, elapsed))
+            return false;
+      }
+      report (nissues, "filter", exprs[i], s);
+   }
+   return true;
+}
+
+static bool bench_size (size_t nissues)
+{
+   bool error = true;
+   char (*guids)[24] = malloc ((nissues ? nissues : 1) * sizeof *guids);
+   char *text = guids ? bench_generate (nissues, guids) : NULL;
+   rotsit_t *rs = NULL;
+   struct samples_t s = { NULL, 0, 0, 0 },
+                    del = { NULL, 0, 0, 0 };
+   size_t nruns = nissues ? 100000 / nissues : BENCH_MAX_RUNS;
+   size_t textlen = text ? strlen (text) : 0;
+
+   if (!text) {
+      fprintf (stderr, "Unable to generate %zu issues\n", nissues);
+      goto errorexit;
+   }
+
+   nruns = nruns < BENCH_MIN_RUNS ? BENCH_MIN_RUNS :
+           nruns > BENCH_MAX_RUNS ? BENCH_MAX_RUNS : nruns;
+
+   // Every parse but the last is deleted again, which times the delete
+   for (size_t i=0; i<nruns; i++) {
+      double start = bench_now ();
+      rs = rotsit_parse (text);
+      double elapsed = bench_now () - start;
+      if (!rs || rotsit_count_records (rs)!=nissues) {
+         fprintf (stderr, "Parse of %zu issues failed\n", nissues);
+         goto errorexit;
+      }
+      s.bytes += textlen;
+      if (!sample_add (&s, elapsed))
+         goto errorexit;
+
+      if (i + 1 < nruns) {
+         start = bench_now ();
+         rotsit_del (rs);
+         rs = NULL;
+         if (!sample_add (&del, bench_now () - start))
+            goto errorexit;
+      }
+   }
+   report (nissues, "parse", NULL, &s);
+
+   if (!bench_filters (rs, nissues, nruns, &s))
+      goto errorexit;
+
+   // The first lookup also builds the index
+   for (size_t i=0; nissues && i<BENCH_LOOKUPS; i++) {
+      const char *guid = guids[bench_below (nissues)];
+      double start = bench_now ();
+      rotrec_t *rr = rotsit_find_by_id (rs, guid);
+      double elapsed = bench_now () - start;
+      if (!rr) {
+         fprintf (stderr, "Issue [%s] not found\n", guid);
+         goto errorexit;
+      }
+      if (!sample_add (&s, elapsed))
+         goto errorexit;
+   }
+   report (nissues, "find_by_id", NULL, &s);
+
+   for (size_t i=0; nissues && i<BENCH_COMMENTS; i++) {
+      rotrec_t *rr = rotsit_get_record (rs, bench_below (nissues));
+      double start = bench_now ();
+      bool ok = rotrec_add_comment (rr, "Also seen on the build server");
+      double elapsed = bench_now () - start;
+      if (!ok) {
+         fprintf (stderr, "Unable to add a comment\n");
+         goto errorexit;
+      }
+      if (!sample_add (&s, elapsed))
+         goto errorexit;
+   }
+   report (nissues, "add_comment", NULL, &s);
+
+   // The first copy is of every record, each one after that only of the
+   // record changed since the last
+   for (size_t i=0; nissues && i<nruns; i++) {
+      rotrec_t *rr = rotsit_get_record (rs, bench_below (nissues));
+      if (i && !rotrec_add_comment (rr, "Changed before freezing")) {
+         fprintf (stderr, "Unable to add a comment\n");
+         goto errorexit;
+      }
+      double start = bench_now ();
+      rotsit_t *frozen = rotsit_freeze (rs);
+      double elapsed = bench_now () - start;
+      if (!frozen) {
+         fprintf (stderr, "Unable to freeze %zu issues\n", nissues);
+         goto errorexit;
+      }
+      rotsit_del (frozen);
+      if (!sample_add (&s, elapsed))
+         goto errorexit;
+   }
+   report (nissues, "freeze", NULL, &s);
+
+   for (size_t i=0; i<nruns; i++) {
+      FILE *outf = tmpfile ();
+      if (!outf) {
+         fprintf (stderr, "Unable to create a temporary file\n");
+         goto errorexit;
+      }
+      double start = bench_now ();
+      bool ok = rotsit_write (rs, outf) && fflush (outf)==0;
+      double elapsed = bench_now () - start;
+      long len = ftell (outf);
+      fclose (outf);
+      if (!ok) {
+         fprintf (stderr, "Write of %zu issues failed\n", nissues);
+         goto errorexit;
+      }
+      s.bytes += len > 0 ? len : 0;
+      if (!sample_add (&s, elapsed))
+         goto errorexit;
+   }
+   report (nissues, "write", NULL, &s);
+
+   // The text changes on disk by one record between reloads. The first
+   // reload, of the records commented on above, is not timed.
+   for (size_t i=0; nissues && i<=nruns; i++) {
+      rotrec_t *rr = rotsit_get_record (rs, bench_below (nissues));
+      if (i && rr && !rotrec_add_comment (rr, "Changed before reloading")) {
+         fprintf (stderr, "Unable to add a comment\n");
+         goto errorexit;
+      }
+      double start = bench_now ();
+      bool ok = rotsit_reload (rs, text);
+      double elapsed = bench_now () - start;
+      if (!ok || rotsit_count_records (rs)!=nissues) {
+         fprintf (stderr, "Reload of %zu issues failed\n", nissues);
+         goto errorexit;
+      }
+      if (i) {
+         s.bytes += textlen;
+         if (!sample_add (&s, elapsed))
+            goto errorexit;
+      }
+   }
+   report (nissues, "reload", NULL, &s);
+
+   double start = bench_now ();
+   rotsit_del (rs);
+   rs = NULL;
+   if (!sample_add (&del, bench_now () - start))
+      goto errorexit;
+   report (nissues, "del", NULL, &del);
+
+   error = false;
+errorexit:
+   rotsit_del (rs);
+   free (s.times);
+   free (del.times);
+   free (text);
+   free (guids);
+   return !error;
+}
+
+static bool parse_size (const char *arg, size_t *nissues)
+{
+   char *end = NULL;
+   unsigned long long n = strtoull (arg, &end, 10);
+   if (!*arg || *end || n < 1 || n > UINT32_MAX) {
+      fprintf (stderr, "[%s] is not a number of issues\n", arg);
+      return false;
+   }
+   *nissues = (size_t)n;
+   return true;
+}
+
+int main (int argc, char **argv)
+{
+   static const size_t default_sizes[] = { 1000, 10000, 100000 };
+   size_t nissues;
+
+   if (argc > 1 && strcmp (argv[1], "gen")==0) {
+      if (argc!=3 || !parse_size (argv[2], &nissues))
+         return EXIT_FAILURE;
+
+      char *text = bench_generate (nissues, NULL);
+      bool ok = text && fputs (text, stdout)!=EOF && fflush (stdout)==0;
+      free (text);
+      return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+
+   if (argc < 2) {
+      for (size_t i=0; i<sizeof default_sizes/sizeof default_sizes[0]; i++) {
+         if (!bench_size (default_sizes[i]))
+            return EXIT_FAILURE;
+      }
+      return EXIT_SUCCESS;
+   }
+
+   for (int i=1; i<argc; i++) {
+      if (!parse_size (argv[i], &nissues) || !bench_size (nissues))
+         return EXIT_FAILURE;
+   }
+   return EXIT_SUCCESS;
+}
@@ -1,9 +1,22 @@
+#ifdef PLATFORM_POSIX
+#define _POSIX_C_SOURCE    200809L
+#endif
+
 
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef PLATFORM_POSIX
+#include <pthread.h>
+#endif
 
 #include "rotsit.h"
+#include "pdate.h"
 
 #include "xstring/xstring.h"
 
@@ -136,6 +149,1674 @@ errorexit:
    return !error;
 }
 
+// Builds a record with the 14 fixed fields, filling in only the ones the
+// filter tests look at.
+#define TEST_RECORD(guid,by,on,status,closed_on)\
+   guid "f\b0x1f\b" by "f\b" on "f\bA test messagef\b" status "f\b"\
+   "f\bf\bf\bf\b" closed_on "f\bf\bf\bf\bf\b\n"
+
+static const char *test_db =
+   TEST_RECORD ("0x01", "Alice", "Fri Feb 16 10:00:00 2024", "OPEN", "")
+   TEST_RECORD ("0x02", "Alice", "Fri Mar  1 09:00:00 2024", "CLOSED",
+                                 "Sat Mar  2 09:00:00 2024")
+   TEST_RECORD ("0x03", "Bob",   "Fri Mar 15 12:00:00 2024", "OPEN", "")
+   TEST_RECORD ("0x04", "Bob",   "Mon Apr  1 08:00:00 2024", "CLOSED",
+                                 "Thu Apr 11 08:00:00 2024");
+
+static bool check_filter (rotsit_t *rs, const char *expr, size_t expected)
+{
+   size_t nresults = 0;
+   rotrec_t **results = rotsit_filter (rs, expr);
+   if (!results) {
+      fprintf (stderr, "Filter [%s] failed\n", expr);
+      return false;
+   }
+
+   while (results[nresults])
+      nresults++;
+   rotsit_free (results);
+
+   if (nresults != expected) {
+      fprintf (stderr, "Filter [%s]: expected %zu records, got %zu\n",
+                       expr, expected, nresults);
+      return false;
+   }
+   return true;
+}
+
+static bool test_filter_dates (void)
+{
+   bool error = true;
+   char *tmp = xstr_dup (test_db);
+   rotsit_t *rs = rotsit_parse (tmp);
+   if (!rs) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   if (!check_filter (rs, "(opened_on >= 1 Mar 2024) & "
+                          "(opened_on <= 31 Mar 2024)", 2) ||
+       !check_filter (rs, "opened_on > 1 Mar 2024", 3) ||
+       !check_filter (rs, "1 Mar 2024 > opened_on", 1) ||
+       !check_filter (rs, "closed_on < 1 Apr 2024", 1) ||
+       !check_filter (rs, "(closed_on > 1 Jan 2024) | "
+                          "(opened_on < 1 Mar 2024)", 3) ||
+       !check_filter (rs, "(opened_on >= 1 Mar 2024) & "
+                          "(opened_by == Bob)", 2)) {
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   rotsit_del (rs);
+   free (tmp);
+   return !error;
+}
+
+static bool test_filter_enums (void)
+{
+   bool error = true;
+   char *tmp = xstr_dup (test_db);
+   rotsit_t *rs = rotsit_parse (tmp);
+   if (!rs) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   if (!check_filter (rs, "status == OPEN", 2) ||
+       !check_filter (rs, "(status == CLOSED) & (opened_by == Alice)", 1) ||
+       !check_filter (rs, "(status != CLOSED) | (opened_by == Bob)", 3) ||
+       !check_filter (rs, "(opened_by == Bob) & "
+                          "(closed_on > 1 Apr 2024)", 1)) {
+      goto errorexit;
+   }
+
+   // The bitmaps must follow the records as they change
+   if (!rotrec_close (rotsit_get_record (rs, 0), "Closing") ||
+       !rotrec_reopen (rotsit_get_record (rs, 1), "Reopening") ||
+       !rotrec_dup (rotsit_get_record (rs, 2), "0x04")) {
+      fprintf (stderr, "Failed to modify records\n");
+      goto errorexit;
+   }
+
+   if (rotsit_filter_count (rs, "status == CLOSED") != 3 ||
+       rotsit_filter_count (rs, "status == REOPEN") != 1 ||
+       rotsit_filter_count (rs, "dup_guid == 0x04") != 1 ||
+       !check_filter (rs, "(status == OPEN) & (closed_on < 1 Jan 2025)", 1)) {
+      fprintf (stderr, "Indexes did not follow record changes\n");
+      goto errorexit;
+   }
+
+   rotrec_t *rr = rotrec_new ("A new issue");
+   if (!rr || !rotsit_add_record (rs, rr)) {
+      fprintf (stderr, "Failed to add record\n");
+      rotrec_del (rr);
+      goto errorexit;
+   }
+
+   if (rotsit_filter_count (rs, "status == OPEN") != 2) {
+      fprintf (stderr, "Index did not pick up the new record\n");
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   rotsit_del (rs);
+   free (tmp);
+   return !error;
+}
+
+static bool test_filter_kernels (void)
+{
+   bool error = true;
+   char *tmp = xstr_dup (test_db);
+   rotsit_t *rs = rotsit_parse (tmp);
+   if (!rs) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   if (!check_filter (rs, "guid == 0x02", 1) ||
+       !check_filter (rs, "guid != 0x02", 3) ||
+       !check_filter (rs, "0x02 < guid", 2) ||
+       !check_filter (rs, "(message == test) & (guid >= 0x03)", 2) ||
+       !check_filter (rs, "message == nothing", 0) ||
+       !check_filter (rs, "opened_on == 15 Mar 2024 12:00:00", 1) ||
+       !check_filter (rs, "(opened_on != 15 Mar 2024 12:00:00) & "
+                          "(order == 0x1)", 3)) {
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   rotsit_del (rs);
+   free (tmp);
+   return !error;
+}
+
+static bool test_filter_types (void)
+{
+   bool error = true;
+   char *tmp = xstr_dup (test_db);
+   rotsit_t *rs = rotsit_parse (tmp);
+   if (!rs) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   // Constant subexpressions are folded before the records are looked at
+   if (!check_filter (rs, "(1 == 1) & (status == OPEN)", 2) ||
+       !check_filter (rs, "(1 == 2) | (opened_by == Bob)", 2) ||
+       !check_filter (rs, "(2 > 1) | (opened_by == Bob)", 4) ||
+       !check_filter (rs, "(opened_on < closed_on) & (0x02 < 0x03)", 2) ||
+       !check_filter (rs, "1 Mar 2024 < 2 Mar 2024", 4)) {
+      goto errorexit;
+   }
+
+   // Comparisons between fields and of arithmetic are read as their types
+   // per record, and a missing date falls back to a comparison as text
+   if (!check_filter (rs, "closed_on > opened_on", 2) ||
+       !check_filter (rs, "opened_on == closed_on", 0) ||
+       !check_filter (rs, "opened_on != closed_on", 4) ||
+       !check_filter (rs, "(guid - order) > 1", 2) ||
+       !check_filter (rs, "((guid - order) < 2) & (opened_on < closed_on)",
+                          1)) {
+      goto errorexit;
+   }
+
+   static const char *invalid[] = {
+      "opened_on < tomorrow",
+      "status < OPEN",
+      "(status == OPEN) & opened_by",
+      "guid > Bob",
+      "opened_on == guid",
+      "status",
+   };
+
+   for (size_t i=0; i<sizeof invalid/sizeof invalid[0]; i++) {
+      rotrec_t **results = rotsit_filter (rs, invalid[i]);
+      if (results) {
+         fprintf (stderr, "Ill-typed filter [%s] was accepted\n", invalid[i]);
+         rotsit_free (results);
+         goto errorexit;
+      }
+   }
+
+   error = false;
+errorexit:
+   rotsit_del (rs);
+   free (tmp);
+   return !error;
+}
+
+// Enough records to span several evaluation blocks, with a partial block
+// at the end.
+static bool test_filter_blocks (void)
+{
+   bool error = true;
+   rotsit_t *rs = NULL;
+   size_t nrecs = 2500;
+   size_t nopen = 0,
+          nclosed_mar = 0,
+          nopen_closed = 0;
+   char *db = malloc (nrecs * 256);
+   if (!db) {
+      fprintf (stderr, "Out of memory\n");
+      goto errorexit;
+   }
+
+   char *end = db;
+   for (size_t i=0; i<nrecs; i++) {
+      bool open = i % 2 == 0;
+      const char *closed_on = i % 3 ? "" : "Sat Mar  2 09:00:00 2024";
+
+      end += sprintf (end, "0x%zxf\b0x%zxf\bAlicef\b"
+                           "Fri Feb 16 10:00:00 2024f\bmessagef\b%sf\b"
+                           "f\bf\bf\bf\b%sf\bf\bf\bf\bf\b\n",
+                           i + 1, i + 1, open ? "OPEN" : "CLOSED",
+                           closed_on);
+
+      nopen += open;
+      nclosed_mar += !open && *closed_on;
+      nopen_closed += open && *closed_on;
+   }
+
+   rs = rotsit_parse (db);
+   if (!rs) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   if (!check_filter (rs, "status == OPEN", nopen) ||
+       !check_filter (rs, "(status == CLOSED) & (closed_on > 1 Mar 2024)",
+                          nclosed_mar) ||
+       !check_filter (rs, "(opened_on < closed_on) & (status != CLOSED)",
+                          nopen_closed) ||
+       !check_filter (rs, "(closed_on == 2 Mar 2024 09:00:00) | "
+                          "(status == OPEN)",
+                          nopen + nclosed_mar) ||
+       !check_filter (rs, "guid > 0x9c4", 0) ||
+       !check_filter (rs, "guid >= 0x9c4", 1)) {
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   rotsit_del (rs);
+   free (db);
+   return !error;
+}
+
+// Reads back everything written to tmpf, which is closed
+static char *read_back (FILE *tmpf)
+{
+   char *ret = NULL;
+   long len = ftell (tmpf);
+   if (len < 0 || !(ret = calloc (len + 1, 1))) {
+      fprintf (stderr, "Out of memory\n");
+      goto errorexit;
+   }
+
+   rewind (tmpf);
+   if (fread (ret, 1, len, tmpf)!=(size_t)len) {
+      fprintf (stderr, "Short read of output\n");
+      free (ret);
+      ret = NULL;
+   }
+
+errorexit:
+   fclose (tmpf);
+   return ret;
+}
+
+static char *write_with (rotsit_t *rs, bool (*writer) (rotsit_t *, FILE *))
+{
+   FILE *tmpf = tmpfile ();
+   if (!tmpf || !writer (rs, tmpf)) {
+      fprintf (stderr, "Unable to write database\n");
+      if (tmpf)
+         fclose (tmpf);
+      return NULL;
+   }
+   return read_back (tmpf);
+}
+
+static char *write_to_string (rotsit_t *rs)
+{
+   return write_with (rs, rotsit_write);
+}
+
+static bool test_writer_order (void)
+{
+   bool error = true;
+   char *tmp = xstr_dup (test_db);
+   char *first = NULL;
+   char *second = NULL;
+   rotsit_t *copy = NULL;
+   rotsit_t *rs = rotsit_parse (tmp);
+   if (!rs) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<2; i++) {
+      rotrec_t *rr = rotrec_new ("A new issue");
+      if (!rr || !rotsit_add_record (rs, rr)) {
+         fprintf (stderr, "Failed to add record\n");
+         rotrec_del (rr);
+         goto errorexit;
+      }
+   }
+
+   // Every record in test_db has order 0x1
+   if (strcmp (rotrec_get_field (rotsit_get_record (rs, 4), RF_ORDER),
+               "0x2")!=0 ||
+       strcmp (rotrec_get_field (rotsit_get_record (rs, 5), RF_ORDER),
+               "0x3")!=0) {
+      fprintf (stderr, "New records were not given the next order\n");
+      goto errorexit;
+   }
+
+   if (!(first = write_to_string (rs)) || !(copy = rotsit_parse (first)) ||
+       !(second = write_to_string (copy))) {
+      goto errorexit;
+   }
+
+   if (rotsit_count_records (copy)!=6 || strcmp (first, second)!=0 ||
+       strncmp (first, test_db, strlen (test_db))!=0) {
+      fprintf (stderr, "Database did not survive a round trip\n");
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   rotsit_del (rs);
+   rotsit_del (copy);
+   free (tmp);
+   free (first);
+   free (second);
+   return !error;
+}
+
+static int cmp_str (const void *lhs, const void *rhs)
+{
+   return strcmp (*(const char **)lhs, *(const char **)rhs);
+}
+
+// Enough GUIDs to go through the random pool several times over
+static bool test_guids (void)
+{
+   bool error = true;
+   const size_t nrecs = 2000;
+   const char **guids = calloc (nrecs, sizeof *guids);
+   rotsit_t *rs = rotsit_parse ("");
+   if (!rs || !guids) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<nrecs; i++) {
+      rotrec_t *rr = rotrec_new ("A new issue");
+      if (!rr || !rotsit_add_record (rs, rr)) {
+         fprintf (stderr, "Failed to add record\n");
+         rotrec_del (rr);
+         goto errorexit;
+      }
+      guids[i] = rotrec_get_field (rr, RF_GUID);
+
+      size_t len = strlen (guids[i]);
+      if (len!=18 || strncmp (guids[i], "0x", 2)!=0 ||
+          strspn (&guids[i][2], "0123456789abcdef")!=16) {
+         fprintf (stderr, "Malformed GUID [%s]\n", guids[i]);
+         goto errorexit;
+      }
+   }
+
+   qsort (guids, nrecs, sizeof *guids, cmp_str);
+   for (size_t i=1; i<nrecs; i++) {
+      if (strcmp (guids[i - 1], guids[i])==0) {
+         fprintf (stderr, "Duplicate GUID [%s]\n", guids[i]);
+         goto errorexit;
+      }
+   }
+
+   error = false;
+errorexit:
+   free (guids);
+   rotsit_del (rs);
+   return !error;
+}
+
+// Dates given to a record are stored in the same form as asctime()
+static bool test_timestamps (void)
+{
+   bool error = true;
+   const char *dates[] = {
+      "5 Jan 2023", "2024-02-29 23:59:59", "31 Dec 1999 00:00:01",
+      "5 Jan 2023",
+   };
+   rotrec_t *rr = rotrec_new ("A new issue");
+   if (!rr) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<sizeof dates/sizeof dates[0]; i++) {
+      time_t tv;
+      char expected[32];
+
+      if (pdate_parse (dates[i], &tv, true)!=pdate_valid ||
+          !rotrec_set_field (rr, RF_CLOSED_ON, dates[i])) {
+         fprintf (stderr, "Unable to set date [%s]\n", dates[i]);
+         goto errorexit;
+      }
+
+      snprintf (expected, sizeof expected, "%s", asctime (localtime (&tv)));
+      expected[strcspn (expected, "\n")] = 0;
+      if (strcmp (rotrec_get_field (rr, RF_CLOSED_ON), expected)!=0) {
+         fprintf (stderr, "Expected [%s], got [%s]\n", expected,
+                  rotrec_get_field (rr, RF_CLOSED_ON));
+         goto errorexit;
+      }
+   }
+
+   error = false;
+errorexit:
+   rotrec_del (rr);
+   return !error;
+}
+
+// Comments are appended in place; make sure that many of them survive a
+// round trip through the database format in order.
+static bool test_comments (void)
+{
+   bool error = true;
+   const size_t ncomments = 3000;
+   char *first = NULL;
+   char *second = NULL;
+   rotsit_t *copy = NULL;
+   rotsit_t *rs = rotsit_parse ("");
+   rotrec_t *rr = rotrec_new ("A new issue");
+   if (!rs || !rr || !rotsit_add_record (rs, rr)) {
+      fprintf (stderr, "Object creation failed\n");
+      rotrec_del (rr);
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<ncomments; i++) {
+      char comment[32];
+      snprintf (comment, sizeof comment, "Comment %zu", i);
+      if (!rotrec_add_comment (rr, comment)) {
+         fprintf (stderr, "Failed to add comment %zu\n", i);
+         goto errorexit;
+      }
+   }
+
+   if (!(first = write_to_string (rs)) || !(copy = rotsit_parse (first)) ||
+       !(second = write_to_string (copy))) {
+      goto errorexit;
+   }
+
+   char *c0 = strstr (first, "Comment 0f\b");
+   char *c1 = strstr (first, "Comment 1f\b");
+   char *clast = strstr (first, "Comment 2999f\b");
+   if (strcmp (first, second)!=0 || !c0 || !c1 || !clast ||
+       c0 > c1 || c1 > clast) {
+      fprintf (stderr, "Comments did not survive a round trip\n");
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   rotsit_del (rs);
+   rotsit_del (copy);
+   free (first);
+   free (second);
+   return !error;
+}
+
+
+static char *export_to_string (rotsit_t *rs, rotsit_fmt_t fmt,
+                               size_t nthreads)
+{
+   FILE *tmpf = tmpfile ();
+   if (!tmpf || !rotsit_export (rs, tmpf, fmt, nthreads)) {
+      fprintf (stderr, "Unable to export database\n");
+      if (tmpf)
+         fclose (tmpf);
+      return NULL;
+   }
+   return read_back (tmpf);
+}
+
+// A parallel export must be identical to one made a record at a time
+static bool test_export (void)
+{
+   bool error = true;
+   const size_t nrecs = 10000;
+   char *serial = NULL;
+   char *parallel = NULL;
+   char *dumped = NULL;
+   FILE *tmpf = NULL;
+   rotsit_t *rs = rotsit_parse ("");
+   if (!rs || !(tmpf = tmpfile ())) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<nrecs; i++) {
+      char msg[32];
+      snprintf (msg, sizeof msg, "Issue %zu", i);
+      rotrec_t *rr = rotrec_new (msg);
+      if (!rr || !rotsit_add_record (rs, rr) ||
+          (i % 3==0 && !rotrec_add_comment (rr, "A comment")) ||
+          (i % 5==0 && !rotrec_close (rr, "Closed"))) {
+         fprintf (stderr, "Failed to add record\n");
+         goto errorexit;
+      }
+      rotrec_dump (rr, tmpf);
+   }
+
+   if (!(serial = export_to_string (rs, rotsit_fmt_text, 1)) ||
+       !(parallel = export_to_string (rs, rotsit_fmt_text, 4)))
+      goto errorexit;
+
+   dumped = read_back (tmpf);
+   tmpf = NULL;
+   if (!dumped || strcmp (serial, dumped)!=0 ||
+       strcmp (serial, parallel)!=0) {
+      fprintf (stderr, "Exports differ\n");
+      goto errorexit;
+   }
+
+   for (rotsit_fmt_t fmt=rotsit_fmt_jsonl; fmt<=rotsit_fmt_tsv; fmt++) {
+      free (serial);
+      free (parallel);
+      if (!(serial = export_to_string (rs, fmt, 1)) ||
+          !(parallel = export_to_string (rs, fmt, 4)))
+         goto errorexit;
+
+      if (strcmp (serial, parallel)!=0) {
+         fprintf (stderr, "Exports in format %i differ\n", fmt);
+         goto errorexit;
+      }
+   }
+
+   error = false;
+errorexit:
+   if (tmpf)
+      fclose (tmpf);
+   free (dumped);
+   free (serial);
+   free (parallel);
+   rotsit_del (rs);
+   return !error;
+}
+
+// Values with characters that are special in each of the formats
+static bool test_export_formats (void)
+{
+   size_t num_errors = 0;
+   char *tmp = xstr_dup (
+      "0x01f\b0x1f\bjsf\bThu Jan  5 00:00:00 2023f\b"
+      "Say \"hi\", then\n\ttab \\ \x01 \xc3\xa9" "f\bOPENf\b"
+      "f\bf\bf\bf\bf\bf\bf\bf\b"
+      "0x02f\bbobf\bThu Jan  5 00:00:01 2023f\bA commentf\bf\b\n");
+   const char *expected[] = {
+      "{\"guid\":\"0x01\",\"order\":\"0x1\",\"opened_by\":\"js\","
+      "\"opened_on\":\"Thu Jan  5 00:00:00 2023\","
+      "\"message\":\"Say \\\"hi\\\", then\\n\\ttab \\\\ \\u0001 \xc3\xa9\","
+      "\"status\":\"OPEN\",\"assigned_by\":\"\",\"assigned_to\":\"\","
+      "\"assigned_on\":\"\",\"closed_by\":\"\",\"closed_on\":\"\","
+      "\"closed_msg\":\"\",\"dup_by\":\"\",\"dup_guid\":\"\","
+      "\"comments\":[{\"guid\":\"0x02\",\"user\":\"bob\","
+      "\"time\":\"Thu Jan  5 00:00:01 2023\",\"comment\":\"A comment\"}]}\n",
+
+      "guid,order,opened_by,opened_on,message,status,assigned_by,"
+      "assigned_to,assigned_on,closed_by,closed_on,closed_msg,dup_by,"
+      "dup_guid,comment\r\n"
+      "0x01,0x1,js,Thu Jan  5 00:00:00 2023,"
+      "\"Say \"\"hi\"\", then\n\ttab \\ \x01 \xc3\xa9\",OPEN,,,,,,,,,"
+      "A comment\r\n",
+
+      "guid\torder\topened_by\topened_on\tmessage\tstatus\tassigned_by\t"
+      "assigned_to\tassigned_on\tclosed_by\tclosed_on\tclosed_msg\tdup_by\t"
+      "dup_guid\tcomment\n"
+      "0x01\t0x1\tjs\tThu Jan  5 00:00:00 2023\t"
+      "Say \"hi\", then\\n\\ttab \\\\ \x01 \xc3\xa9\tOPEN\t\t\t\t\t\t\t\t\t"
+      "A comment\n",
+   };
+
+   rotsit_t *rs = rotsit_parse (tmp);
+   if (!rs || rotsit_count_records (rs)!=1) {
+      fprintf (stderr, "Object creation failed\n");
+      num_errors++;
+   }
+
+   for (size_t i=0; rs && i<sizeof expected/sizeof expected[0]; i++) {
+      char *output = export_to_string (rs, rotsit_fmt_jsonl + i, 1);
+      if (!output || strcmp (output, expected[i])!=0) {
+         fprintf (stderr, "Format %zu: expected\n[%s]\ngot\n[%s]\n",
+                  i, expected[i], output);
+         num_errors++;
+      }
+      free (output);
+   }
+
+   rotsit_del (rs);
+   free (tmp);
+   return num_errors==0;
+}
+
+static char *read_snapshot (const char *fname, long *len)
+{
+   char *ret = NULL;
+   FILE *inf = fopen (fname, "rb");
+   if (!inf || fseek (inf, 0, SEEK_END)!=0 || (*len = ftell (inf)) <= 0 ||
+       fseek (inf, 0, SEEK_SET)!=0 || !(ret = malloc (*len)) ||
+       fread (ret, 1, *len, inf)!=(size_t)*len) {
+      fprintf (stderr, "Unable to read snapshot [%s]\n", fname);
+      free (ret);
+      ret = NULL;
+   }
+
+   if (inf)
+      fclose (inf);
+   return ret;
+}
+
+// Loads text through the snapshot and checks that the database is the
+// same as one parsed from the text.
+static bool check_cached_load (const char *text, const char *cachefile,
+                               size_t nopened)
+{
+   bool error = true;
+   char *copy = xstr_dup (text);
+   char *written = NULL;
+   rotsit_t *rs = rotsit_parse_cached (copy, cachefile);
+   if (!rs) {
+      fprintf (stderr, "Cached load failed\n");
+      goto errorexit;
+   }
+
+   if (!(written = write_to_string (rs)) || strcmp (written, text)!=0) {
+      fprintf (stderr, "Cached load wrote back\n%s\n", written);
+      goto errorexit;
+   }
+
+   rotrec_t *rr = rotsit_find_by_id (rs, "0x03");
+   if (!rr || strcmp (rotrec_get_field (rr, RF_OPENED_BY), "Bob")!=0 ||
+       rotsit_find_by_id (rs, "0x3") || rotsit_find_by_id (rs, "bad")) {
+      fprintf (stderr, "Lookup by id after cached load failed\n");
+      goto errorexit;
+   }
+
+   if (!check_filter (rs, "opened_on > 1 Mar 2024", nopened) ||
+       !check_filter (rs, "closed_on < 1 Apr 2024", 1))
+      goto errorexit;
+
+   // Fields that came from the text are replaced like any other
+   if (!rotrec_set_field (rr, RF_OPENED_BY, "Dave") ||
+       !rotrec_add_comment (rr, "Changed after a cached load") ||
+       !check_filter (rs, "opened_by == Dave", 1))
+      goto errorexit;
+
+   error = false;
+errorexit:
+   free (written);
+   rotsit_del (rs);
+   free (copy);
+   return !error;
+}
+
+static bool test_snapshot (void)
+{
+   bool error = true;
+   const char *cachefile = "rotsit_test.cache";
+   char *snap = NULL, *again = NULL;
+   long len, againlen;
+   char *grown = xstr_cat (test_db,
+      TEST_RECORD ("0x05", "Carol", "Tue Apr 16 08:00:00 2024", "OPEN", ""),
+      NULL);
+   if (!grown) {
+      fprintf (stderr, "Out of memory\n");
+      goto errorexit;
+   }
+
+   remove (cachefile);
+   if (!check_cached_load (test_db, cachefile, 3) ||
+       !(snap = read_snapshot (cachefile, &len))) {
+      fprintf (stderr, "No snapshot was written\n");
+      goto errorexit;
+   }
+
+   // Restored from the snapshot, which is left alone
+   if (!check_cached_load (test_db, cachefile, 3) ||
+       !(again = read_snapshot (cachefile, &againlen)) ||
+       againlen != len || memcmp (snap, again, len)!=0) {
+      fprintf (stderr, "Snapshot was not reused\n");
+      goto errorexit;
+   }
+   free (again);
+   again = NULL;
+
+#ifdef PLATFORM_POSIX
+   // Every date was read in the local time zone, so in another one the
+   // snapshot is stale and rewritten, and the dates are read again
+   char *tz = getenv ("TZ");
+   if (tz && !(tz = xstr_dup (tz))) {
+      fprintf (stderr, "Out of memory\n");
+      goto errorexit;
+   }
+   setenv ("TZ", "UTC0", 1);
+   tzset ();
+   bool moved = check_cached_load (test_db, cachefile, 3) &&
+                (again = read_snapshot (cachefile, &againlen)) &&
+                (againlen != len || memcmp (snap, again, len)!=0);
+   if (tz) {
+      setenv ("TZ", tz, 1);
+   } else {
+      unsetenv ("TZ");
+   }
+   tzset ();
+   free (tz);
+   free (again);
+   again = NULL;
+   if (!moved) {
+      fprintf (stderr, "Snapshot was reused in another time zone\n");
+      goto errorexit;
+   }
+#endif
+
+   // Stale, so the text is parsed and the snapshot replaced
+   if (!check_cached_load (grown, cachefile, 4) ||
+       !(again = read_snapshot (cachefile, &againlen)) ||
+       againlen <= len) {
+      fprintf (stderr, "Stale snapshot was not replaced\n");
+      goto errorexit;
+   }
+
+   // Corrupted, which is only noticed by the hash of the body
+   FILE *outf = fopen (cachefile, "r+b");
+   if (!outf || fseek (outf, againlen - 1, SEEK_SET)!=0 ||
+       fputc (again[againlen - 1] ^ 1, outf)==EOF) {
+      fprintf (stderr, "Unable to corrupt the snapshot\n");
+      if (outf)
+         fclose (outf);
+      goto errorexit;
+   }
+   fclose (outf);
+
+   if (!check_cached_load (grown, cachefile, 4))
+      goto errorexit;
+
+   error = false;
+errorexit:
+   remove (cachefile);
+   free (snap);
+   free (again);
+   free (grown);
+   return !error;
+}
+
+// Whether a filter could match a closed record is known from the
+// expression alone, without any records.
+static bool test_filter_may_match (void)
+{
+   size_t num_errors = 0;
+   const struct {
+      const char *expr;
+      bool expected;
+   } tests[] = {
+      { "status == OPEN",                       false },
+      { "status != OPEN",                       true  },
+      { "status == CLOSED",                     true  },
+      { "message == foo",                       true  },
+      { "(status == OPEN) & (message == foo)",  false },
+      { "(message == foo) & (status == OPEN)",  false },
+      { "(status == OPEN) | (message == foo)",  true  },
+      { "(status == OPEN) | (status == NEW)",   false },
+      { "status ==",                            true  },
+   };
+
+   for (size_t i=0; i<sizeof tests/sizeof tests[0]; i++) {
+      if (rotsit_filter_may_match (tests[i].expr, RF_STATUS, "CLOSED")!=
+          tests[i].expected) {
+         fprintf (stderr, "[%s] could match a closed record: expected %i\n",
+                  tests[i].expr, tests[i].expected);
+         num_errors++;
+      }
+   }
+   return num_errors==0;
+}
+
+// Archived records are written to the archive only, come back with it and
+// leave it again when reopened.
+static bool test_archive (void)
+{
+   bool error = true;
+   char *tmp = xstr_dup (test_db);
+   char *hot = NULL, *archive = NULL, *rewritten = NULL;
+   rotsit_t *copy = NULL;
+   rotsit_t *rs = rotsit_parse (tmp);
+   if (!rs) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   if (rotsit_archive (rs, "status == CLOSED")!=(uint32_t)-1) {
+      fprintf (stderr, "Archived without loading the archive\n");
+      goto errorexit;
+   }
+
+   // Every record has the same order, so the last one is kept
+   if (!rotsit_load_archive (rs, "") ||
+       rotsit_archive (rs, "status == CLOSED")!=1) {
+      fprintf (stderr, "Failed to archive closed records\n");
+      goto errorexit;
+   }
+
+   // Archiving again with a narrower expression only ever adds records
+   if (rotsit_archive (rs, "guid == 0x02")!=0 ||
+       rotsit_archive (rs, "opened_by == Nobody")!=0) {
+      fprintf (stderr, "Archiving again changed the archive\n");
+      goto errorexit;
+   }
+
+   if (!(hot = write_to_string (rs)) ||
+       !(archive = write_with (rs, rotsit_write_archive)) ||
+       strstr (hot, "0x02") || !strstr (archive, "0x02") ||
+       !strstr (hot, "0x04") || strstr (archive, "0x04")) {
+      fprintf (stderr, "Archived records written to the wrong file\n");
+      goto errorexit;
+   }
+
+   if (!(copy = rotsit_parse (hot)) || rotsit_count_records (copy)!=3 ||
+       rotsit_find_by_id (copy, "0x02") ||
+       !rotsit_load_archive (copy, archive) ||
+       rotsit_load_archive (copy, archive) ||
+       rotsit_count_records (copy)!=4 ||
+       !check_filter (copy, "status == CLOSED", 2)) {
+      fprintf (stderr, "Archive did not load back\n");
+      goto errorexit;
+   }
+
+   if (!rotrec_reopen (rotsit_find_by_id (copy, "0x02"), "Not fixed") ||
+       !(rewritten = write_to_string (copy)) ||
+       !strstr (rewritten, "0x02")) {
+      fprintf (stderr, "Reopened record was left in the archive\n");
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   free (hot);
+   free (archive);
+   free (rewritten);
+   rotsit_del (copy);
+   rotsit_del (rs);
+   free (tmp);
+   return !error;
+}
+
+// Returns everything written to tmpf, which is closed
+
+static char *merge_to_string (rotsit_t *base, rotsit_t *ours,
+                              rotsit_t *theirs, size_t *nconflicts)
+{
+   FILE *tmpf = tmpfile ();
+   if (!tmpf || !rotsit_merge (base, ours, theirs, tmpf, nconflicts)) {
+      fprintf (stderr, "Merge failed\n");
+      if (tmpf)
+         fclose (tmpf);
+      return NULL;
+   }
+   return read_back (tmpf);
+}
+
+static char *changes_to_string (rotsit_t *before, rotsit_t *after)
+{
+   FILE *tmpf = tmpfile ();
+   if (!tmpf || !rotsit_changes (before, after, tmpf)) {
+      fprintf (stderr, "Changes failed\n");
+      if (tmpf)
+         fclose (tmpf);
+      return NULL;
+   }
+   return read_back (tmpf);
+}
+
+static size_t count_substr (const char *haystack, const char *needle)
+{
+   size_t ret = 0;
+   while ((haystack = strstr (haystack, needle))) {
+      ret++;
+      haystack++;
+   }
+   return ret;
+}
+
+static bool test_merge (void)
+{
+   bool error = true;
+   char *base_text = xstr_dup (test_db);
+   char *ours_text = xstr_dup (test_db);
+   char *theirs_text = xstr_dup (test_db);
+   char *result = NULL;
+   rotsit_t *base = NULL, *ours = NULL, *theirs = NULL, *merged = NULL;
+   size_t nconflicts;
+
+   if (!base_text || !ours_text || !theirs_text) {
+      fprintf (stderr, "Out of memory\n");
+      goto errorexit;
+   }
+
+   // Theirs removed the last record, such as by archiving it
+   *strstr (theirs_text, "0x04") = 0;
+
+   base = rotsit_parse (base_text);
+   ours = rotsit_parse (ours_text);
+   theirs = rotsit_parse (theirs_text);
+   rotrec_t *added = rotrec_new ("Added in theirs");
+   if (!base || !ours || !theirs || !added ||
+       !rotsit_add_record (theirs, added)) {
+      fprintf (stderr, "Object creation failed\n");
+      rotrec_del (added);
+      goto errorexit;
+   }
+
+   if (!rotrec_add_comment (rotsit_find_by_id (ours, "0x01"), "From ours") ||
+       !rotrec_add_comment (rotsit_find_by_id (theirs, "0x01"),
+                            "From theirs") ||
+       !rotrec_close (rotsit_find_by_id (ours, "0x03"), "Closed in ours")) {
+      fprintf (stderr, "Failed to change records\n");
+      goto errorexit;
+   }
+
+   if (!(result = merge_to_string (base, ours, theirs, &nconflicts)) ||
+       nconflicts || !(merged = rotsit_parse (result)) ||
+       rotsit_count_records (merged)!=4 ||
+       rotsit_find_by_id (merged, "0x04") ||
+       !check_filter (merged, "status == CLOSED", 2) ||
+       count_substr (result, "From ours")!=1 ||
+       count_substr (result, "From theirs")!=1 ||
+       count_substr (result, "Added in theirs")!=1) {
+      fprintf (stderr, "Unexpected merge (%zu conflicts):\n%s\n",
+               nconflicts, result);
+      goto errorexit;
+   }
+   free (result);
+   result = NULL;
+
+   // Both sides changed the same field
+   if (!rotrec_set_field (rotsit_find_by_id (ours, "0x02"), RF_STATUS,
+                          "WONTFIX") ||
+       !rotrec_set_field (rotsit_find_by_id (theirs, "0x02"), RF_STATUS,
+                          "INVALID") ||
+       !(result = merge_to_string (base, ours, theirs, &nconflicts)) ||
+       nconflicts!=1 || !strstr (result, "WONTFIX") ||
+       strstr (result, "INVALID")) {
+      fprintf (stderr, "Conflict not resolved in favour of ours\n");
+      goto errorexit;
+   }
+   free (result);
+   result = NULL;
+
+   // Both sides added an issue with the next order, 0x2
+   added = rotrec_new ("Added in ours");
+   if (!added || !rotsit_add_record (ours, added)) {
+      fprintf (stderr, "Object creation failed\n");
+      rotrec_del (added);
+      goto errorexit;
+   }
+   if (!(result = merge_to_string (base, ours, theirs, &nconflicts)) ||
+       count_substr (result, "f\b0x2f\b")!=1 ||
+       count_substr (result, "f\b0x3f\b")!=1 ||
+       strstr (result, "f\b0x2f\b") > strstr (result, "Added in ours") ||
+       strstr (result, "f\b0x3f\b") < strstr (result, "Added in ours")) {
+      fprintf (stderr, "Issues added on both sides not renumbered:\n%s\n",
+               result);
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   free (result);
+   rotsit_del (merged);
+   rotsit_del (base);
+   rotsit_del (ours);
+   rotsit_del (theirs);
+   free (base_text);
+   free (ours_text);
+   free (theirs_text);
+   return !error;
+}
+
+static bool test_changes (void)
+{
+   bool error = true;
+   char *before_text = xstr_dup (test_db);
+   char *after_text = xstr_dup (test_db);
+   char *result = NULL;
+   rotsit_t *before = NULL, *after = NULL;
+
+   if (!before_text || !after_text) {
+      fprintf (stderr, "Out of memory\n");
+      goto errorexit;
+   }
+
+   // The last record was removed, such as by archiving it
+   *strstr (after_text, "0x04") = 0;
+
+   before = rotsit_parse (before_text);
+   after = rotsit_parse (after_text);
+   rotrec_t *added = rotrec_new ("Added later\nSecond line");
+   if (!before || !after || !added || !rotsit_add_record (after, added)) {
+      fprintf (stderr, "Object creation failed\n");
+      rotrec_del (added);
+      goto errorexit;
+   }
+
+   if (!(result = changes_to_string (before, before)) || result[0]) {
+      fprintf (stderr, "Unchanged database has changes:\n%s\n", result);
+      goto errorexit;
+   }
+   free (result);
+   result = NULL;
+
+   // The comment only before puts the new one at the same position, so it
+   // has to be found by GUID
+   if (!rotrec_add_comment (rotsit_find_by_id (before, "0x01"),
+                            "Only before") ||
+       !rotrec_add_comment (rotsit_find_by_id (after, "0x01"), "New one") ||
+       !rotrec_close (rotsit_find_by_id (after, "0x03"), "Closed later") ||
+       !rotrec_set_field (rotsit_find_by_id (after, "0x02"), RF_ASSIGNED_TO,
+                          "Dave")) {
+      fprintf (stderr, "Failed to change records\n");
+      goto errorexit;
+   }
+
+   char expected_status[64];
+   snprintf (expected_status, sizeof expected_status, "status  0x03 %s -> %s",
+             rotrec_get_field (rotsit_find_by_id (before, "0x03"), RF_STATUS),
+             rotrec_get_field (rotsit_find_by_id (after, "0x03"), RF_STATUS));
+
+   const char *expected[] = {
+      "comment 0x01 [", "] New one\n", expected_status,
+      "changed 0x02 assigned_to\n", "changed 0x03 closed_by,closed_on,",
+      "removed 0x04\n", "[OPEN] Added later\n",
+   };
+   if (!(result = changes_to_string (before, after)) ||
+       count_substr (result, "\n")!=6 ||
+       strstr (result, "status  0x01")) {
+      fprintf (stderr, "Unexpected changes:\n%s\n", result);
+      goto errorexit;
+   }
+   for (size_t i=0; i<sizeof expected/sizeof expected[0]; i++) {
+      if (!strstr (result, expected[i])) {
+         fprintf (stderr, "[%s] not found in changes:\n%s\n", expected[i],
+                  result);
+         goto errorexit;
+      }
+   }
+
+   error = false;
+errorexit:
+   free (result);
+   rotsit_del (before);
+   rotsit_del (after);
+   free (before_text);
+   free (after_text);
+   return !error;
+}
+
+static bool test_export_sources (void)
+{
+   size_t num_errors = 0;
+   char *tmp = xstr_dup (test_db);
+   rotsit_t *rs = tmp ? rotsit_parse (tmp) : NULL;
+   const char *sources[] = { "a.sitdb", "b,c.sitdb" };
+   const char *expected[] = {
+      "[source: a.sitdb]\n[id: 0x01]", "[source: b,c.sitdb]\n[id: 0x03]",
+      "{\"source\":\"a.sitdb\",\"guid\":\"0x01\"",
+      "{\"source\":\"b,c.sitdb\",\"guid\":\"0x03\"",
+      "source,guid,order,", "\r\na.sitdb,0x01,", "\r\n\"b,c.sitdb\",0x03,",
+      "source\tguid\torder\t", "\na.sitdb\t0x01\t", "\nb,c.sitdb\t0x03\t",
+   };
+   size_t first[] = { 0, 2, 4, 7, 10 };
+
+   if (!rs) {
+      fprintf (stderr, "Object creation failed\n");
+      free (tmp);
+      return false;
+   }
+
+   rotrec_t *records[] = {
+      rotsit_find_by_id (rs, "0x01"), rotsit_find_by_id (rs, "0x03"), NULL,
+   };
+
+   for (rotsit_fmt_t fmt=rotsit_fmt_text; fmt<=rotsit_fmt_tsv; fmt++) {
+      char *output = NULL;
+      FILE *tmpf = tmpfile ();
+      if (!tmpf || !rotsit_export_sources (records, sources, tmpf, fmt, 1)) {
+         fprintf (stderr, "Format %i: export failed\n", fmt);
+         num_errors++;
+         if (tmpf)
+            fclose (tmpf);
+         continue;
+      }
+
+      output = read_back (tmpf);
+      for (size_t i=first[fmt]; output && i<first[fmt + 1]; i++) {
+         if (!strstr (output, expected[i])) {
+            fprintf (stderr, "Format %i: [%s] not found in\n%s\n", fmt,
+                     expected[i], output);
+            num_errors++;
+         }
+      }
+      num_errors += !output;
+      free (output);
+   }
+
+   rotsit_del (rs);
+   free (tmp);
+   return num_errors==0;
+}
+
+static bool test_stats (void)
+{
+   bool error = true;
+   char *tmp = xstr_dup (test_db);
+   char *output = NULL;
+   rotsit_t *rs = tmp ? rotsit_parse (tmp) : NULL;
+   rotsit_stats_t st;
+
+   if (!rs) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   uint32_t nclosed = rotsit_filter_count (rs, "status == CLOSED");
+   if (!(output = write_to_string (rs)) || !rotsit_get_stats (rs, &st)) {
+      fprintf (stderr, "Unable to write the database\n");
+      goto errorexit;
+   }
+
+   if (st.records_parsed!=rotsit_count_records (rs) ||
+       st.bytes_parsed!=strlen (test_db) || st.records_restored ||
+       st.filters!=1 || st.records_matched!=nclosed ||
+       st.records_scanned > rotsit_count_records (rs) ||
+       st.bytes_written!=strlen (output)) {
+      fprintf (stderr, "Unexpected stats: %" PRIu64 " parsed, %" PRIu64
+               " bytes, %" PRIu64 " matched, %" PRIu64 " written\n",
+               st.records_parsed, st.bytes_parsed, st.records_matched,
+               st.bytes_written);
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   free (output);
+   rotsit_del (rs);
+   free (tmp);
+   return !error;
+}
+
+// Counts the blocks it hands out, from whichever thread, and tags them so
+// that memory it did not allocate is noticed when it comes back.
+#define TEST_ALLOC_TAG     (0x524f5453)
+
+struct test_alloc_t {
+   size_t nallocs;
+   size_t nlive;
+   size_t nforeign;
+};
+
+union test_block_t {
+   uint32_t tag;
+   max_align_t align;
+};
+
+static void *test_alloc (void *ctx, size_t size)
+{
+   struct test_alloc_t *ta = ctx;
+   union test_block_t *ret = malloc (sizeof *ret + size);
+   if (!ret)
+      return NULL;
+
+   ret->tag = TEST_ALLOC_TAG;
+   __atomic_fetch_add (&ta->nallocs, 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add (&ta->nlive, 1, __ATOMIC_RELAXED);
+   return ret + 1;
+}
+
+static void *test_resize (void *ctx, void *ptr, size_t size)
+{
+   struct test_alloc_t *ta = ctx;
+   union test_block_t *block = (union test_block_t *)ptr - 1;
+   if (block->tag!=TEST_ALLOC_TAG) {
+      __atomic_fetch_add (&ta->nforeign, 1, __ATOMIC_RELAXED);
+      return NULL;
+   }
+
+   union test_block_t *ret = realloc (block, sizeof *ret + size);
+   return ret ? ret + 1 : NULL;
+}
+
+static void test_release (void *ctx, void *ptr)
+{
+   struct test_alloc_t *ta = ctx;
+   union test_block_t *block = (union test_block_t *)ptr - 1;
+   if (block->tag!=TEST_ALLOC_TAG) {
+      __atomic_fetch_add (&ta->nforeign, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   block->tag = 0;
+   __atomic_fetch_sub (&ta->nlive, 1, __ATOMIC_RELAXED);
+   free (block);
+}
+
+static bool test_allocator (void)
+{
+   bool error = true;
+   struct test_alloc_t ta = { 0, 0, 0 },
+                       tb = { 0, 0, 0 };
+   rotsit_allocator_t alloc = { test_alloc, test_resize, test_release, &ta };
+   rotsit_allocator_t other = { test_alloc, test_resize, test_release, &tb };
+   char *tmp = xstr_dup (test_db);
+   char *output = NULL;
+   rotsit_t *rs = NULL, *frozen = NULL;
+   rotrec_t **results = NULL;
+   FILE *tmpf = tmpfile ();
+
+   if (!tmp || !tmpf) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   rotsit_set_allocator (&alloc);
+   if (!(rs = rotsit_parse (tmp))) {
+      fprintf (stderr, "Failed to parse\n");
+      goto errorexit;
+   }
+
+   // Enough records for the export to be formatted on several threads
+   for (size_t i=0; i<5000; i++) {
+      rotrec_t *rr = rotrec_new ("Allocated elsewhere");
+      if (!rr || !rotsit_add_record (rs, rr) ||
+          !rotrec_add_comment (rr, "With a comment")) {
+         fprintf (stderr, "Failed to add record %zu\n", i);
+         goto errorexit;
+      }
+   }
+
+   // Used from a thread with another allocator, which only gets what is
+   // handed back to it; the indexes, the frozen copy and the changes all
+   // belong to the database.
+   rotsit_set_allocator (&other);
+   if (!(results = rotsit_filter (rs, "status == CLOSED")) ||
+       rotsit_filter_count (rs, "(order > 0x3) | (status == OPEN)")==0 ||
+       rotsit_filter_count (rs, "opened_on > 1 Mar 2024")==0 ||
+       !(frozen = rotsit_freeze (rs)) ||
+       !rotrec_close (rotsit_find_by_id (rs, "0x01"), "Done") ||
+       !rotrec_add_comment (rotsit_find_by_id (rs, "0x02"), "Later") ||
+       !rotsit_export (rs, tmpf, rotsit_fmt_jsonl, 4) ||
+       !(output = write_to_string (rs))) {
+      fprintf (stderr, "Failed to use the database\n");
+      goto errorexit;
+   }
+   rotsit_free (results);
+   results = NULL;
+   if (tb.nlive) {
+      fprintf (stderr, "%zu allocations of the database on another thread\n",
+               tb.nlive);
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   rotsit_free (results);
+   rotsit_del (frozen);
+   rotsit_del (rs);
+   rotsit_set_allocator (NULL);
+
+   if (!error && (!ta.nallocs || ta.nlive || ta.nforeign ||
+                  !tb.nallocs || tb.nlive || tb.nforeign)) {
+      fprintf (stderr, "%zu allocations, %zu not freed, %zu foreign; "
+               "%zu allocations, %zu not freed, %zu foreign elsewhere\n",
+               ta.nallocs, ta.nlive, ta.nforeign,
+               tb.nallocs, tb.nlive, tb.nforeign);
+      error = true;
+   }
+   if (rotsit_get_allocator (NULL)) {
+      fprintf (stderr, "The allocator was not reset\n");
+      error = true;
+   }
+
+   if (tmpf)
+      fclose (tmpf);
+   free (output);
+   free (tmp);
+   return !error;
+}
+
+// Changes to a database are not seen by copies frozen before them, and a
+// record is only copied again once it changes.
+static bool test_freeze (void)
+{
+   bool error = true;
+   char *tmp = xstr_dup (test_db);
+   rotsit_t *rs = tmp ? rotsit_parse (tmp) : NULL;
+   rotsit_t *before = rotsit_freeze (rs);
+   rotsit_t *again = rotsit_freeze (rs);
+   rotsit_t *after = NULL;
+   rotrec_t *rr = rotrec_new ("Added after freezing");
+   char *output = NULL;
+
+   if (!rs || !before || !again || !rr) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   if (before!=again) {
+      fprintf (stderr, "Unchanged database was copied twice\n");
+      goto errorexit;
+   }
+
+   if (!rotsit_add_record (rs, rr) ||
+       !rotrec_add_comment (rotsit_find_by_id (rs, "0x01"), "Late comment") ||
+       !rotrec_close (rotsit_find_by_id (rs, "0x03"), "Closed late")) {
+      fprintf (stderr, "Failed to change the database\n");
+      goto errorexit;
+   }
+
+   // The indexes built on this copy are carried over to the next one
+   if (rotsit_count_records (before)!=4 ||
+       rotsit_filter_count (before, "status == CLOSED")!=2 ||
+       rotsit_filter_count (before, "closed_on > 1 Jan 2024")!=2 ||
+       strcmp (rotrec_get_field (rotsit_find_by_id (before, "0x03"),
+                                 RF_STATUS), "OPEN")!=0 ||
+       rotsit_get_record (before, 0)==rotsit_get_record (rs, 0)) {
+      fprintf (stderr, "Frozen copy sees later changes\n");
+      goto errorexit;
+   }
+
+   if (!(output = export_to_string (before, rotsit_fmt_jsonl, 2)) ||
+       strstr (output, "Late comment")) {
+      fprintf (stderr, "Frozen copy sees a later comment\n");
+      goto errorexit;
+   }
+   free (output);
+
+   if (!(after = rotsit_freeze (rs)) || after==before ||
+       rotsit_count_records (after)!=5 ||
+       rotsit_filter_count (after, "status == CLOSED")!=3 ||
+       rotsit_filter_count (after, "closed_on > 1 Jan 2024")!=3 ||
+       rotsit_filter_count (after, "status == OPEN")!=2 ||
+       !(output = export_to_string (after, rotsit_fmt_jsonl, 2)) ||
+       !strstr (output, "Late comment")) {
+      fprintf (stderr, "Copy frozen after the changes is wrong\n");
+      goto errorexit;
+   }
+
+   if (rotsit_get_record (after, 1)!=rotsit_get_record (before, 1) ||
+       rotsit_get_record (after, 2)==rotsit_get_record (before, 2)) {
+      fprintf (stderr, "Records are not shared as expected\n");
+      goto errorexit;
+   }
+
+   rotrec_t *fresh = rotrec_new ("Never added");
+   bool changed = rotrec_close (rotsit_get_record (before, 0), "Frozen") ||
+                  rotsit_add_record (after, fresh);
+   rotrec_del (fresh);
+   if (changed) {
+      fprintf (stderr, "A frozen copy was changed\n");
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   rotsit_del (after);
+   rotsit_del (again);
+   rotsit_del (before);
+   rotsit_del (rs);
+   free (output);
+   free (tmp);
+   return !error;
+}
+
+// Only what changed on disk is parsed again; everything else, including
+// pointers to records and a copy frozen before the reload, stays put.
+static bool test_reload (void)
+{
+   bool error = true;
+   char *tmp = xstr_dup (test_db);
+   char *changed = xstr_dup (
+      TEST_RECORD ("0x02", "Alice", "Fri Mar  1 09:00:00 2024", "CLOSED",
+                                    "Sat Mar  2 09:00:00 2024")
+      TEST_RECORD ("0x03", "Bob",   "Fri Mar 15 12:00:00 2024", "CLOSED",
+                                    "Sat Mar 16 12:00:00 2024")
+      TEST_RECORD ("0x04", "Bob",   "Mon Apr  1 08:00:00 2024", "CLOSED",
+                                    "Thu Apr 11 08:00:00 2024")
+      TEST_RECORD ("0x05", "Carol", "Tue Apr 16 08:00:00 2024", "OPEN", ""));
+   char *expected = NULL, *output = NULL;
+   rotsit_t *rs = tmp ? rotsit_parse (tmp) : NULL;
+   rotsit_t *copy = changed ? rotsit_parse (changed) : NULL;
+   rotsit_t *before = NULL;
+   rotsit_stats_t st;
+
+   if (!rs || !copy || !(expected = write_to_string (copy))) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   // The indexes are built before the reload and carried over by it
+   rotrec_t *kept = rotsit_find_by_id (rs, "0x02");
+   if (!kept || !check_filter (rs, "status == CLOSED", 2) ||
+       !check_filter (rs, "opened_on > 1 Mar 2024", 3) ||
+       !(before = rotsit_freeze (rs))) {
+      fprintf (stderr, "Failed to query the database\n");
+      goto errorexit;
+   }
+
+   if (!rotsit_reload (rs, changed) || !rotsit_get_stats (rs, &st)) {
+      fprintf (stderr, "Reload failed\n");
+      goto errorexit;
+   }
+
+   if (st.records_kept!=2 || st.records_parsed!=6) {
+      fprintf (stderr, "Reload kept %" PRIu64 " and parsed %" PRIu64
+               " records\n", st.records_kept, st.records_parsed);
+      goto errorexit;
+   }
+
+   if (rotsit_find_by_id (rs, "0x02")!=kept ||
+       rotsit_find_by_id (rs, "0x01") || !rotsit_find_by_id (rs, "0x05") ||
+       rotsit_count_records (rs)!=4 ||
+       !check_filter (rs, "status == CLOSED", 3) ||
+       !check_filter (rs, "opened_on > 1 Mar 2024", 4) ||
+       !check_filter (rs, "closed_on < 1 Apr 2024", 2) ||
+       !(output = write_to_string (rs)) || strcmp (output, expected)!=0) {
+      fprintf (stderr, "Reloaded database differs from the text\n");
+      goto errorexit;
+   }
+   free (output);
+   output = NULL;
+
+   if (rotsit_count_records (before)!=4 || !rotsit_find_by_id (before, "0x01") ||
+       strcmp (rotrec_get_field (rotsit_find_by_id (before, "0x03"),
+                                 RF_STATUS), "OPEN")!=0) {
+      fprintf (stderr, "Frozen copy sees the reload\n");
+      goto errorexit;
+   }
+
+   // Reading back what was just written keeps every record
+   free (expected);
+   if (!rotrec_add_comment (kept, "Kept") ||
+       !(expected = write_to_string (rs)) || !rotsit_reload (rs, expected) ||
+       !rotsit_get_stats (rs, &st) || st.records_kept!=6 ||
+       rotsit_find_by_id (rs, "0x02")!=kept ||
+       !(output = write_to_string (rs)) || strcmp (output, expected)!=0) {
+      fprintf (stderr, "Reload of an unchanged text was not kept\n");
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   rotsit_del (before);
+   rotsit_del (copy);
+   rotsit_del (rs);
+   free (output);
+   free (expected);
+   free (changed);
+   free (tmp);
+   return !error;
+}
+
+// Archived records go after the others on a reload, and so are numbered
+// again when the number of records in the text changes. A copy frozen
+// after that must find their dates by the new number, and a record
+// archived from the old text must outlive it.
+static bool test_reload_archived (void)
+{
+   bool error = true;
+   char *tmp = xstr_dup (
+      TEST_RECORD ("0x01", "Alice", "Fri Feb 16 10:00:00 2024", "OPEN", "")
+      TEST_RECORD ("0x03", "Bob",   "Fri Mar 15 12:00:00 2024", "OPEN", "")
+      TEST_RECORD ("0x04", "Bob",   "Mon Apr  1 08:00:00 2024", "CLOSED",
+                                    "Thu Apr 11 08:00:00 2024")
+      TEST_RECORD ("0x05", "Carol", "Tue Apr 16 08:00:00 2024", "OPEN", ""));
+   char *longer = xstr_dup (
+      TEST_RECORD ("0x01", "Alice", "Fri Feb 16 10:00:00 2024", "OPEN", "")
+      TEST_RECORD ("0x03", "Bob",   "Fri Mar 15 12:00:00 2024", "OPEN", "")
+      TEST_RECORD ("0x05", "Carol", "Tue Apr 16 08:00:00 2024", "OPEN", "")
+      TEST_RECORD ("0x06", "Carol", "Wed Apr 17 08:00:00 2024", "OPEN", "")
+      TEST_RECORD ("0x07", "Dave",  "Thu Apr 18 08:00:00 2024", "CLOSED",
+                                    "Sat Apr 20 08:00:00 2024"));
+   char *archive = xstr_dup (
+      TEST_RECORD ("0x02", "Alice", "Fri Mar  1 09:00:00 2024", "CLOSED", ""));
+   rotsit_t *rs = tmp ? rotsit_parse (tmp) : NULL;
+   rotsit_t *before = NULL, *after = NULL;
+
+   if (!rs || !longer || !archive) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   if (!rotsit_load_archive (rs, archive) ||
+       rotsit_archive (rs, "status == CLOSED")!=1 ||
+       !check_filter (rs, "closed_on > 1 Apr 2024", 1) ||
+       !(before = rotsit_freeze (rs))) {
+      fprintf (stderr, "Failed to archive and freeze\n");
+      goto errorexit;
+   }
+
+   if (!rotsit_reload (rs, longer) || rotsit_count_records (rs)!=7 ||
+       !(after = rotsit_freeze (rs))) {
+      fprintf (stderr, "Reload failed\n");
+      goto errorexit;
+   }
+
+   // The archived record has no date, so == looks it up by its number
+   const char *expr = "closed_on == 20 Apr 2024 08:00:00";
+   if (!check_filter (rs, expr, 1) || !check_filter (after, expr, 1) ||
+       !check_filter (after, "closed_on > 1 Apr 2024", 2) ||
+       !check_filter (before, "closed_on > 1 Apr 2024", 1) ||
+       rotsit_count_records (before)!=5) {
+      fprintf (stderr, "Archived record has the dates of another\n");
+      goto errorexit;
+   }
+
+   // Once the frozen copies are gone nothing else holds the old text
+   rotsit_del (before);
+   rotsit_del (after);
+   before = after = NULL;
+   if (!check_filter (rs, "status == CLOSED", 3) ||
+       strcmp (rotrec_get_field (rotsit_find_by_id (rs, "0x04"),
+                                 RF_OPENED_BY), "Bob")!=0) {
+      fprintf (stderr, "Record archived from the old text was lost\n");
+      goto errorexit;
+   }
+
+   error = false;
+errorexit:
+   rotsit_del (after);
+   rotsit_del (before);
+   rotsit_del (rs);
+   free (archive);
+   free (longer);
+   free (tmp);
+   return !error;
+}
+
+#ifdef PLATFORM_POSIX
+#define CONC_READERS       (4)
+#define CONC_ROUNDS        (200)
+
+struct conc_t {
+   rotsit_t *rs;
+   size_t nerrors;
+};
+
+static void *conc_reader (void *arg)
+{
+   struct conc_t *ct = arg;
+   FILE *tmpf = tmpfile ();
+
+   for (size_t i=0; tmpf && i<CONC_ROUNDS; i++) {
+      rotrec_t **results = rotsit_filter (ct->rs, "status == CLOSED");
+      for (size_t j=0; results && results[j]; j++) {
+         if (!strstr (rotrec_get_field (results[j], RF_STATUS), "CLOSED"))
+            ct->nerrors++;
+      }
+      rotrec_t *rr = rotsit_find_by_id (ct->rs, "0x03");
+      if (!results || !results[0] || !rr ||
+          strcmp (rotrec_get_field (rr, RF_GUID), "0x03")!=0 ||
+          !rotsit_write (ct->rs, tmpf)) {
+         ct->nerrors++;
+      }
+      rotsit_free (results);
+      rewind (tmpf);
+
+      // A frozen copy stays the same however the database changes
+      rotsit_t *frozen = rotsit_freeze (ct->rs);
+      uint32_t nrecs = rotsit_count_records (frozen);
+      uint32_t nclosed = rotsit_filter_count (frozen, "status == CLOSED");
+      if (!frozen || !rotsit_write (frozen, tmpf) ||
+          rotsit_filter_count (frozen, "status == CLOSED")!=nclosed ||
+          rotsit_count_records (frozen)!=nrecs) {
+         ct->nerrors++;
+      }
+      rotsit_del (frozen);
+      rewind (tmpf);
+   }
+
+   if (tmpf) {
+      fclose (tmpf);
+   } else {
+      ct->nerrors++;
+   }
+   return NULL;
+}
+
+// Readers query a database while another thread adds to and changes it
+static bool test_concurrent (void)
+{
+   bool error = true;
+   char *tmp = xstr_dup (test_db);
+   rotsit_t *rs = tmp ? rotsit_parse (tmp) : NULL;
+   pthread_t threads[CONC_READERS];
+   struct conc_t readers[CONC_READERS];
+   size_t nstarted = 0;
+
+   if (!rs) {
+      fprintf (stderr, "Object creation failed\n");
+      goto errorexit;
+   }
+
+   for (; nstarted<CONC_READERS; nstarted++) {
+      readers[nstarted].rs = rs;
+      readers[nstarted].nerrors = 0;
+      if (pthread_create (&threads[nstarted], NULL, conc_reader,
+                          &readers[nstarted])!=0) {
+         fprintf (stderr, "Unable to start reader %zu\n", nstarted);
+         goto errorexit;
+      }
+   }
+
+   for (size_t i=0; i<CONC_ROUNDS; i++) {
+      rotrec_t *rr = rotrec_new ("Added while being read");
+      if (!rr || !rotsit_add_record (rs, rr) ||
+          !rotrec_add_comment (rr, "Commented while being read") ||
+          (i % 2 && !rotrec_close (rr, "Closed while being read"))) {
+         fprintf (stderr, "Failed to change record %zu\n", i);
+         goto errorexit;
+      }
+   }
+
+   error = false;
+errorexit:
+   for (size_t i=0; i<nstarted; i++) {
+      pthread_join (threads[i], NULL);
+      if (readers[i].nerrors) {
+         fprintf (stderr, "Reader %zu: %zu errors\n", i, readers[i].nerrors);
+         error = true;
+      }
+   }
+
+   if (!error && (rotsit_count_records (rs)!=4 + CONC_ROUNDS ||
+       rotsit_filter_count (rs, "status == CLOSED")!=2 + CONC_ROUNDS / 2)) {
+      fprintf (stderr, "Unexpected records after the changes\n");
+      error = true;
+   }
+
+   rotsit_del (rs);
+   free (tmp);
+   return !error;
+}
+#endif
+
 int main (void)
 {
    size_t num_failures = 0;
@@ -149,6 +1830,31 @@ int main (void)
 
       TESTFUNC (test_parser),
       TESTFUNC (test_writer),
+      TESTFUNC (test_writer_order),
+      TESTFUNC (test_guids),
+      TESTFUNC (test_timestamps),
+      TESTFUNC (test_comments),
+      TESTFUNC (test_export),
+      TESTFUNC (test_export_formats),
+      TESTFUNC (test_snapshot),
+      TESTFUNC (test_archive),
+      TESTFUNC (test_filter_may_match),
+      TESTFUNC (test_merge),
+      TESTFUNC (test_changes),
+      TESTFUNC (test_export_sources),
+      TESTFUNC (test_stats),
+      TESTFUNC (test_allocator),
+      TESTFUNC (test_freeze),
+      TESTFUNC (test_reload),
+      TESTFUNC (test_reload_archived),
+#ifdef PLATFORM_POSIX
+      TESTFUNC (test_concurrent),
+#endif
+      TESTFUNC (test_filter_dates),
+      TESTFUNC (test_filter_enums),
+      TESTFUNC (test_filter_kernels),
+      TESTFUNC (test_filter_types),
+      TESTFUNC (test_filter_blocks),
 
 #undef TESTFUNC
 